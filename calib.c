@@ -0,0 +1,704 @@
+/****************************************************************************
+ * apps/industry/ETCetera/calib.c
+ * Electronic Throttle Controller program - calibration data
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "calib.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Values built into the reference page */
+
+#define CALIB_DEFAULTS \
+  { \
+    .spring = \
+    { \
+      .tps_base = 3500, \
+      .tps_shift = 8, \
+      .duty = {[0 ... CALIB_SPRING_POINTS - 1] = 150} \
+    }, \
+    .drs = \
+    { \
+      .accel_close = -100, \
+      .accel_open = 10, \
+      .brake_close = 600, \
+      .brake_open = 400, \
+      .speed_open = 10 \
+    }, \
+    .plaus = \
+    { \
+      .min = {100, 100, 100, 100, 100, 100}, \
+      .max = {32600, 32600, 32600, 32600, 32600, 32600}, \
+      .apps_tol = 1500, \
+      .tps_tol = 1500, \
+      .range_debounce = 4, \
+      .ooc_debounce = 20 \
+    }, \
+    .etb = \
+    { \
+      .kp = 6554, \
+      .ki = 7, \
+      .kd = 65536, \
+      .duty_max = 600, \
+      .slew = 20 \
+    }, \
+    .pedal = \
+    { \
+      .apps_base = 4000, \
+      .apps_shift = 12, \
+      .rpm_base = 0, \
+      .rpm_shift = 11, \
+      .map = \
+      { \
+        [0 ... CALIB_PEDAL_RPM_POINTS - 1] = \
+          {0, 143, 286, 429, 571, 714, 857, 1000} \
+      }, \
+      .rise = 40, \
+      .fall = 80 \
+    } \
+  }
+
+/* Registers a parameter, or an array of them, with the element size. A
+ * download must start and end on element boundaries so that no single
+ * value is ever half old and half new.
+ */
+
+#define CALIB_PARAM(member) \
+  { offsetof(struct calib_data_s, member), \
+    sizeof(((FAR struct calib_data_s *)0)->member), 1 }
+
+#define CALIB_PARAM_ARRAY(member) \
+  { offsetof(struct calib_data_s, member), \
+    sizeof(((FAR struct calib_data_s *)0)->member[0]), \
+    sizeof(((FAR struct calib_data_s *)0)->member) \
+      / sizeof(((FAR struct calib_data_s *)0)->member[0]) }
+
+#define CALIB_PARAM_TABLE(member) \
+  { offsetof(struct calib_data_s, member), \
+    sizeof(((FAR struct calib_data_s *)0)->member[0][0]), \
+    sizeof(((FAR struct calib_data_s *)0)->member) \
+      / sizeof(((FAR struct calib_data_s *)0)->member[0][0]) }
+
+/* XCP packet identifiers, commands and error codes (ASAM MCD-1 XCP). Only
+ * the calibration and page switching subset is implemented.
+ */
+
+#define XCP_PID_RES               0xff
+#define XCP_PID_ERR               0xfe
+
+#define XCP_CMD_CONNECT           0xff
+#define XCP_CMD_DISCONNECT        0xfe
+#define XCP_CMD_GET_STATUS        0xfd
+#define XCP_CMD_SET_MTA           0xf6
+#define XCP_CMD_UPLOAD            0xf5
+#define XCP_CMD_SHORT_UPLOAD      0xf4
+#define XCP_CMD_DOWNLOAD          0xf0
+#define XCP_CMD_SET_CAL_PAGE      0xeb
+#define XCP_CMD_GET_CAL_PAGE      0xea
+#define XCP_CMD_COPY_CAL_PAGE     0xe4
+
+#define XCP_ERR_CMD_BUSY          0x10
+#define XCP_ERR_CMD_UNKNOWN       0x20
+#define XCP_ERR_CMD_SYNTAX        0x21
+#define XCP_ERR_OUT_OF_RANGE      0x22
+#define XCP_ERR_WRITE_PROTECTED   0x23
+#define XCP_ERR_PAGE_NOT_VALID    0x26
+#define XCP_ERR_SEGMENT_NOT_VALID 0x28
+
+#define XCP_RESOURCE_CALPAG       0x01
+#define XCP_COMM_MODE_INTEL       0x00
+#define XCP_MAX_CTO               8
+#define XCP_MAX_DTO               8
+#define XCP_VERSION               0x01
+
+#define XCP_PAGE_MODE_ECU         0x01
+#define XCP_PAGE_MODE_XCP         0x02
+#define XCP_PAGE_MODE_ALL         0x80
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+struct calib_param_s
+{
+  uint16_t offset;
+  uint16_t size;
+  uint16_t count;
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static const struct calib_data_s g_calib_reference = CALIB_DEFAULTS;
+
+static const struct calib_param_s g_calib_params[] = {
+  CALIB_PARAM(spring.tps_base),
+  CALIB_PARAM(spring.tps_shift),
+  CALIB_PARAM_ARRAY(spring.duty),
+  CALIB_PARAM(drs.accel_close),
+  CALIB_PARAM(drs.accel_open),
+  CALIB_PARAM(drs.brake_close),
+  CALIB_PARAM(drs.brake_open),
+  CALIB_PARAM(drs.speed_open),
+  CALIB_PARAM_ARRAY(plaus.min),
+  CALIB_PARAM_ARRAY(plaus.max),
+  CALIB_PARAM(plaus.apps_tol),
+  CALIB_PARAM(plaus.tps_tol),
+  CALIB_PARAM(plaus.range_debounce),
+  CALIB_PARAM(plaus.ooc_debounce),
+  CALIB_PARAM(etb.kp),
+  CALIB_PARAM(etb.ki),
+  CALIB_PARAM(etb.kd),
+  CALIB_PARAM(etb.duty_max),
+  CALIB_PARAM(etb.slew),
+  CALIB_PARAM(pedal.apps_base),
+  CALIB_PARAM(pedal.apps_shift),
+  CALIB_PARAM(pedal.rpm_base),
+  CALIB_PARAM(pedal.rpm_shift),
+  CALIB_PARAM_TABLE(pedal.map),
+  CALIB_PARAM(pedal.rise),
+  CALIB_PARAM(pedal.fall)
+};
+
+/* The working page is double-buffered. Control tasks only ever read the
+ * active buffer, and count themselves in g_calib_refs while they do. A
+ * write copies the active buffer into the other one, changes it there and
+ * then makes it active with a single store, so a reader sees either every
+ * change of a write or none of them. A buffer is not written again until
+ * its last reader has released it.
+ *
+ * Everything except g_calib_refs is only written by the calibration
+ * command handler, which runs in the CAN broadcast task.
+ */
+
+static struct calib_data_s g_calib_ram[2] = {
+  CALIB_DEFAULTS,
+  CALIB_DEFAULTS
+};
+
+static int g_calib_active;
+static int g_calib_refs[2];
+
+static uint8_t g_calib_ecu_page = CALIB_PAGE_WORKING;
+static uint8_t g_calib_xcp_page = CALIB_PAGE_WORKING;
+
+static bool g_calib_connected;
+static uint32_t g_calib_mta;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static inline uint32_t calib_get_le32(FAR const uint8_t *data)
+{
+  return (uint32_t)data[0] | (uint32_t)data[1] << 8
+         | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static FAR const uint8_t *calib_page_data(uint8_t page)
+{
+  if (page == CALIB_PAGE_REFERENCE)
+  {
+    return (FAR const uint8_t *)&g_calib_reference;
+  }
+
+  return (FAR const uint8_t *)&g_calib_ram[g_calib_active];
+}
+
+/* True if [addr, addr + len) lies in the calibration data and does not
+ * split any registered value.
+ */
+
+static bool calib_range_valid(uint32_t addr, uint32_t len)
+{
+  FAR const struct calib_param_s *param;
+  uint32_t start;
+  uint32_t end;
+  int i;
+
+  if (addr > sizeof(struct calib_data_s)
+      || len > sizeof(struct calib_data_s) - addr)
+  {
+    return false;
+  }
+
+  for (i = 0; i < sizeof(g_calib_params) / sizeof(g_calib_params[0]); ++i)
+  {
+    param = &g_calib_params[i];
+    start = param->offset;
+    end = start + param->size * param->count;
+
+    if ((addr > start && addr < end && (addr - start) % param->size != 0)
+        || (addr + len > start && addr + len < end
+            && (addr + len - start) % param->size != 0))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* The ETB feedforward lookup works in Q16 duty, so the spring table point
+ * spacing must leave room for the fraction between points, and the last
+ * point must still be a throttle position the sensor can read. Plausibility
+ * limits must leave some valid range and debounce within the time safing
+ * allows for it when arming. Negative gains would make the ETB loop
+ * unstable, and no spring table point may ask for more duty than the loop
+ * is allowed to command. Pedal map openings cannot go past wide open, and
+ * a zero rate limit would hold the throttle still.
+ */
+
+static bool calib_data_valid(FAR const struct calib_data_s *data)
+{
+  FAR const struct calib_plaus_s *plaus = &data->plaus;
+  FAR const struct calib_pedal_s *pedal = &data->pedal;
+  int i;
+  int j;
+
+  if (data->spring.tps_shift > CALIB_SPRING_MAX_SHIFT
+      || (int32_t)data->spring.tps_base
+         + ((int32_t)(CALIB_SPRING_POINTS - 1) << data->spring.tps_shift)
+         > INT16_MAX)
+  {
+    return false;
+  }
+
+  for (i = 0; i < CALIB_PLAUS_CHANNELS; ++i)
+  {
+    if (plaus->min[i] >= plaus->max[i])
+    {
+      return false;
+    }
+  }
+
+  if (pedal->apps_shift > CALIB_PEDAL_MAX_SHIFT
+      || pedal->rpm_shift > CALIB_PEDAL_MAX_SHIFT
+      || pedal->rise == 0 || pedal->fall == 0)
+  {
+    return false;
+  }
+
+  for (i = 0; i < CALIB_PEDAL_RPM_POINTS; ++i)
+  {
+    for (j = 0; j < CALIB_PEDAL_APPS_POINTS; ++j)
+    {
+      if (pedal->map[i][j] > CALIB_PEDAL_FULL)
+      {
+        return false;
+      }
+    }
+  }
+
+  if (data->etb.kp < 0 || data->etb.ki < 0 || data->etb.kd < 0
+      || data->etb.duty_max == 0 || data->etb.slew == 0)
+  {
+    return false;
+  }
+
+  for (i = 0; i < CALIB_SPRING_POINTS; ++i)
+  {
+    if (data->spring.duty[i] > data->etb.duty_max)
+    {
+      return false;
+    }
+  }
+
+  return plaus->apps_tol >= 0 && plaus->tps_tol >= 0
+         && plaus->range_debounce >= 1
+         && plaus->range_debounce <= CALIB_PLAUS_MAX_DEBOUNCE
+         && plaus->ooc_debounce >= 1
+         && plaus->ooc_debounce <= CALIB_PLAUS_MAX_DEBOUNCE;
+}
+
+/* Applies a write to the working page through the inactive buffer. Returns
+ * -EBUSY if a reader still holds that buffer from before the last switch;
+ * the tool retries, and a control cycle later it is free.
+ */
+
+static int calib_write(uint32_t addr, FAR const void *src, uint32_t len)
+{
+  FAR struct calib_data_s *shadow;
+  int active = g_calib_active;
+
+  if (__atomic_load_n(&g_calib_refs[active ^ 1], __ATOMIC_SEQ_CST) != 0)
+  {
+    return -EBUSY;
+  }
+
+  shadow = &g_calib_ram[active ^ 1];
+  memcpy(shadow, &g_calib_ram[active], sizeof(*shadow));
+  memcpy((FAR uint8_t *)shadow + addr, src, len);
+
+  if (!calib_data_valid(shadow))
+  {
+    return -EINVAL;
+  }
+
+  __atomic_store_n(&g_calib_active, active ^ 1, __ATOMIC_SEQ_CST);
+  return OK;
+}
+
+static int calib_xcp_error(FAR uint8_t *resp, uint8_t code)
+{
+  resp[0] = XCP_PID_ERR;
+  resp[1] = code;
+  return 2;
+}
+
+static int calib_xcp_upload(FAR uint8_t *resp, uint8_t len)
+{
+  /* Reads may split values; tools upload in whole packets regardless */
+
+  if (len == 0 || len > XCP_MAX_CTO - 1
+      || g_calib_mta > sizeof(struct calib_data_s)
+      || len > sizeof(struct calib_data_s) - g_calib_mta)
+  {
+    return calib_xcp_error(resp, XCP_ERR_OUT_OF_RANGE);
+  }
+
+  resp[0] = XCP_PID_RES;
+  memcpy(&resp[1], calib_page_data(g_calib_xcp_page) + g_calib_mta, len);
+  g_calib_mta += len;
+  return len + 1;
+}
+
+static int calib_xcp_download(FAR const uint8_t *cmd, uint8_t cmdlen,
+                              FAR uint8_t *resp)
+{
+  uint8_t len = cmd[1];
+  int ret;
+
+  if (cmdlen < 2 || len == 0 || len > XCP_MAX_CTO - 2 || cmdlen < len + 2)
+  {
+    return calib_xcp_error(resp, XCP_ERR_CMD_SYNTAX);
+  }
+
+  if (g_calib_xcp_page != CALIB_PAGE_WORKING)
+  {
+    return calib_xcp_error(resp, XCP_ERR_WRITE_PROTECTED);
+  }
+
+  if (!calib_range_valid(g_calib_mta, len))
+  {
+    return calib_xcp_error(resp, XCP_ERR_OUT_OF_RANGE);
+  }
+
+  ret = calib_write(g_calib_mta, &cmd[2], len);
+  if (ret == -EBUSY)
+  {
+    return calib_xcp_error(resp, XCP_ERR_CMD_BUSY);
+  }
+  else if (ret < 0)
+  {
+    return calib_xcp_error(resp, XCP_ERR_OUT_OF_RANGE);
+  }
+
+  g_calib_mta += len;
+  resp[0] = XCP_PID_RES;
+  return 1;
+}
+
+static int calib_xcp_set_cal_page(FAR const uint8_t *cmd, uint8_t cmdlen,
+                                  FAR uint8_t *resp)
+{
+  uint8_t mode = cmd[1];
+
+  if (cmdlen < 4)
+  {
+    return calib_xcp_error(resp, XCP_ERR_CMD_SYNTAX);
+  }
+
+  if (cmd[2] != 0 && (mode & XCP_PAGE_MODE_ALL) == 0)
+  {
+    return calib_xcp_error(resp, XCP_ERR_SEGMENT_NOT_VALID);
+  }
+
+  if (cmd[3] != CALIB_PAGE_WORKING && cmd[3] != CALIB_PAGE_REFERENCE)
+  {
+    return calib_xcp_error(resp, XCP_ERR_PAGE_NOT_VALID);
+  }
+
+  /* Control tasks pick up the new ECU page at their next acquire */
+
+  if (mode & XCP_PAGE_MODE_ECU)
+  {
+    __atomic_store_n(&g_calib_ecu_page, cmd[3], __ATOMIC_RELEASE);
+  }
+
+  if (mode & XCP_PAGE_MODE_XCP)
+  {
+    g_calib_xcp_page = cmd[3];
+  }
+
+  resp[0] = XCP_PID_RES;
+  return 1;
+}
+
+static int calib_xcp_get_cal_page(FAR const uint8_t *cmd, uint8_t cmdlen,
+                                  FAR uint8_t *resp)
+{
+  if (cmdlen < 3)
+  {
+    return calib_xcp_error(resp, XCP_ERR_CMD_SYNTAX);
+  }
+
+  if (cmd[2] != 0)
+  {
+    return calib_xcp_error(resp, XCP_ERR_SEGMENT_NOT_VALID);
+  }
+
+  resp[0] = XCP_PID_RES;
+  resp[1] = 0;
+  resp[2] = 0;
+
+  if (cmd[1] == XCP_PAGE_MODE_ECU)
+  {
+    resp[3] = g_calib_ecu_page;
+  }
+  else if (cmd[1] == XCP_PAGE_MODE_XCP)
+  {
+    resp[3] = g_calib_xcp_page;
+  }
+  else
+  {
+    return calib_xcp_error(resp, XCP_ERR_CMD_SYNTAX);
+  }
+
+  return 4;
+}
+
+static int calib_xcp_copy_cal_page(FAR const uint8_t *cmd, uint8_t cmdlen,
+                                   FAR uint8_t *resp)
+{
+  int ret;
+
+  if (cmdlen < 5)
+  {
+    return calib_xcp_error(resp, XCP_ERR_CMD_SYNTAX);
+  }
+
+  if (cmd[1] != 0 || cmd[3] != 0)
+  {
+    return calib_xcp_error(resp, XCP_ERR_SEGMENT_NOT_VALID);
+  }
+
+  if ((cmd[2] != CALIB_PAGE_WORKING && cmd[2] != CALIB_PAGE_REFERENCE)
+      || (cmd[4] != CALIB_PAGE_WORKING && cmd[4] != CALIB_PAGE_REFERENCE))
+  {
+    return calib_xcp_error(resp, XCP_ERR_PAGE_NOT_VALID);
+  }
+
+  if (cmd[4] == CALIB_PAGE_REFERENCE && cmd[2] != CALIB_PAGE_REFERENCE)
+  {
+    return calib_xcp_error(resp, XCP_ERR_WRITE_PROTECTED);
+  }
+
+  if (cmd[2] == CALIB_PAGE_REFERENCE && cmd[4] == CALIB_PAGE_WORKING)
+  {
+    ret = calib_write(0, &g_calib_reference, sizeof(g_calib_reference));
+    if (ret < 0)
+    {
+      return calib_xcp_error(resp, XCP_ERR_CMD_BUSY);
+    }
+  }
+
+  resp[0] = XCP_PID_RES;
+  return 1;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: calib_acquire
+ *
+ * Description:
+ *   Get the calibration data the control loops should use. The values stay
+ *   the same until calib_release(), even if a tool writes new ones or
+ *   switches pages in the meantime, so control tasks acquire once at the
+ *   start of each cycle and release at the end. Never blocks.
+ *
+ ****************************************************************************/
+
+FAR const struct calib_data_s *calib_acquire(void)
+{
+  int idx;
+
+  if (__atomic_load_n(&g_calib_ecu_page, __ATOMIC_ACQUIRE)
+      == CALIB_PAGE_REFERENCE)
+  {
+    return &g_calib_reference;
+  }
+
+  /* Take a reference on the active buffer, then make sure it is still the
+   * active one. If a write switched buffers in between, the writer may
+   * already be reusing it, so drop the reference and try again.
+   */
+
+  while (true)
+  {
+    idx = __atomic_load_n(&g_calib_active, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&g_calib_refs[idx], 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_calib_active, __ATOMIC_SEQ_CST) == idx)
+    {
+      return &g_calib_ram[idx];
+    }
+
+    __atomic_fetch_sub(&g_calib_refs[idx], 1, __ATOMIC_RELEASE);
+  }
+}
+
+/****************************************************************************
+ * Name: calib_release
+ *
+ * Description:
+ *   Release calibration data returned by calib_acquire().
+ *
+ ****************************************************************************/
+
+void calib_release(FAR const struct calib_data_s *data)
+{
+  if (data != &g_calib_reference)
+  {
+    __atomic_fetch_sub(&g_calib_refs[data - g_calib_ram], 1,
+                       __ATOMIC_RELEASE);
+  }
+}
+
+/****************************************************************************
+ * Name: calib_xcp_command
+ *
+ * Description:
+ *   Handle one XCP command packet. Addresses are byte offsets into
+ *   struct calib_data_s with address extension 0, in a single segment with
+ *   the working and reference pages. Uploads of up to 7 bytes and
+ *   downloads of up to 6 bytes are supported; block transfers are not.
+ *
+ * Returned Value:
+ *   The length of the response packet written to resp (at most 8 bytes),
+ *   or 0 if no response should be sent.
+ *
+ ****************************************************************************/
+
+int calib_xcp_command(FAR const uint8_t *cmd, uint8_t len, FAR uint8_t *resp)
+{
+  if (len == 0)
+  {
+    return 0;
+  }
+
+  /* A slave that is not connected ignores everything but CONNECT */
+
+  if (cmd[0] == XCP_CMD_CONNECT)
+  {
+    g_calib_connected = true;
+    resp[0] = XCP_PID_RES;
+    resp[1] = XCP_RESOURCE_CALPAG;
+    resp[2] = XCP_COMM_MODE_INTEL;
+    resp[3] = XCP_MAX_CTO;
+    resp[4] = XCP_MAX_DTO & 0xff;
+    resp[5] = XCP_MAX_DTO >> 8;
+    resp[6] = XCP_VERSION;
+    resp[7] = XCP_VERSION;
+    return 8;
+  }
+  else if (!g_calib_connected)
+  {
+    return 0;
+  }
+
+  switch (cmd[0])
+  {
+    case XCP_CMD_DISCONNECT:
+      g_calib_connected = false;
+      resp[0] = XCP_PID_RES;
+      return 1;
+
+    case XCP_CMD_GET_STATUS:
+      memset(resp, 0, 6);
+      resp[0] = XCP_PID_RES;
+      return 6;
+
+    case XCP_CMD_SET_MTA:
+      if (len < 8)
+      {
+        return calib_xcp_error(resp, XCP_ERR_CMD_SYNTAX);
+      }
+      else if (cmd[3] != 0)
+      {
+        return calib_xcp_error(resp, XCP_ERR_OUT_OF_RANGE);
+      }
+
+      g_calib_mta = calib_get_le32(&cmd[4]);
+      resp[0] = XCP_PID_RES;
+      return 1;
+
+    case XCP_CMD_UPLOAD:
+      if (len < 2)
+      {
+        return calib_xcp_error(resp, XCP_ERR_CMD_SYNTAX);
+      }
+
+      return calib_xcp_upload(resp, cmd[1]);
+
+    case XCP_CMD_SHORT_UPLOAD:
+      if (len < 8)
+      {
+        return calib_xcp_error(resp, XCP_ERR_CMD_SYNTAX);
+      }
+      else if (cmd[3] != 0)
+      {
+        return calib_xcp_error(resp, XCP_ERR_OUT_OF_RANGE);
+      }
+
+      g_calib_mta = calib_get_le32(&cmd[4]);
+      return calib_xcp_upload(resp, cmd[1]);
+
+    case XCP_CMD_DOWNLOAD:
+      return calib_xcp_download(cmd, len, resp);
+
+    case XCP_CMD_SET_CAL_PAGE:
+      return calib_xcp_set_cal_page(cmd, len, resp);
+
+    case XCP_CMD_GET_CAL_PAGE:
+      return calib_xcp_get_cal_page(cmd, len, resp);
+
+    case XCP_CMD_COPY_CAL_PAGE:
+      return calib_xcp_copy_cal_page(cmd, len, resp);
+
+    default:
+      return calib_xcp_error(resp, XCP_ERR_CMD_UNKNOWN);
+  }
+}
@@ -0,0 +1,168 @@
+/****************************************************************************
+ * apps/industry/ETCetera/calib.h
+ * Electronic Throttle Controller program - calibration data
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_CALIB_H
+#define APPS_INDUSTRY_ETCETERA_CALIB_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define CALIB_SPRING_POINTS     CONFIG_INDUSTRY_ETCETERA_SPRING_POINTS
+
+/* Widest spring table point spacing, as a shift */
+
+#define CALIB_SPRING_MAX_SHIFT  12
+
+/* Pedal map size, and the throttle opening that means wide open */
+
+#define CALIB_PEDAL_APPS_POINTS 8
+#define CALIB_PEDAL_RPM_POINTS  8
+#define CALIB_PEDAL_FULL        1000
+
+/* Widest pedal map point spacing on either axis, as a shift */
+
+#define CALIB_PEDAL_MAX_SHIFT   13
+
+/* Channels with plausibility checks, in the order of their limits */
+
+#define CALIB_PLAUS_APPS1       0
+#define CALIB_PLAUS_APPS2       1
+#define CALIB_PLAUS_TPS1        2
+#define CALIB_PLAUS_TPS2        3
+#define CALIB_PLAUS_BRKF        4
+#define CALIB_PLAUS_BRKR        5
+#define CALIB_PLAUS_CHANNELS    6
+
+/* Longest debounce accepted, in safing ticks */
+
+#define CALIB_PLAUS_MAX_DEBOUNCE 40
+
+/* Calibration pages. The reference page is the set built into flash; the
+ * working page starts as a copy of it and is the one a tool can change.
+ */
+
+#define CALIB_PAGE_WORKING      0
+#define CALIB_PAGE_REFERENCE    1
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* ETB return spring: feedforward duty needed to hold the throttle at
+ * tps_base + (i << tps_shift) for each point i. Evenly spaced points let a
+ * lookup index the table directly instead of searching it. A relearn
+ * replaces the duty of the points between the end stops it finds.
+ */
+
+struct calib_spring_s
+{
+  int16_t tps_base;
+  uint16_t tps_shift;
+  uint16_t duty[CALIB_SPRING_POINTS];
+};
+
+/* DRS flap control thresholds */
+
+struct calib_drs_s
+{
+  int16_t accel_close;    /* Close below this acceleration (cm/s^2) */
+  int16_t accel_open;     /* Open above this acceleration (cm/s^2) */
+  int16_t brake_close;    /* Close above this front brake pressure */
+  int16_t brake_open;     /* Open when stopped below this pressure */
+  int16_t speed_open;     /* Stopped below this speed (cm/s) */
+};
+
+/* Sensor plausibility limits, in raw counts. A check must fail on this
+ * many consecutive safing ticks before its DTC is stored.
+ */
+
+struct calib_plaus_s
+{
+  int16_t min[CALIB_PLAUS_CHANNELS];  /* Out of range below this */
+  int16_t max[CALIB_PLAUS_CHANNELS];  /* Out of range above this */
+  int16_t apps_tol;       /* Largest APPS1 - APPS2 difference allowed */
+  int16_t tps_tol;        /* Largest TPS1 - TPS2 difference allowed */
+  uint16_t range_debounce;
+  uint16_t ooc_debounce;
+};
+
+/* ETB position loop. Gains are Q16 duty per count of position error; ki
+ * is applied every tick, and kd to the change in position over a tick.
+ */
+
+struct calib_etb_s
+{
+  int32_t kp;
+  int32_t ki;
+  int32_t kd;
+  uint16_t duty_max;      /* Highest duty commanded */
+  uint16_t slew;          /* Largest duty change per tick */
+};
+
+/* Pedal to throttle map. Each entry is the throttle opening wanted, in
+ * thousandths of the travel between the relearned end stops, with the
+ * pedal at apps_base + (i << apps_shift) counts and the engine at
+ * rpm_base + (j << rpm_shift) rpm. The target then moves towards it by at
+ * most rise or fall TPS counts per ETB control tick.
+ */
+
+struct calib_pedal_s
+{
+  int16_t apps_base;
+  uint16_t apps_shift;
+  uint16_t rpm_base;
+  uint16_t rpm_shift;
+  uint16_t map[CALIB_PEDAL_RPM_POINTS][CALIB_PEDAL_APPS_POINTS];
+  uint16_t rise;
+  uint16_t fall;
+};
+
+/* Everything a tool can calibrate. Calibration addresses are byte offsets
+ * into this structure, in the target's (little-endian) byte order.
+ */
+
+struct calib_data_s
+{
+  struct calib_spring_s spring;
+  struct calib_drs_s drs;
+  struct calib_plaus_s plaus;
+  struct calib_etb_s etb;
+  struct calib_pedal_s pedal;
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+FAR const struct calib_data_s *calib_acquire(void);
+void calib_release(FAR const struct calib_data_s *data);
+int calib_xcp_command(FAR const uint8_t *cmd, uint8_t len,
+                      FAR uint8_t *resp);
+
+#endif /* APPS_INDUSTRY_ETCETERA_CALIB_H */
@@ -27,156 +27,918 @@
 #include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <nuttx/can/can.h>
 #include <sys/boardctl.h>
 #include <mqueue.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <nuttx/clock.h>
+#include <nuttx/semaphore.h>
 
+#include "calib.h"
 #include "can_broadcast.h"
+#include "can_filter.h"
+#include "can_messages.h"
 #include "safing.h"
 
 /****************************************************************************
  * Pre-processor Definitions
  ****************************************************************************/
 
+/* The routing table is an open-addressed hash table keyed by the CAN ID,
+ * with the top bits of the key marking a used slot and an extended ID.
+ * A key of zero is an empty slot, so the zero-initialized table is empty.
+ */
+
+#define CAN_ROUTE_SLOTS       CONFIG_INDUSTRY_ETCETERA_CAN_RX_ROUTES
+#define CAN_ROUTE_SLOT_MASK   (CAN_ROUTE_SLOTS - 1)
+#define CAN_ROUTE_MAX_ROUTES  (CAN_ROUTE_SLOTS / 2)
+#define CAN_ROUTE_KEY_VALID   0x80000000
+#define CAN_ROUTE_KEY_EXTID   0x40000000
+#define CAN_ROUTE_KEY_ID      0x1fffffff
+
+#if (CAN_ROUTE_SLOTS & CAN_ROUTE_SLOT_MASK) != 0
+#  error "CONFIG_INDUSTRY_ETCETERA_CAN_RX_ROUTES must be a power of two"
+#endif
+
+#define CAN_SAFING_TX_DEPTH   CONFIG_INDUSTRY_ETCETERA_CAN_SAFING_TX_DEPTH
+#define CAN_DRS_TX_DEPTH      CONFIG_INDUSTRY_ETCETERA_CAN_DRS_TX_DEPTH
+#define CAN_TELEM_TX_DEPTH    CONFIG_INDUSTRY_ETCETERA_CAN_TELEM_TX_DEPTH
+#define CAN_CALIB_TX_DEPTH    CONFIG_INDUSTRY_ETCETERA_CAN_CALIB_TX_DEPTH
+
+#if (CAN_STATS_IDS & (CAN_STATS_IDS - 1)) != 0
+#  error "CONFIG_INDUSTRY_ETCETERA_CAN_STATS_IDS must be a power of two"
+#endif
+
+#define CAN_STATS_PERIOD_MS   CONFIG_INDUSTRY_ETCETERA_CAN_STATS_PERIOD
+
+#define CAN_STD_FILTERS       CONFIG_INDUSTRY_ETCETERA_CAN_STD_FILTERS
+#define CAN_EXT_FILTERS       CONFIG_INDUSTRY_ETCETERA_CAN_EXT_FILTERS
+#define CAN_MAX_FILTERS       (CAN_STD_FILTERS > CAN_EXT_FILTERS ? \
+                               CAN_STD_FILTERS : CAN_EXT_FILTERS)
+
+#if (CAN_SAFING_TX_DEPTH & (CAN_SAFING_TX_DEPTH - 1)) != 0 || \
+    (CAN_DRS_TX_DEPTH & (CAN_DRS_TX_DEPTH - 1)) != 0 || \
+    (CAN_TELEM_TX_DEPTH & (CAN_TELEM_TX_DEPTH - 1)) != 0 || \
+    (CAN_CALIB_TX_DEPTH & (CAN_CALIB_TX_DEPTH - 1)) != 0
+#  error "CAN tx ring depths must be powers of two"
+#endif
 
 /****************************************************************************
  * Private Types
  ****************************************************************************/
 
+struct can_route_slot_s
+{
+  uint32_t key;
+  uint8_t mqueue_idx;
+};
 
 /****************************************************************************
  * Private Function Prototypes
  ****************************************************************************/
-static void broadcast_sigusr1_sigaction(int signo, FAR siginfo_t *siginfo, FAR void *context);
+static FAR void *can_broadcast_tx_thread(FAR void *arg);
 
 /****************************************************************************
  * Private Data
  ****************************************************************************/
 
-static char *tx_mqueue_names[CAN_NUM_TX_MQUEUES] = {
-  CAN_DRS_TX_MQUEUE_NAME,
-  CAN_SAFING_TX_MQUEUE_NAME
+static char *rx_mqueue_names[CAN_NUM_RX_MQUEUES] = {
+  [CAN_DRS_RX_MQUEUE_IDX]  = CAN_DRS_RX_MQUEUE_NAME,
+  [CAN_DIAG_RX_MQUEUE_IDX] = CAN_DIAG_RX_MQUEUE_NAME,
+  [CAN_ETB_RX_MQUEUE_IDX]  = CAN_ETB_RX_MQUEUE_NAME
 };
 
-static char *rx_mqueue_names[CAN_NUM_RX_MQUEUES] = {
-  CAN_DRS_RX_MQUEUE_NAME
+static const struct can_rx_route_s g_default_rx_routes[] = {
+  CAN_RX_ROUTES
 };
 
+static struct can_route_slot_s g_rx_routes[CAN_ROUTE_SLOTS];
+static int g_rx_route_count;
+static int g_rx_route_maxprobe;
+
+/* The CAN device is normally opened once for both directions. For replay
+ * on the simulator, frames are read from a FIFO and written elsewhere so
+ * that transmitted frames are not received back.
+ */
+
 static int g_canfd;
+static int g_cantxfd;
+
+/* The tx rings have a single consumer and the stats a single writer, so
+ * only one broadcast task may run in the address space.
+ */
+
+static bool g_can_broadcast_started;
+static mqd_t g_rx_mqueues[CAN_NUM_RX_MQUEUES];
+
+/* The driver hands back as many whole frames as fit in the read buffer,
+ * packed back to back with only CAN_MSGLEN(dlc) bytes each. Sizing the
+ * buffer for full-length frames guarantees room for a whole batch.
+ */
+
+static struct can_msg_s g_rxbuf[CONFIG_INDUSTRY_ETCETERA_CAN_RX_BATCH];
 
-static struct sigevent g_mq_sigusr1event = {
-  .sigev_notify = SIGEV_SIGNAL,
-  .sigev_signo = SIGUSR1
+static struct can_txframe_s g_safing_tx_slots[CAN_SAFING_TX_DEPTH];
+static struct can_txframe_s g_drs_tx_slots[CAN_DRS_TX_DEPTH];
+static struct can_txframe_s g_telem_tx_slots[CAN_TELEM_TX_DEPTH];
+static struct can_txframe_s g_calib_tx_slots[CAN_CALIB_TX_DEPTH];
+
+static sem_t g_can_tx_sem = SEM_INITIALIZER(0);
+
+/* Acceptance filters are owned by the tx thread, which reprograms them
+ * whenever a route is added. Other tasks cannot use g_canfd, so they only
+ * set g_rx_filters_dirty and wake the thread.
+ */
+
+static const int g_filter_slots[CAN_NUM_FILTER_TYPES] = {
+  [CAN_FILTER_TYPE_STD] = CAN_STD_FILTERS,
+  [CAN_FILTER_TYPE_EXT] = CAN_EXT_FILTERS
 };
 
+static int g_filter_handles[CAN_NUM_FILTER_TYPES][CAN_MAX_FILTERS];
+static bool g_rx_filters_dirty = true;
+
+/* Scratch space for planning filters; only used by the tx thread */
+
+static uint32_t g_filter_ids[CAN_ROUTE_MAX_ROUTES];
+static struct can_filter_s g_filter_plan[CAN_ROUTE_MAX_ROUTES];
+
 /****************************************************************************
  * Public Data
  ****************************************************************************/
 
+struct can_ring_s g_can_tx_rings[CAN_NUM_TX_RINGS] = {
+  [CAN_SAFING_TX_RING] = CAN_RING_INITIALIZER(g_safing_tx_slots),
+  [CAN_DRS_TX_RING]    = CAN_RING_INITIALIZER(g_drs_tx_slots),
+  [CAN_TELEM_TX_RING]  = CAN_RING_INITIALIZER(g_telem_tx_slots),
+  [CAN_CALIB_TX_RING]  = CAN_RING_INITIALIZER(g_calib_tx_slots)
+};
+
+struct can_tx_latency_s g_can_tx_latency[CAN_NUM_TX_RINGS];
+
+struct can_stats_s g_can_stats;
+
 
 /****************************************************************************
  * Private Functions
  ****************************************************************************/
 
-static void broadcast_sigusr1_sigaction(int signo, FAR siginfo_t *siginfo, FAR void *context)
+static inline uint32_t can_route_key(uint32_t id, bool extid)
+{
+  return CAN_ROUTE_KEY_VALID | (extid ? CAN_ROUTE_KEY_EXTID : 0) | id;
+}
+
+static inline uint32_t can_id_hash(uint32_t key, uint32_t mask)
 {
+  /* Fibonacci hashing spreads the mostly-sequential IDs used on the bus
+   * evenly across the table.
+   */
+  
+  return ((key * 0x9e3779b1) >> 16) & mask;
+}
+
+/* Returns the rx queue index for a received frame, CAN_CALIB_RX_DEST, or -1
+ * if no task has subscribed to its ID. Called for every frame, so the probe
+ * sequence is bounded by the longest one any registration has needed.
+ */
+
+static int can_route_lookup(FAR const struct can_hdr_s *hdr)
+{
+  uint32_t key;
+  uint32_t slot_key;
+  uint32_t slot;
+  int probe;
+  
+  key = can_route_key(hdr->ch_id, hdr->ch_extid);
+  slot = can_id_hash(key, CAN_ROUTE_SLOT_MASK);
+  
+  for (probe = 0; probe <= g_rx_route_maxprobe; ++probe)
+  {
+    slot_key = __atomic_load_n(&g_rx_routes[slot].key, __ATOMIC_ACQUIRE);
+    if (slot_key == key)
+    {
+      return g_rx_routes[slot].mqueue_idx;
+    }
+    else if (slot_key == 0)
+    {
+      break;
+    }
+    
+    slot = (slot + 1) & CAN_ROUTE_SLOT_MASK;
+  }
+  
+  return -1;
+}
+
+/* Returns the counters for a CAN ID, adding it to g_can_stats.ids if it is
+ * new. Both the rx and tx threads add IDs, so a free entry is claimed with
+ * a compare-and-swap on its key. Returns NULL if the table is full.
+ */
+
+static FAR struct can_id_stats_s *can_stats_id(uint32_t id, bool extid)
+{
+  FAR struct can_id_stats_s *entry;
+  uint32_t key;
+  uint32_t expected;
+  uint32_t slot;
+  int probe;
+  
+  key = CAN_STATS_KEY_VALID | (extid ? CAN_STATS_KEY_EXTID : 0) | id;
+  slot = can_id_hash(key, CAN_STATS_IDS - 1);
+  
+  for (probe = 0; probe < CAN_STATS_IDS; ++probe)
+  {
+    entry = &g_can_stats.ids[slot];
+    expected = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+    if (expected == 0)
+    {
+      if (__atomic_compare_exchange_n(&entry->key, &expected, key, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+        return entry;
+      }
+    }
+    
+    if (expected == key)
+    {
+      return entry;
+    }
+    
+    slot = (slot + 1) & (CAN_STATS_IDS - 1);
+  }
+  
+  __atomic_fetch_add(&g_can_stats.ids_overflow, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/* Samples the depth of each rx queue a read batch sent frames to. The
+ * batch is queued back to back, so its end is as deep as the queues get,
+ * and the mq_getattr() call is made once per batch rather than per frame.
+ */
+
+static void can_stats_rx_queued(uint32_t routes)
+{
+  struct mq_attr attr;
+  int route;
+  
+  for (route = 0; routes != 0; ++route, routes >>= 1)
+  {
+    if ((routes & 1) != 0 && mq_getattr(g_rx_mqueues[route], &attr) == OK
+        && attr.mq_curmsgs > g_can_stats.rx_mq_highwater[route])
+    {
+      g_can_stats.rx_mq_highwater[route] = attr.mq_curmsgs;
+    }
+  }
+}
+
+/* Serves a calibration command and queues the response. This task is the
+ * only producer on the calibration tx ring. If the ring is full the command
+ * is dropped unanswered rather than executed, so that the tool's retry does
+ * not apply a download twice.
+ */
+
+static void can_broadcast_calib_rx(FAR const struct can_msg_s *msg)
+{
+  FAR struct can_ring_s *ring = &g_can_tx_rings[CAN_CALIB_TX_RING];
+  FAR struct can_msg_s *resp;
+  int len;
+
+  resp = can_ring_claim(ring);
+  if (resp == NULL)
+  {
+    return;
+  }
+
+  len = calib_xcp_command(msg->cm_data, msg->cm_hdr.ch_dlc, resp->cm_data);
+  if (len > 0)
+  {
+    resp->cm_hdr.ch_id = CAN_ID_CALIB_TX;
+    resp->cm_hdr.ch_extid = true;
+    resp->cm_hdr.ch_dlc = len;
+    resp->cm_hdr.ch_rtr = 0;
+#ifdef CONFIG_CAN_ERRORS
+    resp->cm_hdr.ch_error = 0;
+#endif
+    can_broadcast_publish(CAN_CALIB_TX_RING);
+  }
+}
+
+/* Walks the packed frames returned by one read() and forwards each one to
+ * the rx queue its ID is routed to, or handles it here. Stops at the first
+ * frame that does not fit entirely within the bytes read. Returns the
+ * number of frames walked.
+ */
+
+static int can_broadcast_dispatch_rx(FAR const uint8_t *buf, size_t nbytes)
+{
+  FAR const struct can_msg_s *msg;
+  FAR struct can_id_stats_s *id_stats;
+  size_t offset = 0;
+  size_t msglen;
+  uint32_t queued = 0;
+  int nframes = 0;
+  int route;
+  
+  while (offset + sizeof(struct can_hdr_s) <= nbytes)
+  {
+    msg = (FAR const struct can_msg_s *)&buf[offset];
+    if (msg->cm_hdr.ch_dlc > CAN_MAXDATALEN)
+    {
+      break;
+    }
+    
+    msglen = CAN_MSGLEN(msg->cm_hdr.ch_dlc);
+    if (offset + msglen > nbytes)
+    {
+      break;
+    }
+    
+    offset += msglen;
+    ++nframes;
+    
+#ifdef CONFIG_CAN_ERRORS
+    if (msg->cm_hdr.ch_error)
+    {
+      ++g_can_stats.rx_bus_errors;
+      continue;
+    }
+#endif
+    
+    id_stats = can_stats_id(msg->cm_hdr.ch_id, msg->cm_hdr.ch_extid);
+    if (id_stats != NULL)
+    {
+      ++id_stats->rx;
+    }
+    
+    route = can_route_lookup(&msg->cm_hdr);
+    if (route < 0)
+    {
+      ++g_can_stats.rx_unrouted;
+    }
+    else if (route == CAN_CALIB_RX_DEST)
+    {
+      can_broadcast_calib_rx(msg);
+    }
+    else if (mq_send(g_rx_mqueues[route], (FAR const char *)msg, msglen, 1) < 0)
+    {
+      ++g_can_stats.rx_mq_failures[route];
+    }
+    else
+    {
+      queued |= 1u << route;
+    }
+  }
+  
+  can_stats_rx_queued(queued);
+  g_can_stats.rx_frames += nframes;
+  return nframes;
+}
+
+static int can_broadcast_filter_ioctl(int type, bool add,
+                                      FAR const struct can_filter_s *filter,
+                                      int handle)
+{
+  struct canioc_stdfilter_s stdfilter;
+  struct canioc_extfilter_s extfilter;
+  
+  if (type == CAN_FILTER_TYPE_EXT)
+  {
+    if (!add)
+    {
+      return ioctl(g_canfd, CANIOC_DEL_EXTFILTER, handle);
+    }
+    
+    extfilter.xf_id1 = filter->id;
+    extfilter.xf_id2 = filter->mask;
+    extfilter.xf_type = CAN_FILTER_MASK;
+    extfilter.xf_prio = CAN_MSGPRIO_HIGH;
+    return ioctl(g_canfd, CANIOC_ADD_EXTFILTER, (unsigned long)&extfilter);
+  }
+  
+  if (!add)
+  {
+    return ioctl(g_canfd, CANIOC_DEL_STDFILTER, handle);
+  }
+  
+  stdfilter.sf_id1 = filter->id;
+  stdfilter.sf_id2 = filter->mask;
+  stdfilter.sf_type = CAN_FILTER_MASK;
+  stdfilter.sf_prio = CAN_MSGPRIO_HIGH;
+  return ioctl(g_canfd, CANIOC_ADD_STDFILTER, (unsigned long)&stdfilter);
+}
+
+/* Replaces the acceptance filters of one ID type with a plan covering the
+ * current routes. The old filters are removed first because the controller
+ * may not have room for both sets, so frames can be missed for the
+ * duration of the update; routes are only added at startup in practice.
+ * If the driver rejects a filter, all of them are removed again so that
+ * no routed frame is filtered out.
+ */
+
+static void can_broadcast_apply_filters(int type)
+{
+  FAR struct can_filter_stats_s *stats;
+  uint32_t idmask;
+  uint32_t key;
+  int nids = 0;
+  int nfilters;
   int ret;
-  mqd_t *tx_mqueue;
-  struct can_msg_s msg;
-  tx_mqueue = (mqd_t *)(siginfo->si_value.sival_ptr);
+  int i;
   
+  stats = &g_can_stats.filters[type];
+  idmask = type == CAN_FILTER_TYPE_EXT ? CAN_MAX_EXTMSGID : CAN_MAX_STDMSGID;
   
-  do
+  for (i = 0; i < CAN_ROUTE_SLOTS && nids < CAN_ROUTE_MAX_ROUTES; ++i)
+  {
+    key = __atomic_load_n(&g_rx_routes[i].key, __ATOMIC_ACQUIRE);
+    if (key != 0
+        && ((key & CAN_ROUTE_KEY_EXTID) != 0) == (type == CAN_FILTER_TYPE_EXT))
+    {
+      g_filter_ids[nids++] = key & CAN_ROUTE_KEY_ID;
+    }
+  }
+  
+  nfilters = can_filter_merge(g_filter_ids, nids, idmask, g_filter_plan,
+                              g_filter_slots[type]);
+  
+  for (i = 0; i < stats->filters; ++i)
+  {
+    can_broadcast_filter_ioctl(type, false, NULL, g_filter_handles[type][i]);
+  }
+  
+  stats->filters = 0;
+  stats->ids = nids;
+  stats->accepted = 0;
+  ++stats->updates;
+  
+  for (i = 0; i < nfilters; ++i)
   {
-    ret = mq_receive(*tx_mqueue, (char *)&msg, sizeof(msg), NULL);
-    if (ret > 0)
+    ret = can_broadcast_filter_ioctl(type, true, &g_filter_plan[i], 0);
+    if (ret < 0)
+    {
+      syslog(LOG_WARNING, "can_broadcast: %s filter rejected (%d), "
+             "receiving all frames\n",
+             type == CAN_FILTER_TYPE_EXT ? "ext" : "std", errno);
+      ++stats->failures;
+      
+      while (--i >= 0)
       {
-        write(g_canfd, &msg, CAN_MSGLEN(msg.cm_hdr.ch_dlc));
+        can_broadcast_filter_ioctl(type, false, NULL,
+                                   g_filter_handles[type][i]);
       }
+      
+      return;
+    }
+    
+    g_filter_handles[type][i] = ret;
+  }
+  
+  stats->filters = nfilters;
+  stats->accepted = can_filter_accepted(g_filter_plan, nfilters, idmask);
+  
+  if (nfilters > 0)
+  {
+    syslog(LOG_INFO, "can_broadcast: %d %s IDs in %d filters accepting "
+           "%" PRIu32 " IDs (%" PRIu32 "%% efficient)\n",
+           nids, type == CAN_FILTER_TYPE_EXT ? "ext" : "std", nfilters,
+           stats->accepted, (uint32_t)nids * 100 / stats->accepted);
   }
-  while (ret > 0 || (ret < 0 && errno == EINTR));
+}
+
+static inline uint32_t can_broadcast_now_us(void)
+{
+  struct timespec now;
   
-  /* Reregister after handling it */
-  g_mq_sigusr1event.sigev_value.sival_ptr = tx_mqueue;
-  mq_notify(*tx_mqueue, &g_mq_sigusr1event);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * USEC_PER_SEC + now.tv_nsec / NSEC_PER_USEC;
+}
+
+static void can_stats_tx_latency(int ring, uint32_t delay_us)
+{
+  FAR struct can_tx_latency_s *latency;
+  int bucket;
+  
+  latency = &g_can_tx_latency[ring];
+  latency->last_us = delay_us;
+  latency->total_us += delay_us;
+  if (delay_us > latency->max_us)
+  {
+    latency->max_us = delay_us;
+  }
+  ++latency->frames;
+  
+  bucket = 0;
+  if (delay_us >> CAN_LATENCY_BUCKET0_SHIFT)
+  {
+    bucket = 32 - __builtin_clz(delay_us) - CAN_LATENCY_BUCKET0_SHIFT;
+    if (bucket >= CAN_LATENCY_BUCKETS)
+    {
+      bucket = CAN_LATENCY_BUCKETS - 1;
+    }
+  }
+  ++latency->hist[bucket];
+}
+
+static inline uint32_t can_stats_saturate(uint32_t value, uint32_t max)
+{
+  return value > max ? max : value;
+}
+
+/* Writes the periodic diagnostic frame summarizing the counters. It goes
+ * straight to the driver rather than through a ring, since this thread is
+ * the only writer.
+ */
+
+static void can_stats_send_summary(void)
+{
+  struct can_msg_s msg = {{0}};
+  uint32_t ring_drops = 0;
+  uint32_t rx_drops = 0;
+  uint32_t max_us = 0;
+  int i;
+  
+  for (i = 0; i < CAN_NUM_TX_RINGS; ++i)
+  {
+    ring_drops += g_can_tx_rings[i].dropped;
+    if (g_can_tx_latency[i].max_us > max_us)
+    {
+      max_us = g_can_tx_latency[i].max_us;
+    }
+  }
+  
+  for (i = 0; i < CAN_NUM_RX_MQUEUES; ++i)
+  {
+    rx_drops += g_can_stats.rx_mq_failures[i];
+  }
+  
+  msg.cm_hdr.ch_id = CAN_ID_CANSTAT_TX;
+  msg.cm_hdr.ch_extid = true;
+  msg.cm_hdr.ch_dlc = 8;
+  canstat_ring_drops_pack(msg.cm_data,
+                          can_stats_saturate(ring_drops, UINT16_MAX));
+  canstat_rx_drops_pack(msg.cm_data, can_stats_saturate(rx_drops, UINT16_MAX));
+  canstat_max_latency_us_pack(msg.cm_data,
+                              can_stats_saturate(max_us, UINT16_MAX * 100));
+  canstat_write_failures_pack(msg.cm_data,
+                              can_stats_saturate(g_can_stats.tx_write_failures,
+                                                 UINT8_MAX));
+  canstat_bus_errors_pack(msg.cm_data,
+                          can_stats_saturate(g_can_stats.rx_bus_errors,
+                                             UINT8_MAX));
+  
+  if (write(g_cantxfd, &msg, CAN_MSGLEN(msg.cm_hdr.ch_dlc)) < 0)
+  {
+    ++g_can_stats.tx_write_failures;
+  }
+}
+
+/* Waits for a published frame, or until the next diagnostic summary is due.
+ * sem_timedwait() only takes CLOCK_REALTIME, so the monotonic deadline is
+ * converted to a relative wait first.
+ */
+
+static int can_broadcast_tx_wait(uint32_t summary_due_us)
+{
+  struct timespec timeout;
+  struct timespec wait;
+  int32_t wait_us;
+  
+  if (CAN_STATS_PERIOD_MS == 0)
+  {
+    return sem_wait(&g_can_tx_sem);
+  }
+  
+  wait_us = summary_due_us - can_broadcast_now_us();
+  if (wait_us < 0)
+  {
+    wait_us = 0;
+  }
+  
+  wait.tv_sec = wait_us / USEC_PER_SEC;
+  wait.tv_nsec = (wait_us % USEC_PER_SEC) * NSEC_PER_USEC;
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  clock_timespec_add(&timeout, &wait, &timeout);
+  return sem_timedwait(&g_can_tx_sem, &timeout);
+}
+
+/* Transmit worker. Each wakeup sends at most one frame: the oldest one in
+ * the highest-priority ring that is not empty. Every frame published with
+ * can_broadcast_publish() posts g_can_tx_sem once, so no frame is left
+ * waiting. can_broadcast_register_rx() also posts, to have the filters
+ * reprogrammed, and the wait times out when the summary frame is due. Such
+ * a wakeup may only service the filters or the summary; if it sends a
+ * frame as well, that frame's own post later finds nothing to send.
+ */
+
+static FAR void *can_broadcast_tx_thread(FAR void *arg)
+{
+  FAR struct can_txframe_s *frame;
+  FAR struct can_id_stats_s *id_stats;
+  uint32_t summary_due_us;
+  uint32_t now_us;
+  int ret;
+  int i;
+  
+  summary_due_us = can_broadcast_now_us() + CAN_STATS_PERIOD_MS * USEC_PER_MSEC;
+  
+  while (true)
+  {
+    ret = can_broadcast_tx_wait(summary_due_us);
+    
+    if (__atomic_exchange_n(&g_rx_filters_dirty, false, __ATOMIC_ACQ_REL))
+    {
+      can_broadcast_apply_filters(CAN_FILTER_TYPE_STD);
+      can_broadcast_apply_filters(CAN_FILTER_TYPE_EXT);
+    }
+    
+    if (CAN_STATS_PERIOD_MS > 0
+        && (int32_t)(can_broadcast_now_us() - summary_due_us) >= 0)
+    {
+      can_stats_send_summary();
+      summary_due_us += CAN_STATS_PERIOD_MS * USEC_PER_MSEC;
+      if ((int32_t)(can_broadcast_now_us() - summary_due_us) >= 0)
+      {
+        summary_due_us = can_broadcast_now_us() + CAN_STATS_PERIOD_MS * USEC_PER_MSEC;
+      }
+    }
+    
+    if (ret < 0)
+    {
+      continue;
+    }
+    
+    for (i = 0; i < CAN_NUM_TX_RINGS; ++i)
+    {
+      frame = can_ring_peek(&g_can_tx_rings[i]);
+      if (frame != NULL)
+      {
+        break;
+      }
+    }
+    
+    if (i == CAN_NUM_TX_RINGS)
+    {
+      continue;
+    }
+    
+    ret = write(g_cantxfd, &frame->msg, CAN_MSGLEN(frame->msg.cm_hdr.ch_dlc));
+    now_us = can_broadcast_now_us();
+    
+    if (ret < 0)
+    {
+      ++g_can_stats.tx_write_failures;
+    }
+    else
+    {
+      id_stats = can_stats_id(frame->msg.cm_hdr.ch_id, frame->msg.cm_hdr.ch_extid);
+      if (id_stats != NULL)
+      {
+        ++id_stats->tx;
+      }
+      
+      can_stats_tx_latency(i, now_us - frame->enqueue_us);
+    }
+    
+    can_ring_release(&g_can_tx_rings[i]);
+  }
+  
+  return NULL;
 }
 
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
 
+/****************************************************************************
+ * Name: can_broadcast_register_rx
+ *
+ * Description:
+ *   Route received frames with the given CAN ID to one of the rx message
+ *   queues, or to CAN_CALIB_RX_DEST. May be called by any task, before
+ *   or after the CAN broadcast task has started. The CAN controller's
+ *   acceptance filters are updated shortly afterwards to let the ID
+ *   through.
+ *
+ * Returned Value:
+ *   OK on success; -EINVAL for an invalid ID or queue index, -EEXIST if the
+ *   ID is already routed to a different queue, or -ENOSPC if the routing
+ *   table is full.
+ *
+ ****************************************************************************/
+
+int can_broadcast_register_rx(uint32_t id, bool extid, int mqueue_idx)
+{
+  uint32_t key;
+  uint32_t slot;
+  int probe;
+  int ret = OK;
+  
+  if (mqueue_idx < 0 || mqueue_idx > CAN_CALIB_RX_DEST
+      || id > (extid ? CAN_MAX_EXTMSGID : CAN_MAX_STDMSGID))
+  {
+    return -EINVAL;
+  }
+  
+  key = can_route_key(id, extid);
+  slot = can_id_hash(key, CAN_ROUTE_SLOT_MASK);
+  
+  sched_lock();
+  
+  for (probe = 0; ; ++probe)
+  {
+    if (g_rx_routes[slot].key == key)
+    {
+      if (g_rx_routes[slot].mqueue_idx != mqueue_idx)
+      {
+        ret = -EEXIST;
+      }
+      break;
+    }
+    else if (g_rx_routes[slot].key == 0)
+    {
+      if (g_rx_route_count >= CAN_ROUTE_MAX_ROUTES)
+      {
+        ret = -ENOSPC;
+        break;
+      }
+      
+      /* Fill in the destination before publishing the key so the rx loop
+       * never sees a half-written slot.
+       */
+      
+      g_rx_routes[slot].mqueue_idx = mqueue_idx;
+      if (probe > g_rx_route_maxprobe)
+      {
+        g_rx_route_maxprobe = probe;
+      }
+      __atomic_store_n(&g_rx_routes[slot].key, key, __ATOMIC_RELEASE);
+      ++g_rx_route_count;
+      
+      /* Have the tx thread open the hardware filters for the new ID */
+      
+      __atomic_store_n(&g_rx_filters_dirty, true, __ATOMIC_RELEASE);
+      sem_post(&g_can_tx_sem);
+      break;
+    }
+    
+    slot = (slot + 1) & CAN_ROUTE_SLOT_MASK;
+  }
+  
+  sched_unlock();
+  return ret;
+}
+
+/****************************************************************************
+ * Name: can_broadcast_publish
+ *
+ * Description:
+ *   Publish the frame the calling task filled in after can_ring_claim() on
+ *   its tx ring, and wake the transmit worker.
+ *
+ ****************************************************************************/
+
+void can_broadcast_publish(int ring)
+{
+  can_ring_publish(&g_can_tx_rings[ring], can_broadcast_now_us());
+  sem_post(&g_can_tx_sem);
+}
+
+/****************************************************************************
+ * Name: can_broadcast_running
+ *
+ * Description:
+ *   Whether a CAN broadcast task has been started. A second one would
+ *   share the tx rings and stats with the first, so it refuses to run.
+ *
+ ****************************************************************************/
+
+bool can_broadcast_running(void)
+{
+  return __atomic_load_n(&g_can_broadcast_started, __ATOMIC_ACQUIRE);
+}
+
 /****************************************************************************
  * Name: main
  *
  * Description:
- *   Entry point for the ETCetera daemon. Starts a task to run NuttShell then
- *   continues on.
+ *   Entry point for the CAN broadcast task. Optional arguments name the
+ *   device frames are read from (default /dev/can0) and, if different, the
+ *   one they are written to. Returns straight away if another broadcast
+ *   task is already running.
  *
  ****************************************************************************/
 
 int main(int argc, char **argv)
 {
+  FAR const char *rxpath = argc > 1 ? argv[1] : "/dev/can0";
+  uint16_t fault = FAULT_CAN_OPEN_FAILED;
+  int nqueues = 0;
   int ret;
   int i;
-  struct can_msg_s rxbuf;
-  struct can_msg_s *rxptr;
-  mqd_t tx_mqueues[CAN_NUM_TX_MQUEUES];
-  mqd_t rx_mqueues[CAN_NUM_RX_MQUEUES];
+  pthread_t tx_thread;
+  pthread_attr_t tx_thread_attr;
+  struct sched_param tx_thread_param;
   const struct mq_attr canmq_attr =
     { .mq_maxmsg = 3, .mq_msgsize = sizeof(struct can_msg_s) };
   
-  g_canfd = open("/dev/can0", O_RDWR);
-  if (g_canfd < 0)
+  if (__atomic_exchange_n(&g_can_broadcast_started, true, __ATOMIC_ACQ_REL))
   {
-    safing_store_internal_fault(FAULT_CAN_OPEN_FAILED);
+    syslog(LOG_ERR, "can_broadcast: already running\n");
     return -1;
   }
   
+  g_cantxfd = -1;
+  g_canfd = open(rxpath, O_RDWR);
+  if (g_canfd < 0)
+  {
+    syslog(LOG_ERR, "can_broadcast: cannot open %s: %d\n", rxpath, errno);
+    goto errout;
+  }
   
-  /* Initialize tx message queues and attach to SIGUSR1 */
+  g_cantxfd = argc > 2 ? open(argv[2], O_WRONLY) : g_canfd;
+  if (g_cantxfd < 0)
+  {
+    syslog(LOG_ERR, "can_broadcast: cannot open %s: %d\n", argv[2], errno);
+    goto errout;
+  }
   
-  for (i = 0; i < CAN_NUM_TX_MQUEUES; ++i)
+  /* Initialize rx message queues */
+  for (nqueues = 0; nqueues < CAN_NUM_RX_MQUEUES; ++nqueues)
   {
-    tx_mqueues[i] = mq_open(tx_mqueue_names[i], O_RDWR | O_NONBLOCK | O_CREAT, 0600, &canmq_attr);
-    g_mq_sigusr1event.sigev_value.sival_ptr = &tx_mqueues[i];
-    mq_notify(tx_mqueues[i], &g_mq_sigusr1event);
+    g_rx_mqueues[nqueues] = mq_open(rx_mqueue_names[nqueues],
+                                    O_RDWR | O_NONBLOCK | O_CREAT, 0600,
+                                    &canmq_attr);
+    if (g_rx_mqueues[nqueues] == (mqd_t)-1)
+    {
+      syslog(LOG_ERR, "can_broadcast: cannot open %s: %d\n",
+             rx_mqueue_names[nqueues], errno);
+      goto errout;
+    }
   }
   
-  /* Register SIGUSR1 handler */
-  struct sigaction sigusr1_action = {
-    .sa_sigaction = &broadcast_sigusr1_sigaction,
-    .sa_flags = SA_SIGINFO
-  };
-  sigemptyset(&sigusr1_action.sa_mask);
-  sigaction(SIGUSR1, &sigusr1_action, NULL);
+  /* Start the worker that drains the tx rings */
   
-  /* Initialize rx message queues */
-  for (i = 0; i < CAN_NUM_RX_MQUEUES; ++i)
+  pthread_attr_init(&tx_thread_attr);
+  pthread_attr_setstacksize(&tx_thread_attr, CONFIG_INDUSTRY_ETCETERA_CAN_TX_STACKSIZE);
+  tx_thread_param.sched_priority = CONFIG_INDUSTRY_ETCETERA_CAN_TX_PRIORITY;
+  pthread_attr_setschedparam(&tx_thread_attr, &tx_thread_param);
+  ret = pthread_create(&tx_thread, &tx_thread_attr, can_broadcast_tx_thread, NULL);
+  if (ret != 0)
+  {
+    syslog(LOG_ERR, "can_broadcast: cannot start tx thread: %d\n", ret);
+    fault = FAULT_CAN_THREAD_FAILED;
+    goto errout;
+  }
+  
+  /* Install the build-time routes; tasks may already have added their own */
+  for (i = 0; i < sizeof(g_default_rx_routes) / sizeof(g_default_rx_routes[0]); ++i)
   {
-    rx_mqueues[i] = mq_open(rx_mqueue_names[i], O_RDWR | O_NONBLOCK | O_CREAT, 0600, &canmq_attr);
+    can_broadcast_register_rx(g_default_rx_routes[i].id,
+                              g_default_rx_routes[i].extid,
+                              g_default_rx_routes[i].mqueue_idx);
   }
   
   do
     {
-      ret = read(g_canfd, &rxbuf, sizeof(rxbuf));
+      ret = read(g_canfd, g_rxbuf, sizeof(g_rxbuf));
       if (ret > 0)
         {
-          rxptr = &rxbuf;
-          do
-            {
-              if (rxptr->cm_hdr.ch_id == CAN_ID_DRS_CONTROL_RX)
-                {
-                  mq_send(rx_mqueues[CAN_DRS_RX_MQUEUE_IDX], (const char *)rxptr,
-                              CAN_MSGLEN(rxptr->cm_hdr.ch_dlc),
-                              1);
-                }
-              rxptr = (struct can_msg_s *)((uint8_t *)rxptr + CAN_MSGLEN(rxptr->cm_hdr.ch_dlc));
-            } while (rxptr < &rxbuf + sizeof(rxbuf));
+          ++g_can_stats.rx_reads;
+          can_broadcast_dispatch_rx((FAR const uint8_t *)g_rxbuf, ret);
         }
     } while (true);
   
   return 0;
+  
+errout:
+  /* Nothing has been started yet, so release everything for the next try */
+  
+  while (nqueues > 0)
+  {
+    mq_close(g_rx_mqueues[--nqueues]);
+  }
+  
+  if (g_cantxfd >= 0 && g_cantxfd != g_canfd)
+  {
+    close(g_cantxfd);
+  }
+  
+  if (g_canfd >= 0)
+  {
+    close(g_canfd);
+  }
+  
+  g_canfd = -1;
+  g_cantxfd = -1;
+  safing_store_internal_fault(fault);
+  __atomic_store_n(&g_can_broadcast_started, false, __ATOMIC_RELEASE);
+  return -1;
 }
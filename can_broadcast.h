@@ -34,6 +34,7 @@
 #include <sys/boardctl.h>
 
 #include "nshlib/nshlib.h"
+#include "can_ring.h"
 #include "safing.h"
 
 /****************************************************************************
@@ -44,18 +45,126 @@
 #define CAN_ID_DRS_CONTROL_RX   0xAAAA2
 #define CAN_ID_BRAKE_TX         0x1B0
 #define CAN_ID_WS_TX            0x1B1
-#define CAN_ID_DTC_TX           0xBBBB0
-#define CAN_ID_FAULT_TX         0xBBBB1
-
-#define CAN_NUM_RX_MQUEUES          1
+#define CAN_ID_CANSTAT_TX       0xBBBB2
+#define CAN_ID_DIAG_REQ_RX      0xBBBB3
+#define CAN_ID_DIAG_RESP_TX     0xBBBB4
+#define CAN_ID_CALIB_RX         0xBBBB5
+#define CAN_ID_CALIB_TX         0xBBBB6
+#define CAN_ID_ENGINE_RX        0x1A0
+
+#define CAN_NUM_RX_MQUEUES          3
 #define CAN_DRS_RX_MQUEUE_NAME      "/can.drs.rx"
 #define CAN_DRS_RX_MQUEUE_IDX       0
+#define CAN_DIAG_RX_MQUEUE_NAME     "/can.diag.rx"
+#define CAN_DIAG_RX_MQUEUE_IDX      1
+#define CAN_ETB_RX_MQUEUE_NAME      "/can.etb.rx"
+#define CAN_ETB_RX_MQUEUE_IDX       2
+
+/* Route destination for calibration commands, which are handled in the CAN
+ * broadcast task itself instead of being forwarded to a queue
+ */
+
+#define CAN_CALIB_RX_DEST           CAN_NUM_RX_MQUEUES
+
+/* Each producer task has its own tx ring. The rings are drained in strict
+ * priority order: a lower index is always sent first.
+ */
+
+#define CAN_NUM_TX_RINGS            4
+#define CAN_SAFING_TX_RING          0
+#define CAN_DRS_TX_RING             1
+#define CAN_TELEM_TX_RING           2
+#define CAN_CALIB_TX_RING           3
+
+/* Tx latency histogram: bucket 0 counts frames written within 64 us of
+ * being published, each following bucket doubles the limit, and the last
+ * bucket collects everything slower.
+ */
+
+#define CAN_LATENCY_BUCKETS         8
+#define CAN_LATENCY_BUCKET0_SHIFT   6
+
+#define CAN_STATS_IDS               CONFIG_INDUSTRY_ETCETERA_CAN_STATS_IDS
+
+/* Hardware acceptance filters are planned separately for each ID type */
+
+#define CAN_NUM_FILTER_TYPES        2
+#define CAN_FILTER_TYPE_STD         0
+#define CAN_FILTER_TYPE_EXT         1
+
+/* Receive routes known at build time. Each entry maps a CAN ID to the index
+ * of the rx message queue its frames are forwarded to, or to
+ * CAN_CALIB_RX_DEST. Tasks can add more at runtime with
+ * can_broadcast_register_rx().
+ */
 
-#define CAN_NUM_TX_MQUEUES          2
-#define CAN_DRS_TX_MQUEUE_NAME      "/can.drs.tx"
-#define CAN_DRS_TX_MQUEUE_IDX       0
-#define CAN_SAFING_TX_MQUEUE_NAME   "/can.safing.tx"
-#define CAN_SAFING_TX_MQUEUE_IDX    1
+#define CAN_RX_ROUTES \
+  { CAN_ID_DRS_CONTROL_RX, true, CAN_DRS_RX_MQUEUE_IDX }, \
+  { CAN_ID_DIAG_REQ_RX, true, CAN_DIAG_RX_MQUEUE_IDX }, \
+  { CAN_ID_ENGINE_RX, false, CAN_ETB_RX_MQUEUE_IDX }, \
+  { CAN_ID_CALIB_RX, true, CAN_CALIB_RX_DEST }
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+struct can_tx_latency_s
+{
+  uint32_t frames;
+  uint32_t last_us;
+  uint32_t max_us;
+  uint64_t total_us;
+  uint32_t hist[CAN_LATENCY_BUCKETS];
+};
+
+/* Per-ID frame counters. key is zero for an unused entry; otherwise it
+ * holds the ID with CAN_STATS_KEY_EXTID set for extended IDs.
+ */
+
+#define CAN_STATS_KEY_VALID 0x80000000
+#define CAN_STATS_KEY_EXTID 0x40000000
+#define CAN_STATS_KEY_ID    0x1fffffff
+
+struct can_id_stats_s
+{
+  uint32_t key;
+  uint32_t tx;
+  uint32_t rx;
+};
+
+/* Outcome of the last acceptance filter update for one ID type. If no
+ * filters are installed, every frame of that type is received.
+ */
+
+struct can_filter_stats_s
+{
+  uint16_t ids;               /* Routed IDs */
+  uint16_t filters;           /* Filters installed */
+  uint32_t accepted;          /* IDs the filters let through, at most */
+  uint32_t updates;           /* Times the filters were reprogrammed */
+  uint32_t failures;          /* Updates the driver rejected */
+};
+
+struct can_stats_s
+{
+  uint32_t rx_reads;          /* read() calls that returned frames */
+  uint32_t rx_frames;         /* Frames received */
+  uint32_t rx_unrouted;       /* Frames no task subscribed to */
+  uint32_t rx_bus_errors;     /* Error frames reported by the driver */
+  uint32_t rx_mq_failures[CAN_NUM_RX_MQUEUES];
+  uint16_t rx_mq_highwater[CAN_NUM_RX_MQUEUES];
+  uint32_t tx_write_failures;
+  uint32_t ids_overflow;      /* Frames whose ID did not fit in ids[] */
+  struct can_filter_stats_s filters[CAN_NUM_FILTER_TYPES];
+  struct can_id_stats_s ids[CAN_STATS_IDS];
+};
+
+struct can_rx_route_s
+{
+  uint32_t id;
+  bool extid;
+  uint8_t mqueue_idx;
+};
 
 /****************************************************************************
  * Private Types
@@ -76,6 +185,21 @@
  * Public Data
  ****************************************************************************/
 
+/* Tx rings, indexed by CAN_*_TX_RING. Only the owning task may claim and
+ * publish frames on a ring.
+ */
+
+extern struct can_ring_s g_can_tx_rings[CAN_NUM_TX_RINGS];
+
+/* Enqueue-to-write latency of the frames sent from each tx ring */
+
+extern struct can_tx_latency_s g_can_tx_latency[CAN_NUM_TX_RINGS];
+
+/* Bus traffic counters. Updated only by the CAN broadcast task; other
+ * tasks may read them at any time.
+ */
+
+extern struct can_stats_s g_can_stats;
 
 /****************************************************************************
  * Private Functions
@@ -86,4 +210,8 @@
  * Public Functions
  ****************************************************************************/
 
+int can_broadcast_register_rx(uint32_t id, bool extid, int mqueue_idx);
+void can_broadcast_publish(int ring);
+bool can_broadcast_running(void);
+
 #endif /* APPS_INDUSTRY_ETCETERA_CAN_BROADCAST_H */
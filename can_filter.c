@@ -0,0 +1,204 @@
+/****************************************************************************
+ * apps/industry/ETCetera/can_filter.c
+ * Electronic Throttle Controller program - CAN acceptance filter planning
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "can_filter.h"
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Number of IDs a filter lets through: two for every bit it ignores */
+
+static inline uint32_t can_filter_size(uint32_t mask, uint32_t idmask)
+{
+  return (uint32_t)1 << __builtin_popcount(idmask & ~mask);
+}
+
+static inline bool can_filter_covers(FAR const struct can_filter_s *outer,
+                                     FAR const struct can_filter_s *inner)
+{
+  return (inner->mask & outer->mask) == outer->mask
+         && ((inner->id ^ outer->id) & outer->mask) == 0;
+}
+
+static inline void can_filter_join(FAR const struct can_filter_s *a,
+                                   FAR const struct can_filter_s *b,
+                                   FAR struct can_filter_s *joined)
+{
+  joined->mask = a->mask & b->mask & ~(a->id ^ b->id);
+  joined->id = a->id & joined->mask;
+}
+
+/* Replaces filter i with the join of filters i and j, then drops j and any
+ * other filter the join now covers.
+ */
+
+static int can_filter_merge_pair(FAR struct can_filter_s *filters, int n,
+                                 int i, int j)
+{
+  struct can_filter_s joined;
+  int k;
+
+  can_filter_join(&filters[i], &filters[j], &joined);
+  filters[i] = joined;
+
+  for (k = 0; k < n; )
+  {
+    if (k != i && can_filter_covers(&joined, &filters[k]))
+    {
+      filters[k] = filters[--n];
+      if (i == n)
+      {
+        i = k;
+      }
+    }
+    else
+    {
+      ++k;
+    }
+  }
+
+  return n;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: can_filter_merge
+ *
+ * Description:
+ *   Plan at most maxfilters mask filters that together accept every ID in
+ *   ids. Each ID starts with an exact-match filter; while there are too
+ *   many, the pair of filters whose join lets through the fewest extra IDs
+ *   is merged. The search is quadratic per merge, which is fine for the
+ *   few dozen IDs a routing table holds.
+ *
+ * Input Parameters:
+ *   ids        - The IDs to accept. Duplicates are allowed.
+ *   nids       - Number of entries in ids.
+ *   idmask     - All ID bits: CAN_MAX_STDMSGID or CAN_MAX_EXTMSGID.
+ *   filters    - Output; must have room for nids entries while merging.
+ *   maxfilters - Number of hardware filters available.
+ *
+ * Returned Value:
+ *   The number of filters written, or 0 if there is nothing to filter or
+ *   no filter is available, in which case every ID should be accepted.
+ *
+ ****************************************************************************/
+
+int can_filter_merge(FAR const uint32_t *ids, int nids, uint32_t idmask,
+                     FAR struct can_filter_s *filters, int maxfilters)
+{
+  struct can_filter_s joined;
+  int32_t cost;
+  int32_t best_cost;
+  int best_i;
+  int best_j;
+  int n = 0;
+  int i;
+  int j;
+
+  if (maxfilters <= 0)
+  {
+    return 0;
+  }
+
+  for (i = 0; i < nids; ++i)
+  {
+    for (j = 0; j < n; ++j)
+    {
+      if (filters[j].id == (ids[i] & idmask))
+      {
+        break;
+      }
+    }
+
+    if (j == n)
+    {
+      filters[n].id = ids[i] & idmask;
+      filters[n].mask = idmask;
+      ++n;
+    }
+  }
+
+  while (n > maxfilters)
+  {
+    best_cost = INT32_MAX;
+    best_i = 0;
+    best_j = 1;
+
+    for (i = 0; i < n; ++i)
+    {
+      for (j = i + 1; j < n; ++j)
+      {
+        can_filter_join(&filters[i], &filters[j], &joined);
+        /* Overlapping filters can make this negative */
+
+        cost = (int32_t)can_filter_size(joined.mask, idmask)
+               - (int32_t)can_filter_size(filters[i].mask, idmask)
+               - (int32_t)can_filter_size(filters[j].mask, idmask);
+        if (cost < best_cost)
+        {
+          best_cost = cost;
+          best_i = i;
+          best_j = j;
+        }
+      }
+    }
+
+    n = can_filter_merge_pair(filters, n, best_i, best_j);
+  }
+
+  return n;
+}
+
+/****************************************************************************
+ * Name: can_filter_accepted
+ *
+ * Description:
+ *   Upper bound on the number of distinct IDs a set of filters accepts,
+ *   counting an ID twice if two filters overlap on it.
+ *
+ ****************************************************************************/
+
+uint32_t can_filter_accepted(FAR const struct can_filter_s *filters,
+                             int nfilters, uint32_t idmask)
+{
+  uint32_t total = 0;
+  int i;
+
+  for (i = 0; i < nfilters; ++i)
+  {
+    total += can_filter_size(filters[i].mask, idmask);
+  }
+
+  return total;
+}
@@ -0,0 +1,55 @@
+/****************************************************************************
+ * apps/industry/ETCetera/can_filter.h
+ * Electronic Throttle Controller program - CAN acceptance filter planning
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_CAN_FILTER_H
+#define APPS_INDUSTRY_ETCETERA_CAN_FILTER_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* A mask filter accepts every ID whose bits under mask equal those of id,
+ * which is how CAN_FILTER_MASK filters are programmed into the driver.
+ */
+
+struct can_filter_s
+{
+  uint32_t id;
+  uint32_t mask;
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int can_filter_merge(FAR const uint32_t *ids, int nids, uint32_t idmask,
+                     FAR struct can_filter_s *filters, int maxfilters);
+uint32_t can_filter_accepted(FAR const struct can_filter_s *filters,
+                             int nfilters, uint32_t idmask);
+
+#endif /* APPS_INDUSTRY_ETCETERA_CAN_FILTER_H */
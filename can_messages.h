@@ -0,0 +1,95 @@
+/****************************************************************************
+ * apps/industry/ETCetera/can_messages.h
+ * Electronic Throttle Controller program - CAN message layouts
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_CAN_MESSAGES_H
+#define APPS_INDUSTRY_ETCETERA_CAN_MESSAGES_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+
+#include "can_signals.h"
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/* Signals of every frame the ETC sends or receives, grouped by message.
+ * Arguments: start bit, length, byte order, signedness, factor, offset.
+ */
+
+/* CAN_ID_BRAKE_TX: front and rear brake pressure, raw ADC counts */
+
+CAN_SIGNAL(brake_front, 7, 16, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_SIGNED, 1, 0)
+CAN_SIGNAL(brake_rear, 23, 16, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_SIGNED, 1, 0)
+
+/* CAN_ID_WS_TX: wheel speeds in cm/s */
+
+CAN_SIGNAL(ws_ws1, 7, 16, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_SIGNED, 1, 0)
+CAN_SIGNAL(ws_ws2, 23, 16, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_SIGNED, 1, 0)
+CAN_SIGNAL(ws_ws3, 39, 16, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_SIGNED, 1, 0)
+CAN_SIGNAL(ws_ws4, 55, 16, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_SIGNED, 1, 0)
+
+/* One DTC or internal fault table entry, as returned in the diagnostic
+ * table dumps (7 bytes per entry)
+ */
+
+CAN_SIGNAL(fault_code, 7, 16, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_UNSIGNED, 1, 0)
+CAN_SIGNAL(fault_keycycle, 23, 8, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_UNSIGNED,
+           1, 0)
+CAN_SIGNAL(fault_time_ms, 31, 32, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_UNSIGNED,
+           1, 0)
+
+/* CAN_ID_ENGINE_RX: engine speed from the engine ECU, in rpm */
+
+CAN_SIGNAL(engine_rpm, 7, 16, CAN_SIGNAL_BIG_ENDIAN, CAN_SIGNAL_UNSIGNED,
+           1, 0)
+
+/* CAN_ID_DRS_CONTROL_RX: command 1 moves the flap to the given angle */
+
+CAN_SIGNAL(drs_control_cmd, 0, 8, CAN_SIGNAL_LITTLE_ENDIAN,
+           CAN_SIGNAL_UNSIGNED, 1, 0)
+CAN_SIGNAL(drs_control_angle, 8, 16, CAN_SIGNAL_LITTLE_ENDIAN,
+           CAN_SIGNAL_UNSIGNED, 1, 0)
+
+/* CAN_ID_DRS_STATUS_TX: 0xff if a command arrived in the last period */
+
+CAN_SIGNAL(drs_status, 0, 8, CAN_SIGNAL_LITTLE_ENDIAN, CAN_SIGNAL_UNSIGNED,
+           1, 0)
+
+/* CAN_ID_CANSTAT_TX: bus health summary. Counters saturate rather than
+ * wrap; the caller clamps them to the field width before packing.
+ */
+
+CAN_SIGNAL(canstat_ring_drops, 7, 16, CAN_SIGNAL_BIG_ENDIAN,
+           CAN_SIGNAL_UNSIGNED, 1, 0)
+CAN_SIGNAL(canstat_rx_drops, 23, 16, CAN_SIGNAL_BIG_ENDIAN,
+           CAN_SIGNAL_UNSIGNED, 1, 0)
+CAN_SIGNAL(canstat_max_latency_us, 39, 16, CAN_SIGNAL_BIG_ENDIAN,
+           CAN_SIGNAL_UNSIGNED, 100, 0)
+CAN_SIGNAL(canstat_write_failures, 55, 8, CAN_SIGNAL_BIG_ENDIAN,
+           CAN_SIGNAL_UNSIGNED, 1, 0)
+CAN_SIGNAL(canstat_bus_errors, 63, 8, CAN_SIGNAL_BIG_ENDIAN,
+           CAN_SIGNAL_UNSIGNED, 1, 0)
+
+#endif /* APPS_INDUSTRY_ETCETERA_CAN_MESSAGES_H */
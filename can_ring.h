@@ -0,0 +1,159 @@
+/****************************************************************************
+ * apps/industry/ETCetera/can_ring.h
+ * Electronic Throttle Controller program - CAN tx ring buffers
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_CAN_RING_H
+#define APPS_INDUSTRY_ETCETERA_CAN_RING_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <nuttx/can/can.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Initializes a ring over a slot array whose size is a power of two */
+
+#define CAN_RING_INITIALIZER(storage) \
+  { .head = 0, .tail = 0, \
+    .mask = sizeof(storage) / sizeof((storage)[0]) - 1, \
+    .highwater = 0, .dropped = 0, .slots = (storage) }
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Slot of a tx ring: a frame plus the time it was published, used to
+ * measure how long it waited before being written to the bus.
+ */
+
+struct can_txframe_s
+{
+  uint32_t enqueue_us;
+  struct can_msg_s msg;
+};
+
+/* Single-producer, single-consumer ring of tx frames. The producer owns
+ * head, highwater and dropped; the consumer owns tail. Each field is only
+ * ever written by its owner, so neither side needs a lock or a system call.
+ */
+
+struct can_ring_s
+{
+  uint16_t head;
+  uint16_t tail;
+  uint16_t mask;
+  uint16_t highwater;
+  uint32_t dropped;
+  FAR struct can_txframe_s *slots;
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: can_ring_claim
+ *
+ * Description:
+ *   Producer side. Returns the next free slot's frame to be filled in place,
+ *   or NULL (counting a dropped frame) if the ring is full. The frame does
+ *   not become visible to the consumer until can_ring_publish().
+ *
+ ****************************************************************************/
+
+static inline FAR struct can_msg_s *can_ring_claim(FAR struct can_ring_s *ring)
+{
+  uint16_t tail;
+
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if ((uint16_t)(ring->head - tail) > ring->mask)
+  {
+    ++ring->dropped;
+    return NULL;
+  }
+
+  return &ring->slots[ring->head & ring->mask].msg;
+}
+
+/****************************************************************************
+ * Name: can_ring_publish
+ *
+ * Description:
+ *   Producer side. Hands the slot returned by can_ring_claim() to the
+ *   consumer with a single store of the head index.
+ *
+ ****************************************************************************/
+
+static inline void can_ring_publish(FAR struct can_ring_s *ring,
+                                    uint32_t now_us)
+{
+  uint16_t fill;
+
+  ring->slots[ring->head & ring->mask].enqueue_us = now_us;
+  __atomic_store_n(&ring->head, (uint16_t)(ring->head + 1), __ATOMIC_RELEASE);
+
+  fill = ring->head - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  if (fill > ring->highwater)
+  {
+    ring->highwater = fill;
+  }
+}
+
+/****************************************************************************
+ * Name: can_ring_peek
+ *
+ * Description:
+ *   Consumer side. Returns the oldest published slot, or NULL if the ring
+ *   is empty. The slot stays owned by the consumer until can_ring_release().
+ *
+ ****************************************************************************/
+
+static inline FAR struct can_txframe_s *can_ring_peek(FAR struct can_ring_s *ring)
+{
+  uint16_t head;
+
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (head == ring->tail)
+  {
+    return NULL;
+  }
+
+  return &ring->slots[ring->tail & ring->mask];
+}
+
+static inline void can_ring_release(FAR struct can_ring_s *ring)
+{
+  __atomic_store_n(&ring->tail, (uint16_t)(ring->tail + 1), __ATOMIC_RELEASE);
+}
+
+static inline unsigned int can_ring_count(FAR struct can_ring_s *ring)
+{
+  return (uint16_t)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+                    - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+#endif /* APPS_INDUSTRY_ETCETERA_CAN_RING_H */
@@ -0,0 +1,207 @@
+/****************************************************************************
+ * apps/industry/ETCetera/can_sched.c
+ * Electronic Throttle Controller program - cyclic CAN transmit schedule
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <nuttx/clock.h>
+#include <nuttx/can/can.h>
+
+#include "can_broadcast.h"
+#include "can_sched.h"
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void can_sched_send(FAR struct can_sched_s *sched,
+                           FAR struct can_sched_entry_s *entry,
+                           uint32_t now_ms)
+{
+  FAR struct can_msg_s *txmsg;
+  bool changed;
+
+  txmsg = can_ring_claim(&g_can_tx_rings[sched->ring]);
+  if (txmsg == NULL)
+  {
+    return;
+  }
+
+  txmsg->cm_hdr.ch_id = entry->id;
+  txmsg->cm_hdr.ch_extid = entry->extid;
+  txmsg->cm_hdr.ch_dlc = entry->dlc;
+  txmsg->cm_hdr.ch_rtr = 0;
+#ifdef CONFIG_CAN_ERRORS
+  txmsg->cm_hdr.ch_error = 0;
+#endif
+  memset(txmsg->cm_data, 0, sizeof(txmsg->cm_data));
+
+  if (!entry->pack(txmsg, entry->arg))
+  {
+    return;
+  }
+  
+  if (entry->policy == CAN_SCHED_ON_CHANGE && entry->sent > 0
+      && now_ms - entry->last_tx_ms < entry->heartbeat_ms)
+  {
+    if (entry->changed != NULL)
+    {
+      changed = entry->changed(entry->last_data, txmsg->cm_data,
+                               entry->dlc, entry->deadband);
+    }
+    else
+    {
+      changed = memcmp(entry->last_data, txmsg->cm_data, entry->dlc) != 0;
+    }
+    
+    /* Leaving the slot unpublished discards the frame */
+    
+    if (!changed)
+    {
+      ++entry->suppressed;
+      return;
+    }
+  }
+  
+  memcpy(entry->last_data, txmsg->cm_data, entry->dlc);
+  entry->last_tx_ms = now_ms;
+  ++entry->sent;
+  can_broadcast_publish(sched->ring);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: can_sched_now_ms
+ *
+ * Description:
+ *   Monotonic time base for schedules, in milliseconds. Wraps every ~49
+ *   days; all comparisons against it are done modulo 2^32.
+ *
+ ****************************************************************************/
+
+uint32_t can_sched_now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * MSEC_PER_SEC + now.tv_nsec / NSEC_PER_MSEC;
+}
+
+/****************************************************************************
+ * Name: can_sched_start
+ *
+ * Description:
+ *   Anchor every entry of the schedule to now_ms plus its offset.
+ *
+ ****************************************************************************/
+
+void can_sched_start(FAR struct can_sched_s *sched, uint32_t now_ms)
+{
+  int i;
+
+  for (i = 0; i < sched->nentries; ++i)
+  {
+    sched->entries[i].due_ms = now_ms + sched->entries[i].offset_ms;
+    sched->entries[i].missed = 0;
+    sched->entries[i].sent = 0;
+    sched->entries[i].suppressed = 0;
+  }
+}
+
+/****************************************************************************
+ * Name: can_sched_run
+ *
+ * Description:
+ *   Send every message whose slot has come up. Due times advance by whole
+ *   periods from the anchor, so they never drift with the caller's loop;
+ *   if the caller falls behind by more than a period, the skipped periods
+ *   are counted rather than sent in a burst.
+ *
+ * Returned Value:
+ *   The number of entries that were due.
+ *
+ ****************************************************************************/
+
+int can_sched_run(FAR struct can_sched_s *sched, uint32_t now_ms)
+{
+  FAR struct can_sched_entry_s *entry;
+  uint32_t late_ms;
+  uint32_t periods;
+  int ndue = 0;
+  int i;
+
+  for (i = 0; i < sched->nentries; ++i)
+  {
+    entry = &sched->entries[i];
+    late_ms = now_ms - entry->due_ms;
+    if ((int32_t)late_ms < 0)
+    {
+      continue;
+    }
+
+    can_sched_send(sched, entry, now_ms);
+    ++ndue;
+
+    periods = late_ms / entry->period_ms + 1;
+    entry->due_ms += periods * entry->period_ms;
+    entry->missed += periods - 1;
+  }
+
+  return ndue;
+}
+
+/****************************************************************************
+ * Name: can_sched_changed_be16
+ *
+ * Description:
+ *   Change detector for payloads made of big-endian 16-bit signed signals,
+ *   like the brake and wheel speed frames. Reports a change if any signal
+ *   moved by more than deadband.
+ *
+ ****************************************************************************/
+
+bool can_sched_changed_be16(FAR const uint8_t *last, FAR const uint8_t *now,
+                            uint8_t dlc, uint16_t deadband)
+{
+  int16_t a;
+  int16_t b;
+  int i;
+
+  for (i = 0; i + 1 < dlc; i += 2)
+  {
+    a = (int16_t)((last[i] << 8) | last[i + 1]);
+    b = (int16_t)((now[i] << 8) | now[i + 1]);
+    if (b - a > deadband || a - b > deadband)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
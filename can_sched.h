@@ -0,0 +1,128 @@
+/****************************************************************************
+ * apps/industry/ETCetera/can_sched.h
+ * Electronic Throttle Controller program - cyclic CAN transmit schedule
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_CAN_SCHED_H
+#define APPS_INDUSTRY_ETCETERA_CAN_SCHED_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <nuttx/can/can.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Transmit policies */
+
+#define CAN_SCHED_CYCLIC      0 /* Send every period */
+#define CAN_SCHED_ON_CHANGE   1 /* Sample every period, send on change or
+                                 * when the heartbeat interval has elapsed */
+
+/* Declares a schedule entry. Offsets should be chosen so that messages
+ * with the same period fall in different ticks of the owning task's loop.
+ */
+
+#define CAN_SCHED_ENTRY(id_, extid_, dlc_, period_ms_, offset_ms_, pack_, arg_) \
+  { .id = (id_), .extid = (extid_), .dlc = (dlc_), \
+    .period_ms = (period_ms_), .offset_ms = (offset_ms_), \
+    .pack = (pack_), .arg = (arg_), .policy = CAN_SCHED_CYCLIC }
+
+/* Declares an on-change entry. The message is packed every period but only
+ * sent when changed() reports a difference larger than deadband from the
+ * last frame sent, or when heartbeat_ms has passed since it.
+ */
+
+#define CAN_SCHED_ON_CHANGE_ENTRY(id_, extid_, dlc_, period_ms_, offset_ms_, \
+                                  pack_, arg_, changed_, deadband_, \
+                                  heartbeat_ms_) \
+  { .id = (id_), .extid = (extid_), .dlc = (dlc_), \
+    .period_ms = (period_ms_), .offset_ms = (offset_ms_), \
+    .pack = (pack_), .arg = (arg_), .policy = CAN_SCHED_ON_CHANGE, \
+    .changed = (changed_), .deadband = (deadband_), \
+    .heartbeat_ms = (heartbeat_ms_) }
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Fills in the payload of a frame whose header and zeroed data have already
+ * been set up. Returns false if there is nothing to send this period, in
+ * which case the frame is discarded.
+ */
+
+typedef bool (*can_pack_t)(FAR struct can_msg_s *msg, FAR void *arg);
+
+/* Returns true if the payload differs from the last one sent by more than
+ * deadband, in whatever units the message's signals use.
+ */
+
+typedef bool (*can_changed_t)(FAR const uint8_t *last, FAR const uint8_t *now,
+                              uint8_t dlc, uint16_t deadband);
+
+struct can_sched_entry_s
+{
+  uint32_t id;
+  bool extid;
+  uint8_t dlc;
+  uint16_t period_ms;
+  uint16_t offset_ms;
+  can_pack_t pack;
+  FAR void *arg;
+  uint8_t policy;
+  can_changed_t changed;
+  uint16_t deadband;
+  uint16_t heartbeat_ms;
+
+  /* Run-time state */
+
+  uint32_t due_ms;      /* Absolute time of the next transmission */
+  uint32_t missed;      /* Periods skipped because the task ran late */
+  uint32_t last_tx_ms;  /* Time the last frame was sent */
+  uint32_t sent;        /* Frames published */
+  uint32_t suppressed;  /* On-change samples not sent */
+  uint8_t last_data[CAN_MAXDATALEN];
+};
+
+/* A schedule belongs to one task and publishes to that task's tx ring */
+
+struct can_sched_s
+{
+  FAR struct can_sched_entry_s *entries;
+  uint8_t nentries;
+  uint8_t ring;
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+uint32_t can_sched_now_ms(void);
+void can_sched_start(FAR struct can_sched_s *sched, uint32_t now_ms);
+int can_sched_run(FAR struct can_sched_s *sched, uint32_t now_ms);
+bool can_sched_changed_be16(FAR const uint8_t *last, FAR const uint8_t *now,
+                            uint8_t dlc, uint16_t deadband);
+
+#endif /* APPS_INDUSTRY_ETCETERA_CAN_SCHED_H */
@@ -0,0 +1,173 @@
+/****************************************************************************
+ * apps/industry/ETCetera/can_signals.h
+ * Electronic Throttle Controller program - CAN signal packing
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_CAN_SIGNALS_H
+#define APPS_INDUSTRY_ETCETERA_CAN_SIGNALS_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Byte orders, using the DBC conventions for the start bit: for a little
+ * endian (Intel) signal it is the position of the least significant bit,
+ * for a big endian (Motorola) signal the position of the most significant
+ * bit, where bit n is bit n % 8 of byte n / 8.
+ */
+
+#define CAN_SIGNAL_LITTLE_ENDIAN  0
+#define CAN_SIGNAL_BIG_ENDIAN     1
+
+#define CAN_SIGNAL_UNSIGNED       0
+#define CAN_SIGNAL_SIGNED         1
+
+/* Defines name_pack() and name_unpack() for one signal, converting between
+ * the physical value and the raw field as physical = raw * factor + offset.
+ * All layout parameters are constants, so after inlining each accessor
+ * reduces to the byte loads, shifts and masks for that one field; no
+ * multi-byte loads are made, so the payload needs no particular alignment.
+ */
+
+#define CAN_SIGNAL(name, start, len, order, sign, factor, offset) \
+  static inline void name##_pack(FAR uint8_t *data, int32_t value) \
+  { \
+    can_signal_put(data, (start), (len), (order), \
+                   (uint32_t)((value - (offset)) / (factor))); \
+  } \
+  static inline int32_t name##_unpack(FAR const uint8_t *data) \
+  { \
+    return can_signal_extend(can_signal_get(data, (start), (len), (order)), \
+                             (len), (sign)) * (factor) + (offset); \
+  }
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+static inline uint32_t can_signal_mask(unsigned int len)
+{
+  return len >= 32 ? UINT32_MAX : ((uint32_t)1 << len) - 1;
+}
+
+/* First and last payload bytes a signal touches, and how far its least
+ * significant bit is from bit 0 of the word assembled from those bytes.
+ */
+
+static inline void can_signal_span(unsigned int start, unsigned int len,
+                                   int order, FAR unsigned int *first,
+                                   FAR unsigned int *last,
+                                   FAR unsigned int *shift)
+{
+  unsigned int lsb;
+
+  *first = start / 8;
+  if (order == CAN_SIGNAL_BIG_ENDIAN)
+  {
+    /* Count bits MSB-first through the payload to find the last one */
+
+    lsb = (start / 8) * 8 + 7 - (start % 8) + len - 1;
+    *last = lsb / 8;
+    *shift = 7 - (lsb % 8);
+  }
+  else
+  {
+    *last = (start + len - 1) / 8;
+    *shift = start % 8;
+  }
+}
+
+static inline uint32_t can_signal_get(FAR const uint8_t *data,
+                                      unsigned int start, unsigned int len,
+                                      int order)
+{
+  unsigned int first;
+  unsigned int last;
+  unsigned int shift;
+  unsigned int b;
+  uint64_t word = 0;
+
+  can_signal_span(start, len, order, &first, &last, &shift);
+
+  for (b = first; b <= last; ++b)
+  {
+    if (order == CAN_SIGNAL_BIG_ENDIAN)
+    {
+      word = (word << 8) | data[b];
+    }
+    else
+    {
+      word |= (uint64_t)data[b] << (8 * (b - first));
+    }
+  }
+
+  return (uint32_t)(word >> shift) & can_signal_mask(len);
+}
+
+static inline void can_signal_put(FAR uint8_t *data, unsigned int start,
+                                  unsigned int len, int order, uint32_t raw)
+{
+  unsigned int first;
+  unsigned int last;
+  unsigned int shift;
+  unsigned int b;
+  unsigned int byteshift;
+  uint64_t word;
+  uint64_t mask;
+
+  can_signal_span(start, len, order, &first, &last, &shift);
+
+  mask = (uint64_t)can_signal_mask(len) << shift;
+  word = ((uint64_t)raw << shift) & mask;
+
+  for (b = first; b <= last; ++b)
+  {
+    if (order == CAN_SIGNAL_BIG_ENDIAN)
+    {
+      byteshift = 8 * (last - b);
+    }
+    else
+    {
+      byteshift = 8 * (b - first);
+    }
+
+    data[b] = (data[b] & ~(uint8_t)(mask >> byteshift))
+              | (uint8_t)(word >> byteshift);
+  }
+}
+
+static inline int32_t can_signal_extend(uint32_t raw, unsigned int len,
+                                        int sign)
+{
+  if (sign == CAN_SIGNAL_SIGNED && len < 32)
+  {
+    return (int32_t)(raw << (32 - len)) >> (32 - len);
+  }
+
+  return (int32_t)raw;
+}
+
+#endif /* APPS_INDUSTRY_ETCETERA_CAN_SIGNALS_H */
@@ -0,0 +1,659 @@
+/****************************************************************************
+ * apps/industry/ETCetera/canreplay.c
+ * Electronic Throttle Controller program - CAN log replay NSH command
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <nuttx/clock.h>
+#include <nuttx/can/can.h>
+
+#include "can_broadcast.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define CANREPLAY_DEFAULT_FIFO  "/tmp/canreplay"
+#define CANREPLAY_BATCH         CONFIG_INDUSTRY_ETCETERA_CAN_RX_BATCH
+#define CANREPLAY_STALL_US      (1 * USEC_PER_SEC)
+#define CANREPLAY_LINE_MAX      128
+
+/* pcap files with LINKTYPE_CAN_SOCKETCAN records, as written by tcpdump or
+ * Wireshark on a SocketCAN interface.
+ */
+
+#define PCAP_MAGIC_USEC         0xa1b2c3d4
+#define PCAP_MAGIC_NSEC         0xa1b23c4d
+#define PCAP_LINKTYPE_SOCKETCAN 227
+#define SOCKETCAN_EFF_FLAG      0x80000000
+#define SOCKETCAN_RTR_FLAG      0x40000000
+#define SOCKETCAN_ERR_FLAG      0x20000000
+#define SOCKETCAN_HDR_LEN       8
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+enum canreplay_format_e
+{
+  CANREPLAY_CANDUMP = 0,        /* candump -l text log */
+  CANREPLAY_PCAP                /* pcap, LINKTYPE_CAN_SOCKETCAN */
+};
+
+struct canreplay_s
+{
+  FAR FILE *log;
+  enum canreplay_format_e format;
+  bool swapped;                 /* pcap written with the other byte order */
+  bool nsec;                    /* pcap timestamps are in nanoseconds */
+  uint32_t skipped;             /* Records that could not be replayed */
+};
+
+struct canreplay_result_s
+{
+  uint32_t frames;
+  uint32_t batches;
+  uint32_t stalls;
+  uint64_t elapsed_us;
+  uint32_t late_max_us;         /* Worst lag behind the log's timing */
+  uint32_t latency_min_us;      /* Write to dispatch, per batch */
+  uint32_t latency_max_us;
+  uint64_t latency_total_us;
+};
+
+/****************************************************************************
+ * Private Function Prototypes
+ ****************************************************************************/
+
+/* Defined in can_broadcast.c */
+
+int can_broadcast_main(int argc, char **argv);
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* All ETCetera programs share one address space, so the broadcast task
+ * started for a previous replay is still reading the FIFO.
+ */
+
+static pid_t g_replay_broadcast_pid = -1;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static uint64_t canreplay_now_us(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * USEC_PER_SEC + now.tv_nsec / NSEC_PER_USEC;
+}
+
+static uint32_t canreplay_swap32(uint32_t value, bool swapped)
+{
+  return swapped ? __builtin_bswap32(value) : value;
+}
+
+static int canreplay_open(FAR struct canreplay_s *replay, FAR const char *path)
+{
+  uint32_t header[6];
+
+  memset(replay, 0, sizeof(*replay));
+  replay->log = fopen(path, "rb");
+  if (replay->log == NULL)
+  {
+    return -errno;
+  }
+
+  /* Anything that does not start with a pcap header is read as text */
+
+  if (fread(header, sizeof(header), 1, replay->log) == 1)
+  {
+    if (header[0] == PCAP_MAGIC_USEC || header[0] == PCAP_MAGIC_NSEC)
+    {
+      replay->format = CANREPLAY_PCAP;
+    }
+    else if (header[0] == __builtin_bswap32(PCAP_MAGIC_USEC)
+             || header[0] == __builtin_bswap32(PCAP_MAGIC_NSEC))
+    {
+      replay->format = CANREPLAY_PCAP;
+      replay->swapped = true;
+    }
+  }
+
+  if (replay->format == CANREPLAY_PCAP)
+  {
+    replay->nsec = canreplay_swap32(header[0], replay->swapped)
+                   == PCAP_MAGIC_NSEC;
+    if (canreplay_swap32(header[5], replay->swapped)
+        != PCAP_LINKTYPE_SOCKETCAN)
+    {
+      fclose(replay->log);
+      return -EPROTONOSUPPORT;
+    }
+  }
+  else
+  {
+    rewind(replay->log);
+  }
+
+  return OK;
+}
+
+/* Parses "(seconds.micros) iface ID#data", the format written by
+ * candump -l. Returns false for lines that are not a classic CAN frame.
+ */
+
+static bool canreplay_parse_candump(FAR const char *line,
+                                    FAR struct can_msg_s *msg,
+                                    FAR uint64_t *ts_us)
+{
+  char frame[40];
+  FAR char *hash;
+  FAR char *data;
+  FAR char *end;
+  unsigned long sec;
+  unsigned long usec;
+  unsigned long id;
+  char byte[3] = {0};
+  int len;
+
+  if (sscanf(line, " (%lu.%6lu) %*s %39s", &sec, &usec, frame) != 3)
+  {
+    return false;
+  }
+
+  hash = strchr(frame, '#');
+  if (hash == NULL || hash == frame || hash[1] == '#')
+  {
+    return false;
+  }
+
+  *hash = '\0';
+  id = strtoul(frame, &end, 16);
+  if (*end != '\0')
+  {
+    return false;
+  }
+
+  memset(msg, 0, sizeof(*msg));
+  msg->cm_hdr.ch_extid = strlen(frame) > 3;
+  msg->cm_hdr.ch_id = id;
+  if (id > (msg->cm_hdr.ch_extid ? CAN_MAX_EXTMSGID : CAN_MAX_STDMSGID))
+  {
+    return false;
+  }
+
+  data = hash + 1;
+  if (*data == 'R')
+  {
+    msg->cm_hdr.ch_rtr = 1;
+    msg->cm_hdr.ch_dlc = data[1] >= '0' && data[1] <= '8' ? data[1] - '0' : 0;
+  }
+  else
+  {
+    for (len = 0; data[0] != '\0' && data[1] != '\0'; data += 2, ++len)
+    {
+      if (len == CAN_MAXDATALEN)
+      {
+        return false;
+      }
+
+      byte[0] = data[0];
+      byte[1] = data[1];
+      msg->cm_data[len] = strtoul(byte, &end, 16);
+      if (*end != '\0')
+      {
+        return false;
+      }
+    }
+
+    msg->cm_hdr.ch_dlc = len;
+  }
+
+  *ts_us = (uint64_t)sec * USEC_PER_SEC + usec;
+  return true;
+}
+
+static bool canreplay_parse_pcap(FAR const uint8_t *rec, uint32_t len,
+                                 FAR struct can_msg_s *msg)
+{
+  uint32_t can_id;
+
+  if (len < SOCKETCAN_HDR_LEN || rec[4] > CAN_MAXDATALEN
+      || len - SOCKETCAN_HDR_LEN < rec[4])
+  {
+    return false;
+  }
+
+  /* The SocketCAN header stores the ID in network byte order */
+
+  can_id = ((uint32_t)rec[0] << 24) | ((uint32_t)rec[1] << 16)
+           | ((uint32_t)rec[2] << 8) | rec[3];
+  if (can_id & SOCKETCAN_ERR_FLAG)
+  {
+    return false;
+  }
+
+  memset(msg, 0, sizeof(*msg));
+  msg->cm_hdr.ch_extid = (can_id & SOCKETCAN_EFF_FLAG) != 0;
+  msg->cm_hdr.ch_rtr = (can_id & SOCKETCAN_RTR_FLAG) != 0;
+  msg->cm_hdr.ch_id = can_id & (msg->cm_hdr.ch_extid ?
+                                CAN_MAX_EXTMSGID : CAN_MAX_STDMSGID);
+  msg->cm_hdr.ch_dlc = rec[4];
+  memcpy(msg->cm_data, &rec[SOCKETCAN_HDR_LEN], rec[4]);
+  return true;
+}
+
+/* Reads the next replayable frame and its capture time. Returns false at
+ * the end of the log.
+ */
+
+static bool canreplay_next(FAR struct canreplay_s *replay,
+                           FAR struct can_msg_s *msg, FAR uint64_t *ts_us)
+{
+  char line[CANREPLAY_LINE_MAX];
+  uint32_t hdr[4];
+  uint8_t rec[SOCKETCAN_HDR_LEN + CAN_MAXDATALEN];
+  uint32_t incl_len;
+  uint32_t subsec;
+
+  if (replay->format == CANREPLAY_CANDUMP)
+  {
+    while (fgets(line, sizeof(line), replay->log) != NULL)
+    {
+      if (canreplay_parse_candump(line, msg, ts_us))
+      {
+        return true;
+      }
+
+      ++replay->skipped;
+    }
+
+    return false;
+  }
+
+  while (fread(hdr, sizeof(hdr), 1, replay->log) == 1)
+  {
+    incl_len = canreplay_swap32(hdr[2], replay->swapped);
+    subsec = canreplay_swap32(hdr[1], replay->swapped);
+    *ts_us = (uint64_t)canreplay_swap32(hdr[0], replay->swapped)
+             * USEC_PER_SEC + (replay->nsec ? subsec / NSEC_PER_USEC : subsec);
+
+    if (incl_len > sizeof(rec))
+    {
+      if (fseek(replay->log, incl_len, SEEK_CUR) != 0)
+      {
+        return false;
+      }
+
+      ++replay->skipped;
+      continue;
+    }
+
+    if (fread(rec, 1, incl_len, replay->log) != incl_len)
+    {
+      return false;
+    }
+
+    if (canreplay_parse_pcap(rec, incl_len, msg))
+    {
+      return true;
+    }
+
+    ++replay->skipped;
+  }
+
+  return false;
+}
+
+/* Writes one batch of packed frames to the FIFO and waits until the
+ * broadcast task has dispatched all of them. A batch never exceeds what one
+ * read() of the broadcast task takes, and the next one is not written until
+ * it has been consumed, so no read can return a partial frame.
+ */
+
+static int canreplay_write_batch(int fd, FAR const uint8_t *buf, size_t len,
+                                 uint32_t nframes,
+                                 FAR struct canreplay_result_s *result)
+{
+  uint32_t target;
+  uint64_t start_us;
+  uint32_t latency_us;
+
+  target = __atomic_load_n(&g_can_stats.rx_frames, __ATOMIC_RELAXED) + nframes;
+  start_us = canreplay_now_us();
+
+  if (write(fd, buf, len) != (ssize_t)len)
+  {
+    return -errno;
+  }
+
+  while ((int32_t)(__atomic_load_n(&g_can_stats.rx_frames, __ATOMIC_RELAXED)
+                   - target) < 0)
+  {
+    if (canreplay_now_us() - start_us > CANREPLAY_STALL_US)
+    {
+      ++result->stalls;
+      return -ETIMEDOUT;
+    }
+
+    sched_yield();
+  }
+
+  latency_us = canreplay_now_us() - start_us;
+  result->latency_total_us += latency_us;
+  if (latency_us < result->latency_min_us)
+  {
+    result->latency_min_us = latency_us;
+  }
+
+  if (latency_us > result->latency_max_us)
+  {
+    result->latency_max_us = latency_us;
+  }
+
+  result->frames += nframes;
+  ++result->batches;
+  return OK;
+}
+
+/* Replays the whole log. In real-time mode each frame is held back until
+ * its offset from the first frame has elapsed, and frames that come due
+ * together are written as one batch; otherwise batches are filled
+ * completely and written back to back.
+ */
+
+static int canreplay_run(FAR struct canreplay_s *replay, int fd,
+                         bool realtime,
+                         FAR struct canreplay_result_s *result)
+{
+  uint8_t buf[sizeof(struct can_msg_s) * CANREPLAY_BATCH];
+  struct can_msg_s msg;
+  struct timespec due;
+  uint64_t first_ts_us = 0;
+  uint64_t start_us;
+  uint64_t ts_us;
+  uint64_t due_us;
+  uint64_t now_us;
+  size_t len = 0;
+  uint32_t nframes = 0;
+  bool pending;
+  int ret = OK;
+
+  memset(result, 0, sizeof(*result));
+  result->latency_min_us = UINT32_MAX;
+
+  pending = canreplay_next(replay, &msg, &first_ts_us);
+  ts_us = first_ts_us;
+  start_us = canreplay_now_us();
+
+  while (pending && ret == OK)
+  {
+    if (realtime)
+    {
+      due_us = start_us + (ts_us - first_ts_us);
+      now_us = canreplay_now_us();
+
+      if (nframes > 0 && due_us > now_us)
+      {
+        ret = canreplay_write_batch(fd, buf, len, nframes, result);
+        len = 0;
+        nframes = 0;
+        continue;
+      }
+
+      if (due_us > now_us)
+      {
+        due.tv_sec = due_us / USEC_PER_SEC;
+        due.tv_nsec = (due_us % USEC_PER_SEC) * NSEC_PER_USEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+               == EINTR)
+        {};
+      }
+      else if (now_us - due_us > result->late_max_us)
+      {
+        result->late_max_us = now_us - due_us;
+      }
+    }
+
+    memcpy(&buf[len], &msg, CAN_MSGLEN(msg.cm_hdr.ch_dlc));
+    len += CAN_MSGLEN(msg.cm_hdr.ch_dlc);
+    ++nframes;
+
+    pending = canreplay_next(replay, &msg, &ts_us);
+
+    if (nframes == CANREPLAY_BATCH || !pending)
+    {
+      ret = canreplay_write_batch(fd, buf, len, nframes, result);
+      len = 0;
+      nframes = 0;
+    }
+  }
+
+  result->elapsed_us = canreplay_now_us() - start_us;
+  return ret;
+}
+
+/* Starts a broadcast task reading from the FIFO, once. Its transmissions
+ * go to /dev/null so that they are not read back as received frames. Only
+ * one broadcast task can run at a time, so replay needs the one reading
+ * the CAN device to be stopped first.
+ */
+
+static int canreplay_start_broadcast(FAR const char *fifo)
+{
+  FAR char *argv[3];
+
+  if (g_replay_broadcast_pid >= 0)
+  {
+    return OK;
+  }
+
+  if (can_broadcast_running())
+  {
+    return -EBUSY;
+  }
+
+  if (mkfifo(fifo, 0666) < 0 && errno != EEXIST)
+  {
+    return -errno;
+  }
+
+  argv[0] = (FAR char *)fifo;
+  argv[1] = "/dev/null";
+  argv[2] = NULL;
+
+  g_replay_broadcast_pid = task_create("can_broadcast",
+                                       CONFIG_SYSTEM_NSH_PRIORITY,
+                                       2048,
+                                       can_broadcast_main,
+                                       argv);
+  if (g_replay_broadcast_pid < 0)
+  {
+    return -errno;
+  }
+
+  /* Let it open the FIFO and install its routes */
+
+  usleep(100000);
+  return OK;
+}
+
+static void canreplay_report(FAR const struct canreplay_s *replay,
+                             FAR const struct canreplay_result_s *result,
+                             FAR const struct can_stats_s *before)
+{
+  uint32_t rate;
+  int i;
+
+  rate = result->elapsed_us > 0 ?
+         (uint64_t)result->frames * USEC_PER_SEC / result->elapsed_us : 0;
+
+  printf("Replayed %" PRIu32 " frames in %" PRIu32 " batches, %" PRIu32
+         " ms (%" PRIu32 " frames/s)\n",
+         result->frames, result->batches,
+         (uint32_t)(result->elapsed_us / USEC_PER_MSEC), rate);
+  printf("Skipped records: %" PRIu32 "  stalls: %" PRIu32
+         "  max lag behind log: %" PRIu32 " us\n",
+         replay->skipped, result->stalls, result->late_max_us);
+
+  if (result->batches > 0)
+  {
+    printf("Write to dispatch latency (us): min %" PRIu32 "  avg %" PRIu32
+           "  max %" PRIu32 "\n",
+           result->latency_min_us,
+           (uint32_t)(result->latency_total_us / result->batches),
+           result->latency_max_us);
+  }
+
+  printf("Unrouted: %" PRIu32 "\n",
+         g_can_stats.rx_unrouted - before->rx_unrouted);
+
+  printf("RX queue  drops  hiwat\n");
+  for (i = 0; i < CAN_NUM_RX_MQUEUES; ++i)
+  {
+    printf("%8d  %5" PRIu32 "  %5u\n", i,
+           g_can_stats.rx_mq_failures[i] - before->rx_mq_failures[i],
+           g_can_stats.rx_mq_highwater[i]);
+  }
+}
+
+static void canreplay_usage(FAR const char *progname)
+{
+  fprintf(stderr, "Usage: %s [-m] [-f fifo] <log>\n"
+          "  <log>    candump -l text log or SocketCAN pcap capture\n"
+          "  -m       replay as fast as possible instead of in real time\n"
+          "  -f fifo  FIFO standing in for the CAN device (default %s)\n",
+          progname, CANREPLAY_DEFAULT_FIFO);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: main
+ *
+ * Description:
+ *   Replay a CAN capture through the CAN broadcast task's receive path, on
+ *   the simulator or any target without the bus attached. A broadcast task
+ *   is started that reads from a FIFO instead of /dev/can0; the frames of
+ *   the log are written into the FIFO in the packed format the CAN driver
+ *   returns from read(), and the dispatch throughput, per-queue drops and
+ *   write-to-dispatch latency are reported when the log ends.
+ *
+ ****************************************************************************/
+
+int main(int argc, char **argv)
+{
+  FAR const char *fifo = CANREPLAY_DEFAULT_FIFO;
+  struct canreplay_s replay;
+  struct canreplay_result_s result;
+  struct can_stats_s before;
+  bool realtime = true;
+  int option;
+  int fd;
+  int ret;
+
+  while ((option = getopt(argc, argv, "mf:")) != ERROR)
+  {
+    switch (option)
+    {
+      case 'm':
+        realtime = false;
+        break;
+
+      case 'f':
+        fifo = optarg;
+        break;
+
+      default:
+        canreplay_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 1)
+  {
+    canreplay_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  ret = canreplay_open(&replay, argv[optind]);
+  if (ret < 0)
+  {
+    fprintf(stderr, "canreplay: cannot read %s: %d\n", argv[optind], ret);
+    return EXIT_FAILURE;
+  }
+
+  ret = canreplay_start_broadcast(fifo);
+  if (ret == -EBUSY)
+  {
+    fprintf(stderr, "canreplay: can_broadcast is already running on the "
+            "CAN device\n");
+    fclose(replay.log);
+    return EXIT_FAILURE;
+  }
+  else if (ret < 0)
+  {
+    fprintf(stderr, "canreplay: cannot start can_broadcast: %d\n", ret);
+    fclose(replay.log);
+    return EXIT_FAILURE;
+  }
+
+  fd = open(fifo, O_WRONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "canreplay: cannot open %s: %d\n", fifo, errno);
+    fclose(replay.log);
+    return EXIT_FAILURE;
+  }
+
+  before = g_can_stats;
+  ret = canreplay_run(&replay, fd, realtime, &result);
+  if (ret < 0)
+  {
+    fprintf(stderr, "canreplay: replay stopped: %d\n", ret);
+  }
+
+  canreplay_report(&replay, &result, &before);
+
+  close(fd);
+  fclose(replay.log);
+  return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+/****************************************************************************
+ * apps/industry/ETCetera/canstat.c
+ * Electronic Throttle Controller program - CAN statistics NSH command
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "can_broadcast.h"
+#include "periodic.h"
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static const char *g_tx_ring_names[CAN_NUM_TX_RINGS] = {
+  [CAN_SAFING_TX_RING] = "safing",
+  [CAN_DRS_TX_RING]    = "drs",
+  [CAN_TELEM_TX_RING]  = "telem",
+  [CAN_CALIB_TX_RING]  = "calib"
+};
+
+static const char *g_rx_mqueue_names[CAN_NUM_RX_MQUEUES] = {
+  [CAN_DRS_RX_MQUEUE_IDX]  = "drs",
+  [CAN_DIAG_RX_MQUEUE_IDX] = "diag",
+  [CAN_ETB_RX_MQUEUE_IDX]  = "etb"
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void canstat_print_tx(void)
+{
+  FAR struct can_ring_s *ring;
+  FAR struct can_tx_latency_s *latency;
+  uint32_t avg_us;
+  char label[12];
+  int i;
+  int j;
+
+  printf("TX ring  depth  hiwat  dropped     frames  avg us  max us\n");
+  for (i = 0; i < CAN_NUM_TX_RINGS; ++i)
+  {
+    ring = &g_can_tx_rings[i];
+    latency = &g_can_tx_latency[i];
+    avg_us = latency->frames ? latency->total_us / latency->frames : 0;
+    printf("%-7s  %5u  %5u  %7" PRIu32 " %10" PRIu32 "  %6" PRIu32
+           "  %6" PRIu32 "\n",
+           g_tx_ring_names[i], ring->mask + 1, ring->highwater,
+           ring->dropped, latency->frames, avg_us, latency->max_us);
+  }
+
+  printf("\nTX latency histogram (us)\n%-7s", "");
+  for (j = 0; j < CAN_LATENCY_BUCKETS - 1; ++j)
+  {
+    snprintf(label, sizeof(label), "<%u", 1u << (CAN_LATENCY_BUCKET0_SHIFT + j));
+    printf(" %11s", label);
+  }
+  snprintf(label, sizeof(label), ">=%u",
+           1u << (CAN_LATENCY_BUCKET0_SHIFT + CAN_LATENCY_BUCKETS - 2));
+  printf(" %11s\n", label);
+
+  for (i = 0; i < CAN_NUM_TX_RINGS; ++i)
+  {
+    printf("%-7s", g_tx_ring_names[i]);
+    for (j = 0; j < CAN_LATENCY_BUCKETS; ++j)
+    {
+      printf(" %11" PRIu32, g_can_tx_latency[i].hist[j]);
+    }
+    printf("\n");
+  }
+
+  printf("\nTX write failures: %" PRIu32 "\n", g_can_stats.tx_write_failures);
+}
+
+static void canstat_print_rx(void)
+{
+  int i;
+
+  printf("\nRX reads: %" PRIu32 "  frames: %" PRIu32 "  unrouted: %" PRIu32
+         "  bus errors: %" PRIu32 "\n",
+         g_can_stats.rx_reads, g_can_stats.rx_frames,
+         g_can_stats.rx_unrouted, g_can_stats.rx_bus_errors);
+
+  printf("RX queue  hiwat  failures\n");
+  for (i = 0; i < CAN_NUM_RX_MQUEUES; ++i)
+  {
+    printf("%-8s  %5u  %8" PRIu32 "\n", g_rx_mqueue_names[i],
+           g_can_stats.rx_mq_highwater[i], g_can_stats.rx_mq_failures[i]);
+  }
+}
+
+static void canstat_print_filters(void)
+{
+  FAR struct can_filter_stats_s *stats;
+  int i;
+
+  printf("\nRX filters  ids  filters  accepted  updates  failures\n");
+  for (i = 0; i < CAN_NUM_FILTER_TYPES; ++i)
+  {
+    stats = &g_can_stats.filters[i];
+    printf("%-10s  %3u  %7u  ",
+           i == CAN_FILTER_TYPE_EXT ? "extended" : "standard",
+           stats->ids, stats->filters);
+    if (stats->filters == 0)
+    {
+      printf("%8s", "all");
+    }
+    else
+    {
+      printf("%8" PRIu32, stats->accepted);
+    }
+
+    printf("  %7" PRIu32 "  %8" PRIu32 "\n", stats->updates, stats->failures);
+  }
+}
+
+static void canstat_print_ids(void)
+{
+  FAR struct can_id_stats_s *entry;
+  int i;
+
+  printf("\nID              tx          rx\n");
+  for (i = 0; i < CAN_STATS_IDS; ++i)
+  {
+    entry = &g_can_stats.ids[i];
+    if (entry->key == 0)
+    {
+      continue;
+    }
+
+    if (entry->key & CAN_STATS_KEY_EXTID)
+    {
+      printf("%08" PRIx32 "  ", entry->key & CAN_STATS_KEY_ID);
+    }
+    else
+    {
+      printf("     %03" PRIx32 "  ", entry->key & CAN_STATS_KEY_ID);
+    }
+
+    printf("%10" PRIu32 "  %10" PRIu32 "\n", entry->tx, entry->rx);
+  }
+
+  if (g_can_stats.ids_overflow > 0)
+  {
+    printf("(%" PRIu32 " frames with untracked IDs)\n",
+           g_can_stats.ids_overflow);
+  }
+}
+
+static void canstat_print_periodic(void)
+{
+  FAR struct periodic_s *task;
+  uint32_t cycles;
+  int i;
+
+  printf("\nLoop      period us      cycles  overruns  skipped  avg us  max us\n");
+  for (i = 0; (task = periodic_get(i)) != NULL; ++i)
+  {
+    cycles = task->cycles;
+    printf("%-8s  %9" PRIu32 "  %10" PRIu32 "  %8" PRIu32 "  %7" PRIu32
+           "  %6" PRIu32 "  %6" PRIu32 "\n",
+           task->name, (uint32_t)(task->period_ns / NSEC_PER_USEC), cycles,
+           task->overruns, task->skipped,
+           cycles > 0 ? (uint32_t)(task->total_jitter_us / cycles) : 0,
+           task->max_jitter_us);
+  }
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: main
+ *
+ * Description:
+ *   Print the CAN broadcast task's traffic counters, queue high-water marks
+ *   and transmit latency histograms, then the periodic loops' timing.
+ *
+ ****************************************************************************/
+
+int main(int argc, char **argv)
+{
+  canstat_print_tx();
+  canstat_print_rx();
+  canstat_print_filters();
+  canstat_print_ids();
+  canstat_print_periodic();
+  return 0;
+}
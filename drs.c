@@ -38,13 +38,25 @@
 #include <errno.h>
 #include <arch/board/board.h>
 
+#include "calib.h"
 #include "can_broadcast.h"
+#include "can_messages.h"
+#include "can_sched.h"
+#include "periodic.h"
 #include "safing.h"
 
 /****************************************************************************
  * Pre-processor Definitions
  ****************************************************************************/
 
+#define DRS_CTL_PERIOD_MS 50
+
+/* Commands are picked up every DRS_POLL_MS; control runs every
+ * DRS_POLLS_PER_CTL polls.
+ */
+
+#define DRS_POLL_MS 10
+#define DRS_POLLS_PER_CTL (DRS_CTL_PERIOD_MS / DRS_POLL_MS)
 
 /****************************************************************************
  * Private Types
@@ -55,11 +67,25 @@
  * Private Function Prototypes
  ****************************************************************************/
 
+static bool drs_pack_status(FAR struct can_msg_s *msg, FAR void *arg);
 
 /****************************************************************************
  * Private Data
  ****************************************************************************/
 
+static uint8_t g_drs_status;
+static struct periodic_s g_drs_period;
+
+static struct can_sched_entry_s g_drs_sched_entries[] = {
+  CAN_SCHED_ENTRY(CAN_ID_DRS_STATUS_TX, true, 4, DRS_CTL_PERIOD_MS, 0, drs_pack_status, NULL)
+};
+
+static struct can_sched_s g_drs_sched = {
+  .entries = g_drs_sched_entries,
+  .nentries = sizeof(g_drs_sched_entries) / sizeof(g_drs_sched_entries[0]),
+  .ring = CAN_DRS_TX_RING
+};
+
 
 /****************************************************************************
  * Public Data
@@ -70,6 +96,39 @@
  * Private Functions
  ****************************************************************************/
 
+static bool drs_pack_status(FAR struct can_msg_s *msg, FAR void *arg)
+{
+  drs_status_pack(msg->cm_data, g_drs_status);
+  return true;
+}
+
+/* Control based on wheel speed and steering angle */
+
+static void drs_control(int16_t speed, int16_t accel, int16_t brk_f_value)
+{
+  FAR const struct calib_data_s *calib;
+  
+  calib = calib_acquire();
+  if (accel < calib->drs.accel_close)
+  {
+    boardctl(BOARDIOC_DRS_ANGLE, 0);
+  }
+  else if (accel > calib->drs.accel_open)
+  {
+    boardctl(BOARDIOC_DRS_ANGLE, 130);
+  }
+  else if (brk_f_value > calib->drs.brake_close)
+  {
+    boardctl(BOARDIOC_DRS_ANGLE, 0);
+  }
+  else if (speed < calib->drs.speed_open
+           && brk_f_value < calib->drs.brake_open)
+  {
+    boardctl(BOARDIOC_DRS_ANGLE, 130);
+  }
+  calib_release(calib);
+}
+
 
 /****************************************************************************
  * Public Functions
@@ -87,18 +146,15 @@
 int main(int argc, char **argv)
 {
   int ret = 0;
-  struct can_msg_s txmsg;
   struct can_msg_s rxmsg;
   int16_t last_speed = 0;
   int16_t *speed; // cm/s
   int16_t accel; // cm/s^2
   int16_t *brk_f_value;
   struct chan_subscription_s brk_subscription;
-  struct timespec current_time = {0};
-  struct timespec last_ctl_time = {0};
-  struct timespec delta_t = {0};
+  bool accel_valid = false;
+  int polls = 0;
   
-  mqd_t txmq;
   mqd_t rxmq;
   
   brk_subscription.tid = gettid();
@@ -106,23 +162,13 @@ int main(int argc, char **argv)
   boardctl(BOARDIOC_BRK_F_SUBSCRIBE, (uintptr_t)&brk_subscription);
   boardctl(BOARDIOC_WS2_SUBSCRIBE, (uintptr_t)&speed);
   
-  struct timespec mq_timeout;
-  const struct timespec canmq_wait_time =
-    { .tv_sec = 0, .tv_nsec = 50 * NSEC_PER_MSEC };
+  uint32_t now_ms;
   const struct mq_attr canmq_attr =
     { .mq_maxmsg = 3, .mq_msgsize = sizeof(rxmsg) };
   bool drs_powered = false;
   
-  txmsg.cm_hdr.ch_id = CAN_ID_DRS_STATUS_TX;
-  txmsg.cm_hdr.ch_extid = true;
-  txmsg.cm_hdr.ch_dlc = 4;
-  txmsg.cm_hdr.ch_rtr = 0;
-#ifdef CONFIG_CAN_ERRORS
-  txmsg.cm_hdr.ch_error = 0;
-#endif
-  
-  txmq = mq_open(CAN_DRS_TX_MQUEUE_NAME, O_RDWR | O_CREAT | O_NONBLOCK, 0600, &canmq_attr);
-  rxmq = mq_open(CAN_DRS_RX_MQUEUE_NAME, O_RDWR | O_CREAT, 0600, &canmq_attr);
+  rxmq = mq_open(CAN_DRS_RX_MQUEUE_NAME, O_RDWR | O_NONBLOCK | O_CREAT, 0600,
+                 &canmq_attr);
   
   boardctl(BOARDIOC_DRS_ANGLE, 50);
   ret = boardctl(BOARDIOC_DRS_START, 0);
@@ -146,68 +192,29 @@ int main(int argc, char **argv)
   sleep(1);
   boardctl(BOARDIOC_DRS_ANGLE, 130);
   
+  /* Control runs on every DRS_POLLS_PER_CTL'th release of the loop, so
+   * control passes are exactly DRS_CTL_PERIOD_MS apart and acceleration
+   * is the change in speed over that period. If releases had to be
+   * skipped, the next acceleration is not trusted.
+   */
+  
+  periodic_init(&g_drs_period, "drs", DRS_POLL_MS * USEC_PER_MSEC);
+  now_ms = periodic_release_ms(&g_drs_period);
+  can_sched_start(&g_drs_sched, now_ms);
+  
   while(true)
     {
-      clock_gettime(CLOCK_REALTIME, &mq_timeout);
-      
-      clock_timespec_add(&canmq_wait_time, &mq_timeout, &mq_timeout);
-      ret = mq_timedreceive(rxmq, (char *)&rxmsg, sizeof(rxmsg), NULL, &mq_timeout);
-      if (ret < 0 && errno == ETIMEDOUT)
-      {
-        // Control based on wheel speed and steering angle
-        clock_gettime(CLOCK_REALTIME, &current_time);
-        clock_timespec_subtract(&current_time, &last_ctl_time, &delta_t);
-        
-        if (delta_t.tv_sec > 0 || delta_t.tv_nsec > 60 * NSEC_PER_MSEC || delta_t.tv_nsec == 0)
-        {
-          accel = 0;
-        }
-        else
-        {
-          accel = (*speed - last_speed) * (NSEC_PER_SEC / delta_t.tv_nsec);
-        }
-        
-        if (accel < -100)
-        {
-          boardctl(BOARDIOC_DRS_ANGLE, 0);
-        }
-        else if (accel > 10)
-        {
-          boardctl(BOARDIOC_DRS_ANGLE, 130);
-        }
-        else if (*brk_f_value > 600)
-        {
-          boardctl(BOARDIOC_DRS_ANGLE, 0);
-        }
-        else if (*speed < 10 && *brk_f_value < 400)
-        {
-          boardctl(BOARDIOC_DRS_ANGLE, 130);
-        }
-        
-        last_speed = *speed;
-        last_ctl_time = current_time;
-        txmsg.cm_data[0] = 0;
-        
-      }
-      else if (ret < 0 && errno == EINTR)
-      {
-        continue;
-      }
-      else if (ret < 0)
-      {
-        safing_store_internal_fault(FAULT_DRS_SOFTWARE);
-        return -errno;
-      }
-      else
+      while (mq_receive(rxmq, (char *)&rxmsg, sizeof(rxmsg), NULL) >= 0)
       {
         /* Parse the message and follow its instructions */
         if (rxmsg.cm_hdr.ch_dlc != 4)
           continue;
         
-        if (rxmsg.cm_data[0] == 1)
+        if (drs_control_cmd_unpack(rxmsg.cm_data) == 1)
         {
-          txmsg.cm_data[0] = 0xff;
-          boardctl(BOARDIOC_DRS_ANGLE, *(uint16_t *)(&(rxmsg.cm_data[1])));
+          g_drs_status = 0xff;
+          boardctl(BOARDIOC_DRS_ANGLE,
+                   drs_control_angle_unpack(rxmsg.cm_data));
           if (!drs_powered)
           {
             ret = boardctl(BOARDIOC_DRS_START, 0);
@@ -221,7 +228,38 @@ int main(int argc, char **argv)
         }
       }
       
-      mq_send(txmq, (const char *)&txmsg, CAN_MSGLEN(txmsg.cm_hdr.ch_dlc), 1);
+      if (errno != EAGAIN && errno != EINTR)
+      {
+        safing_store_internal_fault(FAULT_DRS_SOFTWARE);
+        return -errno;
+      }
+      
+      if (++polls >= DRS_POLLS_PER_CTL)
+      {
+        polls = 0;
+        accel = 0;
+        if (accel_valid)
+        {
+          accel = (*speed - last_speed) * (MSEC_PER_SEC / DRS_CTL_PERIOD_MS);
+        }
+        
+        drs_control(*speed, accel, *brk_f_value);
+        last_speed = *speed;
+        accel_valid = true;
+        
+        /* The status frame reports whether a command arrived since the
+         * previous one was sent.
+         */
+        
+        now_ms = periodic_release_ms(&g_drs_period);
+        can_sched_run(&g_drs_sched, now_ms);
+        g_drs_status = 0;
+      }
+      
+      if (periodic_wait(&g_drs_period) > 0)
+      {
+        accel_valid = false;
+      }
     }
   
   return 0;
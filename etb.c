@@ -25,8 +25,10 @@
 
 #include <nuttx/config.h>
 #include <sched.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <syslog.h>
 #include <nuttx/can/can.h>
 #include <sys/boardctl.h>
 #include <mqueue.h>
@@ -37,25 +39,114 @@
 #include <nuttx/clock.h>
 #include <errno.h>
 #include <arch/board/board.h>
-#include <semaphore.h>
 
+#include "calib.h"
 #include "can_broadcast.h"
+#include "can_messages.h"
+#include "etb.h"
+#include "freeze.h"
+#include "periodic.h"
 #include "safing.h"
+#include "seqlock.h"
 
 /****************************************************************************
  * Pre-processor Definitions
  ****************************************************************************/
 
-#define SPRING_TABLE_SIZE 4
+/* Position loop period */
+
+#define ETB_CTL_PERIOD_US       1000
+
+/* Relearn phases */
+
+#define ETB_RELEARN_REST        0   /* Finding limp home at zero duty */
+#define ETB_RELEARN_OPEN        1   /* Finding the upper mechanical stop */
+#define ETB_RELEARN_SWEEP_DOWN  2   /* Lowering duty past each point */
+#define ETB_RELEARN_SWEEP_UP    3   /* Raising duty past each point */
+#define ETB_RELEARN_DONE        4
+#define ETB_RELEARN_FAILED      5
+
+/* The throttle is settled once it has moved no more than
+ * ETB_RELEARN_STILL counts over the last ETB_RELEARN_WINDOW ticks, and has
+ * had that long since the duty last changed. If it has not settled
+ * ETB_RELEARN_TIMEOUT ticks after a change, the attempt fails.
+ */
+
+#define ETB_RELEARN_WINDOW      8
+#define ETB_RELEARN_STILL       8
+#define ETB_RELEARN_TIMEOUT     1000
+
+/* Duty change per settled tick while sweeping, and while the throttle
+ * is still held against the upper stop
+ */
+
+#define ETB_RELEARN_DUTY_STEP   2
+#define ETB_RELEARN_COARSE_STEP 16
+
+/* Least travel between limp home and the upper stop */
+
+#define ETB_RELEARN_MIN_TRAVEL  5000
+
+#define ETB_RELEARN_ATTEMPTS    3
+
+/* Engine speed is taken as zero once no frame has arrived for this long */
+
+#define ETB_RPM_TIMEOUT_MS      100
 
 /****************************************************************************
  * Private Types
  ****************************************************************************/
 
-struct spring_table_s
+/* Position loop state. The integral is held in Q16 duty so that small
+ * errors still accumulate; the derivative acts on the measured position,
+ * so a step in the target does not kick the output.
+ */
+
+struct etb_ctl_s
+{
+  int64_t integral;
+  int16_t last_tps;
+  uint16_t last_duty;
+  bool primed;                  /* last_tps is from the previous tick */
+};
+
+/* Pedal map output, rate limited */
+
+struct etb_pedal_s
+{
+  int16_t target;               /* Throttle position, in TPS counts */
+  bool primed;                  /* target has been set since the reset */
+};
+
+/* Spring table relearn, run a tick at a time. Sweeping the duty down and
+ * then up past each spring table point gives the duty at which the
+ * throttle slips past it in each direction: their mean holds against the
+ * spring, and half their difference is static friction. Only a finished
+ * relearn updates the results at the end.
+ */
+
+struct etb_relearn_s
 {
-  int16_t tps[SPRING_TABLE_SIZE];
-  uint16_t duty[SPRING_TABLE_SIZE];
+  uint8_t phase;
+  uint8_t attempts;
+  uint16_t duty;
+  uint16_t since_change;        /* Ticks since the duty last changed */
+  int16_t history[ETB_RELEARN_WINDOW];
+  int16_t lhp;
+  int16_t ums;
+  int8_t first;                 /* Points between the end stops */
+  int8_t last;
+  int8_t point;                 /* Next point to be passed */
+  uint16_t down[CALIB_SPRING_POINTS];
+  uint16_t up[CALIB_SPRING_POINTS];
+  uint32_t ticks;               /* Ticks taken so far */
+
+  /* Results */
+
+  int16_t learned_lhp;          /* Limp home position */
+  int16_t learned_ums;          /* Upper mechanical stop */
+  uint16_t friction;            /* Mean static friction, in duty */
+  struct calib_spring_s spring;
 };
 
 /****************************************************************************
@@ -69,15 +160,28 @@ struct spring_table_s
 
 static int16_t *g_tps1;
 static int16_t *g_tps2;
+static int16_t *g_apps1;
+static int16_t *g_apps2;
 static uint8_t g_frozen_channels;
-static sem_t g_tps_avg_sem;
 
+/* TPS sample taken at the start of each control tick. Only the ETB task
+ * writes it.
+ */
 
-static struct spring_table_s g_spring_table =
-{
-  .tps = {10, 25, 40, 70},
-  .duty = {0, 150, 250, 300}
-};
+static struct etb_tps_s g_etb_tps;
+static struct seqlock_s g_etb_tps_lock = SEQLOCK_INITIALIZER;
+
+/* Last duty commanded, for freeze frames. It is stored halved, so that
+ * full duty fits the signed channel and no duty reads as
+ * FREEZE_VALUE_NONE.
+ */
+
+static int16_t g_etb_duty;
+
+static struct etb_ctl_s g_etb_ctl;
+static struct etb_pedal_s g_etb_pedal;
+static struct etb_relearn_s g_etb_relearn;
+static struct periodic_s g_etb_period;
 
 
 /****************************************************************************
@@ -89,129 +193,500 @@ static struct spring_table_s g_spring_table =
  * Private Functions
  ****************************************************************************/
 
-static void etb_sigstop_sigaction(int signo, FAR siginfo_t *siginfo, FAR void *context)
+/* SIGSTOP and SIGCONT both carry the new frozen channel mask. The next
+ * control tick picks it up.
+ */
+
+static void etb_frozen_sigaction(int signo, FAR siginfo_t *siginfo,
+                                 FAR void *context)
 {
-  g_frozen_channels = siginfo->si_value.sival_int;
-  
-  if (g_frozen_channels & (TPS1_FROZEN | TPS2_FROZEN))
+  __atomic_store_n(&g_frozen_channels, siginfo->si_value.sival_int,
+                   __ATOMIC_RELAXED);
+}
+
+static void etb_set_duty(uint16_t duty)
+{
+  g_etb_duty = duty >> 1;
+  boardctl(BOARDIOC_ETB_DUTY, duty);
+}
+
+/* Samples both TPS channels and the frozen mask together and publishes
+ * them for etb_get_tps(), so the whole control tick works from one
+ * consistent sample.
+ */
+
+static void etb_sample_tps(FAR struct etb_tps_s *tps, uint32_t now_ms)
+{
+  uint8_t frozen = __atomic_load_n(&g_frozen_channels, __ATOMIC_RELAXED);
+
+  tps->time_ms = now_ms;
+  tps->tps1 = *(FAR volatile int16_t *)g_tps1;
+  tps->tps2 = *(FAR volatile int16_t *)g_tps2;
+  tps->frozen = frozen;
+  tps->valid = ((frozen & TPS1_FROZEN) == 0 ? ETB_TPS1_VALID : 0)
+               | ((frozen & TPS2_FROZEN) == 0 ? ETB_TPS2_VALID : 0);
+
+  seqlock_write_begin(&g_etb_tps_lock);
+  g_etb_tps = *tps;
+  seqlock_write_end(&g_etb_tps_lock);
+}
+
+/* Interpolates the spring table at a throttle position, in Q16 duty. The
+ * points are evenly spaced, so the segment is found with a shift and the
+ * position within it scaled to Q16 with another; no division or search is
+ * needed. Q16 duty can pass INT32_MAX, so it is worked in 64 bits.
+ */
+
+static int64_t get_feedforward_duty(FAR const struct calib_spring_s *spring,
+                                    int16_t tps)
+{
+  uint32_t offset;
+  uint32_t idx;
+  int64_t frac;
+
+  if (tps <= spring->tps_base)
   {
-    while (sem_trywait(&g_tps_avg_sem) == OK)
-    {};
+    return (int64_t)spring->duty[0] << 16;
   }
+
+  offset = (uint32_t)(tps - spring->tps_base);
+  idx = offset >> spring->tps_shift;
+  if (idx >= CALIB_SPRING_POINTS - 1)
+  {
+    return (int64_t)spring->duty[CALIB_SPRING_POINTS - 1] << 16;
+  }
+
+  frac = (offset - (idx << spring->tps_shift)) << (16 - spring->tps_shift);
+  return ((int64_t)spring->duty[idx] << 16)
+         + ((int64_t)spring->duty[idx + 1] - spring->duty[idx]) * frac;
 }
 
-static void etb_sigcont_sigaction(int signo, FAR siginfo_t *siginfo, FAR void *context)
+/* Stops the position loop. The next run starts from zero duty with an
+ * empty integrator.
+ */
+
+static void etb_control_reset(FAR struct etb_ctl_s *ctl)
 {
-  g_frozen_channels = siginfo->si_value.sival_int;
-  
-  if (! (g_frozen_channels & (TPS1_FROZEN | TPS2_FROZEN)))
+  ctl->integral = 0;
+  ctl->last_duty = 0;
+  ctl->primed = false;
+}
+
+/* One tick of the position loop: feedforward from the relearned spring
+ * table at the target plus PID on the error. The integrator stops while
+ * the output is held at a limit and the error would drive it further
+ * past, and the output may change by at most the calibrated slew each
+ * tick.
+ */
+
+static uint16_t etb_control(FAR struct etb_ctl_s *ctl,
+                            FAR const struct calib_spring_s *spring,
+                            FAR const struct calib_data_s *calib,
+                            int16_t target, int16_t tps)
+{
+  FAR const struct calib_etb_s *gains = &calib->etb;
+  int32_t error = (int32_t)target - tps;
+  int64_t limit = (int64_t)gains->duty_max << 16;
+  int32_t lo;
+  int32_t hi;
+  int64_t out;
+  int64_t integral;
+
+  lo = ctl->last_duty - gains->slew;
+  lo = lo > 0 ? lo : 0;
+  hi = ctl->last_duty + gains->slew;
+  hi = hi < gains->duty_max ? hi : gains->duty_max;
+
+  out = get_feedforward_duty(spring, target)
+        + (int64_t)gains->kp * error + ctl->integral;
+  if (ctl->primed)
   {
-    int sval;
-    sval = 0;
-    sem_getvalue(&g_tps_avg_sem, &sval);
-    if (sval < 1)
-      sem_post(&g_tps_avg_sem);
+    out -= (int64_t)gains->kd * (tps - ctl->last_tps);
   }
+
+  if (!((out >= ((int64_t)hi << 16) && error > 0)
+        || (out <= ((int64_t)lo << 16) && error < 0)))
+  {
+    integral = ctl->integral + (int64_t)gains->ki * error;
+    integral = integral < limit ? integral : limit;
+    integral = integral > -limit ? integral : -limit;
+    ctl->integral = integral;
+  }
+
+  out >>= 16;
+  out = out < hi ? out : hi;
+  out = out > lo ? out : lo;
+
+  ctl->last_tps = tps;
+  ctl->last_duty = out;
+  ctl->primed = true;
+  return out;
+}
+
+/* Throttle position of a spring table point. Worked in 32 bits, so that
+ * the scans over the table compare true positions even for a table that
+ * reaches past the sensor's range.
+ */
+
+static int32_t etb_spring_point(FAR const struct calib_spring_s *spring,
+                                int point)
+{
+  return (int32_t)spring->tps_base + ((int32_t)point << spring->tps_shift);
+}
+
+static void etb_relearn_reset(FAR struct etb_relearn_s *rl)
+{
+  rl->phase = ETB_RELEARN_REST;
+  rl->attempts = 0;
+  rl->duty = 0;
+  rl->since_change = 0;
+  rl->ticks = 0;
+}
+
+static void etb_relearn_set_duty(FAR struct etb_relearn_s *rl,
+                                 uint16_t duty)
+{
+  rl->duty = duty;
+  rl->since_change = 0;
+}
+
+/* Starts over from rest, or gives up after ETB_RELEARN_ATTEMPTS */
+
+static void etb_relearn_fail(FAR struct etb_relearn_s *rl)
+{
+  etb_relearn_set_duty(rl, 0);
+  rl->phase = ++rl->attempts < ETB_RELEARN_ATTEMPTS ? ETB_RELEARN_REST
+                                                    : ETB_RELEARN_FAILED;
+}
+
+/* True once the throttle has stopped moving after the last duty change */
+
+static bool etb_relearn_settled(FAR struct etb_relearn_s *rl, int16_t tps)
+{
+  FAR int16_t *old = &rl->history[rl->since_change % ETB_RELEARN_WINDOW];
+  bool settled;
+
+  settled = rl->since_change >= ETB_RELEARN_WINDOW
+            && tps - *old <= ETB_RELEARN_STILL
+            && *old - tps <= ETB_RELEARN_STILL;
+  *old = tps;
+  ++rl->since_change;
+  return settled;
 }
 
-static int16_t get_tps_any(void)
+/* Works out the results once both sweeps have passed every point. Points
+ * beyond the travel keep their calibrated duty.
+ */
+
+static void etb_relearn_finish(FAR struct etb_relearn_s *rl,
+                               FAR const struct calib_spring_s *spring)
 {
-  if (!(g_frozen_channels & (TPS1_FROZEN | TPS2_FROZEN)))
+  uint32_t friction = 0;
+  int i;
+
+  rl->spring = *spring;
+  for (i = rl->first; i <= rl->last; ++i)
   {
-    return (*g_tps1 + *g_tps2) / 2;
+    rl->spring.duty[i] = (rl->up[i] + rl->down[i]) / 2;
+    friction += rl->up[i] > rl->down[i] ? (rl->up[i] - rl->down[i]) / 2 : 0;
   }
-  else if (g_frozen_channels & TPS1_FROZEN)
+
+  rl->friction = friction / (rl->last - rl->first + 1);
+  rl->learned_lhp = rl->lhp;
+  rl->learned_ums = rl->ums;
+  rl->phase = ETB_RELEARN_DONE;
+}
+
+/* One tick of the relearn. Returns the duty to command. Makes no system
+ * calls, so it can be run against a model of the throttle.
+ */
+
+static uint16_t etb_relearn_step(FAR struct etb_relearn_s *rl,
+                                 FAR const struct calib_data_s *calib,
+                                 int16_t tps)
+{
+  FAR const struct calib_spring_s *spring = &calib->spring;
+  uint16_t step;
+  bool settled;
+
+  if (rl->phase == ETB_RELEARN_DONE || rl->phase == ETB_RELEARN_FAILED)
   {
-    return *g_tps2;
+    return 0;
   }
-  else
+
+  ++rl->ticks;
+  settled = etb_relearn_settled(rl, tps);
+  if (!settled && rl->since_change > ETB_RELEARN_TIMEOUT)
   {
-    return *g_tps1;
+    etb_relearn_fail(rl);
+    return rl->duty;
   }
+
+  switch (rl->phase)
+  {
+    case ETB_RELEARN_REST:
+      if (settled)
+      {
+        rl->lhp = tps;
+        etb_relearn_set_duty(rl, calib->etb.duty_max);
+        rl->phase = ETB_RELEARN_OPEN;
+      }
+      break;
+
+    case ETB_RELEARN_OPEN:
+      if (settled)
+      {
+        rl->ums = tps;
+        rl->first = 0;
+        while (rl->first < CALIB_SPRING_POINTS
+               && etb_spring_point(spring, rl->first)
+                  <= rl->lhp + ETB_RELEARN_STILL)
+        {
+          ++rl->first;
+        }
+
+        rl->last = CALIB_SPRING_POINTS - 1;
+        while (rl->last >= 0
+               && etb_spring_point(spring, rl->last)
+                  >= rl->ums - ETB_RELEARN_STILL)
+        {
+          --rl->last;
+        }
+
+        if (rl->ums < rl->lhp + ETB_RELEARN_MIN_TRAVEL
+            || rl->first > rl->last)
+        {
+          etb_relearn_fail(rl);
+          break;
+        }
+
+        rl->point = rl->last;
+        rl->phase = ETB_RELEARN_SWEEP_DOWN;
+      }
+      break;
+
+    case ETB_RELEARN_SWEEP_DOWN:
+      while (rl->point >= rl->first
+             && tps < etb_spring_point(spring, rl->point))
+      {
+        rl->down[rl->point--] = rl->duty;
+      }
+
+      if (settled)
+      {
+        if (rl->point < rl->first)
+        {
+          rl->point = rl->first;
+          rl->phase = ETB_RELEARN_SWEEP_UP;
+        }
+        else if (rl->duty == 0)
+        {
+          etb_relearn_fail(rl);
+        }
+        else
+        {
+          step = tps >= rl->ums - ETB_RELEARN_STILL ? ETB_RELEARN_COARSE_STEP
+                                                    : ETB_RELEARN_DUTY_STEP;
+          etb_relearn_set_duty(rl, rl->duty > step ? rl->duty - step : 0);
+        }
+      }
+      break;
+
+    case ETB_RELEARN_SWEEP_UP:
+      while (rl->point <= rl->last
+             && tps >= etb_spring_point(spring, rl->point))
+      {
+        rl->up[rl->point++] = rl->duty;
+      }
+
+      if (rl->point > rl->last)
+      {
+        etb_relearn_finish(rl, spring);
+        return 0;
+      }
+
+      if (settled)
+      {
+        if (rl->duty >= calib->etb.duty_max)
+        {
+          etb_relearn_fail(rl);
+        }
+        else
+        {
+          etb_relearn_set_duty(rl, rl->duty + ETB_RELEARN_DUTY_STEP);
+        }
+      }
+      break;
+  }
+
+  return rl->duty;
 }
 
-static uint16_t get_tps_average(void)
+/* Pedal position from whichever APPS channels are live in the frozen mask
+ * sampled with TPS. Returns false if neither is.
+ */
+
+static bool etb_get_apps(uint8_t frozen, FAR int16_t *apps)
 {
-  sem_wait(&g_tps_avg_sem);
-  
-  return (*g_tps1 + *g_tps2) / 2;
+  int16_t apps1 = *(FAR volatile int16_t *)g_apps1;
+  int16_t apps2 = *(FAR volatile int16_t *)g_apps2;
+
+  switch (frozen & (APPS1_FROZEN | APPS2_FROZEN))
+  {
+    case 0:
+      *apps = (apps1 + apps2) / 2;
+      return true;
+
+    case APPS2_FROZEN:
+      *apps = apps1;
+      return true;
+
+    case APPS1_FROZEN:
+      *apps = apps2;
+      return true;
+
+    default:
+      return false;
+  }
 }
 
+/* Where x falls along an evenly spaced axis of npoints points: the index
+ * of the segment, and the Q16 fraction of the way across it. Values off
+ * either end are held at the end point.
+ */
 
-int16_t get_feedforward_duty(void)
+static uint32_t etb_axis(int32_t x, int32_t base, uint16_t shift,
+                         int npoints, FAR int *idx)
 {
-  int idx;
-  int16_t tps;
-  tps = get_tps_average();
-  if (tps <= g_spring_table.tps[0])
+  uint32_t offset;
+
+  if (x <= base)
   {
-    return g_spring_table.duty[0];
+    *idx = 0;
+    return 0;
   }
-  else if (tps >= g_spring_table.tps[SPRING_TABLE_SIZE - 1])
+
+  offset = x - base;
+  *idx = offset >> shift;
+  if (*idx >= npoints - 1)
   {
-    return g_spring_table.duty[SPRING_TABLE_SIZE - 1];
+    *idx = npoints - 2;
+    return 1 << 16;
   }
-  else
+
+  return (offset & ((1u << shift) - 1)) << (16 - shift);
+}
+
+/* Throttle position the pedal map asks for, by bilinear interpolation
+ * between the four surrounding points. Both axes are indexed directly, so
+ * every lookup takes the same steps.
+ */
+
+static int16_t etb_pedal_want(FAR const struct calib_pedal_s *pedal,
+                              int16_t apps, uint16_t rpm,
+                              int16_t lhp, int16_t ums)
+{
+  FAR const uint16_t *lo;
+  FAR const uint16_t *hi;
+  uint32_t fx;
+  uint32_t fy;
+  int32_t a;
+  int32_t b;
+  int32_t opening;
+  int i;
+  int j;
+
+  fx = etb_axis(apps, pedal->apps_base, pedal->apps_shift,
+                CALIB_PEDAL_APPS_POINTS, &i);
+  fy = etb_axis(rpm, pedal->rpm_base, pedal->rpm_shift,
+                CALIB_PEDAL_RPM_POINTS, &j);
+
+  lo = pedal->map[j];
+  hi = pedal->map[j + 1];
+  a = ((int32_t)lo[i] << 16) + ((int32_t)lo[i + 1] - lo[i]) * (int32_t)fx;
+  b = ((int32_t)hi[i] << 16) + ((int32_t)hi[i + 1] - hi[i]) * (int32_t)fx;
+  opening = a + (int32_t)((int64_t)(b - a) * fy >> 16);
+
+  return lhp + (int32_t)((int64_t)(ums - lhp) * opening >> 16)
+               / CALIB_PEDAL_FULL;
+}
+
+/* Moves the target towards want by at most the calibrated rise or fall.
+ * After a reset it starts from limp home.
+ */
+
+static int16_t etb_pedal_step(FAR struct etb_pedal_s *ped,
+                              FAR const struct calib_pedal_s *pedal,
+                              int16_t want, int16_t lhp)
+{
+  int32_t delta;
+
+  if (!ped->primed)
   {
-    for (idx = 1; idx < SPRING_TABLE_SIZE; ++idx)
-    {
-      if (tps < g_spring_table.tps[idx])
-      {
-        return g_spring_table.duty[idx - 1]
-              + (g_spring_table.duty[idx] - g_spring_table.duty[idx - 1])
-                  / (g_spring_table.tps[idx] - g_spring_table.tps[idx - 1])
-                  * (tps - g_spring_table.tps[idx - 1]);
-      }
-    }
+    ped->target = lhp;
+    ped->primed = true;
   }
-  return g_spring_table.duty[SPRING_TABLE_SIZE - 1];
+
+  delta = (int32_t)want - ped->target;
+  delta = delta < pedal->rise ? delta : pedal->rise;
+  delta = delta > -(int32_t)pedal->fall ? delta : -(int32_t)pedal->fall;
+  ped->target += delta;
+  return ped->target;
 }
 
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
 
+/****************************************************************************
+ * Name: etb_get_tps
+ *
+ * Description:
+ *   Copy the TPS sample from the latest control tick. Never blocks or makes
+ *   a system call.
+ *
+ ****************************************************************************/
+
+void etb_get_tps(FAR struct etb_tps_s *tps)
+{
+  uint32_t seq;
+
+  do
+  {
+    seq = seqlock_read_begin(&g_etb_tps_lock);
+    *tps = g_etb_tps;
+  }
+  while (seqlock_read_retry(&g_etb_tps_lock, seq));
+}
+
 /****************************************************************************
  * Name: main
  *
  * Description:
- *   Entry point for the ETCetera daemon. Starts a task to run NuttShell then
- *   continues on.
+ *   ETB task. Runs a fixed-rate loop that relearns the spring table while
+ *   safing is in SAFING_STATE_ETB_RELEARN, and once it is active holds the
+ *   throttle where the pedal map asks.
  *
  ****************************************************************************/
 
 int main(int argc, char **argv)
 {
-  //int16_t *apps1;
-  //int16_t *apps2;
-  int32_t tps;
-  //int32_t apps;
-  int16_t lhp; /* limp home position */
-  int16_t ums; /* upper mechanical stop */
-  int i;
-  
-  sigset_t normal_sigmask;
-  sigset_t sleep_sigmask;
-  sigfillset(&sleep_sigmask);
-  
-  
-  struct sigaction sigstop_action = {
-    .sa_sigaction = etb_sigstop_sigaction,
-    .sa_flags = SA_SIGINFO
-  };
-  struct sigaction sigcont_action = {
-    .sa_sigaction = etb_sigcont_sigaction,
+  struct sigaction frozen_action = {
+    .sa_sigaction = etb_frozen_sigaction,
     .sa_flags = SA_SIGINFO
   };
-  sigemptyset(&sigstop_action.sa_mask);
-  sigemptyset(&sigcont_action.sa_mask);
-  
-  sem_init(&g_tps_avg_sem, 0, 1);
-  
-  sigaction(SIGSTOP, &sigstop_action, NULL);
-  sigaction(SIGCONT, &sigcont_action, NULL);
-  
+  const struct mq_attr canmq_attr =
+    { .mq_maxmsg = 3, .mq_msgsize = sizeof(struct can_msg_s) };
   struct chan_subscription_s subscr;
+  struct can_msg_s rxmsg;
+  uint16_t rpm = 0;
+  uint32_t rpm_ms = 0;
+  uint32_t now_ms;
+  mqd_t rxmq;
+  
+  sigemptyset(&frozen_action.sa_mask);
+  sigaction(SIGSTOP, &frozen_action, NULL);
+  sigaction(SIGCONT, &frozen_action, NULL);
   
   subscr.tid = gettid();
   
@@ -219,279 +694,113 @@ int main(int argc, char **argv)
   boardctl(BOARDIOC_TPS1_SUBSCRIBE, (uintptr_t)&subscr);
   subscr.ptr = &g_tps2;
   boardctl(BOARDIOC_TPS2_SUBSCRIBE, (uintptr_t)&subscr);
-  /*subscr.ptr = &apps1;
+  subscr.ptr = &g_apps1;
   boardctl(BOARDIOC_APPS1_SUBSCRIBE, (uintptr_t)&subscr);
-  subscr.ptr = &apps2;
+  subscr.ptr = &g_apps2;
   boardctl(BOARDIOC_APPS2_SUBSCRIBE, (uintptr_t)&subscr);
-  */
+  freeze_set_source(FREEZE_CHAN_TPS1, g_tps1);
+  freeze_set_source(FREEZE_CHAN_TPS2, g_tps2);
+  freeze_set_source(FREEZE_CHAN_ETB_DUTY, &g_etb_duty);
   boardctl(BOARDIOC_RELAY_ENABLE, 0);
   
-  /* Wait for shutdown circuit to arm */
-  sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-  sleep(5);
-  sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-  
-  tps = get_tps_average();
-  //apps = (*apps1 + *apps2) /2;
+  rxmq = mq_open(CAN_ETB_RX_MQUEUE_NAME, O_RDONLY | O_NONBLOCK | O_CREAT,
+                 0600, &canmq_attr);
   
-  lhp = tps;
+  /* The throttle is only driven while at least one TPS channel is live.
+   * Anywhere else, or if it stops being live, the loop holds zero duty and
+   * starts the relearn or the position loop again from rest.
+   */
   
-  do
+  periodic_init(&g_etb_period, "etb", ETB_CTL_PERIOD_US);
+  while (true)
   {
-    boardctl(BOARDIOC_ETB_DUTY, 350);
-    sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-    sleep(2);
-    sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
+    FAR const struct calib_data_s *calib;
+    struct safing_status_s status;
+    FAR struct etb_relearn_s *rl = &g_etb_relearn;
+    struct etb_tps_s tps;
+    int16_t target;
+    int16_t apps;
+    uint16_t duty = 0;
+    bool live;
     
-    tps = get_tps_average();
-    if (tps > 10000)
-    {
-      ums = tps;
-    }
-    else
-    {
-        boardctl(BOARDIOC_ETB_DUTY, 0);
-        sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-        sleep(1);
-        sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-        continue;
-    }
-    
-    boardctl(BOARDIOC_ETB_DUTY, 0);
-    while(true)
-    {
-      tps = get_tps_any();
-      if (tps <= 3500)
-      {
-        boardctl(BOARDIOC_ETB_DUTY, 150);
-        break;
-      }
-      else
-      {
-        sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-        usleep(1000);
-        sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      }
-    }
+    now_ms = periodic_release_ms(&g_etb_period);
+    etb_sample_tps(&tps, now_ms);
     
-    int16_t actual_position;
-    actual_position = get_tps_average();
-    
-#if 0
-    for (i = 280; i < 400; i = i + 1)
+    while (mq_receive(rxmq, (FAR char *)&rxmsg, sizeof(rxmsg), NULL) >= 0)
     {
-      boardctl(BOARDIOC_ETB_DUTY, i);
-      
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(5);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      
-      tps = get_tps_average();
-      
-      if (tps > lhp + 3500)
-      {
-        break;
-      }
-      else
+      if (rxmsg.cm_hdr.ch_dlc >= 2)
       {
-        boardctl(BOARDIOC_ETB_DUTY, 0);
-        sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-        sleep(1);
-        sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
+        rpm = engine_rpm_unpack(rxmsg.cm_data);
+        rpm_ms = now_ms;
       }
     }
     
-    if (i == 400)
+    if (now_ms - rpm_ms > ETB_RPM_TIMEOUT_MS)
     {
-      boardctl(BOARDIOC_ETB_DUTY, 0);
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(2);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      continue;
+      rpm = 0;
     }
     
-    uint16_t test_duty;
-    int16_t test_pos;
+    safing_get_status(&status);
+    calib = calib_acquire();
+    live = tps.valid != 0;
     
-    /* The first attempt that succeeds in reaching a position greater than 35%
-     * may not be reliably reproducable; use a slightly larger duty cyle to
-     * improve it.
-     */
-    test_duty = i + 3;
-    
-    /* Ensure we can reliably reproduce this position */
-    boardctl(BOARDIOC_ETB_DUTY, 0);
-    sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-    sleep(1);
-    boardctl(BOARDIOC_ETB_DUTY, test_duty);
-    sleep(5); // Ensure ETB is at rest
-    sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-    test_pos = get_tps_average();
-    
-    boardctl(BOARDIOC_ETB_DUTY, 0);
-    sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-    sleep(1);
-    boardctl(BOARDIOC_ETB_DUTY, test_duty);
-    sleep(5);
-    sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-    
-    tps = get_tps_average();
-    if (test_pos - tps > 20 || test_pos - tps < -20)
-    {
-      boardctl(BOARDIOC_ETB_DUTY, 0);
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(2);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      continue;
-    }
-    
-    test_pos = tps;
-    
-    for (i = test_duty; i > 0; --i)
+    if (live && status.state == SAFING_STATE_ETB_RELEARN
+        && status.reason == SAFING_ETB_RELEARN_INPROGRESS)
     {
-      boardctl(BOARDIOC_ETB_DUTY, i);
-      
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(1);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      
-      tps = get_tps_average();
-      if (tps < test_pos - 20)
+      duty = etb_relearn_step(rl, calib, etb_tps_position(&tps));
+      if (rl->phase == ETB_RELEARN_DONE)
       {
-        break;
+        syslog(LOG_INFO, "etb: relearned in %lu ms: lhp %d ums %d "
+               "friction %u\n",
+               (unsigned long)(rl->ticks * ETB_CTL_PERIOD_US / USEC_PER_MSEC),
+               rl->learned_lhp, rl->learned_ums, rl->friction);
+        safing_set_reason(SAFING_STATE_ETB_RELEARN,
+                          SAFING_ETB_RELEARN_AWAIT_BRAKE_RELEASE);
       }
-    }
-    
-    if (i == 0)
-    {
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(2);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      
-      continue;
-    }
-    
-    uint16_t test_duty_lower = i;
-    
-    boardctl(BOARDIOC_ETB_DUTY, 0);
-    
-    sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-    sleep(1); // Ensure ETB is at rest
-    
-    boardctl(BOARDIOC_ETB_DUTY, test_duty);
-    sleep(5);
-    sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-    
-    tps = get_tps_average();
-    if (tps > test_pos + 20 || tps < test_pos - 20)
-    {
-      boardctl(BOARDIOC_ETB_DUTY, 0);
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(2);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      continue;
-      //return -EIO;
-    }
-    
-    test_pos = get_tps_average();
-    
-    for (i = test_duty; i < 600; ++i)
-    {
-      boardctl(BOARDIOC_ETB_DUTY, i);
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(1);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      
-      tps = get_tps_average();
-      if (tps > test_pos + 20)
+      else if (rl->phase == ETB_RELEARN_FAILED)
       {
-        break;
+        syslog(LOG_ERR, "etb: relearn failed\n");
+        safing_try_step_reason(SAFING_STATE_PAUSED,
+                               SAFING_PAUSED_THROTTLE_STUCK);
       }
     }
-    
-    if (i == 600)
+    else
     {
-      boardctl(BOARDIOC_ETB_DUTY, 0);
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(2);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      continue;
+      etb_relearn_reset(rl);
     }
     
-    uint16_t test_duty_upper = i;
+    /* With no live pedal channel the throttle closes at the fall rate */
     
-    int16_t static_friction = (test_duty_upper - test_duty_lower) / 2;
-    
-    /* Slowly bring the valve to UMS (upper mechanical stop) */
-    int16_t last_tps;
-    
-    for (i = test_duty; i < 600; ++i)
+    if (live && status.state == SAFING_STATE_ACTIVE)
     {
-      last_tps = tps;
-      boardctl(BOARDIOC_ETB_DUTY, i);
-      
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      usleep(50000);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      
-      tps = get_tps_average();
-      if (tps > 10000 && tps < last_tps + 20)
+      target = rl->learned_lhp;
+      if (etb_get_apps(tps.frozen, &apps))
       {
-        break;
+        target = etb_pedal_want(&calib->pedal, apps, rpm, rl->learned_lhp,
+                                rl->learned_ums);
       }
+      
+      target = etb_pedal_step(&g_etb_pedal, &calib->pedal, target,
+                              rl->learned_lhp);
+      duty = etb_control(&g_etb_ctl, &rl->spring, calib, target,
+                         etb_tps_position(&tps));
     }
-    
-    if (i == 600)
+    else
     {
-      boardctl(BOARDIOC_ETB_DUTY, 0);
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(2);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      continue;
+      g_etb_pedal.primed = false;
+      etb_control_reset(&g_etb_ctl);
     }
     
-    /* Slowly lower the valve down from UMS; the input torque at which it breaks
-    * loose and starts to move is equal to spring torque minus static friction.
-    * Record the first spring torque in the table. Every time the ETB moves
-    * thereafter, record a new point in the table if the torque is "significantly"
-    * different than the previous one (we'll use 1% duty cycle).
-    */
-    last_tps = tps;
-    uint16_t last_duty;
-    last_duty = i;
-    int spring_table_idx = SPRING_TABLE_SIZE;
-    for (/* i already set */ ; i > 0 && spring_table_idx >= 0; --i)
-    {
-      boardctl(BOARDIOC_ETB_DUTY, i);
-      
-      sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-      sleep(1);
-      sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-      
-      tps = get_tps_average();
-      
-      if (tps < last_tps - 20)
-      {
-        /* The ETB moved */
-        if (spring_table_idx == SPRING_TABLE_SIZE || last_duty - i >= 10)
-        {
-          spring_table.tps[spring_table_idx] = last_tps;
-          spring_table.duty[spring_table_idx] = i + static_friction;
-          --spring_table_idx;
-          last_duty = i;
-        }
-        
-        last_tps = tps;
-      }
-    }
-#endif
+    calib_release(calib);
+    etb_set_duty(duty);
     
-    sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-    sleep(5);
-    sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
+    /* After a stall the last position is too old to differentiate */
     
-  } while(true);
+    if (periodic_wait(&g_etb_period) > 0)
+    {
+      g_etb_ctl.primed = false;
+    }
+  }
   
   return 0;
 }
- 
@@ -0,0 +1,88 @@
+/****************************************************************************
+ * apps/industry/ETCetera/etb.h
+ * Electronic Throttle Controller program - ETB Control
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_ETB_H
+#define APPS_INDUSTRY_ETCETERA_ETB_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Channels in an etb_tps_s sample that were live when it was taken */
+
+#define ETB_TPS1_VALID          0x01
+#define ETB_TPS2_VALID          0x02
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Both throttle position sensors, sampled together at the start of an ETB
+ * control tick
+ */
+
+struct etb_tps_s
+{
+  uint32_t time_ms;             /* Release time of the tick */
+  int16_t tps1;
+  int16_t tps2;
+  uint8_t frozen;               /* Frozen channel mask from the board */
+  uint8_t valid;
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: etb_tps_position
+ *
+ * Description:
+ *   The throttle position from a sample: the mean of both channels, or the
+ *   one still valid. Meaningless if neither is.
+ *
+ ****************************************************************************/
+
+static inline int16_t etb_tps_position(FAR const struct etb_tps_s *tps)
+{
+  switch (tps->valid)
+  {
+    case ETB_TPS1_VALID:
+      return tps->tps1;
+
+    case ETB_TPS2_VALID:
+      return tps->tps2;
+
+    default:
+      return (tps->tps1 + tps->tps2) / 2;
+  }
+}
+
+void etb_get_tps(FAR struct etb_tps_s *tps);
+
+#endif /* APPS_INDUSTRY_ETCETERA_ETB_H */
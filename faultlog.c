@@ -0,0 +1,426 @@
+/****************************************************************************
+ * apps/industry/ETCetera/faultlog.c
+ * Electronic Throttle Controller program - persistent fault log
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <nuttx/crc32.h>
+
+#include "faultlog.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Layout: the log area is a ring of sectors. Each holds a header and then
+ * records appended in order, each with its own CRC. Records are only ever
+ * written to erased space, and the sector with the highest sequence number
+ * is the head. When the head fills up, the oldest sector is erased and
+ * gets a keycycle marker plus a snapshot of everything still stored, so
+ * the head alone describes the current state.
+ *
+ * A sector's header is written last, after its snapshot. If power is cut
+ * before then, the old head is still the newest valid sector. A record cut
+ * short fails its CRC and is skipped, and appending carries on after it.
+ */
+
+#define FAULTLOG_MAGIC          0x474f4c46  /* "FLOG" */
+#define FAULTLOG_VERSION        1
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+struct faultlog_header_s
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint16_t version;
+  uint16_t record_size;
+  uint32_t crc;
+};
+
+/****************************************************************************
+ * Private Function Prototypes
+ ****************************************************************************/
+
+static int faultlog_fd_read(FAR void *priv, off_t offset, FAR void *buf,
+                            size_t len);
+static int faultlog_fd_write(FAR void *priv, off_t offset,
+                             FAR const void *buf, size_t len);
+static int faultlog_fd_erase(FAR void *priv, off_t offset, size_t len);
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+const struct faultlog_ops_s g_faultlog_fd_ops = {
+  .read = faultlog_fd_read,
+  .write = faultlog_fd_write,
+  .erase = faultlog_fd_erase
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static int faultlog_fd_read(FAR void *priv, off_t offset, FAR void *buf,
+                            size_t len)
+{
+  ssize_t ret = pread((int)(intptr_t)priv, buf, len, offset);
+
+  if (ret < 0)
+  {
+    return -errno;
+  }
+
+  return (size_t)ret == len ? OK : -EIO;
+}
+
+static int faultlog_fd_write(FAR void *priv, off_t offset,
+                             FAR const void *buf, size_t len)
+{
+  ssize_t ret = pwrite((int)(intptr_t)priv, buf, len, offset);
+
+  if (ret < 0)
+  {
+    return -errno;
+  }
+
+  return (size_t)ret == len ? OK : -EIO;
+}
+
+static int faultlog_fd_erase(FAR void *priv, off_t offset, size_t len)
+{
+  uint8_t erased[64];
+  size_t chunk;
+  int ret;
+
+  memset(erased, 0xff, sizeof(erased));
+  while (len > 0)
+  {
+    chunk = len < sizeof(erased) ? len : sizeof(erased);
+    ret = faultlog_fd_write(priv, offset, erased, chunk);
+    if (ret < 0)
+    {
+      return ret;
+    }
+
+    offset += chunk;
+    len -= chunk;
+  }
+
+  return OK;
+}
+
+static bool faultlog_erased(FAR const void *buf, size_t len)
+{
+  FAR const uint8_t *bytes = buf;
+
+  while (len-- > 0)
+  {
+    if (*bytes++ != 0xff)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static inline off_t faultlog_sector_offset(FAR struct faultlog_s *log,
+                                           uint16_t sector)
+{
+  return (off_t)sector * log->sector_size;
+}
+
+static bool faultlog_read_header(FAR struct faultlog_s *log, uint16_t sector,
+                                 FAR struct faultlog_header_s *hdr)
+{
+  if (log->ops->read(log->priv, faultlog_sector_offset(log, sector), hdr,
+                     sizeof(*hdr)) < 0)
+  {
+    return false;
+  }
+
+  return hdr->magic == FAULTLOG_MAGIC
+         && hdr->version == FAULTLOG_VERSION
+         && hdr->record_size == FAULTLOG_RECORD_SIZE
+         && hdr->crc == crc32((FAR const uint8_t *)hdr,
+                              offsetof(struct faultlog_header_s, crc));
+}
+
+/* Writes a record into the head sector. The slot is used up even if the
+ * write fails, since it may no longer be erased.
+ */
+
+static int faultlog_put(FAR struct faultlog_s *log,
+                        FAR struct faultlog_record_s *rec)
+{
+  off_t offset;
+
+  if (log->offset + FAULTLOG_RECORD_SIZE > log->sector_size)
+  {
+    return -ENOSPC;
+  }
+
+  rec->crc = crc32((FAR const uint8_t *)rec,
+                   offsetof(struct faultlog_record_s, crc));
+  offset = faultlog_sector_offset(log, log->head) + log->offset;
+  log->offset += FAULTLOG_RECORD_SIZE;
+  return log->ops->write(log->priv, offset, rec, sizeof(*rec));
+}
+
+/* Starts the next sector with a keycycle marker and a snapshot, then
+ * commits it by writing its header.
+ */
+
+static int faultlog_rotate(FAR struct faultlog_s *log)
+{
+  struct faultlog_header_s hdr;
+  struct faultlog_record_s marker;
+  uint16_t old_head = log->head;
+  uint32_t old_offset = log->offset;
+  uint16_t next;
+  int ret;
+
+  next = (log->head + 1) % log->nsectors;
+  ret = log->ops->erase(log->priv, faultlog_sector_offset(log, next),
+                        log->sector_size);
+  if (ret < 0)
+  {
+    return ret;
+  }
+
+  log->head = next;
+  log->offset = FAULTLOG_HEADER_SIZE;
+
+  memset(&marker, 0, sizeof(marker));
+  marker.type = FAULTLOG_TYPE_BOOT;
+  marker.keycycle = log->keycycle;
+  ret = faultlog_put(log, &marker);
+
+  if (ret == OK && log->snapshot != NULL)
+  {
+    log->rotating = true;
+    ret = log->snapshot(log, log->arg);
+    log->rotating = false;
+  }
+
+  if (ret == OK)
+  {
+    hdr.magic = FAULTLOG_MAGIC;
+    hdr.seq = log->seq + 1;
+    hdr.version = FAULTLOG_VERSION;
+    hdr.record_size = FAULTLOG_RECORD_SIZE;
+    hdr.crc = crc32((FAR const uint8_t *)&hdr,
+                    offsetof(struct faultlog_header_s, crc));
+    ret = log->ops->write(log->priv, faultlog_sector_offset(log, next), &hdr,
+                          sizeof(hdr));
+  }
+
+  if (ret < 0)
+  {
+    /* Stay on the full sector; the next append tries again */
+
+    log->head = old_head;
+    log->offset = old_offset;
+    return ret;
+  }
+
+  ++log->seq;
+  return OK;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: faultlog_open
+ *
+ * Description:
+ *   Find the head of the log and pass each intact record in it to replay,
+ *   in the order they were written. Only the head sector is read. If no
+ *   valid sector is found the log starts empty and the first append
+ *   formats sector 0.
+ *
+ * Input Parameters:
+ *   log         - Log state to initialize
+ *   ops, priv   - Storage access
+ *   nsectors    - Number of erase sectors in the log area, at least 2
+ *   sector_size - Size of each one in bytes
+ *   replay      - Called for each record found, may be NULL
+ *   snapshot    - Called when moving to a new sector, may be NULL
+ *   arg         - Passed to replay and snapshot
+ *
+ * Returned Value:
+ *   OK, or a negated errno if the storage cannot be read.
+ *
+ ****************************************************************************/
+
+int faultlog_open(FAR struct faultlog_s *log,
+                  FAR const struct faultlog_ops_s *ops, FAR void *priv,
+                  uint16_t nsectors, uint32_t sector_size,
+                  faultlog_replay_t replay, faultlog_snapshot_t snapshot,
+                  FAR void *arg)
+{
+  struct faultlog_header_s hdr;
+  struct faultlog_record_s rec;
+  bool found = false;
+  uint16_t sector;
+  int ret;
+
+  if (nsectors < 2 || sector_size < FAULTLOG_HEADER_SIZE + FAULTLOG_RECORD_SIZE)
+  {
+    return -EINVAL;
+  }
+
+  memset(log, 0, sizeof(*log));
+  log->ops = ops;
+  log->priv = priv;
+  log->snapshot = snapshot;
+  log->arg = arg;
+  log->nsectors = nsectors;
+  log->sector_size = sector_size;
+
+  for (sector = 0; sector < nsectors; ++sector)
+  {
+    if (faultlog_read_header(log, sector, &hdr)
+        && (!found || (int32_t)(hdr.seq - log->seq) > 0))
+    {
+      found = true;
+      log->head = sector;
+      log->seq = hdr.seq;
+    }
+  }
+
+  if (!found)
+  {
+    /* Appear full so that the first append formats sector 0 */
+
+    log->head = nsectors - 1;
+    log->offset = sector_size;
+    return OK;
+  }
+
+  for (log->offset = FAULTLOG_HEADER_SIZE;
+       log->offset + FAULTLOG_RECORD_SIZE <= sector_size;
+       log->offset += FAULTLOG_RECORD_SIZE)
+  {
+    ret = ops->read(priv, faultlog_sector_offset(log, log->head) + log->offset,
+                    &rec, sizeof(rec));
+    if (ret < 0)
+    {
+      return ret;
+    }
+
+    if (faultlog_erased(&rec, sizeof(rec)))
+    {
+      break;
+    }
+
+    if (rec.crc != crc32((FAR const uint8_t *)&rec,
+                         offsetof(struct faultlog_record_s, crc)))
+    {
+      continue;
+    }
+
+    if (rec.type == FAULTLOG_TYPE_BOOT
+        && (int16_t)(rec.keycycle - log->keycycle) > 0)
+    {
+      log->keycycle = rec.keycycle;
+    }
+
+    if (replay != NULL)
+    {
+      replay(&rec, arg);
+    }
+  }
+
+  return OK;
+}
+
+/****************************************************************************
+ * Name: faultlog_start_keycycle
+ *
+ * Description:
+ *   Count a new keycycle, one past the latest found by faultlog_open(),
+ *   and record its start. The new number is left in log->keycycle.
+ *
+ ****************************************************************************/
+
+int faultlog_start_keycycle(FAR struct faultlog_s *log, uint32_t time_ms)
+{
+  struct faultlog_record_s marker;
+
+  memset(&marker, 0, sizeof(marker));
+  marker.type = FAULTLOG_TYPE_BOOT;
+  marker.keycycle = ++log->keycycle;
+  marker.time_ms = time_ms;
+  return faultlog_append(log, &marker);
+}
+
+/****************************************************************************
+ * Name: faultlog_append
+ *
+ * Description:
+ *   Append a record, moving on to the next sector if the head is full.
+ *   Only its type, status, code, keycycle, count and time_ms are used.
+ *   This writes to storage and may erase a sector, so it must not be
+ *   called from a task with timing constraints. Not reentrant.
+ *
+ * Returned Value:
+ *   OK, or a negated errno. After a failure the record is not stored.
+ *
+ ****************************************************************************/
+
+int faultlog_append(FAR struct faultlog_s *log,
+                    FAR const struct faultlog_record_s *rec)
+{
+  struct faultlog_record_s copy;
+  int ret;
+
+  if (log->offset + FAULTLOG_RECORD_SIZE > log->sector_size)
+  {
+    if (log->rotating)
+    {
+      return -ENOSPC;
+    }
+
+    ret = faultlog_rotate(log);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  copy = *rec;
+  return faultlog_put(log, &copy);
+}
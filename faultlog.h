@@ -0,0 +1,136 @@
+/****************************************************************************
+ * apps/industry/ETCetera/faultlog.h
+ * Electronic Throttle Controller program - persistent fault log
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_FAULTLOG_H
+#define APPS_INDUSTRY_ETCETERA_FAULTLOG_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define FAULTLOG_TYPE_BOOT        0x01  /* Start of a keycycle */
+#define FAULTLOG_TYPE_DTC         0x02  /* First occurrence and status */
+#define FAULTLOG_TYPE_FAULT       0x03
+#define FAULTLOG_TYPE_DTC_LAST    0x04  /* Latest occurrence */
+#define FAULTLOG_TYPE_FAULT_LAST  0x05
+
+/* Each sector starts with a header, followed by fixed-size records */
+
+#define FAULTLOG_HEADER_SIZE    16
+#define FAULTLOG_RECORD_SIZE    16
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Access to the storage. Offsets are from the start of the log area; erase
+ * is only called on whole sectors and must leave them reading as 0xff.
+ * Each returns OK or a negated errno.
+ */
+
+struct faultlog_ops_s
+{
+  int (*read)(FAR void *priv, off_t offset, FAR void *buf, size_t len);
+  int (*write)(FAR void *priv, off_t offset, FAR const void *buf,
+               size_t len);
+  int (*erase)(FAR void *priv, off_t offset, size_t len);
+};
+
+/* status and count are left to the caller; records written before they
+ * were used have both 0.
+ */
+
+struct faultlog_record_s
+{
+  uint8_t type;
+  uint8_t status;
+  uint16_t code;
+  uint16_t keycycle;
+  uint16_t count;
+  uint32_t time_ms;
+  uint32_t crc;
+};
+
+struct faultlog_s;
+
+/* Called by faultlog_open() for every intact record in the head sector */
+
+typedef void (*faultlog_replay_t)(FAR const struct faultlog_record_s *rec,
+                                  FAR void *arg);
+
+/* Called when the head sector is full and the log moves on to the next
+ * one. It must append everything that is still current, since only the
+ * head is read back at startup.
+ */
+
+typedef int (*faultlog_snapshot_t)(FAR struct faultlog_s *log,
+                                   FAR void *arg);
+
+struct faultlog_s
+{
+  FAR const struct faultlog_ops_s *ops;
+  FAR void *priv;
+  faultlog_snapshot_t snapshot;
+  FAR void *arg;
+  uint32_t sector_size;
+  uint16_t nsectors;
+  uint16_t head;              /* Sector being appended to */
+  uint32_t seq;               /* Sequence number of the head sector */
+  uint32_t offset;            /* Next free record in the head sector */
+  uint16_t keycycle;          /* Latest keycycle found or started */
+  bool rotating;
+};
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* Storage ops for a file or device opened with open(); priv is the file
+ * descriptor cast to a pointer. Erasing writes 0xff, which suits EEPROM,
+ * files, and flash behind a block-to-character driver.
+ */
+
+extern const struct faultlog_ops_s g_faultlog_fd_ops;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int faultlog_open(FAR struct faultlog_s *log,
+                  FAR const struct faultlog_ops_s *ops, FAR void *priv,
+                  uint16_t nsectors, uint32_t sector_size,
+                  faultlog_replay_t replay, faultlog_snapshot_t snapshot,
+                  FAR void *arg);
+int faultlog_start_keycycle(FAR struct faultlog_s *log, uint32_t time_ms);
+int faultlog_append(FAR struct faultlog_s *log,
+                    FAR const struct faultlog_record_s *rec);
+
+#endif /* APPS_INDUSTRY_ETCETERA_FAULTLOG_H */
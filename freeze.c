@@ -0,0 +1,229 @@
+/****************************************************************************
+ * apps/industry/ETCetera/freeze.c
+ * Electronic Throttle Controller program - DTC freeze frames
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freeze.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define FREEZE_POOL_SIZE        CONFIG_INDUSTRY_ETCETERA_FREEZE_FRAMES
+
+/* Times a reader copies a slot again after a capture changed it under it */
+
+#define FREEZE_READ_RETRIES     3
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/* A pool entry. seq is odd while a capture is filling it in and 0 until
+ * the first capture; readers copy the frame and only keep the copy if seq
+ * was even and unchanged across it. ticket orders the captures.
+ */
+
+struct freeze_slot_s
+{
+  uint32_t seq;
+  uint32_t ticket;
+  struct freeze_frame_s frame;
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static struct freeze_slot_s g_freeze_pool[FREEZE_POOL_SIZE];
+static FAR const volatile int16_t *g_freeze_sources[FREEZE_NUM_CHANNELS];
+static uint32_t g_freeze_next_ticket;
+static uint32_t g_freeze_dropped;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Copies a slot's frame if it is stable. Never waits for a capture in
+ * progress, since that may belong to a lower priority task.
+ */
+
+static bool freeze_copy_slot(FAR struct freeze_slot_s *slot,
+                             FAR struct freeze_frame_s *frame,
+                             FAR uint32_t *ticket)
+{
+  uint32_t seq;
+  int tries;
+
+  for (tries = 0; tries < FREEZE_READ_RETRIES; ++tries)
+  {
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0 || (seq & 1) != 0)
+    {
+      return false;
+    }
+
+    *frame = slot->frame;
+    *ticket = slot->ticket;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: freeze_set_source
+ *
+ * Description:
+ *   Set where a channel's current value is read from when capturing, such
+ *   as the pointer filled in by a channel subscription. NULL stops the
+ *   channel being recorded.
+ *
+ ****************************************************************************/
+
+void freeze_set_source(int chan, FAR const volatile int16_t *src)
+{
+  if (chan >= 0 && chan < FREEZE_NUM_CHANNELS)
+  {
+    __atomic_store_n(&g_freeze_sources[chan], src, __ATOMIC_RELEASE);
+  }
+}
+
+/****************************************************************************
+ * Name: freeze_sample
+ *
+ * Description:
+ *   Read the current value of every channel into values, which must hold
+ *   FREEZE_NUM_CHANNELS of them. Channels without a source read as
+ *   FREEZE_VALUE_NONE.
+ *
+ ****************************************************************************/
+
+void freeze_sample(FAR int16_t *values)
+{
+  FAR const volatile int16_t *src;
+  int i;
+
+  for (i = 0; i < FREEZE_NUM_CHANNELS; ++i)
+  {
+    src = __atomic_load_n(&g_freeze_sources[i], __ATOMIC_ACQUIRE);
+    values[i] = src != NULL ? *src : FREEZE_VALUE_NONE;
+  }
+}
+
+/****************************************************************************
+ * Name: freeze_capture
+ *
+ * Description:
+ *   Record every channel for a DTC that has just been stored, replacing
+ *   the oldest frame in the pool. Takes a fixed number of steps, never
+ *   blocks and is async-signal-safe. If the slot it would use is still
+ *   being filled in by another capture, the frame is dropped.
+ *
+ ****************************************************************************/
+
+void freeze_capture(uint16_t dtc, uint16_t keycycle, uint32_t time_ms)
+{
+  FAR struct freeze_slot_s *slot;
+  uint32_t ticket;
+  uint32_t seq;
+
+  ticket = __atomic_fetch_add(&g_freeze_next_ticket, 1, __ATOMIC_RELAXED);
+  slot = &g_freeze_pool[ticket % FREEZE_POOL_SIZE];
+
+  seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) != 0
+      || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, false,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    __atomic_fetch_add(&g_freeze_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  /* A capture preempted for a whole trip around the pool must not replace
+   * a newer frame.
+   */
+
+  if (seq == 0 || (int32_t)(ticket - slot->ticket) > 0)
+  {
+    freeze_sample(slot->frame.values);
+    slot->frame.dtc = dtc;
+    slot->frame.keycycle = keycycle;
+    slot->frame.time_ms = time_ms;
+    slot->ticket = ticket;
+  }
+  else
+  {
+    __atomic_fetch_add(&g_freeze_dropped, 1, __ATOMIC_RELAXED);
+  }
+
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/****************************************************************************
+ * Name: freeze_read
+ *
+ * Description:
+ *   Copy the latest frame captured for a DTC.
+ *
+ * Returned Value:
+ *   true if one was found; false if there is none, it has been evicted, or
+ *   it is being replaced right now.
+ *
+ ****************************************************************************/
+
+bool freeze_read(uint16_t dtc, FAR struct freeze_frame_s *frame)
+{
+  struct freeze_frame_s copy;
+  uint32_t best_ticket = 0;
+  uint32_t ticket;
+  bool found = false;
+  int i;
+
+  for (i = 0; i < FREEZE_POOL_SIZE; ++i)
+  {
+    if (freeze_copy_slot(&g_freeze_pool[i], &copy, &ticket)
+        && copy.dtc == dtc
+        && (!found || (int32_t)(ticket - best_ticket) > 0))
+    {
+      *frame = copy;
+      best_ticket = ticket;
+      found = true;
+    }
+  }
+
+  return found;
+}
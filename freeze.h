@@ -0,0 +1,79 @@
+/****************************************************************************
+ * apps/industry/ETCetera/freeze.h
+ * Electronic Throttle Controller program - DTC freeze frames
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_FREEZE_H
+#define APPS_INDUSTRY_ETCETERA_FREEZE_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Channels recorded in each freeze frame. FREEZE_CHAN_ETB_DUTY is the Q16
+ * duty halved, 0 to 32767 for 0 to 100 %.
+ */
+
+#define FREEZE_CHAN_TPS1        0
+#define FREEZE_CHAN_TPS2        1
+#define FREEZE_CHAN_APPS1       2
+#define FREEZE_CHAN_APPS2       3
+#define FREEZE_CHAN_BRKF        4
+#define FREEZE_CHAN_BRKR        5
+#define FREEZE_CHAN_WS1         6
+#define FREEZE_CHAN_WS2         7
+#define FREEZE_CHAN_WS3         8
+#define FREEZE_CHAN_WS4         9
+#define FREEZE_CHAN_ETB_DUTY    10
+#define FREEZE_NUM_CHANNELS     11
+
+/* Recorded for a channel whose source has not been set yet */
+
+#define FREEZE_VALUE_NONE       INT16_MIN
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+struct freeze_frame_s
+{
+  uint32_t time_ms;
+  uint16_t dtc;
+  uint16_t keycycle;
+  int16_t values[FREEZE_NUM_CHANNELS];
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+void freeze_set_source(int chan, FAR const volatile int16_t *src);
+void freeze_sample(FAR int16_t *values);
+void freeze_capture(uint16_t dtc, uint16_t keycycle, uint32_t time_ms);
+bool freeze_read(uint16_t dtc, FAR struct freeze_frame_s *frame);
+
+#endif /* APPS_INDUSTRY_ETCETERA_FREEZE_H */
@@ -0,0 +1,429 @@
+/****************************************************************************
+ * apps/industry/ETCetera/isotp.c
+ * Electronic Throttle Controller program - ISO-TP transport
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <nuttx/can/can.h>
+
+#include "can_broadcast.h"
+#include "isotp.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Protocol control information, the upper nibble of the first byte */
+
+#define ISOTP_PCI_MASK        0xf0
+#define ISOTP_PCI_SF          0x00  /* Single frame */
+#define ISOTP_PCI_FF          0x10  /* First frame of a segmented message */
+#define ISOTP_PCI_CF          0x20  /* Consecutive frame */
+#define ISOTP_PCI_FC          0x30  /* Flow control */
+
+#define ISOTP_FC_CTS          0     /* Continue to send */
+#define ISOTP_FC_WAIT         1
+#define ISOTP_FC_OVERFLOW     2
+
+#define ISOTP_SF_MAX_DATA     7
+#define ISOTP_FF_DATA         6
+#define ISOTP_CF_DATA         7
+
+/* Unused bytes of a frame are padded so that every frame has DLC 8 */
+
+#define ISOTP_PADDING         0xcc
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Returns a padded frame to fill in on the link's tx ring, or NULL if the
+ * ring is full. Unlike can_ring_claim() a full ring is not counted as a
+ * drop, since the caller retries later.
+ */
+
+static FAR struct can_msg_s *isotp_claim(FAR struct isotp_s *link)
+{
+  FAR struct can_ring_s *ring = &g_can_tx_rings[link->ring];
+  FAR struct can_msg_s *msg;
+
+  if (can_ring_count(ring) > ring->mask)
+  {
+    return NULL;
+  }
+
+  msg = can_ring_claim(ring);
+  msg->cm_hdr.ch_id = link->tx_id;
+  msg->cm_hdr.ch_extid = link->tx_extid;
+  msg->cm_hdr.ch_dlc = CAN_MAXDATALEN;
+  msg->cm_hdr.ch_rtr = 0;
+#ifdef CONFIG_CAN_ERRORS
+  msg->cm_hdr.ch_error = 0;
+#endif
+  memset(msg->cm_data, ISOTP_PADDING, CAN_MAXDATALEN);
+  return msg;
+}
+
+static int isotp_send_fc(FAR struct isotp_s *link, uint8_t status)
+{
+  FAR struct can_msg_s *msg;
+
+  msg = isotp_claim(link);
+  if (msg == NULL)
+  {
+    return -EAGAIN;
+  }
+
+  /* Always let the peer send the whole message without pausing */
+
+  msg->cm_data[0] = ISOTP_PCI_FC | status;
+  msg->cm_data[1] = 0;
+  msg->cm_data[2] = 0;
+  can_broadcast_publish(link->ring);
+  return OK;
+}
+
+static void isotp_receive_fc(FAR struct isotp_s *link,
+                             FAR const uint8_t *data, uint32_t now_ms)
+{
+  uint8_t stmin;
+
+  if (link->tx_state != ISOTP_TX_WAIT_FC)
+  {
+    return;
+  }
+
+  switch (data[0] & 0x0f)
+  {
+    case ISOTP_FC_CTS:
+      link->tx_bs = data[1];
+
+      /* 0xf1-0xf9 are 100-900 us, which the caller's tick rounds up to a
+       * whole period anyway; reserved values mean the longest separation.
+       */
+
+      stmin = data[2];
+      if (stmin >= 0xf1 && stmin <= 0xf9)
+      {
+        stmin = 1;
+      }
+      else if (stmin > 0x7f)
+      {
+        stmin = 0x7f;
+      }
+
+      link->tx_stmin_ms = stmin;
+      link->tx_next_ms = now_ms;
+      link->tx_state = ISOTP_TX_SENDING;
+      break;
+
+    case ISOTP_FC_WAIT:
+      link->tx_deadline_ms = now_ms + ISOTP_TIMEOUT_MS;
+      break;
+
+    default:
+      link->tx_state = ISOTP_TX_IDLE;
+      ++link->errors;
+      break;
+  }
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: isotp_init
+ *
+ * Description:
+ *   Set up a link that sends on the given CAN ID through one of the tx
+ *   rings. Received frames are matched to the link by the caller's rx
+ *   route, so only the transmit ID is needed here.
+ *
+ ****************************************************************************/
+
+void isotp_init(FAR struct isotp_s *link, uint32_t tx_id, bool tx_extid,
+                uint8_t ring)
+{
+  memset(link, 0, sizeof(*link));
+  link->tx_id = tx_id;
+  link->tx_extid = tx_extid;
+  link->ring = ring;
+}
+
+/****************************************************************************
+ * Name: isotp_receive
+ *
+ * Description:
+ *   Process one frame received from the peer. Flow control frames advance
+ *   a transmission in progress; data frames are reassembled into rxbuf.
+ *
+ * Returned Value:
+ *   The length of the message in rxbuf once one is complete, 0 if more
+ *   frames are needed, or a negated errno if the frame was invalid or a
+ *   reception was abandoned.
+ *
+ ****************************************************************************/
+
+int isotp_receive(FAR struct isotp_s *link, FAR const struct can_msg_s *msg,
+                  uint32_t now_ms)
+{
+  FAR const uint8_t *data = msg->cm_data;
+  uint8_t dlc = msg->cm_hdr.ch_dlc;
+  uint16_t len;
+
+  if (dlc < 1)
+  {
+    ++link->errors;
+    return -EINVAL;
+  }
+
+  switch (data[0] & ISOTP_PCI_MASK)
+  {
+    case ISOTP_PCI_SF:
+      len = data[0] & 0x0f;
+      if (len == 0 || len > ISOTP_SF_MAX_DATA || len > dlc - 1)
+      {
+        ++link->errors;
+        return -EINVAL;
+      }
+
+      /* A new request abandons any unfinished one */
+
+      memcpy(link->rxbuf, &data[1], len);
+      link->rx_len = len;
+      link->rx_expected = 0;
+      ++link->rx_messages;
+      return len;
+
+    case ISOTP_PCI_FF:
+      len = ((data[0] & 0x0f) << 8) | data[1];
+      if (dlc < CAN_MAXDATALEN || len <= ISOTP_SF_MAX_DATA)
+      {
+        ++link->errors;
+        return -EINVAL;
+      }
+
+      if (len > ISOTP_MAX_PAYLOAD)
+      {
+        isotp_send_fc(link, ISOTP_FC_OVERFLOW);
+        ++link->errors;
+        return -EMSGSIZE;
+      }
+
+      if (isotp_send_fc(link, ISOTP_FC_CTS) < 0)
+      {
+        ++link->errors;
+        return -EAGAIN;
+      }
+
+      memcpy(link->rxbuf, &data[2], ISOTP_FF_DATA);
+      link->rx_len = ISOTP_FF_DATA;
+      link->rx_expected = len;
+      link->rx_sn = 1;
+      link->rx_deadline_ms = now_ms + ISOTP_TIMEOUT_MS;
+      return 0;
+
+    case ISOTP_PCI_CF:
+      if (link->rx_expected == 0)
+      {
+        return 0;
+      }
+
+      if ((int32_t)(now_ms - link->rx_deadline_ms) > 0
+          || (data[0] & 0x0f) != link->rx_sn)
+      {
+        link->rx_expected = 0;
+        ++link->errors;
+        return -EPROTO;
+      }
+
+      len = link->rx_expected - link->rx_len;
+      if (len > ISOTP_CF_DATA)
+      {
+        len = ISOTP_CF_DATA;
+      }
+
+      if (len > dlc - 1)
+      {
+        link->rx_expected = 0;
+        ++link->errors;
+        return -EINVAL;
+      }
+
+      memcpy(&link->rxbuf[link->rx_len], &data[1], len);
+      link->rx_len += len;
+      link->rx_sn = (link->rx_sn + 1) & 0x0f;
+      link->rx_deadline_ms = now_ms + ISOTP_TIMEOUT_MS;
+
+      if (link->rx_len < link->rx_expected)
+      {
+        return 0;
+      }
+
+      link->rx_expected = 0;
+      ++link->rx_messages;
+      return link->rx_len;
+
+    case ISOTP_PCI_FC:
+      if (dlc < 3)
+      {
+        ++link->errors;
+        return -EINVAL;
+      }
+
+      isotp_receive_fc(link, data, now_ms);
+      return 0;
+
+    default:
+      ++link->errors;
+      return -EINVAL;
+  }
+}
+
+/****************************************************************************
+ * Name: isotp_send
+ *
+ * Description:
+ *   Start sending the first len bytes of txbuf. A message that fits in one
+ *   frame is sent immediately; a longer one sends its first frame and the
+ *   rest follows from isotp_poll() as the peer's flow control allows.
+ *
+ * Returned Value:
+ *   OK on success; -EBUSY if a message is still being sent, -EAGAIN if
+ *   the tx ring is full, or -EINVAL for a bad length.
+ *
+ ****************************************************************************/
+
+int isotp_send(FAR struct isotp_s *link, uint16_t len, uint32_t now_ms)
+{
+  FAR struct can_msg_s *msg;
+
+  if (link->tx_state != ISOTP_TX_IDLE)
+  {
+    return -EBUSY;
+  }
+
+  if (len == 0 || len > ISOTP_MAX_PAYLOAD)
+  {
+    return -EINVAL;
+  }
+
+  msg = isotp_claim(link);
+  if (msg == NULL)
+  {
+    return -EAGAIN;
+  }
+
+  if (len <= ISOTP_SF_MAX_DATA)
+  {
+    msg->cm_data[0] = ISOTP_PCI_SF | len;
+    memcpy(&msg->cm_data[1], link->txbuf, len);
+    can_broadcast_publish(link->ring);
+    ++link->tx_messages;
+    return OK;
+  }
+
+  msg->cm_data[0] = ISOTP_PCI_FF | (len >> 8);
+  msg->cm_data[1] = len & 0xff;
+  memcpy(&msg->cm_data[2], link->txbuf, ISOTP_FF_DATA);
+  can_broadcast_publish(link->ring);
+
+  link->tx_len = len;
+  link->tx_off = ISOTP_FF_DATA;
+  link->tx_sn = 1;
+  link->tx_state = ISOTP_TX_WAIT_FC;
+  link->tx_deadline_ms = now_ms + ISOTP_TIMEOUT_MS;
+  return OK;
+}
+
+/****************************************************************************
+ * Name: isotp_poll
+ *
+ * Description:
+ *   Send as many consecutive frames as the peer's block size, separation
+ *   time and the free space in the tx ring allow. Call it every tick of
+ *   the owning task's loop.
+ *
+ ****************************************************************************/
+
+void isotp_poll(FAR struct isotp_s *link, uint32_t now_ms)
+{
+  FAR struct can_msg_s *msg;
+  uint16_t len;
+
+  if (link->tx_state == ISOTP_TX_WAIT_FC
+      && (int32_t)(now_ms - link->tx_deadline_ms) > 0)
+  {
+    link->tx_state = ISOTP_TX_IDLE;
+    ++link->errors;
+    return;
+  }
+
+  if (link->tx_state != ISOTP_TX_SENDING)
+  {
+    return;
+  }
+
+  while (link->tx_off < link->tx_len)
+  {
+    if ((int32_t)(now_ms - link->tx_next_ms) < 0)
+    {
+      return;
+    }
+
+    msg = isotp_claim(link);
+    if (msg == NULL)
+    {
+      return;
+    }
+
+    len = link->tx_len - link->tx_off;
+    if (len > ISOTP_CF_DATA)
+    {
+      len = ISOTP_CF_DATA;
+    }
+
+    msg->cm_data[0] = ISOTP_PCI_CF | link->tx_sn;
+    memcpy(&msg->cm_data[1], &link->txbuf[link->tx_off], len);
+    can_broadcast_publish(link->ring);
+
+    link->tx_off += len;
+    link->tx_sn = (link->tx_sn + 1) & 0x0f;
+    link->tx_next_ms = now_ms + link->tx_stmin_ms;
+
+    if (link->tx_bs > 0 && --link->tx_bs == 0
+        && link->tx_off < link->tx_len)
+    {
+      link->tx_state = ISOTP_TX_WAIT_FC;
+      link->tx_deadline_ms = now_ms + ISOTP_TIMEOUT_MS;
+      return;
+    }
+  }
+
+  link->tx_state = ISOTP_TX_IDLE;
+  ++link->tx_messages;
+}
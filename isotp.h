@@ -0,0 +1,107 @@
+/****************************************************************************
+ * apps/industry/ETCetera/isotp.h
+ * Electronic Throttle Controller program - ISO-TP transport
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_ISOTP_H
+#define APPS_INDUSTRY_ETCETERA_ISOTP_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <nuttx/can/can.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Largest message either direction can carry; ISO-TP itself allows 4095 */
+
+#define ISOTP_MAX_PAYLOAD     256
+
+/* How long to wait for the peer's next flow control or consecutive frame
+ * (N_Bs and N_Cr in ISO 15765-2) before abandoning a transfer.
+ */
+
+#define ISOTP_TIMEOUT_MS      1000
+
+/* Transmit states */
+
+#define ISOTP_TX_IDLE         0
+#define ISOTP_TX_WAIT_FC      1 /* Waiting for the peer to allow more frames */
+#define ISOTP_TX_SENDING      2 /* Sending consecutive frames */
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* One end of an ISO-TP connection. Received frames are fed in with
+ * isotp_receive(); outgoing frames are written to a CAN tx ring owned by
+ * the calling task, so a link must only be used from that task.
+ */
+
+struct isotp_s
+{
+  uint32_t tx_id;
+  bool tx_extid;
+  uint8_t ring;
+
+  /* Reassembly of the message being received */
+
+  uint8_t rxbuf[ISOTP_MAX_PAYLOAD];
+  uint16_t rx_len;
+  uint16_t rx_expected;
+  uint8_t rx_sn;
+  uint32_t rx_deadline_ms;
+
+  /* Segmentation of the message being sent */
+
+  uint8_t txbuf[ISOTP_MAX_PAYLOAD];
+  uint16_t tx_len;
+  uint16_t tx_off;
+  uint8_t tx_state;
+  uint8_t tx_sn;
+  uint8_t tx_bs;            /* Frames left in this block; 0 is unlimited */
+  uint8_t tx_stmin_ms;
+  uint32_t tx_next_ms;      /* Earliest time of the next consecutive frame */
+  uint32_t tx_deadline_ms;
+
+  /* Counters */
+
+  uint32_t rx_messages;
+  uint32_t tx_messages;
+  uint32_t errors;
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+void isotp_init(FAR struct isotp_s *link, uint32_t tx_id, bool tx_extid,
+                uint8_t ring);
+int isotp_receive(FAR struct isotp_s *link, FAR const struct can_msg_s *msg,
+                  uint32_t now_ms);
+int isotp_send(FAR struct isotp_s *link, uint16_t len, uint32_t now_ms);
+void isotp_poll(FAR struct isotp_s *link, uint32_t now_ms);
+
+#endif /* APPS_INDUSTRY_ETCETERA_ISOTP_H */
@@ -25,14 +25,24 @@
 
 #include <nuttx/config.h>
 #include <sched.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <stdio.h>
+#include <unistd.h>
+
+#include "safing.h"
 
 /****************************************************************************
  * Pre-processor Definitions
  ****************************************************************************/
 
+/* Times arming is attempted before giving up with a soft fault */
+
+#define ETCETERA_ARM_ATTEMPTS     3
+
+/* How often the progress of a safing step is polled */
+
+#define ETCETERA_STEP_POLL_USEC   10000
 
 /****************************************************************************
  * Private Types
@@ -65,6 +75,31 @@ int etb_main(int argc, char **argv);
  * Private Functions
  ****************************************************************************/
 
+/* Asks safing to move to a state and waits until it is done with the work
+ * of that state or has moved on from it. Every state's first reason code
+ * means the work is still in progress.
+ */
+
+static int etcetera_step(uint8_t state, FAR struct safing_status_s *status)
+{
+  int ret;
+
+  ret = safing_try_step(state);
+  safing_get_status(status);
+  if (ret < 0)
+  {
+    return ret;
+  }
+
+  while (status->state == state && status->reason == 0)
+  {
+    usleep(ETCETERA_STEP_POLL_USEC);
+    safing_get_status(status);
+  }
+
+  return OK;
+}
+
 
 /****************************************************************************
  * Public Functions
@@ -81,9 +116,8 @@ int etb_main(int argc, char **argv);
 
 int main(int argc, char **argv)
 {
-  //int ret;
-  //int count = 0;
-  //struct safing_status_s safing_status;
+  struct safing_status_s safing_status;
+  int count = 0;
   
   task_create("drs",
               100,
@@ -106,50 +140,46 @@ int main(int argc, char **argv)
               2048,
               etb_main,
               NULL);
-  /*
-  do
+  
+  while (true)
+  {
+    etcetera_step(SAFING_STATE_ONBOARD_PROVEOUT, &safing_status);
+    ++count;
+    
+    if (safing_status.state == SAFING_STATE_ONBOARD_PROVEOUT
+        && safing_status.reason == SAFING_ONBOARD_PROVEOUT_SUCCESSFUL)
     {
-      safing_try_step(SAFING_STATE_ONBOARD_PROVEOUT);
-      safing_get_status(&safing_status);
-      ++count;
-      
-      switch (safing_status.state)
-      {
-        case SAFING_STATE_SOFT_FAULT:
-        case SAFING_STATE_HARD_FAULT:
-          printf("Safing fault; cannot arm.\n");
-          goto start_nsh;
-        
-        case SAFING_STATE_PAUSED:
-          if (safing_status.reason == SAFING_PAUSED_ARM_FAILED)
-          {
-            if (count == 3)
-              {
-                safing_trigger_soft_fault();
-              }
-            else
-              {
-                printf("Failed to arm; trying again. Fault flags = %x\n",
-                      (unsigned int)safing_status.fault_flags);
-              }
-          }
-        case SAFING_STATE_ONBOARD_PROVEOUT:
-          break;
-        default:
-          safing_trigger_soft_fault();
-      }
+      break;
     }
-  while (ret < 0);
-  
-  count = 0;
-  do
+    
+    if (safing_status.state == SAFING_STATE_PAUSED
+        && safing_status.reason == SAFING_PAUSED_ARM_FAILED
+        && count < ETCETERA_ARM_ATTEMPTS)
     {
-      ret = safing_try_step(SAFING_STATE_BSPD_PROVEOUT);
-      ++count;
-      
-      if (ret < 0)
-      {
-        printf("Failed to 
-  */
+      printf("Failed to arm; trying again. Fault flags = %x\n",
+             (unsigned int)safing_status.fault_flags);
+      continue;
+    }
+    
+    printf("Safing fault; cannot arm. Fault flags = %x\n",
+           (unsigned int)safing_status.fault_flags);
+    safing_trigger_soft_fault();
+    return OK;
+  }
+  
+  etcetera_step(SAFING_STATE_BSPD_PROVEOUT, &safing_status);
+  if (safing_status.state != SAFING_STATE_BSPD_PROVEOUT
+      || safing_status.reason != SAFING_BSPD_PROVEOUT_SUCCESSFUL)
+  {
+    printf("BSPD proveout failed.\n");
+    safing_trigger_soft_fault();
+    return OK;
+  }
+  
+  /* From here the ETB task relearns its end stops and the step to the
+   * active state follows from it.
+   */
+  
+  safing_try_step(SAFING_STATE_ETB_RELEARN);
   return OK;
 }
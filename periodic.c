@@ -0,0 +1,162 @@
+/****************************************************************************
+ * apps/industry/ETCetera/periodic.c
+ * Electronic Throttle Controller program - periodic task pacing
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <nuttx/clock.h>
+
+#include "periodic.h"
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static FAR struct periodic_s *g_periodic_tasks[PERIODIC_MAX_TASKS];
+static uint32_t g_periodic_ntasks;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static uint64_t periodic_now_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: periodic_init
+ *
+ * Description:
+ *   Start a loop with its first release now, and list it for
+ *   periodic_get().
+ *
+ * Returned Value:
+ *   OK, or -ENOMEM if PERIODIC_MAX_TASKS loops are already listed. The loop
+ *   still runs, without its statistics being listed.
+ *
+ ****************************************************************************/
+
+int periodic_init(FAR struct periodic_s *task, FAR const char *name,
+                  uint32_t period_us)
+{
+  uint32_t index;
+
+  memset(task, 0, sizeof(*task));
+  task->name = name;
+  task->period_ns = (uint64_t)period_us * NSEC_PER_USEC;
+  task->release_ns = periodic_now_ns();
+
+  index = __atomic_fetch_add(&g_periodic_ntasks, 1, __ATOMIC_RELAXED);
+  if (index >= PERIODIC_MAX_TASKS)
+  {
+    return -ENOMEM;
+  }
+
+  __atomic_store_n(&g_periodic_tasks[index], task, __ATOMIC_RELEASE);
+  return OK;
+}
+
+/****************************************************************************
+ * Name: periodic_wait
+ *
+ * Description:
+ *   Sleep until the next release with an absolute CLOCK_MONOTONIC
+ *   deadline, and record how late the wakeup was. If the pass just
+ *   finished ran past the next release, that counts as an overrun and the
+ *   next pass starts at once; releases that have passed entirely are
+ *   skipped rather than run back to back.
+ *
+ * Returned Value:
+ *   The number of releases skipped, normally 0.
+ *
+ ****************************************************************************/
+
+uint32_t periodic_wait(FAR struct periodic_s *task)
+{
+  struct timespec deadline;
+  uint64_t next_ns = task->release_ns + task->period_ns;
+  uint64_t now_ns;
+  uint32_t late_us;
+  uint32_t skipped = 0;
+
+  now_ns = periodic_now_ns();
+  if (now_ns >= next_ns)
+  {
+    ++task->overruns;
+    while (now_ns >= next_ns + task->period_ns)
+    {
+      next_ns += task->period_ns;
+      ++skipped;
+    }
+
+    task->skipped += skipped;
+  }
+
+  deadline.tv_sec = next_ns / NSEC_PER_SEC;
+  deadline.tv_nsec = next_ns % NSEC_PER_SEC;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)
+         == EINTR)
+  {};
+
+  now_ns = periodic_now_ns();
+  late_us = now_ns > next_ns ? (now_ns - next_ns) / NSEC_PER_USEC : 0;
+  if (late_us > task->max_jitter_us)
+  {
+    task->max_jitter_us = late_us;
+  }
+
+  task->total_jitter_us += late_us;
+  task->release_ns = next_ns;
+  ++task->cycles;
+  return skipped;
+}
+
+/****************************************************************************
+ * Name: periodic_get
+ *
+ * Description:
+ *   Return the index'th loop started, or NULL past the last one.
+ *
+ ****************************************************************************/
+
+FAR struct periodic_s *periodic_get(int index)
+{
+  if (index < 0 || index >= PERIODIC_MAX_TASKS)
+  {
+    return NULL;
+  }
+
+  return __atomic_load_n(&g_periodic_tasks[index], __ATOMIC_ACQUIRE);
+}
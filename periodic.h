@@ -0,0 +1,86 @@
+/****************************************************************************
+ * apps/industry/ETCetera/periodic.h
+ * Electronic Throttle Controller program - periodic task pacing
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_PERIODIC_H
+#define APPS_INDUSTRY_ETCETERA_PERIODIC_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdint.h>
+#include <nuttx/clock.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Loops whose statistics can be listed with periodic_get() */
+
+#define PERIODIC_MAX_TASKS      8
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* A loop released every period_ns on CLOCK_MONOTONIC. Release times are
+ * whole periods after the first one, however long each pass takes, so the
+ * loop keeps its phase. Only the loop's own task writes the statistics.
+ */
+
+struct periodic_s
+{
+  FAR const char *name;
+  uint64_t period_ns;
+  uint64_t release_ns;          /* Current release time */
+  uint32_t cycles;
+  uint32_t overruns;            /* Passes that ran past the next release */
+  uint32_t skipped;             /* Releases dropped to catch up */
+  uint32_t max_jitter_us;       /* Latest wakeup after a release */
+  uint64_t total_jitter_us;
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: periodic_release_ms
+ *
+ * Description:
+ *   The current release time in the millisecond time base of
+ *   can_sched_now_ms(). Timestamps taken from it are exactly a whole
+ *   number of periods apart.
+ *
+ ****************************************************************************/
+
+static inline uint32_t periodic_release_ms(FAR const struct periodic_s *task)
+{
+  return task->release_ns / NSEC_PER_MSEC;
+}
+
+int periodic_init(FAR struct periodic_s *task, FAR const char *name,
+                  uint32_t period_us);
+uint32_t periodic_wait(FAR struct periodic_s *task);
+FAR struct periodic_s *periodic_get(int index);
+
+#endif /* APPS_INDUSTRY_ETCETERA_PERIODIC_H */
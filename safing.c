@@ -36,13 +36,231 @@
 #include <time.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <nuttx/clock.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <nuttx/semaphore.h>
 
+#include "calib.h"
 #include "can_broadcast.h"
+#include "can_messages.h"
+#include "can_sched.h"
+#include "faultlog.h"
+#include "freeze.h"
+#include "isotp.h"
+#include "periodic.h"
+#include "seqlock.h"
 
 /****************************************************************************
  * Pre-processor Definitions
  ****************************************************************************/
 
+/* Period of the safing loop, which drives the CAN transmit schedules. All
+ * schedule periods and offsets below are multiples of it.
+ */
+
+#define SAFING_TICK_MS 5
+
+/* Brake and wheel speed frames are sampled at 100 Hz but only sent when a
+ * reading moves by more than its deadband, or at the heartbeat interval.
+ */
+
+#define SAFING_BRK_DEADBAND         CONFIG_INDUSTRY_ETCETERA_BRK_TX_DEADBAND
+#define SAFING_WS_DEADBAND          CONFIG_INDUSTRY_ETCETERA_WS_TX_DEADBAND
+#define SAFING_TELEM_HEARTBEAT_MS   CONFIG_INDUSTRY_ETCETERA_TELEM_TX_HEARTBEAT
+
+/* UDS (ISO 14229) services answered on the diagnostic ISO-TP link */
+
+#define UDS_SID_READ_DTC_INFO             0x19
+#define UDS_SID_READ_DATA_BY_ID           0x22
+#define UDS_POSITIVE_RESPONSE             0x40
+#define UDS_NEGATIVE_RESPONSE             0x7f
+#define UDS_SUPPRESS_POS_RESPONSE         0x80
+
+#define UDS_NRC_SERVICE_NOT_SUPPORTED     0x11
+#define UDS_NRC_SUBFUNCTION_NOT_SUPPORTED 0x12
+#define UDS_NRC_INCORRECT_LENGTH          0x13
+#define UDS_NRC_RESPONSE_TOO_LONG         0x14
+#define UDS_NRC_REQUEST_OUT_OF_RANGE      0x31
+
+/* ReadDTCInformation sub-functions */
+
+#define UDS_DTC_NUMBER_BY_STATUS_MASK     0x01
+#define UDS_DTC_BY_STATUS_MASK            0x02
+#define UDS_DTC_SNAPSHOT_BY_DTC           0x04
+#define UDS_DTC_EXT_DATA_BY_DTC           0x06
+
+/* DTC status bits. Passing tests are not reported, so testFailed is
+ * taken to mean that the DTC occurred in this keycycle. Confirmed DTCs
+ * request the warning indicator until they heal.
+ */
+
+#define UDS_DTC_STATUS_TEST_FAILED        0x01
+#define UDS_DTC_STATUS_FAILED_THIS_CYCLE  0x02
+#define UDS_DTC_STATUS_PENDING            0x04
+#define UDS_DTC_STATUS_CONFIRMED          0x08
+#define UDS_DTC_STATUS_WARNING            0x80
+#define UDS_DTC_STATUS_AVAILABILITY       (UDS_DTC_STATUS_TEST_FAILED | \
+                                           UDS_DTC_STATUS_FAILED_THIS_CYCLE | \
+                                           UDS_DTC_STATUS_PENDING | \
+                                           UDS_DTC_STATUS_CONFIRMED | \
+                                           UDS_DTC_STATUS_WARNING)
+#define UDS_DTC_FORMAT_ISO14229           0x01
+
+/* Extended data records 1 and 2 hold the keycycle and time of the first
+ * and latest occurrence; record 3 the occurrence count and the keycycles
+ * since the latest one.
+ */
+
+#define UDS_DTC_EXT_RECORD_FIRST          0x01
+#define UDS_DTC_EXT_RECORD_LAST           0x02
+#define UDS_DTC_EXT_RECORD_COUNTERS       0x03
+#define UDS_DTC_EXT_RECORD_ALL            0xff
+
+/* Snapshot record 1 is the DTC's freeze frame: each channel as a 2-byte
+ * identifier, SAFING_DID_FREEZE_BASE plus the FREEZE_CHAN_* number,
+ * followed by its signed 16-bit value. ETB duty is recorded halved, so
+ * 32767 is full duty.
+ */
+
+#define UDS_DTC_SNAPSHOT_RECORD           0x01
+#define UDS_DTC_SNAPSHOT_RECORD_ALL       0xff
+
+/* Data identifiers returning a whole table, as an entry count followed by
+ * SAFING_ENTRY_RECORD_LEN bytes per stored entry.
+ */
+
+#define SAFING_DID_DTC_TABLE              0xf1a0
+#define SAFING_DID_FAULT_TABLE            0xf1a1
+#define SAFING_ENTRY_RECORD_LEN           7
+#define SAFING_DID_FREEZE_BASE            0xf1b0
+
+/* Plausibility checks, one bit each in a tick's results. Range checks of
+ * channel i (CALIB_PLAUS_*) are bit 2i for below range and 2i + 1 for
+ * above; the correlation checks follow.
+ */
+
+#define SAFING_PLAUS_RANGE_CHECKS         (2 * CALIB_PLAUS_CHANNELS)
+#define SAFING_PLAUS_APPS_OOC             SAFING_PLAUS_RANGE_CHECKS
+#define SAFING_PLAUS_TPS_OOC              (SAFING_PLAUS_RANGE_CHECKS + 1)
+#define SAFING_PLAUS_CHECKS               (SAFING_PLAUS_RANGE_CHECKS + 2)
+
+/* Safing state machine. Each entry of g_safing_steps is the set of reasons
+ * for being in one state that allow a step to another, as a bitmap by
+ * reason code; no bits means the step is never allowed.
+ */
+
+#define SAFING_NUM_STATES                 8
+#define SAFING_STEP_WHEN(reason)          (1u << (reason))
+#define SAFING_STEP_ANY                   0xff
+
+/* States in which the shutdown circuit is armed, and the flags that mean
+ * it has since been opened without being asked to.
+ */
+
+#define SAFING_ARMED_STATES               ((1u << SAFING_STATE_BSPD_PROVEOUT) | \
+                                           (1u << SAFING_STATE_ETB_RELEARN) | \
+                                           (1u << SAFING_STATE_ACTIVE))
+#define SAFING_HARD_FAULT_FLAGS           (SAFINGSIG_SAFING1_DISARMING | \
+                                           SAFINGSIG_SAFING1_ASSERTING | \
+                                           SAFINGSIG_SAFING2_DISARMING | \
+                                           SAFINGSIG_SAFING2_ASSERTING)
+
+/* Arming takes several hundred milliseconds of settling and checking, so
+ * it is done a tick at a time by safing_arm_step() rather than holding up
+ * the rest of the safing loop.
+ */
+
+#define SAFING_ARM_START                  0   /* Subscribe, arm 5V0LIN_SENSE */
+#define SAFING_ARM_SETTLE                 1   /* Let the sensors settle */
+#define SAFING_ARM_CHECK                  2   /* Range checks past debounce */
+#define SAFING_ARM_OPEN_LINE              3   /* Open-line detection */
+
+#define SAFING_ARM_SETTLE_TICKS           (50 / SAFING_TICK_MS)
+#define SAFING_ARM_OPEN_LINE_TICKS        (200 / SAFING_TICK_MS)
+
+/* Stored DTCs are deduplicated with a bitmap indexed by code. Each DTC
+ * letter gets a block of SAFING_DTC_BLOCK_SIZE numbers starting at
+ * g_dtc_block_base; codes outside the blocks cannot be stored.
+ */
+
+#define SAFING_NUM_DTC_ENTRIES    16
+#define SAFING_NUM_FAULT_ENTRIES  16
+#define SAFING_DTC_BLOCK_SIZE     64
+#define SAFING_DTC_INDICES        (4 * SAFING_DTC_BLOCK_SIZE)
+#define SAFING_FAULT_INDICES      64
+
+#if SAFING_NUM_DTC_ENTRIES > 32 || SAFING_NUM_FAULT_ENTRIES > 32
+#  error "Slot bitmaps hold at most 32 entries"
+#endif
+
+#define SAFING_STORE_INITIALIZER(entries_, present_, slot_of_, log_type_, \
+                                 last_log_type_) \
+  { .present = (present_), .slot_of = (slot_of_), .entries = (entries_), \
+    .nentries = sizeof(entries_) / sizeof((entries_)[0]), \
+    .log_type = (log_type_), .last_log_type = (last_log_type_), \
+    .valid = 0, .logged = 0, .lost = 0 }
+
+/* Entry lifecycle. An entry stored by safing_report_dtc() is pending until
+ * the code occurs again in a later keycycle; one stored any other way is
+ * confirmed straight away. A confirmed entry heals after
+ * SAFING_DTC_HEAL_CYCLES whole keycycles without occurring, and a healed
+ * or pending one is removed after SAFING_DTC_AGING_CYCLES. When the table
+ * is full, a new entry replaces the healed, then pending, entry with the
+ * fewest occurrences, but never a confirmed one.
+ */
+
+#define SAFING_ENTRY_EMPTY                0
+#define SAFING_ENTRY_PENDING              1
+#define SAFING_ENTRY_CONFIRMED            2
+#define SAFING_ENTRY_HEALED               3
+
+#define SAFING_DTC_HEAL_CYCLES    CONFIG_INDUSTRY_ETCETERA_DTC_HEAL_CYCLES
+#define SAFING_DTC_AGING_CYCLES   CONFIG_INDUSTRY_ETCETERA_DTC_AGING_CYCLES
+
+#if SAFING_DTC_AGING_CYCLES <= SAFING_DTC_HEAL_CYCLES
+#  error "DTC_AGING_CYCLES must be more than DTC_HEAL_CYCLES"
+#endif
+
+/* An entry's status word: state, occurrence count (saturating) and the
+ * keycycle of the latest occurrence.
+ */
+
+#define SAFING_ENTRY_STATE(s)             ((s) & 0x3)
+#define SAFING_ENTRY_COUNT(s)             (((s) >> 8) & 0xff)
+#define SAFING_ENTRY_LAST_KEYCYCLE(s)     ((uint16_t)((s) >> 16))
+#define SAFING_ENTRY_STATUS(state, count, keycycle) \
+  ((uint32_t)(state) | ((uint32_t)(count) << 8) | \
+   ((uint32_t)(keycycle) << 16))
+#define SAFING_ENTRY_MAX_COUNT            0xff
+
+/* Times a reader copies an entry again after a writer changed it under it */
+
+#define SAFING_ENTRY_READ_RETRIES         3
+
+/* Stored entries are written to a log in flash by a low priority thread,
+ * so that they survive power-off. When the log moves to a new sector it
+ * rewrites every stored entry, which must fit in one sector.
+ */
+
+#define SAFING_FAULTLOG_PATH        CONFIG_INDUSTRY_ETCETERA_FAULTLOG_PATH
+#define SAFING_FAULTLOG_SECTORS     CONFIG_INDUSTRY_ETCETERA_FAULTLOG_SECTORS
+#define SAFING_FAULTLOG_SECTOR_SIZE CONFIG_INDUSTRY_ETCETERA_FAULTLOG_SECTOR_SIZE
+#define SAFING_FAULTLOG_PRIORITY    CONFIG_INDUSTRY_ETCETERA_FAULTLOG_PRIORITY
+
+#if defined(CONFIG_INDUSTRY_ETCETERA_FAULTLOG) && \
+    FAULTLOG_HEADER_SIZE + FAULTLOG_RECORD_SIZE * \
+    (2 * (SAFING_NUM_DTC_ENTRIES + SAFING_NUM_FAULT_ENTRIES) + 2) > \
+    SAFING_FAULTLOG_SECTOR_SIZE
+#  error "CONFIG_INDUSTRY_ETCETERA_FAULTLOG_SECTOR_SIZE is too small"
+#endif
+
+/* Entries of g_safingsig_actions, indexed by the bit number of the flag */
+
+#define SAFINGSIG_DTC(flag, code) \
+  [__builtin_ctz(flag)] = { .dtc = (code), .fault = FAULT_INVALID }
+#define SAFINGSIG_FAULT(flag, code) \
+  [__builtin_ctz(flag)] = { .dtc = DTC_INVALID, .fault = (code) }
 
 /****************************************************************************
  * Private Types
@@ -50,9 +268,44 @@
 
 struct fault_entry_s
 {
-  uint32_t time_ms;
+  uint32_t seq;                     /* Odd while being written */
+  uint32_t first_ms;
+  uint32_t last_ms;
+  uint32_t status;                  /* SAFING_ENTRY_STATUS() */
   uint16_t fault_code;
-  uint8_t  keycycle;
+  uint16_t first_keycycle;
+};
+
+/* Table of stored DTCs or internal faults, safe to update from any task or
+ * signal handler at once. A new code is first claimed in the present
+ * bitmap, so exactly one caller goes on to store it. Every write to an
+ * entry is made with its seq odd, taken with a compare-and-swap; a caller
+ * that finds it already odd gives up rather than wait, since the holder
+ * may be a preempted lower priority task. Readers copy valid entries and
+ * keep the copy if seq was even and unchanged across it.
+ */
+
+struct safing_store_s
+{
+  FAR uint32_t *present;            /* Bitmap by code index */
+  FAR uint8_t *slot_of;             /* Slot by code index, once valid */
+  FAR struct fault_entry_s *entries;
+  uint8_t nentries;
+  uint8_t log_type;                 /* FAULTLOG_TYPE_* of its records */
+  uint8_t last_log_type;            /* ... and of its latest occurrences */
+  uint32_t valid;                   /* Bitmap of slots filled in */
+  uint32_t logged;                  /* Bitmap of slots in the fault log */
+  uint32_t lost;                    /* Occurrences not recorded */
+};
+
+/* What to store when a safing subscription flag is raised: a DTC, or an
+ * internal fault if dtc is DTC_INVALID.
+ */
+
+struct safing_sig_action_s
+{
+  uint16_t dtc;
+  uint16_t fault;
 };
 
 /****************************************************************************
@@ -63,18 +316,258 @@ static int safing_check_sensor_ranges(void);
 static void safing_subscription_update_dtcs_and_faults(void);
 static void safing_sigusr1_handler(int signo);
 static void safing_5v0lin_sense_retry_handler(int signo);
+static bool safing_pack_wheel_speed(FAR struct can_msg_s *msg, FAR void *arg);
+static bool safing_pack_brake(FAR struct can_msg_s *msg, FAR void *arg);
 
 /****************************************************************************
  * Private Data
  ****************************************************************************/
 
-#define SAFING_NUM_DTC_ENTRIES 16
-static struct fault_entry_s g_dtc_table[SAFING_NUM_DTC_ENTRIES] = {0};
-#define SAFING_NUM_FAULT_ENTRIES 16
-static struct fault_entry_s g_fault_table[SAFING_NUM_FAULT_ENTRIES] = {0};
+static struct fault_entry_s g_dtc_entries[SAFING_NUM_DTC_ENTRIES];
+static uint32_t g_dtc_present[SAFING_DTC_INDICES / 32];
+static uint8_t g_dtc_slot_of[SAFING_DTC_INDICES];
+static struct safing_store_s g_dtc_table =
+  SAFING_STORE_INITIALIZER(g_dtc_entries, g_dtc_present, g_dtc_slot_of,
+                           FAULTLOG_TYPE_DTC, FAULTLOG_TYPE_DTC_LAST);
+
+static struct fault_entry_s g_fault_entries[SAFING_NUM_FAULT_ENTRIES];
+static uint32_t g_fault_present[SAFING_FAULT_INDICES / 32];
+static uint8_t g_fault_slot_of[SAFING_FAULT_INDICES];
+static struct safing_store_s g_fault_table =
+  SAFING_STORE_INITIALIZER(g_fault_entries, g_fault_present, g_fault_slot_of,
+                           FAULTLOG_TYPE_FAULT, FAULTLOG_TYPE_FAULT_LAST);
+
+/* First DTC number of each letter's block, indexed by the letter bits. U
+ * codes start at 0x3000 so that DTC_INTERNAL_FAULT has a place.
+ */
+
+static const uint16_t g_dtc_block_base[4] = {0x0000, 0x0000, 0x0000, 0x3000};
+
+/* Keycycle recorded with new entries, counted by the fault log */
+
+static uint16_t g_safing_keycycle;
+
+/* Order in which entries are replaced when a table is full, by state */
+
+static const uint8_t g_safing_entry_rank[4] = {
+  [SAFING_ENTRY_EMPTY] = 0,
+  [SAFING_ENTRY_HEALED] = 1,
+  [SAFING_ENTRY_PENDING] = 2,
+  [SAFING_ENTRY_CONFIRMED] = 3
+};
+
+/* UDS status bits of each state, before the bits for this keycycle */
+
+static const uint8_t g_safing_entry_uds_status[4] = {
+  [SAFING_ENTRY_EMPTY] = 0,
+  [SAFING_ENTRY_PENDING] = UDS_DTC_STATUS_PENDING,
+  [SAFING_ENTRY_CONFIRMED] = UDS_DTC_STATUS_CONFIRMED
+                             | UDS_DTC_STATUS_WARNING,
+  [SAFING_ENTRY_HEALED] = UDS_DTC_STATUS_CONFIRMED
+};
+
+/* Posted whenever an entry is stored; the fault log thread writes out
+ * every entry not yet logged.
+ */
+
+static sem_t g_faultlog_sem = SEM_INITIALIZER(0);
+
+#ifdef CONFIG_INDUSTRY_ETCETERA_FAULTLOG
+static struct faultlog_s g_faultlog;
+#endif
 
 static struct safing_subscription_s g_safing_subscr;
 
+/* 5V0LIN_SENSE_STG is not in the table; it starts a retry instead */
+
+static const struct safing_sig_action_s g_safingsig_actions[32] = {
+  SAFINGSIG_DTC(SAFINGSIG_STP_APPS1, DTC_APPS1_STP),
+  SAFINGSIG_DTC(SAFINGSIG_STP_APPS2, DTC_APPS2_STP),
+  SAFINGSIG_DTC(SAFINGSIG_STP_BRKF, DTC_BRKF_STP),
+  SAFINGSIG_DTC(SAFINGSIG_STP_BRKR, DTC_BRKR_STP),
+  SAFINGSIG_DTC(SAFINGSIG_STP_TPS, DTC_TPS_STP),
+  SAFINGSIG_DTC(SAFINGSIG_STP_AUX, DTC_5VAUX_STP),
+  SAFINGSIG_DTC(SAFINGSIG_OL_APPS1, DTC_APPS1_OPEN),
+  SAFINGSIG_DTC(SAFINGSIG_OL_APPS2, DTC_APPS2_OPEN),
+  SAFINGSIG_DTC(SAFINGSIG_OL_BRKF, DTC_BRKF_OPEN),
+  SAFINGSIG_DTC(SAFINGSIG_OL_BRKR, DTC_BRKR_OPEN),
+  SAFINGSIG_DTC(SAFINGSIG_OL_TPS1, DTC_TPS1_OPEN),
+  SAFINGSIG_DTC(SAFINGSIG_OL_TPS2, DTC_TPS2_OPEN),
+  SAFINGSIG_DTC(SAFINGSIG_OOC_TPS, DTC_TPS_OOC),
+  SAFINGSIG_DTC(SAFINGSIG_OOC_APPS, DTC_APPS_OOC),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING1_DISARMING, FAULT_UNEXPECTED_DISARM_1),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING1_ASSERTING, FAULT_UNEXPECTED_SAFING_1),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING2_DISARMING, FAULT_UNEXPECTED_DISARM_2),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING2_ASSERTING, FAULT_UNEXPECTED_SAFING_2),
+  SAFINGSIG_FAULT(SAFINGSIG_OL_INTERNAL_FAULT, FAULT_OL_INTERNAL_FAULT),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING1_ALREADYARMED, FAULT_ALREADY_ARMED_1),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING2_ALREADYARMED, FAULT_ALREADY_ARMED_2),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING1_NOT_ASSERTED, FAULT_NOT_SAFING_1),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING2_NOT_ASSERTED, FAULT_NOT_SAFING_2),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING1_ARM_FAILED, FAULT_ARM_FAILED_1),
+  SAFINGSIG_FAULT(SAFINGSIG_SAFING2_ARM_FAILED, FAULT_ARM_FAILED_2),
+  SAFINGSIG_DTC(SAFINGSIG_DRSBCK_STG, DTC_DRSBCK_STG)
+};
+
+/* Plausibility checker state: where each checked channel is in a sample,
+ * the DTC of each check, consecutive failed ticks of each check, and the
+ * checks confirmed on the last tick.
+ */
+
+static const uint8_t g_plaus_chan[CALIB_PLAUS_CHANNELS] = {
+  [CALIB_PLAUS_APPS1] = FREEZE_CHAN_APPS1,
+  [CALIB_PLAUS_APPS2] = FREEZE_CHAN_APPS2,
+  [CALIB_PLAUS_TPS1] = FREEZE_CHAN_TPS1,
+  [CALIB_PLAUS_TPS2] = FREEZE_CHAN_TPS2,
+  [CALIB_PLAUS_BRKF] = FREEZE_CHAN_BRKF,
+  [CALIB_PLAUS_BRKR] = FREEZE_CHAN_BRKR
+};
+
+static const uint16_t g_plaus_dtcs[SAFING_PLAUS_CHECKS] = {
+  [2 * CALIB_PLAUS_APPS1] = DTC_APPS1_LOW,
+  [2 * CALIB_PLAUS_APPS1 + 1] = DTC_APPS1_HIGH,
+  [2 * CALIB_PLAUS_APPS2] = DTC_APPS2_LOW,
+  [2 * CALIB_PLAUS_APPS2 + 1] = DTC_APPS2_HIGH,
+  [2 * CALIB_PLAUS_TPS1] = DTC_TPS1_LOW,
+  [2 * CALIB_PLAUS_TPS1 + 1] = DTC_TPS1_HIGH,
+  [2 * CALIB_PLAUS_TPS2] = DTC_TPS2_LOW,
+  [2 * CALIB_PLAUS_TPS2 + 1] = DTC_TPS2_HIGH,
+  [2 * CALIB_PLAUS_BRKF] = DTC_BRKF_LOW,
+  [2 * CALIB_PLAUS_BRKF + 1] = DTC_BRKF_HIGH,
+  [2 * CALIB_PLAUS_BRKR] = DTC_BRKR_LOW,
+  [2 * CALIB_PLAUS_BRKR + 1] = DTC_BRKR_HIGH,
+  [SAFING_PLAUS_APPS_OOC] = DTC_APPS_OOC,
+  [SAFING_PLAUS_TPS_OOC] = DTC_TPS_OOC
+};
+
+static uint8_t g_plaus_count[SAFING_PLAUS_CHECKS];
+static uint32_t g_plaus_confirmed;
+
+/* Current safing status. Every change goes through safing_step() or
+ * safing_set_reason(), which take g_safing_step_sem between themselves;
+ * readers only use the seqlock.
+ */
+
+static struct safing_status_s g_safing_status = {
+  .fault_flags = 0,
+  .state = SAFING_STATE_PRE_PROVEOUT,
+  .reason = 0
+};
+
+static struct seqlock_s g_safing_status_lock = SEQLOCK_INITIALIZER;
+static sem_t g_safing_step_sem = SEM_INITIALIZER(1);
+
+/* Allowed steps, indexed by current state and then by new state. Faults
+ * can be entered from anywhere; otherwise the car goes through each
+ * proveout in order, and once paused must relearn the ETB before it is
+ * active again, or prove out again if arming failed.
+ */
+
+static const uint8_t g_safing_steps[SAFING_NUM_STATES][SAFING_NUM_STATES] = {
+  [SAFING_STATE_PRE_PROVEOUT] =
+  {
+    [SAFING_STATE_ONBOARD_PROVEOUT] = SAFING_STEP_ANY,
+    [SAFING_STATE_SOFT_FAULT] = SAFING_STEP_ANY,
+    [SAFING_STATE_HARD_FAULT] = SAFING_STEP_ANY
+  },
+  [SAFING_STATE_ONBOARD_PROVEOUT] =
+  {
+    [SAFING_STATE_BSPD_PROVEOUT] =
+      SAFING_STEP_WHEN(SAFING_ONBOARD_PROVEOUT_SUCCESSFUL),
+    [SAFING_STATE_PAUSED] = SAFING_STEP_ANY,
+    [SAFING_STATE_SOFT_FAULT] = SAFING_STEP_ANY,
+    [SAFING_STATE_HARD_FAULT] = SAFING_STEP_ANY
+  },
+  [SAFING_STATE_BSPD_PROVEOUT] =
+  {
+    [SAFING_STATE_ETB_RELEARN] =
+      SAFING_STEP_WHEN(SAFING_BSPD_PROVEOUT_SUCCESSFUL),
+    [SAFING_STATE_PAUSED] = SAFING_STEP_ANY,
+    [SAFING_STATE_SOFT_FAULT] = SAFING_STEP_ANY,
+    [SAFING_STATE_HARD_FAULT] = SAFING_STEP_ANY
+  },
+  [SAFING_STATE_ETB_RELEARN] =
+  {
+    [SAFING_STATE_ACTIVE] =
+      SAFING_STEP_WHEN(SAFING_ETB_RELEARN_AWAIT_BRAKE_RELEASE),
+    [SAFING_STATE_PAUSED] = SAFING_STEP_ANY,
+    [SAFING_STATE_SOFT_FAULT] = SAFING_STEP_ANY,
+    [SAFING_STATE_HARD_FAULT] = SAFING_STEP_ANY
+  },
+  [SAFING_STATE_ACTIVE] =
+  {
+    [SAFING_STATE_PAUSED] = SAFING_STEP_ANY,
+    [SAFING_STATE_SOFT_FAULT] = SAFING_STEP_ANY,
+    [SAFING_STATE_HARD_FAULT] = SAFING_STEP_ANY
+  },
+  [SAFING_STATE_PAUSED] =
+  {
+    [SAFING_STATE_ONBOARD_PROVEOUT] =
+      SAFING_STEP_WHEN(SAFING_PAUSED_ARM_FAILED),
+    [SAFING_STATE_ETB_RELEARN] =
+      SAFING_STEP_WHEN(SAFING_PAUSED_SOFTWARE_REQUEST)
+      | SAFING_STEP_WHEN(SAFING_PAUSED_CMS_OPEN)
+      | SAFING_STEP_WHEN(SAFING_PAUSED_BOTS_OPEN)
+      | SAFING_STEP_WHEN(SAFING_PAUSED_THROTTLE_STUCK),
+    [SAFING_STATE_SOFT_FAULT] = SAFING_STEP_ANY,
+    [SAFING_STATE_HARD_FAULT] = SAFING_STEP_ANY
+  },
+  [SAFING_STATE_SOFT_FAULT] =
+  {
+    [SAFING_STATE_PRE_PROVEOUT] = SAFING_STEP_ANY,
+    [SAFING_STATE_HARD_FAULT] = SAFING_STEP_ANY
+  }
+};
+
+/* Flags already handled by safing_subscription_update_dtcs_and_faults() */
+
+static uint32_t g_safing_seen_flags;
+
+static int16_t *g_apps1;
+static int16_t *g_apps2;
+static int16_t *g_brk_f_value;
+static int16_t *g_brk_r_value;
+static int16_t *g_ws1;
+static int16_t *g_ws2;
+static int16_t *g_ws3;
+static int16_t *g_ws4;
+
+/* Each message has its own rate; offsets keep them in separate ticks of the
+ * safing loop so the bus never sees them in one burst.
+ */
+
+static struct can_sched_entry_s g_telem_sched_entries[] = {
+  CAN_SCHED_ON_CHANGE_ENTRY(CAN_ID_WS_TX, false, 8, 10, 0,
+                            safing_pack_wheel_speed, NULL,
+                            can_sched_changed_be16,
+                            SAFING_WS_DEADBAND, SAFING_TELEM_HEARTBEAT_MS),
+  CAN_SCHED_ON_CHANGE_ENTRY(CAN_ID_BRAKE_TX, false, 8, 10, 5,
+                            safing_pack_brake, NULL,
+                            can_sched_changed_be16,
+                            SAFING_BRK_DEADBAND, SAFING_TELEM_HEARTBEAT_MS)
+};
+
+static struct can_sched_s g_telem_sched = {
+  .entries = g_telem_sched_entries,
+  .nentries = sizeof(g_telem_sched_entries) / sizeof(g_telem_sched_entries[0]),
+  .ring = CAN_TELEM_TX_RING
+};
+
+static struct periodic_s g_safing_period;
+
+/* Progress through arming, and the ticks left in the current phase */
+
+static uint8_t g_safing_arm_phase = SAFING_ARM_START;
+static uint16_t g_safing_arm_ticks;
+
+/* Diagnostic requests arrive on their own rx queue and are answered on the
+ * safing tx ring, which nothing else uses.
+ */
+
+static struct isotp_s g_diag_link;
+static mqd_t g_diag_rxmq;
+static uint16_t g_diag_response_len;
+
 
 static struct sigevent g_retry_5v0lin_sense_event = {
   .sigev_notify = SIGEV_SIGNAL,
@@ -105,87 +598,263 @@ static timer_t g_retry_5v0lin_sense_timer;
  * Private Functions
  ****************************************************************************/
 
-static void safing_arm(void)
+/* Does one tick of arming. Returns -EINPROGRESS until the circuit is armed
+ * or arming has failed, then starts again from SAFING_ARM_START next time.
+ */
+
+static int safing_arm_step(void)
 {
-  int ret;
+  int ret = OK;
+  
+  switch (g_safing_arm_phase)
+  {
+    case SAFING_ARM_START:
+      {
+        struct sigaction sigusr1_action = {
+          .sa_handler = safing_sigusr1_handler,
+          .sa_flags = 0
+        };
+        struct sigaction sigusr2_action = {
+          .sa_handler = safing_5v0lin_sense_retry_handler,
+          .sa_flags = 0
+        };
+        
+        g_safing_subscr.tid = gettid();
+        g_safing_subscr.faultflags = 0;
+        g_safing_seen_flags = 0;
+        
+        sigemptyset(&sigusr1_action.sa_mask);
+        sigemptyset(&sigusr2_action.sa_mask);
+        sigaction(SIGUSR1, &sigusr1_action, NULL);
+        sigaction(SIGUSR2, &sigusr2_action, NULL);
+        
+        boardctl(BOARDIOC_SAFING_SUBSCRIBE, (uintptr_t)&g_safing_subscr);
+        
+        /* Enable 5V0LIN_SENSE and enable receiving a signal if it later
+         * fails.
+         */
+        
+        ret = boardctl(BOARDIOC_5V0LIN_SENSE_ARM, 0);
+        if (ret < 0)
+        {
+          safing_store_dtc(DTC_5V0LIN_SENSE_STG);
+          goto safing_failed;
+        }
+        
+        /* Allow sensors to settle */
+        
+        g_safing_arm_phase = SAFING_ARM_SETTLE;
+        g_safing_arm_ticks = SAFING_ARM_SETTLE_TICKS;
+      }
+      break;
+    
+    case SAFING_ARM_SETTLE:
+      if (--g_safing_arm_ticks == 0)
+      {
+        g_safing_arm_phase = SAFING_ARM_CHECK;
+        g_safing_arm_ticks = CALIB_PLAUS_MAX_DEBOUNCE;
+      }
+      break;
+    
+    case SAFING_ARM_CHECK:
+      /* Software check of sensor ranges and correlation, run for long
+       * enough that a failure gets past any debounce.
+       */
+      
+      ret = safing_check_sensor_ranges();
+      if (ret < 0)
+      {
+        goto safing_failed;
+      }
+      
+      if (--g_safing_arm_ticks != 0)
+      {
+        break;
+      }
+      
+      /* Enable edge interrupts for hardware out-of-range, open line, and
+       * out-of-correlation faults and verify that they are not already
+       * signalling a fault to the latching logic.
+       */
+      
+      ret = boardctl(BOARDIOC_HW_PLAUS_CK_ARM, 0);
+      if (ret < 0)
+      {
+        goto safing_failed;
+      }
+      
+      /* Wait 200 ms to ensure the open-line detection circuit does not
+       * find any faults.
+       */
+      
+      g_safing_arm_phase = SAFING_ARM_OPEN_LINE;
+      g_safing_arm_ticks = SAFING_ARM_OPEN_LINE_TICKS;
+      break;
+    
+    case SAFING_ARM_OPEN_LINE:
+      if (--g_safing_arm_ticks != 0)
+      {
+        break;
+      }
+      
+      /* Read arm/safing status (must be disarmed with safing active),
+       * send arming signal, enable edge interrupts to detect unexpected
+       * disarming or safing assertion, and verify that system is armed
+       * and safing is inactive.
+       */
+      
+      ret = boardctl(BOARDIOC_HW_SAFING_ARM, 0);
+      if (ret < 0)
+      {
+        goto safing_failed;
+      }
+      
+      g_safing_arm_phase = SAFING_ARM_START;
+      return OK;
+  }
   
-  g_safing_subscr.tid = gettid();
-  g_safing_subscr.faultflags = 0;
+  return -EINPROGRESS;
   
-  struct sigaction sigusr1_action = {
-    .sa_handler = safing_sigusr1_handler,
-    .sa_flags = 0
-  };
-  struct sigaction sigusr2_action = {
-    .sa_handler = safing_5v0lin_sense_retry_handler,
-    .sa_flags = 0
-  };
-  sigemptyset(&sigusr1_action.sa_mask);
-  sigemptyset(&sigusr2_action.sa_mask);
-  sigaction(SIGUSR1, &sigusr1_action, NULL);
-  sigaction(SIGUSR2, &sigusr2_action, NULL);
-  sigset_t normal_sigmask;
-  sigset_t sleep_sigmask;
-  sigfillset(&sleep_sigmask);
+safing_failed:
+  g_safing_arm_phase = SAFING_ARM_START;
+  safing_subscription_update_dtcs_and_faults();
+  safing_store_dtc(DTC_INITIAL_ARM_FAILED);
+  return ret < 0 ? ret : -EIO;
+}
+
+/* Moves to a new state if g_safing_steps allows it from the current one */
+
+static int safing_step(uint8_t state, uint8_t reason)
+{
+  int ret = -EPERM;
   
-  boardctl(BOARDIOC_SAFING_SUBSCRIBE, (uintptr_t)&g_safing_subscr);
+  if (state >= SAFING_NUM_STATES)
+  {
+    return -EINVAL;
+  }
   
-  /* Enable 5V0LIN_SENSE and enable receiving a signal if it later fails */
-  ret = boardctl(BOARDIOC_5V0LIN_SENSE_ARM, 0);
+  while (sem_wait(&g_safing_step_sem) < 0)
+  {};
   
-  if (ret < 0)
+  if (g_safing_steps[g_safing_status.state][state]
+      & SAFING_STEP_WHEN(g_safing_status.reason))
   {
-    safing_store_dtc(DTC_5V0LIN_SENSE_STG);
-    goto safing_failed;
+    seqlock_write_begin(&g_safing_status_lock);
+    g_safing_status.state = state;
+    g_safing_status.reason = reason;
+    seqlock_write_end(&g_safing_status_lock);
+    ret = OK;
   }
   
-  /* Allow sensors to settle */
-  sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-  ret = usleep(50000);
-  sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
+  sem_post(&g_safing_step_sem);
+  return ret;
+}
+
+static void safing_publish_fault_flags(uint32_t flags)
+{
+  while (sem_wait(&g_safing_step_sem) < 0)
+  {};
+  
+  seqlock_write_begin(&g_safing_status_lock);
+  g_safing_status.fault_flags = flags;
+  seqlock_write_end(&g_safing_status_lock);
   
-  /* Software check of sensor ranges and correlation */
-  ret = safing_check_sensor_ranges();
-  if (ret < 0)
+  sem_post(&g_safing_step_sem);
+}
+
+/* Does the work of the current state for one tick of the safing loop. The
+ * sensors are only checked once the shutdown circuit is armed; any
+ * confirmed failure then is a soft fault, and the circuit opening by
+ * itself is a hard fault.
+ */
+
+static void safing_run_state(void)
+{
+  struct safing_status_s status;
+  uint32_t flags;
+  int ret;
+  
+  flags = __atomic_load_n(&g_safing_subscr.faultflags, __ATOMIC_ACQUIRE);
+  safing_get_status(&status);
+  if (flags != status.fault_flags)
   {
-    goto safing_failed;
+    safing_publish_fault_flags(flags);
   }
   
-  /* Enable edge interrupts for hardware out-of-range, open line, and
-   * out-of-correlation faults and verify that they are not already
-   * signalling a fault to the latching logic.
-   */
-  ret = boardctl(BOARDIOC_HW_PLAUS_CK_ARM, 0);
-  if (ret < 0)
+  if ((SAFING_ARMED_STATES & (1u << status.state)) != 0)
   {
-    goto safing_failed;
+    if ((flags & SAFING_HARD_FAULT_FLAGS) != 0)
+    {
+      safing_step(SAFING_STATE_HARD_FAULT, 0);
+      return;
+    }
+    
+    if (safing_check_sensor_ranges() < 0)
+    {
+      safing_step(SAFING_STATE_SOFT_FAULT, 0);
+      return;
+    }
   }
   
-  /* Wait 100 ms to ensure the open-line detection circuit does not
-   * find any faults. Disable signals while doing this; otherwise
-   * usleep may return early.
-   */
-  sigprocmask(SIG_SETMASK, &sleep_sigmask, &normal_sigmask);
-  ret = usleep(200000);
-  sigprocmask(SIG_SETMASK, &normal_sigmask, NULL);
-  
-  /* Read arm/safing status (must be disarmed with safing active),
-   * send arming signal, enable edge interrupts to detect unexpected
-   * disarming or safing assertion, and verify that system is armed
-   * and safing is inactive.
-   */
+  /* Arming left part way, by a fault or a pause, starts over next time */
   
-  ret = boardctl(BOARDIOC_HW_SAFING_ARM, 0);
-  if (ret < 0)
+  if (status.state != SAFING_STATE_ONBOARD_PROVEOUT)
   {
-    goto safing_failed;
+    g_safing_arm_phase = SAFING_ARM_START;
   }
   
-  return;
-  
-safing_failed:
-  safing_subscription_update_dtcs_and_faults();
-  safing_store_dtc(DTC_INITIAL_ARM_FAILED);
+  switch (status.state)
+  {
+    case SAFING_STATE_ONBOARD_PROVEOUT:
+      if (status.reason == SAFING_ONBOARD_PROVEOUT_INPROGRESS)
+      {
+        ret = safing_arm_step();
+        if (ret == OK)
+        {
+          safing_set_reason(SAFING_STATE_ONBOARD_PROVEOUT,
+                            SAFING_ONBOARD_PROVEOUT_SUCCESSFUL);
+        }
+        else if (ret != -EINPROGRESS)
+        {
+          safing_step(SAFING_STATE_PAUSED, SAFING_PAUSED_ARM_FAILED);
+        }
+      }
+      break;
+    
+    case SAFING_STATE_BSPD_PROVEOUT:
+      /* The board cannot trip the BSPD for a test yet, so there is nothing
+       * to wait for.
+       */
+      
+      if (status.reason == SAFING_BSPD_PROVEOUT_INPROGRESS)
+      {
+        safing_set_reason(SAFING_STATE_BSPD_PROVEOUT,
+                          SAFING_BSPD_PROVEOUT_SUCCESSFUL);
+      }
+      break;
+    
+    case SAFING_STATE_ETB_RELEARN:
+      /* The ETB task records when it has relearned; the throttle then
+       * goes live once the driver is off the brake, at the same pressure
+       * DRS takes as released.
+       */
+      
+      if (status.reason == SAFING_ETB_RELEARN_AWAIT_BRAKE_RELEASE)
+      {
+        FAR const struct calib_data_s *calib = calib_acquire();
+        
+        if (*g_brk_f_value < calib->drs.brake_open)
+        {
+          safing_step(SAFING_STATE_ACTIVE, SAFING_ACTIVE_OK);
+        }
+        
+        calib_release(calib);
+      }
+      break;
+    
+    default:
+      break;
+  }
 }
 
 static void safing_sigusr1_handler(int signo)
@@ -216,7 +885,14 @@ static void safing_5v0lin_sense_retry_handler(int signo)
 
 static void safing_subscription_update_dtcs_and_faults(void)
 {
-  if (g_safing_subscr.faultflags & SAFINGSIG_5V0LIN_SENSE_STG)
+  FAR const struct safing_sig_action_s *action;
+  uint32_t flags;
+  uint32_t newflags;
+  int bit;
+  
+  flags = __atomic_load_n(&g_safing_subscr.faultflags, __ATOMIC_ACQUIRE);
+  
+  if (flags & SAFINGSIG_5V0LIN_SENSE_STG)
   {
     if (g_retrying_5v0lin_sense == RETRY_5V0LIN_SENSE_NOT_RETRYING)
     {
@@ -227,140 +903,1127 @@ static void safing_subscription_update_dtcs_and_faults(void)
     }
   }
   
-  /* 5V0LIN_SENSE successfully reenabled */
-  if (g_safing_subscr.faultflags & SAFINGSIG_STP_APPS1)
-    safing_store_dtc(DTC_APPS1_STP);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_STP_APPS2)
-    safing_store_dtc(DTC_APPS2_STP);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_STP_BRKF)
-    safing_store_dtc(DTC_BRKF_STP);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_STP_BRKR)
-    safing_store_dtc(DTC_BRKR_STP);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_STP_TPS)
-    safing_store_dtc(DTC_TPS_STP);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_STP_AUX)
-    safing_store_dtc(DTC_5VAUX_STP);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_OL_APPS1)
-    safing_store_dtc(DTC_APPS1_OPEN);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_OL_APPS2)
-    safing_store_dtc(DTC_APPS2_OPEN);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_OL_BRKF)
-    safing_store_dtc(DTC_BRKF_OPEN);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_OL_BRKR)
-    safing_store_dtc(DTC_BRKR_OPEN);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_OL_TPS1)
-    safing_store_dtc(DTC_TPS1_OPEN);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_OL_TPS2)
-    safing_store_dtc(DTC_TPS2_OPEN);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_OOC_TPS)
-    safing_store_dtc(DTC_TPS_OOC);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_OOC_APPS)
-    safing_store_dtc(DTC_APPS_OOC);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING1_DISARMING)
-    safing_store_internal_fault(FAULT_UNEXPECTED_DISARM_1);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING1_ASSERTING)
-    safing_store_internal_fault(FAULT_UNEXPECTED_SAFING_1);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING2_DISARMING)
-    safing_store_internal_fault(FAULT_UNEXPECTED_DISARM_2);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING2_ASSERTING)
-    safing_store_internal_fault(FAULT_UNEXPECTED_SAFING_2);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_OL_INTERNAL_FAULT)
-    safing_store_internal_fault(FAULT_OL_INTERNAL_FAULT);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING1_ALREADYARMED)
-    safing_store_internal_fault(FAULT_ALREADY_ARMED_1);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING2_ALREADYARMED)
-    safing_store_internal_fault(FAULT_ALREADY_ARMED_2);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING1_NOT_ASSERTED)
-    safing_store_internal_fault(FAULT_NOT_SAFING_1);
-  
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING2_NOT_ASSERTED)
-    safing_store_internal_fault(FAULT_NOT_SAFING_2);
+  /* Flags stay set once raised, so only the ones that appeared since the
+   * last signal need storing; each costs one table lookup. A flag may be
+   * raised by a glitch, so its DTC is only pending until it is raised
+   * again in a later keycycle.
+   */
   
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING1_ARM_FAILED)
-    safing_store_internal_fault(FAULT_ARM_FAILED_1);
+  newflags = flags & (flags ^ g_safing_seen_flags);
+  g_safing_seen_flags = flags;
   
-  if (g_safing_subscr.faultflags & SAFINGSIG_SAFING2_ARM_FAILED)
-    safing_store_internal_fault(FAULT_ARM_FAILED_2);
+  while (newflags != 0)
+  {
+    bit = __builtin_ctz(newflags);
+    newflags &= newflags - 1;
+    
+    action = &g_safingsig_actions[bit];
+    if (action->dtc != DTC_INVALID)
+    {
+      safing_report_dtc(action->dtc);
+    }
+    else if (action->fault != FAULT_INVALID)
+    {
+      safing_store_internal_fault(action->fault);
+    }
+  }
+}
+
+static int safing_dtc_index(uint16_t dtc)
+{
+  uint16_t letter = (dtc & DTC_LETTER_MASK) >> 14;
+  uint16_t number = (dtc & DTC_NUMBER_MASK) - g_dtc_block_base[letter];
   
-  if (g_safing_subscr.faultflags & SAFINGSIG_DRSBCK_STG)
-    safing_store_dtc(DTC_DRSBCK_STG);
+  if (number >= SAFING_DTC_BLOCK_SIZE)
+  {
+    return -1;
+  }
   
+  return letter * SAFING_DTC_BLOCK_SIZE + number;
 }
 
-static void copy_fault_entry(struct can_msg_s *dest, struct fault_entry_s *src)
+static uint32_t safing_time_ms(void)
 {
-  dest->cm_data[0] = (uint8_t)(src->fault_code >> 8);
-  dest->cm_data[1] = (uint8_t)(src->fault_code & 0xff);
-  dest->cm_data[2] = src->keycycle;
-  dest->cm_data[3] = (uint8_t)(src->time_ms >> 24);
-  dest->cm_data[4] = (uint8_t)(src->time_ms >> 16);
-  dest->cm_data[5] = (uint8_t)(src->time_ms >> 8);
-  dest->cm_data[6] = (uint8_t)(src->time_ms & 0xff);
+  struct timespec now;
+  
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
-static void safing_sigint_sigaction(int signo, siginfo_t *siginfo, void *context)
+static inline int safing_store_index(FAR struct safing_store_s *store,
+                                     uint16_t code)
 {
-
+  return store->log_type == FAULTLOG_TYPE_DTC ? safing_dtc_index(code) : code;
 }
 
-/****************************************************************************
- * Public Functions
- ****************************************************************************/
-
-/****************************************************************************
- * Name: main
- *
- * Description:
- *   Entry point for the ETCetera daemon. Starts a task to run NuttShell then
- *   continues on.
- *
- ****************************************************************************/
+/* Whole keycycles gone by since an entry last occurred */
 
-int main(int argc, char **argv)
+static inline uint16_t safing_entry_clean_cycles(uint32_t status)
 {
-  mqd_t txmq;
-  struct can_msg_s txmsg = {{0}};
-  const struct mq_attr canmq_attr =
-    { .mq_maxmsg = 3, .mq_msgsize = sizeof(txmsg) };
-  
-  txmq = mq_open(CAN_SAFING_TX_MQUEUE_NAME, O_RDWR | O_CREAT | O_NONBLOCK, 0600, &canmq_attr);
-  
-  txmsg.cm_hdr.ch_extid = true;
-  txmsg.cm_hdr.ch_dlc = 8;
+  uint16_t elapsed = g_safing_keycycle - SAFING_ENTRY_LAST_KEYCYCLE(status);
   
-  timer_create(CLOCK_REALTIME, &g_retry_5v0lin_sense_event, &g_retry_5v0lin_sense_timer);
-  safing_arm();
-
-  int16_t *brk_f_value;
-  int16_t *brk_r_value;
-  int16_t *ws1;
-  int16_t *ws2;
-  int16_t *ws3;
-  int16_t *ws4;
-  int16_t *button_states;
+  return elapsed > 0 ? elapsed - 1 : 0;
+}
 
-  struct sigaction sigint_action =
+/* Replacement order of an entry: lower ranks go first, and within a rank,
+ * entries with fewer occurrences, then those that last occurred longest
+ * ago.
+ */
+
+static inline uint32_t safing_entry_rank(uint32_t status)
+{
+  return ((uint32_t)g_safing_entry_rank[SAFING_ENTRY_STATE(status)] << 24)
+         | (SAFING_ENTRY_COUNT(status) << 16)
+         | (0xffff - safing_entry_clean_cycles(status));
+}
+
+static inline bool safing_entry_lock(FAR struct fault_entry_s *entry,
+                                     FAR uint32_t *seq)
+{
+  *seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+  return (*seq & 1) == 0
+         && __atomic_compare_exchange_n(&entry->seq, seq, *seq + 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void safing_entry_unlock(FAR struct fault_entry_s *entry,
+                                       uint32_t seq)
+{
+  __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Copies an entry if it is stable. Never waits for a writer. */
+
+static bool safing_entry_copy(FAR struct fault_entry_s *entry,
+                              FAR struct fault_entry_s *copy)
+{
+  uint32_t seq;
+  int tries;
+  
+  for (tries = 0; tries < SAFING_ENTRY_READ_RETRIES; ++tries)
+  {
+    seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) != 0)
+    {
+      return false;
+    }
+    
+    *copy = *entry;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq)
+    {
+      return copy->status != SAFING_ENTRY_EMPTY;
+    }
+  }
+  
+  return false;
+}
+
+/* Empties a slot whose seq the caller holds */
+
+static void safing_entry_remove(FAR struct safing_store_s *store, int slot)
+{
+  FAR struct fault_entry_s *entry = &store->entries[slot];
+  int index = safing_store_index(store, entry->fault_code);
+  
+  __atomic_fetch_and(&store->valid, ~(1u << slot), __ATOMIC_RELEASE);
+  __atomic_fetch_and(&store->present[index / 32], ~(1u << (index % 32)),
+                     __ATOMIC_RELEASE);
+  entry->status = SAFING_ENTRY_EMPTY;
+}
+
+/* Queues an entry to be written to the fault log */
+
+static void safing_entry_changed(FAR struct safing_store_s *store, int slot)
+{
+  __atomic_fetch_and(&store->logged, ~(1u << slot), __ATOMIC_RELEASE);
+  sem_post(&g_faultlog_sem);
+}
+
+/* Takes the seq of a slot for a new entry in the given state: an empty one
+ * if there is any, otherwise the lowest ranked entry below it, which is
+ * removed. Returns the slot, or -1 if every entry ranks at least as high
+ * or is being written.
+ */
+
+static int safing_claim_slot(FAR struct safing_store_s *store, uint8_t state,
+                             FAR uint32_t *seq)
+{
+  FAR struct fault_entry_s *entry;
+  uint32_t rank = (uint32_t)g_safing_entry_rank[state] << 24;
+  uint32_t victim_rank;
+  uint32_t valid;
+  int victim = -1;
+  int slot;
+  
+  valid = __atomic_load_n(&store->valid, __ATOMIC_ACQUIRE);
+  for (slot = 0; slot < store->nentries; ++slot)
+  {
+    entry = &store->entries[slot];
+    if ((valid & (1u << slot)) != 0)
+    {
+      victim_rank = safing_entry_rank(entry->status);
+      if (victim_rank < rank)
+      {
+        victim = slot;
+        rank = victim_rank;
+      }
+    }
+    else if (safing_entry_lock(entry, seq))
+    {
+      if (entry->status == SAFING_ENTRY_EMPTY)
+      {
+        return slot;
+      }
+      
+      safing_entry_unlock(entry, *seq);
+    }
+  }
+  
+  /* The victim may have changed since it was picked */
+  
+  if (victim >= 0 && safing_entry_lock(&store->entries[victim], seq))
+  {
+    entry = &store->entries[victim];
+    if ((__atomic_load_n(&store->valid, __ATOMIC_ACQUIRE)
+         & (1u << victim)) != 0
+        && safing_entry_rank(entry->status) == rank)
+    {
+      safing_entry_remove(store, victim);
+      return victim;
+    }
+    
+    safing_entry_unlock(entry, *seq);
+  }
+  
+  return -1;
+}
+
+/* Takes the seq of the entry holding a code. Returns its slot, or -1 if
+ * the code is not stored (any more) or its entry is being written.
+ */
+
+static int safing_lock_entry(FAR struct safing_store_s *store, int index,
+                             uint16_t code, FAR uint32_t *seq)
+{
+  FAR struct fault_entry_s *entry;
+  uint8_t slot = store->slot_of[index];
+  
+  if (slot >= store->nentries)
+  {
+    return -1;
+  }
+  
+  entry = &store->entries[slot];
+  if (!safing_entry_lock(entry, seq))
+  {
+    return -1;
+  }
+  
+  if ((__atomic_load_n(&store->valid, __ATOMIC_ACQUIRE) & (1u << slot)) == 0
+      || entry->fault_code != code)
+  {
+    safing_entry_unlock(entry, *seq);
+    return -1;
+  }
+  
+  return slot;
+}
+
+/* Records an occurrence of a code: stores a new entry, pending unless
+ * confirm is set, or counts it against the entry already stored. Entries
+ * are queued for the fault log when they change state or first occur in a
+ * keycycle. Never blocks, so it may be called from signal handlers and any
+ * number of tasks at once; an occurrence racing with another write to the
+ * same entry is counted as lost.
+ *
+ * Returns the entry's state if it was stored or changed state, 0 if the
+ * occurrence was only counted, or -1 if it was lost.
+ */
+
+static int safing_record(FAR struct safing_store_s *store, int index,
+                         uint16_t code, bool confirm, uint32_t now_ms)
+{
+  FAR struct fault_entry_s *entry;
+  uint16_t keycycle = g_safing_keycycle;
+  uint32_t bit = 1u << (index % 32);
+  uint32_t status;
+  uint32_t seq;
+  uint8_t state;
+  uint8_t count;
+  int slot;
+  int tries;
+  
+  /* A second try is only needed when the entry was removed in between */
+  
+  for (tries = 0; tries < 2; ++tries)
+  {
+    if ((__atomic_fetch_or(&store->present[index / 32], bit, __ATOMIC_ACQ_REL)
+         & bit) == 0)
+    {
+      state = confirm ? SAFING_ENTRY_CONFIRMED : SAFING_ENTRY_PENDING;
+      slot = safing_claim_slot(store, state, &seq);
+      if (slot < 0)
+      {
+        __atomic_fetch_and(&store->present[index / 32], ~bit,
+                           __ATOMIC_RELEASE);
+        break;
+      }
+      
+      entry = &store->entries[slot];
+      entry->fault_code = code;
+      entry->first_keycycle = keycycle;
+      entry->first_ms = now_ms;
+      entry->last_ms = now_ms;
+      entry->status = SAFING_ENTRY_STATUS(state, 1, keycycle);
+      store->slot_of[index] = slot;
+      __atomic_fetch_or(&store->valid, 1u << slot, __ATOMIC_RELEASE);
+      safing_entry_unlock(entry, seq);
+      safing_entry_changed(store, slot);
+      return state;
+    }
+    
+    slot = safing_lock_entry(store, index, code, &seq);
+    if (slot < 0)
+    {
+      continue;
+    }
+    
+    entry = &store->entries[slot];
+    status = entry->status;
+    state = SAFING_ENTRY_STATE(status);
+    if (confirm || state == SAFING_ENTRY_HEALED
+        || SAFING_ENTRY_LAST_KEYCYCLE(status) != keycycle)
+    {
+      state = SAFING_ENTRY_CONFIRMED;
+    }
+    
+    count = SAFING_ENTRY_COUNT(status);
+    count += count < SAFING_ENTRY_MAX_COUNT;
+    entry->last_ms = now_ms;
+    entry->status = SAFING_ENTRY_STATUS(state, count, keycycle);
+    safing_entry_unlock(entry, seq);
+    
+    if (state != SAFING_ENTRY_STATE(status)
+        || SAFING_ENTRY_LAST_KEYCYCLE(status) != keycycle)
+    {
+      safing_entry_changed(store, slot);
+    }
+    
+    return state != SAFING_ENTRY_STATE(status) ? state : 0;
+  }
+  
+  __atomic_fetch_add(&store->lost, 1, __ATOMIC_RELAXED);
+  return -1;
+}
+
+/* Copies the stored entry for a code. Returns false if it is not stored
+ * or is being written.
+ */
+
+static bool safing_read_entry(FAR struct safing_store_s *store, int index,
+                              uint16_t code, FAR struct fault_entry_s *copy)
+{
+  uint8_t slot;
+  
+  if (index < 0)
+  {
+    return false;
+  }
+  
+  slot = store->slot_of[index];
+  return slot < store->nentries
+         && (__atomic_load_n(&store->valid, __ATOMIC_ACQUIRE)
+             & (1u << slot)) != 0
+         && safing_entry_copy(&store->entries[slot], copy)
+         && copy->fault_code == code;
+}
+
+static void safing_record_dtc(uint16_t dtc, bool confirm)
+{
+  uint32_t now_ms;
+  int index;
+  
+  if (dtc == DTC_INVALID)
+  {
+    return;
+  }
+  
+  index = safing_dtc_index(dtc);
+  if (index < 0)
+  {
+    __atomic_fetch_add(&g_dtc_table.lost, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  
+  now_ms = safing_time_ms();
+  if (safing_record(&g_dtc_table, index, dtc, confirm, now_ms) > 0)
+  {
+    freeze_capture(dtc, g_safing_keycycle, now_ms);
+  }
+}
+
+#ifdef CONFIG_INDUSTRY_ETCETERA_FAULTLOG
+/* Starts a keycycle for a table: heals the confirmed entries and removes
+ * the healed and pending ones that have gone long enough without occurring.
+ * Removals are not logged, since replaying the log ages the entries the
+ * same way.
+ */
+
+static void safing_store_age(FAR struct safing_store_s *store)
+{
+  FAR struct fault_entry_s *entry;
+  uint32_t valid;
+  uint32_t status;
+  uint32_t seq;
+  uint16_t clean;
+  int slot;
+  
+  valid = __atomic_load_n(&store->valid, __ATOMIC_ACQUIRE);
+  for (; valid != 0; valid &= valid - 1)
+  {
+    slot = __builtin_ctz(valid);
+    entry = &store->entries[slot];
+    if (!safing_entry_lock(entry, &seq))
+    {
+      continue;
+    }
+    
+    status = entry->status;
+    clean = safing_entry_clean_cycles(status);
+    if (SAFING_ENTRY_STATE(status) == SAFING_ENTRY_CONFIRMED)
+    {
+      if (clean >= SAFING_DTC_HEAL_CYCLES)
+      {
+        entry->status = SAFING_ENTRY_STATUS(SAFING_ENTRY_HEALED,
+                                            SAFING_ENTRY_COUNT(status),
+                                            SAFING_ENTRY_LAST_KEYCYCLE(status));
+        safing_entry_unlock(entry, seq);
+        safing_entry_changed(store, slot);
+        continue;
+      }
+    }
+    else if (clean >= SAFING_DTC_AGING_CYCLES)
+    {
+      safing_entry_remove(store, slot);
+    }
+    
+    safing_entry_unlock(entry, seq);
+  }
+}
+
+/* Appends an entry as two records: its first occurrence with its state and
+ * count, then its latest occurrence.
+ */
+
+static int safing_faultlog_put_entry(FAR struct faultlog_s *log,
+                                     FAR struct safing_store_s *store,
+                                     FAR const struct fault_entry_s *entry)
+{
+  struct faultlog_record_s rec;
+  int ret;
+  
+  rec.type = store->log_type;
+  rec.status = SAFING_ENTRY_STATE(entry->status);
+  rec.code = entry->fault_code;
+  rec.keycycle = entry->first_keycycle;
+  rec.count = SAFING_ENTRY_COUNT(entry->status);
+  rec.time_ms = entry->first_ms;
+  ret = faultlog_append(log, &rec);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  
+  rec.type = store->last_log_type;
+  rec.keycycle = SAFING_ENTRY_LAST_KEYCYCLE(entry->status);
+  rec.time_ms = entry->last_ms;
+  return faultlog_append(log, &rec);
+}
+
+/* Writes out the entries of a table that are new or changed since they
+ * were last logged. Stops at the first failure; the rest are retried on
+ * the next wakeup.
+ */
+
+static int safing_faultlog_flush(FAR struct safing_store_s *store)
+{
+  struct fault_entry_s copy;
+  uint32_t pending;
+  uint32_t bit;
+  int ret;
+  
+  pending = __atomic_load_n(&store->valid, __ATOMIC_ACQUIRE)
+            & ~__atomic_load_n(&store->logged, __ATOMIC_ACQUIRE);
+  for (; pending != 0; pending &= pending - 1)
+  {
+    /* Marked before copying, so that a change made meanwhile marks the
+     * entry for logging again.
+     */
+    
+    bit = pending & -pending;
+    __atomic_fetch_or(&store->logged, bit, __ATOMIC_ACQ_REL);
+    if (!safing_entry_copy(&store->entries[__builtin_ctz(bit)], &copy))
+    {
+      __atomic_fetch_and(&store->logged, ~bit, __ATOMIC_RELEASE);
+      continue;
+    }
+    
+    ret = safing_faultlog_put_entry(&g_faultlog, store, &copy);
+    if (ret < 0)
+    {
+      __atomic_fetch_and(&store->logged, ~bit, __ATOMIC_RELEASE);
+      return ret;
+    }
+  }
+  
+  return OK;
+}
+
+static int safing_faultlog_snapshot_store(FAR struct faultlog_s *log,
+                                          FAR struct safing_store_s *store)
+{
+  struct fault_entry_s copy;
+  uint32_t logged;
+  int ret;
+  
+  logged = __atomic_load_n(&store->valid, __ATOMIC_ACQUIRE)
+           & __atomic_load_n(&store->logged, __ATOMIC_ACQUIRE);
+  for (; logged != 0; logged &= logged - 1)
+  {
+    if (!safing_entry_copy(&store->entries[__builtin_ctz(logged)], &copy))
+    {
+      continue;
+    }
+    
+    ret = safing_faultlog_put_entry(log, store, &copy);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+  
+  return OK;
+}
+
+static int safing_faultlog_snapshot(FAR struct faultlog_s *log, FAR void *arg)
+{
+  int ret;
+  
+  ret = safing_faultlog_snapshot_store(log, &g_dtc_table);
+  if (ret == OK)
+  {
+    ret = safing_faultlog_snapshot_store(log, &g_fault_table);
+  }
+  
+  return ret;
+}
+
+/* Brings back an entry from its records. Later records for a code replace
+ * what earlier ones restored. Records from before entries had a state are
+ * restored as confirmed.
+ */
+
+static void safing_faultlog_restore(FAR struct safing_store_s *store,
+                                    int index,
+                                    FAR const struct faultlog_record_s *rec)
+{
+  FAR struct fault_entry_s *entry;
+  uint32_t bit = 1u << (index % 32);
+  uint32_t status;
+  uint32_t seq;
+  uint8_t state;
+  int slot;
+  
+  state = rec->status & 0x3;
+  if (state == SAFING_ENTRY_EMPTY)
+  {
+    state = SAFING_ENTRY_CONFIRMED;
+  }
+  
+  if (rec->type == store->last_log_type)
+  {
+    slot = safing_lock_entry(store, index, rec->code, &seq);
+    if (slot >= 0)
+    {
+      entry = &store->entries[slot];
+      status = entry->status;
+      entry->last_ms = rec->time_ms;
+      entry->status = SAFING_ENTRY_STATUS(SAFING_ENTRY_STATE(status),
+                                          SAFING_ENTRY_COUNT(status),
+                                          rec->keycycle);
+      safing_entry_unlock(entry, seq);
+    }
+    
+    return;
+  }
+  
+  if ((__atomic_fetch_or(&store->present[index / 32], bit, __ATOMIC_ACQ_REL)
+       & bit) == 0)
+  {
+    slot = safing_claim_slot(store, state, &seq);
+    if (slot < 0)
+    {
+      __atomic_fetch_and(&store->present[index / 32], ~bit, __ATOMIC_RELEASE);
+      __atomic_fetch_add(&store->lost, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  else
+  {
+    slot = safing_lock_entry(store, index, rec->code, &seq);
+    if (slot < 0)
+    {
+      return;
+    }
+  }
+  
+  entry = &store->entries[slot];
+  entry->fault_code = rec->code;
+  entry->first_keycycle = rec->keycycle;
+  entry->first_ms = rec->time_ms;
+  entry->last_ms = rec->time_ms;
+  entry->status = SAFING_ENTRY_STATUS(state, rec->count > 0 ? rec->count : 1,
+                                      rec->keycycle);
+  store->slot_of[index] = slot;
+  __atomic_fetch_or(&store->valid, 1u << slot, __ATOMIC_RELEASE);
+  __atomic_fetch_or(&store->logged, 1u << slot, __ATOMIC_RELEASE);
+  safing_entry_unlock(entry, seq);
+}
+
+static void safing_faultlog_replay(FAR const struct faultlog_record_s *rec,
+                                   FAR void *arg)
+{
+  int index;
+  
+  switch (rec->type)
+  {
+    /* Ages what is restored so far as it was aged when that keycycle
+     * started, so that entries removed then do not take slots from the
+     * entries that replaced them.
+     */
+    
+    case FAULTLOG_TYPE_BOOT:
+      if ((int16_t)(rec->keycycle - g_safing_keycycle) > 0)
+      {
+        g_safing_keycycle = rec->keycycle;
+        safing_store_age(&g_dtc_table);
+        safing_store_age(&g_fault_table);
+      }
+      break;
+    
+    case FAULTLOG_TYPE_DTC:
+    case FAULTLOG_TYPE_DTC_LAST:
+      index = rec->code != DTC_INVALID ? safing_dtc_index(rec->code) : -1;
+      if (index >= 0)
+      {
+        safing_faultlog_restore(&g_dtc_table, index, rec);
+      }
+      break;
+    
+    case FAULTLOG_TYPE_FAULT:
+    case FAULTLOG_TYPE_FAULT_LAST:
+      if (rec->code != FAULT_INVALID && rec->code < SAFING_FAULT_INDICES)
+      {
+        safing_faultlog_restore(&g_fault_table, rec->code, rec);
+      }
+      break;
+  }
+}
+
+static FAR void *safing_faultlog_thread(FAR void *arg)
+{
+  while (true)
+  {
+    if (sem_wait(&g_faultlog_sem) < 0)
+    {
+      continue;
+    }
+    
+    if (safing_faultlog_flush(&g_dtc_table) < 0
+        || safing_faultlog_flush(&g_fault_table) < 0)
+    {
+      safing_store_internal_fault(FAULT_FAULTLOG_FAILED);
+    }
+  }
+  
+  return NULL;
+}
+
+/* Restores the stored entries from the log, starts a new keycycle, ages
+ * the entries and starts the thread that logs new entries. Without a
+ * working log the tables are simply not persistent, and never age.
+ */
+
+static void safing_faultlog_start(void)
+{
+  struct sched_param param;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int fd;
+  int ret;
+  
+  fd = open(SAFING_FAULTLOG_PATH, O_RDWR);
+  if (fd < 0)
+  {
+    safing_store_internal_fault(FAULT_FAULTLOG_FAILED);
+    return;
+  }
+  
+  ret = faultlog_open(&g_faultlog, &g_faultlog_fd_ops, (FAR void *)(intptr_t)fd,
+                      SAFING_FAULTLOG_SECTORS, SAFING_FAULTLOG_SECTOR_SIZE,
+                      safing_faultlog_replay, safing_faultlog_snapshot, NULL);
+  if (ret == OK)
+  {
+    ret = faultlog_start_keycycle(&g_faultlog, safing_time_ms());
+  }
+  
+  g_safing_keycycle = g_faultlog.keycycle;
+  if (ret < 0)
+  {
+    close(fd);
+    safing_store_internal_fault(FAULT_FAULTLOG_FAILED);
+    return;
+  }
+  
+  safing_store_age(&g_dtc_table);
+  safing_store_age(&g_fault_table);
+  
+  pthread_attr_init(&attr);
+  param.sched_priority = SAFING_FAULTLOG_PRIORITY;
+  pthread_attr_setschedparam(&attr, &param);
+  if (pthread_create(&thread, &attr, safing_faultlog_thread, NULL) != 0)
+  {
+    safing_store_internal_fault(FAULT_FAULTLOG_FAILED);
+    return;
+  }
+  
+  /* Log anything stored before the thread was running */
+  
+  sem_post(&g_faultlog_sem);
+}
+#endif
+
+static void copy_fault_entry(FAR uint8_t *dest, struct fault_entry_s *src)
+{
+  fault_code_pack(dest, src->fault_code);
+  fault_keycycle_pack(dest, src->first_keycycle);
+  fault_time_ms_pack(dest, src->first_ms);
+}
+
+static bool safing_pack_wheel_speed(FAR struct can_msg_s *msg, FAR void *arg)
+{
+  ws_ws1_pack(msg->cm_data, *g_ws1);
+  ws_ws2_pack(msg->cm_data, *g_ws2);
+  ws_ws3_pack(msg->cm_data, *g_ws3);
+  ws_ws4_pack(msg->cm_data, *g_ws4);
+  return true;
+}
+
+static bool safing_pack_brake(FAR struct can_msg_s *msg, FAR void *arg)
+{
+  brake_front_pack(msg->cm_data, *g_brk_f_value);
+  brake_rear_pack(msg->cm_data, *g_brk_r_value);
+  return true;
+}
+
+/* 1 if both channels are present and differ by more than tol */
+
+static inline uint32_t safing_plaus_ooc(int32_t a, int32_t b, int32_t tol)
+{
+  int32_t diff = a - b;
+  
+  return (a != FREEZE_VALUE_NONE) & (b != FREEZE_VALUE_NONE)
+         & ((diff > tol) | (diff < -tol));
+}
+
+static int safing_diag_negative(FAR uint8_t *resp, uint8_t sid, uint8_t nrc)
+{
+  resp[0] = UDS_NEGATIVE_RESPONSE;
+  resp[1] = sid;
+  resp[2] = nrc;
+  return 3;
+}
+
+static inline void safing_diag_put_dtc(FAR uint8_t *dest, uint16_t dtc)
+{
+  /* 3-byte UDS DTC: the 2-byte code and a failure type byte of 0 */
+
+  dest[0] = dtc >> 8;
+  dest[1] = dtc & 0xff;
+  dest[2] = 0;
+}
+
+static uint8_t safing_diag_dtc_status(uint32_t status)
+{
+  uint8_t uds = g_safing_entry_uds_status[SAFING_ENTRY_STATE(status)];
+  
+  if (SAFING_ENTRY_LAST_KEYCYCLE(status) == g_safing_keycycle)
+  {
+    uds |= UDS_DTC_STATUS_TEST_FAILED | UDS_DTC_STATUS_FAILED_THIS_CYCLE;
+  }
+  
+  return uds;
+}
+
+/* An occurrence record: the low byte of the keycycle, then the time */
+
+static int safing_diag_put_occurrence(FAR uint8_t *resp, int n,
+                                      uint8_t record, uint16_t keycycle,
+                                      uint32_t time_ms)
+{
+  resp[n++] = record;
+  resp[n++] = keycycle & 0xff;
+  resp[n++] = time_ms >> 24;
+  resp[n++] = time_ms >> 16;
+  resp[n++] = time_ms >> 8;
+  resp[n++] = time_ms & 0xff;
+  return n;
+}
+
+/* Handles ReadDTCInformation. All stored DTCs fit in one response, so the
+ * tester gets the whole table from a single request.
+ */
+
+static int safing_diag_read_dtc_info(FAR const uint8_t *req, int len,
+                                     FAR uint8_t *resp)
+{
+  struct fault_entry_s entry;
+  struct freeze_frame_s frame;
+  uint16_t did;
+  uint16_t dtc;
+  uint16_t count = 0;
+  uint16_t clean;
+  uint32_t valid;
+  uint8_t status;
+  uint8_t mask;
+  uint8_t record;
+  bool found = false;
+  int n = 3;
+  int i;
+
+  if (len < 2)
+  {
+    return safing_diag_negative(resp, req[0], UDS_NRC_INCORRECT_LENGTH);
+  }
+
+  resp[0] = req[0] + UDS_POSITIVE_RESPONSE;
+  resp[1] = req[1] & ~UDS_SUPPRESS_POS_RESPONSE;
+  resp[2] = UDS_DTC_STATUS_AVAILABILITY;
+
+  switch (resp[1])
+  {
+    case UDS_DTC_NUMBER_BY_STATUS_MASK:
+    case UDS_DTC_BY_STATUS_MASK:
+      if (len != 3)
+      {
+        return safing_diag_negative(resp, req[0], UDS_NRC_INCORRECT_LENGTH);
+      }
+
+      mask = req[2] & UDS_DTC_STATUS_AVAILABILITY;
+      valid = __atomic_load_n(&g_dtc_table.valid, __ATOMIC_ACQUIRE);
+      for (; valid != 0; valid &= valid - 1)
+      {
+        if (!safing_entry_copy(&g_dtc_entries[__builtin_ctz(valid)], &entry))
+        {
+          continue;
+        }
+
+        status = safing_diag_dtc_status(entry.status);
+        if ((status & mask) == 0)
+        {
+          continue;
+        }
+
+        ++count;
+        if (resp[1] == UDS_DTC_BY_STATUS_MASK)
+        {
+          safing_diag_put_dtc(&resp[n], entry.fault_code);
+          resp[n + 3] = status;
+          n += 4;
+        }
+      }
+
+      if (resp[1] == UDS_DTC_NUMBER_BY_STATUS_MASK)
+      {
+        resp[3] = UDS_DTC_FORMAT_ISO14229;
+        resp[4] = count >> 8;
+        resp[5] = count & 0xff;
+        n = 6;
+      }
+      break;
+
+    case UDS_DTC_EXT_DATA_BY_DTC:
+      if (len != 6)
+      {
+        return safing_diag_negative(resp, req[0], UDS_NRC_INCORRECT_LENGTH);
+      }
+
+      dtc = (req[2] << 8) | req[3];
+      record = req[5];
+      if (dtc != DTC_INVALID)
+      {
+        found = safing_read_entry(&g_dtc_table, safing_dtc_index(dtc), dtc,
+                                  &entry);
+      }
+
+      if (!found || req[4] != 0
+          || ((record < UDS_DTC_EXT_RECORD_FIRST
+               || record > UDS_DTC_EXT_RECORD_COUNTERS)
+              && record != UDS_DTC_EXT_RECORD_ALL))
+      {
+        return safing_diag_negative(resp, req[0],
+                                    UDS_NRC_REQUEST_OUT_OF_RANGE);
+      }
+
+      safing_diag_put_dtc(&resp[2], dtc);
+      resp[5] = safing_diag_dtc_status(entry.status);
+      n = 6;
+      if (record == UDS_DTC_EXT_RECORD_FIRST
+          || record == UDS_DTC_EXT_RECORD_ALL)
+      {
+        n = safing_diag_put_occurrence(resp, n, UDS_DTC_EXT_RECORD_FIRST,
+                                       entry.first_keycycle, entry.first_ms);
+      }
+
+      if (record == UDS_DTC_EXT_RECORD_LAST
+          || record == UDS_DTC_EXT_RECORD_ALL)
+      {
+        n = safing_diag_put_occurrence(resp, n, UDS_DTC_EXT_RECORD_LAST,
+                                       SAFING_ENTRY_LAST_KEYCYCLE(entry.status),
+                                       entry.last_ms);
+      }
+
+      if (record == UDS_DTC_EXT_RECORD_COUNTERS
+          || record == UDS_DTC_EXT_RECORD_ALL)
+      {
+        clean = safing_entry_clean_cycles(entry.status);
+        resp[n++] = UDS_DTC_EXT_RECORD_COUNTERS;
+        resp[n++] = SAFING_ENTRY_COUNT(entry.status);
+        resp[n++] = clean < 0xff ? clean : 0xff;
+      }
+      break;
+
+    case UDS_DTC_SNAPSHOT_BY_DTC:
+      if (len != 6)
+      {
+        return safing_diag_negative(resp, req[0], UDS_NRC_INCORRECT_LENGTH);
+      }
+
+      dtc = (req[2] << 8) | req[3];
+      if (dtc != DTC_INVALID)
+      {
+        found = safing_read_entry(&g_dtc_table, safing_dtc_index(dtc), dtc,
+                                  &entry);
+      }
+
+      if (!found || req[4] != 0
+          || (req[5] != UDS_DTC_SNAPSHOT_RECORD
+              && req[5] != UDS_DTC_SNAPSHOT_RECORD_ALL))
+      {
+        return safing_diag_negative(resp, req[0],
+                                    UDS_NRC_REQUEST_OUT_OF_RANGE);
+      }
+
+      safing_diag_put_dtc(&resp[2], dtc);
+      resp[5] = safing_diag_dtc_status(entry.status);
+      n = 6;
+
+      /* A DTC from an earlier keycycle, or whose frame has been evicted,
+       * is reported without a record.
+       */
+
+      if (freeze_read(dtc, &frame))
+      {
+        resp[n++] = UDS_DTC_SNAPSHOT_RECORD;
+        resp[n++] = FREEZE_NUM_CHANNELS;
+        for (i = 0; i < FREEZE_NUM_CHANNELS; ++i)
+        {
+          did = SAFING_DID_FREEZE_BASE + i;
+          resp[n++] = did >> 8;
+          resp[n++] = did & 0xff;
+          resp[n++] = (uint16_t)frame.values[i] >> 8;
+          resp[n++] = frame.values[i] & 0xff;
+        }
+      }
+      break;
+
+    default:
+      return safing_diag_negative(resp, req[0],
+                                  UDS_NRC_SUBFUNCTION_NOT_SUPPORTED);
+  }
+
+  return (req[1] & UDS_SUPPRESS_POS_RESPONSE) ? 0 : n;
+}
+
+/* Appends the stored entries of a table as a count and one record each.
+ * Returns the new response length, or -1 if it would not fit.
+ */
+
+static int safing_diag_put_table(FAR uint8_t *resp, int n,
+                                 FAR struct safing_store_s *store)
+{
+  struct fault_entry_s entry;
+  uint32_t valid;
+  int count_idx = n++;
+
+  resp[count_idx] = 0;
+  valid = __atomic_load_n(&store->valid, __ATOMIC_ACQUIRE);
+  for (; valid != 0; valid &= valid - 1)
+  {
+    if (!safing_entry_copy(&store->entries[__builtin_ctz(valid)], &entry))
+    {
+      continue;
+    }
+
+    if (n + SAFING_ENTRY_RECORD_LEN > ISOTP_MAX_PAYLOAD)
+    {
+      return -1;
+    }
+
+    copy_fault_entry(&resp[n], &entry);
+    n += SAFING_ENTRY_RECORD_LEN;
+    ++resp[count_idx];
+  }
+
+  return n;
+}
+
+static int safing_diag_read_data_by_id(FAR const uint8_t *req, int len,
+                                       FAR uint8_t *resp)
+{
+  uint16_t did;
+  int n = 1;
+  int i;
+
+  if (len < 3 || (len - 1) % 2 != 0)
+  {
+    return safing_diag_negative(resp, req[0], UDS_NRC_INCORRECT_LENGTH);
+  }
+
+  resp[0] = req[0] + UDS_POSITIVE_RESPONSE;
+
+  for (i = 1; i < len; i += 2)
+  {
+    did = (req[i] << 8) | req[i + 1];
+    if (n + 2 > ISOTP_MAX_PAYLOAD)
+    {
+      return safing_diag_negative(resp, req[0], UDS_NRC_RESPONSE_TOO_LONG);
+    }
+
+    resp[n++] = req[i];
+    resp[n++] = req[i + 1];
+
+    switch (did)
+    {
+      case SAFING_DID_DTC_TABLE:
+        n = safing_diag_put_table(resp, n, &g_dtc_table);
+        break;
+
+      case SAFING_DID_FAULT_TABLE:
+        n = safing_diag_put_table(resp, n, &g_fault_table);
+        break;
+
+      default:
+        return safing_diag_negative(resp, req[0],
+                                    UDS_NRC_REQUEST_OUT_OF_RANGE);
+    }
+
+    if (n < 0)
+    {
+      return safing_diag_negative(resp, req[0], UDS_NRC_RESPONSE_TOO_LONG);
+    }
+  }
+
+  return n;
+}
+
+/* Returns the length of the response to a request, 0 if none is sent */
+
+static int safing_diag_handle(FAR const uint8_t *req, int len,
+                              FAR uint8_t *resp)
+{
+  switch (req[0])
+  {
+    case UDS_SID_READ_DTC_INFO:
+      return safing_diag_read_dtc_info(req, len, resp);
+
+    case UDS_SID_READ_DATA_BY_ID:
+      return safing_diag_read_data_by_id(req, len, resp);
+
+    default:
+      return safing_diag_negative(resp, req[0],
+                                  UDS_NRC_SERVICE_NOT_SUPPORTED);
+  }
+}
+
+/* Runs the diagnostic link for one tick of the safing loop: feeds received
+ * frames to ISO-TP, answers a completed request, and sends the next frames
+ * of a segmented response. The response is built straight into the link's
+ * tx buffer, so requests that arrive while one is still being sent are
+ * ignored; the tester will time out and repeat them.
+ */
+
+static void safing_diag_poll(uint32_t now_ms)
+{
+  struct can_msg_s rxmsg;
+  int len;
+
+  while (mq_receive(g_diag_rxmq, (FAR char *)&rxmsg, sizeof(rxmsg), NULL) >= 0)
+  {
+    len = isotp_receive(&g_diag_link, &rxmsg, now_ms);
+    if (len > 0 && g_diag_response_len == 0
+        && g_diag_link.tx_state == ISOTP_TX_IDLE)
+    {
+      g_diag_response_len = safing_diag_handle(g_diag_link.rxbuf, len,
+                                               g_diag_link.txbuf);
+    }
+  }
+
+  if (g_diag_response_len > 0
+      && isotp_send(&g_diag_link, g_diag_response_len, now_ms) != -EAGAIN)
+  {
+    g_diag_response_len = 0;
+  }
+
+  isotp_poll(&g_diag_link, now_ms);
+}
+
+static void safing_sigint_sigaction(int signo, siginfo_t *siginfo, void *context)
+{
+
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: main
+ *
+ * Description:
+ *   Entry point for the ETCetera daemon. Starts a task to run NuttShell then
+ *   continues on.
+ *
+ ****************************************************************************/
+
+int main(int argc, char **argv)
+{
+  uint32_t now_ms;
+  const struct mq_attr diagmq_attr =
+    { .mq_maxmsg = 3, .mq_msgsize = sizeof(struct can_msg_s) };
+  
+  /* Bring back the entries stored in earlier keycycles before arming, which
+   * may store new ones.
+   */
+  
+#ifdef CONFIG_INDUSTRY_ETCETERA_FAULTLOG
+  safing_faultlog_start();
+#endif
+  
+  int16_t *button_states;
+
+  struct sigaction sigint_action =
   {
     .sa_sigaction = safing_sigint_sigaction,
     .sa_flags     = SA_SIGINFO
@@ -376,122 +2039,295 @@ int main(int argc, char **argv)
   struct chan_subscription_s brk_subscription;
   brk_subscription.tid = gettid();
   
-  brk_subscription.ptr = &brk_f_value;
+  brk_subscription.ptr = &g_brk_f_value;
   boardctl(BOARDIOC_BRK_F_SUBSCRIBE, (uintptr_t)&brk_subscription);
   
-  brk_subscription.ptr = &brk_r_value;
+  brk_subscription.ptr = &g_brk_r_value;
   boardctl(BOARDIOC_BRK_R_SUBSCRIBE, (uintptr_t)&brk_subscription);
   
-  boardctl(BOARDIOC_WS1_SUBSCRIBE, (uintptr_t)&ws1);
-  boardctl(BOARDIOC_WS2_SUBSCRIBE, (uintptr_t)&ws2);
-  boardctl(BOARDIOC_WS3_SUBSCRIBE, (uintptr_t)&ws3);
-  boardctl(BOARDIOC_WS4_SUBSCRIBE, (uintptr_t)&ws4);
+  struct chan_subscription_s apps_subscription;
+  apps_subscription.tid = gettid();
+  
+  apps_subscription.ptr = &g_apps1;
+  boardctl(BOARDIOC_APPS1_SUBSCRIBE, (uintptr_t)&apps_subscription);
+  
+  apps_subscription.ptr = &g_apps2;
+  boardctl(BOARDIOC_APPS2_SUBSCRIBE, (uintptr_t)&apps_subscription);
+  
+  boardctl(BOARDIOC_WS1_SUBSCRIBE, (uintptr_t)&g_ws1);
+  boardctl(BOARDIOC_WS2_SUBSCRIBE, (uintptr_t)&g_ws2);
+  boardctl(BOARDIOC_WS3_SUBSCRIBE, (uintptr_t)&g_ws3);
+  boardctl(BOARDIOC_WS4_SUBSCRIBE, (uintptr_t)&g_ws4);
+  
+  freeze_set_source(FREEZE_CHAN_APPS1, g_apps1);
+  freeze_set_source(FREEZE_CHAN_APPS2, g_apps2);
+  freeze_set_source(FREEZE_CHAN_BRKF, g_brk_f_value);
+  freeze_set_source(FREEZE_CHAN_BRKR, g_brk_r_value);
+  freeze_set_source(FREEZE_CHAN_WS1, g_ws1);
+  freeze_set_source(FREEZE_CHAN_WS2, g_ws2);
+  freeze_set_source(FREEZE_CHAN_WS3, g_ws3);
+  freeze_set_source(FREEZE_CHAN_WS4, g_ws4);
+  
+  /* Arming happens in the loop, once asked for with safing_try_step().
+   * Channels are subscribed first so that it can check them.
+   */
+  
+  timer_create(CLOCK_REALTIME, &g_retry_5v0lin_sense_event, &g_retry_5v0lin_sense_timer);
+  
+  isotp_init(&g_diag_link, CAN_ID_DIAG_RESP_TX, true, CAN_SAFING_TX_RING);
+  g_diag_rxmq = mq_open(CAN_DIAG_RX_MQUEUE_NAME,
+                        O_RDONLY | O_NONBLOCK | O_CREAT, 0600, &diagmq_attr);
+  
+  /* Run the transmit schedule against the release time of each tick so
+   * that message rates do not stretch with the time spent in the loop body.
+   */
+  
+  periodic_init(&g_safing_period, "safing", SAFING_TICK_MS * USEC_PER_MSEC);
+  now_ms = periodic_release_ms(&g_safing_period);
+  can_sched_start(&g_telem_sched, now_ms);
   
-  int i = 0;
-  int j = 0;
   while(true)
   {
-    txmsg.cm_hdr.ch_extid = true;
-    
-    if (g_fault_table[i].fault_code != FAULT_INVALID)
-      {
-        txmsg.cm_hdr.ch_id = CAN_ID_FAULT_TX;
-        copy_fault_entry(&txmsg, &g_fault_table[i]);
-        mq_send(txmq, (const char *)&txmsg, CAN_MSGLEN(txmsg.cm_hdr.ch_dlc), 1);
-      }
-    if (g_dtc_table[j].fault_code != DTC_INVALID)
-      {
-        txmsg.cm_hdr.ch_id = CAN_ID_DTC_TX;
-        copy_fault_entry(&txmsg, &g_dtc_table[j]);
-        mq_send(txmq, (const char *)&txmsg, CAN_MSGLEN(txmsg.cm_hdr.ch_dlc), 1);
-      }
-    
-    if (i == SAFING_NUM_FAULT_ENTRIES - 1)
-      i = 0;
-    else
-      ++i;
-    
-    if (j == SAFING_NUM_DTC_ENTRIES - 1)
-      j = 0;
-    else
-      ++j;
-    
-    txmsg.cm_hdr.ch_id = CAN_ID_BRAKE_TX;
-    txmsg.cm_hdr.ch_extid = false;
-    txmsg.cm_data[0] = (*brk_f_value) >> 8;
-    txmsg.cm_data[1] = (*brk_f_value) & 0xff;
-    txmsg.cm_data[2] = (*brk_r_value) >> 8;
-    txmsg.cm_data[3] = (*brk_r_value) & 0xff;
-    mq_send(txmq, (const char *)&txmsg, CAN_MSGLEN(txmsg.cm_hdr.ch_dlc), 1);
-    
-    txmsg.cm_hdr.ch_id = CAN_ID_WS_TX;
-    txmsg.cm_hdr.ch_extid = false;
-    txmsg.cm_data[0] = (*ws1) >> 8;
-    txmsg.cm_data[1] = (*ws1) & 0xff;
-    txmsg.cm_data[2] = (*ws2) >> 8;
-    txmsg.cm_data[3] = (*ws2) & 0xff;
-    txmsg.cm_data[4] = (*ws3) >> 8;
-    txmsg.cm_data[5] = (*ws3) & 0xff;
-    txmsg.cm_data[6] = (*ws4) >> 8;
-    txmsg.cm_data[7] = (*ws4) & 0xff;
-    mq_send(txmq, (const char *)&txmsg, CAN_MSGLEN(txmsg.cm_hdr.ch_dlc), 1);
-    
-    usleep(50000);
+    now_ms = periodic_release_ms(&g_safing_period);
+    safing_run_state();
+    safing_diag_poll(now_ms);
+    can_sched_run(&g_telem_sched, now_ms);
+    periodic_wait(&g_safing_period);
   }
 }
 
+/****************************************************************************
+ * Name: safing_try_step
+ *
+ * Description:
+ *   Ask to move to a new state, with its first reason code (in progress,
+ *   or a software request for SAFING_STATE_PAUSED). The safing task then
+ *   does the work of the state and records its progress in the reason.
+ *
+ * Returned Value:
+ *   OK, -EINVAL if state is not a state, or -EPERM if the step is not
+ *   allowed from the current state and reason.
+ *
+ ****************************************************************************/
 
-void safing_store_dtc(uint16_t dtc)
+int safing_try_step(uint8_t state)
 {
-  int i;
-  struct timespec current_time;
+  return safing_step(state, 0);
+}
+
+/****************************************************************************
+ * Name: safing_try_step_reason
+ *
+ * Description:
+ *   As safing_try_step(), but entering the new state with the given
+ *   reason, for a task that knows why it is asking. State and reason are
+ *   published together, so no reader sees one without the other.
+ *
+ * Returned Value:
+ *   As safing_try_step().
+ *
+ ****************************************************************************/
+
+int safing_try_step_reason(uint8_t state, uint8_t reason)
+{
+  return safing_step(state, reason);
+}
+
+/****************************************************************************
+ * Name: safing_set_reason
+ *
+ * Description:
+ *   Record progress within a state, for work done outside the safing
+ *   task. Nothing changes if safing has already left the state.
+ *
+ * Returned Value:
+ *   OK, or -EPERM if not in state.
+ *
+ ****************************************************************************/
+
+int safing_set_reason(uint8_t state, uint8_t reason)
+{
+  int ret = -EPERM;
   
-  clock_gettime(CLOCK_REALTIME, &current_time);
+  while (sem_wait(&g_safing_step_sem) < 0)
+  {};
   
-  for (i = 0; i < SAFING_NUM_DTC_ENTRIES; ++i)
+  if (g_safing_status.state == state)
   {
-    if (g_dtc_table[i].fault_code == dtc)
-      return;
+    seqlock_write_begin(&g_safing_status_lock);
+    g_safing_status.reason = reason;
+    seqlock_write_end(&g_safing_status_lock);
+    ret = OK;
   }
-  for (i = 0; i < SAFING_NUM_DTC_ENTRIES; ++i)
+  
+  sem_post(&g_safing_step_sem);
+  return ret;
+}
+
+/****************************************************************************
+ * Name: safing_trigger_soft_fault
+ *
+ * Description:
+ *   Enter SAFING_STATE_SOFT_FAULT, unless already in a fault state.
+ *
+ ****************************************************************************/
+
+void safing_trigger_soft_fault(void)
+{
+  safing_step(SAFING_STATE_SOFT_FAULT, 0);
+}
+
+/****************************************************************************
+ * Name: safing_get_status
+ *
+ * Description:
+ *   Copy the current safing state, reason and fault flags. Never blocks or
+ *   makes a system call, so control tasks may call it every cycle.
+ *
+ ****************************************************************************/
+
+void safing_get_status(FAR struct safing_status_s *status)
+{
+  uint32_t seq;
+  
+  do
   {
-    if (g_dtc_table[i].fault_code == DTC_INVALID)
-    {
-      g_dtc_table[i].fault_code = dtc;
-      g_dtc_table[i].time_ms = current_time.tv_sec * 1000 + current_time.tv_nsec / 1000000;
-      return;
-    }
+    seq = seqlock_read_begin(&g_safing_status_lock);
+    *status = g_safing_status;
   }
+  while (seqlock_read_retry(&g_safing_status_lock, seq));
+}
+
+/****************************************************************************
+ * Name: safing_store_dtc
+ *
+ * Description:
+ *   Record an occurrence of a DTC that is known to be real, such as one
+ *   from an already debounced check, confirming it straight away. A freeze
+ *   frame is captured when it is first stored or confirmed. Takes constant
+ *   time, never blocks and is async-signal-safe, so any task or signal
+ *   handler may call it concurrently.
+ *
+ ****************************************************************************/
+
+void safing_store_dtc(uint16_t dtc)
+{
+  safing_record_dtc(dtc, true);
+}
+
+/****************************************************************************
+ * Name: safing_report_dtc
+ *
+ * Description:
+ *   Record an occurrence of a DTC that may be a glitch. It is stored as
+ *   pending, and only confirmed if it occurs again in a later keycycle; a
+ *   pending DTC that does not ages out. Same guarantees as
+ *   safing_store_dtc().
+ *
+ ****************************************************************************/
+
+void safing_report_dtc(uint16_t dtc)
+{
+  safing_record_dtc(dtc, false);
 }
 
+/****************************************************************************
+ * Name: safing_store_internal_fault
+ *
+ * Description:
+ *   Record an internal fault, and the internal fault DTC, both confirmed.
+ *   Same guarantees as safing_store_dtc().
+ *
+ ****************************************************************************/
+
 void safing_store_internal_fault(uint16_t fault_code)
 {
-  int i;
-  struct timespec current_time;
-  
-  clock_gettime(CLOCK_REALTIME, &current_time);
-  
-  for (i = 0; i < SAFING_NUM_FAULT_ENTRIES; ++i)
+  if (fault_code == FAULT_INVALID || fault_code >= SAFING_FAULT_INDICES)
   {
-    if (g_fault_table[i].fault_code == fault_code)
-      return;
+    __atomic_fetch_add(&g_fault_table.lost, 1, __ATOMIC_RELAXED);
   }
-  for (i = 0; i < SAFING_NUM_FAULT_ENTRIES; ++i)
+  else
   {
-    if (g_fault_table[i].fault_code == FAULT_INVALID)
-    {
-      g_fault_table[i].fault_code = fault_code;
-      g_fault_table[i].time_ms = current_time.tv_sec * 1000 + current_time.tv_nsec / 1000000;
-      break;
-    }
+    safing_record(&g_fault_table, fault_code, fault_code, true,
+                  safing_time_ms());
   }
   
   safing_store_dtc(DTC_INTERNAL_FAULT);
 }
 
+/****************************************************************************
+ * Name: safing_check_sensor_ranges
+ *
+ * Description:
+ *   Run one tick of the plausibility checks: every checked channel against
+ *   its calibrated range, and APPS1/APPS2 and TPS1/TPS2 against each other.
+ *   The checks are evaluated together into a bitmap, then each one's count
+ *   of consecutive failed ticks is updated. A check failing for its full
+ *   debounce is confirmed and stores its DTC. Channels not subscribed yet
+ *   are not checked. Must be called once per safing tick.
+ *
+ * Returned Value:
+ *   OK, or -EIO if any check is confirmed failed.
+ *
+ ****************************************************************************/
+
 int safing_check_sensor_ranges(void)
 {
-  return OK;
+  FAR const struct calib_data_s *calib;
+  FAR const struct calib_plaus_s *plaus;
+  int16_t values[FREEZE_NUM_CHANNELS];
+  uint32_t failed = 0;
+  uint32_t confirmed = 0;
+  uint32_t newly;
+  uint32_t present;
+  uint16_t limit;
+  uint8_t count;
+  int32_t x;
+  int i;
+  
+  freeze_sample(values);
+  calib = calib_acquire();
+  plaus = &calib->plaus;
+  
+  for (i = 0; i < CALIB_PLAUS_CHANNELS; ++i)
+  {
+    x = values[g_plaus_chan[i]];
+    present = x != FREEZE_VALUE_NONE;
+    failed |= (present & (x < plaus->min[i])) << (2 * i);
+    failed |= (present & (x > plaus->max[i])) << (2 * i + 1);
+  }
+  
+  failed |= safing_plaus_ooc(values[FREEZE_CHAN_APPS1],
+                             values[FREEZE_CHAN_APPS2], plaus->apps_tol)
+            << SAFING_PLAUS_APPS_OOC;
+  failed |= safing_plaus_ooc(values[FREEZE_CHAN_TPS1],
+                             values[FREEZE_CHAN_TPS2], plaus->tps_tol)
+            << SAFING_PLAUS_TPS_OOC;
+  
+  /* Count up to the limit while failing, back to 0 once passing */
+  
+  for (i = 0; i < SAFING_PLAUS_CHECKS; ++i)
+  {
+    limit = i < SAFING_PLAUS_RANGE_CHECKS ? plaus->range_debounce
+                                          : plaus->ooc_debounce;
+    count = g_plaus_count[i];
+    count = (count + (count < limit)) * ((failed >> i) & 1);
+    g_plaus_count[i] = count;
+    confirmed |= (uint32_t)(count >= limit) << i;
+  }
+  
+  calib_release(calib);
+  
+  newly = confirmed & ~g_plaus_confirmed;
+  g_plaus_confirmed = confirmed;
+  while (newly != 0)
+  {
+    i = __builtin_ctz(newly);
+    newly &= newly - 1;
+    safing_store_dtc(g_plaus_dtcs[i]);
+  }
+  
+  return confirmed != 0 ? -EIO : OK;
 }
 
 
@@ -131,6 +131,8 @@
 #define FAULT_NOT_SAFING_2          11
 #define FAULT_ARM_FAILED_1          12
 #define FAULT_ARM_FAILED_2          13
+#define FAULT_FAULTLOG_FAILED       14
+#define FAULT_CAN_THREAD_FAILED     15
 
 /****************************************************************************
  * Public Types
@@ -171,7 +173,13 @@ struct safing_status_s
  * Public Functions
  ****************************************************************************/
 
+int safing_try_step(uint8_t state);
+int safing_try_step_reason(uint8_t state, uint8_t reason);
+int safing_set_reason(uint8_t state, uint8_t reason);
+void safing_trigger_soft_fault(void);
+void safing_get_status(FAR struct safing_status_s *status);
 void safing_store_dtc(uint16_t dtc);
+void safing_report_dtc(uint16_t dtc);
 void safing_store_internal_fault(uint16_t fault_code);
 
 #endif /* APPS_INDUSTRY_ETCETERA_SAFING_H */
@@ -0,0 +1,129 @@
+/****************************************************************************
+ * apps/industry/ETCetera/seqlock.h
+ * Electronic Throttle Controller program - sequence lock
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_SEQLOCK_H
+#define APPS_INDUSTRY_ETCETERA_SEQLOCK_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sched.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define SEQLOCK_INITIALIZER { .seq = 0 }
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Protects a small structure with one writer at a time and any number of
+ * readers. The count is odd while a write is in progress. Readers copy the
+ * data and retry if the count was odd or changed meanwhile, so they never
+ * block the writer or make a system call.
+ *
+ * The writer holds the scheduler lock for the length of a write, so on a
+ * single CPU no reader task can run in the middle of one and a read never
+ * retries more than once. Writes must be short, and must not be made from a
+ * signal handler, or be read from one in the writing task.
+ */
+
+struct seqlock_s
+{
+  uint32_t seq;
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: seqlock_read_begin
+ *
+ * Description:
+ *   Start a read. Pass the returned count to seqlock_read_retry() once the
+ *   data has been copied.
+ *
+ ****************************************************************************/
+
+static inline uint32_t seqlock_read_begin(FAR const struct seqlock_s *lock)
+{
+  uint32_t seq;
+
+  while (((seq = __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE)) & 1) != 0)
+  {
+  }
+
+  return seq;
+}
+
+/****************************************************************************
+ * Name: seqlock_read_retry
+ *
+ * Description:
+ *   Returns true if a write happened since seqlock_read_begin() returned
+ *   seq, in which case the copy must be thrown away and read again.
+ *
+ ****************************************************************************/
+
+static inline bool seqlock_read_retry(FAR const struct seqlock_s *lock,
+                                      uint32_t seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&lock->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/****************************************************************************
+ * Name: seqlock_write_begin
+ *
+ * Description:
+ *   Start a write. Writers must already be serialized by the caller.
+ *
+ ****************************************************************************/
+
+static inline void seqlock_write_begin(FAR struct seqlock_s *lock)
+{
+  sched_lock();
+  __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/****************************************************************************
+ * Name: seqlock_write_end
+ *
+ * Description:
+ *   Finish a write, making it visible to readers.
+ *
+ ****************************************************************************/
+
+static inline void seqlock_write_end(FAR struct seqlock_s *lock)
+{
+  __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELEASE);
+  sched_unlock();
+}
+
+#endif /* APPS_INDUSTRY_ETCETERA_SEQLOCK_H */
@@ -0,0 +1,194 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/host.c
+ * Electronic Throttle Controller program - host stand-ins for NuttX
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <nuttx/clock.h>
+#include <nuttx/crc32.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/boardctl.h>
+#include <time.h>
+
+#include "host.h"
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+int (*g_host_boardctl)(unsigned int cmd, uintptr_t arg);
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static int g_host_failures;
+static uint32_t g_host_seed = 12345;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/* NuttX services used by the modules */
+
+int sched_lock(void)
+{
+  return OK;
+}
+
+int sched_unlock(void)
+{
+  return OK;
+}
+
+/* Tests run the task entry points they need themselves */
+
+int task_create(FAR const char *name, int priority, int stack_size,
+                int (*entry)(int argc, FAR char **argv), FAR char **argv)
+{
+  errno = ENOSYS;
+  return ERROR;
+}
+
+int boardctl(unsigned int cmd, uintptr_t arg)
+{
+  return g_host_boardctl != NULL ? g_host_boardctl(cmd, arg) : OK;
+}
+
+void clock_timespec_add(FAR const struct timespec *ts1,
+                        FAR const struct timespec *ts2,
+                        FAR struct timespec *ts3)
+{
+  time_t sec = ts1->tv_sec + ts2->tv_sec;
+  long nsec = ts1->tv_nsec + ts2->tv_nsec;
+
+  if (nsec >= NSEC_PER_SEC)
+  {
+    nsec -= NSEC_PER_SEC;
+    sec++;
+  }
+
+  ts3->tv_sec = sec;
+  ts3->tv_nsec = nsec;
+}
+
+void clock_timespec_subtract(FAR const struct timespec *ts1,
+                             FAR const struct timespec *ts2,
+                             FAR struct timespec *ts3)
+{
+  time_t sec = ts1->tv_sec - ts2->tv_sec;
+  long nsec = ts1->tv_nsec - ts2->tv_nsec;
+
+  if (nsec < 0)
+  {
+    nsec += NSEC_PER_SEC;
+    sec--;
+  }
+
+  ts3->tv_sec = sec;
+  ts3->tv_nsec = nsec;
+}
+
+uint32_t clock_systime_ticks(void)
+{
+  return host_time_ns() / NSEC_PER_MSEC;
+}
+
+/* Bitwise CRC-32 (IEEE 802.3, reflected), as libc/misc/lib_crc32.c */
+
+uint32_t crc32(FAR const uint8_t *src, size_t len)
+{
+  uint32_t crc = 0;
+  int bit;
+
+  while (len-- > 0)
+  {
+    crc ^= *src++;
+    for (bit = 0; bit < 8; ++bit)
+    {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+
+  return crc;
+}
+
+/* Test support */
+
+bool host_check(bool ok, FAR const char *expr, FAR const char *file,
+                int line)
+{
+  if (!ok)
+  {
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+    ++g_host_failures;
+  }
+
+  return ok;
+}
+
+/* Reports the result and returns the exit status for main() */
+
+int host_finish(FAR const char *name)
+{
+  if (g_host_failures > 0)
+  {
+    printf("%s: FAILED (%d checks)\n", name, g_host_failures);
+    return EXIT_FAILURE;
+  }
+
+  printf("%s: ok\n", name);
+  return EXIT_SUCCESS;
+}
+
+uint64_t host_time_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Cycle counter for short timings; nanoseconds where there is none */
+
+uint64_t host_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return host_time_ns();
+#endif
+}
+
+/* Two steps of an LCG, high halves only, so every bit is usable. Not
+ * thread safe: tests draw from the main thread.
+ */
+
+uint32_t host_random(void)
+{
+  g_host_seed = g_host_seed * 1103515245 + 12345;
+  return (g_host_seed >> 16) | ((g_host_seed * 69069) & 0xffff0000);
+}
@@ -0,0 +1,65 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/host.h
+ * Electronic Throttle Controller program - host test support
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef APPS_INDUSTRY_ETCETERA_TEST_HOST_H
+#define APPS_INDUSTRY_ETCETERA_TEST_HOST_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Records a failed check and carries on, so that one run reports every
+ * failure. Evaluates to the condition.
+ */
+
+#define HOST_CHECK(cond) host_check((cond), #cond, __FILE__, __LINE__)
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* Called for every boardctl() if set; otherwise boardctl() returns OK */
+
+extern int (*g_host_boardctl)(unsigned int cmd, uintptr_t arg);
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+bool host_check(bool ok, FAR const char *expr, FAR const char *file,
+                int line);
+int host_finish(FAR const char *name);
+uint64_t host_time_ns(void);
+uint64_t host_cycles(void);
+
+/* The same pseudo-random sequence on every run, so failures repeat */
+
+uint32_t host_random(void);
+
+#endif /* APPS_INDUSTRY_ETCETERA_TEST_HOST_H */
@@ -0,0 +1,78 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/include/arch/board/board.h
+ * Host stand-in for the ETCetera board header
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef TEST_INCLUDE_ARCH_BOARD_BOARD_H
+#define TEST_INCLUDE_ARCH_BOARD_BOARD_H
+
+#include <nuttx/config.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Channels whose readings the board has stopped updating */
+
+#define TPS1_FROZEN                     (1 << 0)
+#define TPS2_FROZEN                     (1 << 1)
+#define APPS1_FROZEN                    (1 << 2)
+#define APPS2_FROZEN                    (1 << 3)
+
+/* Fault flags raised to the safing task */
+
+#define SAFINGSIG_5V0LIN_SENSE_STG      (1u << 0)
+#define SAFINGSIG_STP_APPS1             (1u << 1)
+#define SAFINGSIG_STP_APPS2             (1u << 2)
+#define SAFINGSIG_STP_BRKF              (1u << 3)
+#define SAFINGSIG_STP_BRKR              (1u << 4)
+#define SAFINGSIG_STP_TPS               (1u << 5)
+#define SAFINGSIG_STP_AUX               (1u << 6)
+#define SAFINGSIG_OL_APPS1              (1u << 7)
+#define SAFINGSIG_OL_APPS2              (1u << 8)
+#define SAFINGSIG_OL_BRKF               (1u << 9)
+#define SAFINGSIG_OL_BRKR               (1u << 10)
+#define SAFINGSIG_OL_TPS1               (1u << 11)
+#define SAFINGSIG_OL_TPS2               (1u << 12)
+#define SAFINGSIG_OOC_TPS               (1u << 13)
+#define SAFINGSIG_OOC_APPS              (1u << 14)
+#define SAFINGSIG_SAFING1_DISARMING     (1u << 15)
+#define SAFINGSIG_SAFING1_ASSERTING     (1u << 16)
+#define SAFINGSIG_SAFING2_DISARMING     (1u << 17)
+#define SAFINGSIG_SAFING2_ASSERTING     (1u << 18)
+#define SAFINGSIG_OL_INTERNAL_FAULT     (1u << 19)
+#define SAFINGSIG_SAFING1_ALREADYARMED  (1u << 20)
+#define SAFINGSIG_SAFING2_ALREADYARMED  (1u << 21)
+#define SAFINGSIG_SAFING1_NOT_ASSERTED  (1u << 22)
+#define SAFINGSIG_SAFING2_NOT_ASSERTED  (1u << 23)
+#define SAFINGSIG_SAFING1_ARM_FAILED    (1u << 24)
+#define SAFINGSIG_SAFING2_ARM_FAILED    (1u << 25)
+#define SAFINGSIG_DRSBCK_STG            (1u << 26)
+
+struct safing_subscription_s
+{
+  pid_t tid;
+  uint32_t faultflags;
+};
+
+struct chan_subscription_s
+{
+  pid_t tid;
+  FAR void *ptr;
+};
+
+#endif /* TEST_INCLUDE_ARCH_BOARD_BOARD_H */
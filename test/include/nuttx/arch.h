@@ -0,0 +1,30 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/include/nuttx/arch.h
+ * Host stand-in for the NuttX architecture interface
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef TEST_INCLUDE_NUTTX_ARCH_H
+#define TEST_INCLUDE_NUTTX_ARCH_H
+
+#include <stdint.h>
+
+uint32_t up_perf_gettime(void);
+uint32_t up_perf_getfreq(void);
+
+#endif /* TEST_INCLUDE_NUTTX_ARCH_H */
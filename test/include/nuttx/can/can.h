@@ -0,0 +1,78 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/include/nuttx/can/can.h
+ * Host stand-in for the NuttX CAN character driver interface
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef TEST_INCLUDE_NUTTX_CAN_CAN_H
+#define TEST_INCLUDE_NUTTX_CAN_CAN_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define CAN_MAXDATALEN        8
+#define CAN_MAX_STDMSGID      0x07ff
+#define CAN_MAX_EXTMSGID      0x1fffffff
+
+#define CAN_MSGLEN(nbytes)    (sizeof(struct can_hdr_s) + (nbytes))
+
+#define CANIOC_ADD_STDFILTER  0x100
+#define CANIOC_DEL_STDFILTER  0x101
+#define CANIOC_ADD_EXTFILTER  0x102
+#define CANIOC_DEL_EXTFILTER  0x103
+
+#define CAN_FILTER_MASK       0
+#define CAN_FILTER_DUAL       1
+#define CAN_FILTER_RANGE      2
+
+#define CAN_MSGPRIO_LOW       0
+#define CAN_MSGPRIO_HIGH      3
+
+struct can_hdr_s
+{
+  uint32_t ch_id;
+  uint8_t  ch_dlc    : 4;
+  uint8_t  ch_rtr    : 1;
+  uint8_t  ch_error  : 1;
+  uint8_t  ch_extid  : 1;
+  uint8_t  ch_unused : 1;
+} __attribute__((packed));
+
+struct can_msg_s
+{
+  struct can_hdr_s cm_hdr;
+  uint8_t cm_data[CAN_MAXDATALEN];
+} __attribute__((packed));
+
+struct canioc_stdfilter_s
+{
+  uint16_t sf_id1;
+  uint16_t sf_id2;
+  uint8_t sf_type;
+  uint8_t sf_prio;
+};
+
+struct canioc_extfilter_s
+{
+  uint32_t xf_id1;
+  uint32_t xf_id2;
+  uint8_t xf_type;
+  uint8_t xf_prio;
+};
+
+#endif /* TEST_INCLUDE_NUTTX_CAN_CAN_H */
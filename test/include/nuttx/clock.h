@@ -0,0 +1,42 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/include/nuttx/clock.h
+ * Host stand-in for the NuttX clock interface
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef TEST_INCLUDE_NUTTX_CLOCK_H
+#define TEST_INCLUDE_NUTTX_CLOCK_H
+
+#include <nuttx/config.h>
+#include <stdint.h>
+#include <time.h>
+
+/* The host system tick is one millisecond */
+
+#define TICK2MSEC(t) (t)
+#define MSEC2TICK(t) (t)
+
+void clock_timespec_add(FAR const struct timespec *ts1,
+                        FAR const struct timespec *ts2,
+                        FAR struct timespec *ts3);
+void clock_timespec_subtract(FAR const struct timespec *ts1,
+                             FAR const struct timespec *ts2,
+                             FAR struct timespec *ts3);
+uint32_t clock_systime_ticks(void);
+
+#endif /* TEST_INCLUDE_NUTTX_CLOCK_H */
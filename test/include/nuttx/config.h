@@ -0,0 +1,82 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/include/nuttx/config.h
+ * Host stand-in for the NuttX build configuration
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef TEST_INCLUDE_NUTTX_CONFIG_H
+#define TEST_INCLUDE_NUTTX_CONFIG_H
+
+/* The host tests build the application's modules with glibc in place of
+ * the NuttX libc. Only what the modules use from NuttX is provided, and
+ * the application's Kconfig options take their defaults.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#define FAR
+
+#define OK    0
+#define ERROR -1
+
+#define NSEC_PER_USEC   1000
+#define NSEC_PER_MSEC   1000000
+#define NSEC_PER_SEC    1000000000
+#define USEC_PER_MSEC   1000
+#define USEC_PER_SEC    1000000
+#define MSEC_PER_SEC    1000
+
+#define CONFIG_SYSTEM_NSH_PRIORITY                      100
+#define CONFIG_CAN_EXTID                                1
+
+#define CONFIG_INDUSTRY_ETCETERA_CAN_RX_ROUTES          64
+#define CONFIG_INDUSTRY_ETCETERA_CAN_RX_BATCH           8
+#define CONFIG_INDUSTRY_ETCETERA_CAN_STD_FILTERS        4
+#define CONFIG_INDUSTRY_ETCETERA_CAN_EXT_FILTERS        4
+#define CONFIG_INDUSTRY_ETCETERA_CAN_TX_PRIORITY        110
+#define CONFIG_INDUSTRY_ETCETERA_CAN_TX_STACKSIZE       2048
+#define CONFIG_INDUSTRY_ETCETERA_CAN_SAFING_TX_DEPTH    8
+#define CONFIG_INDUSTRY_ETCETERA_CAN_DRS_TX_DEPTH       4
+#define CONFIG_INDUSTRY_ETCETERA_CAN_TELEM_TX_DEPTH     8
+#define CONFIG_INDUSTRY_ETCETERA_CAN_CALIB_TX_DEPTH     2
+#define CONFIG_INDUSTRY_ETCETERA_CAN_STATS_IDS          32
+#define CONFIG_INDUSTRY_ETCETERA_CAN_STATS_PERIOD       1000
+#define CONFIG_INDUSTRY_ETCETERA_FAULTLOG               1
+#define CONFIG_INDUSTRY_ETCETERA_FAULTLOG_PATH          "/dev/faultlog"
+#define CONFIG_INDUSTRY_ETCETERA_FAULTLOG_SECTORS       4
+#define CONFIG_INDUSTRY_ETCETERA_FAULTLOG_SECTOR_SIZE   2048
+#define CONFIG_INDUSTRY_ETCETERA_FAULTLOG_PRIORITY      50
+#define CONFIG_INDUSTRY_ETCETERA_FREEZE_FRAMES          8
+#define CONFIG_INDUSTRY_ETCETERA_DTC_HEAL_CYCLES        3
+#define CONFIG_INDUSTRY_ETCETERA_DTC_AGING_CYCLES       40
+#define CONFIG_INDUSTRY_ETCETERA_SPRING_POINTS          32
+#define CONFIG_INDUSTRY_ETCETERA_BRK_TX_DEADBAND        5
+#define CONFIG_INDUSTRY_ETCETERA_WS_TX_DEADBAND         2
+#define CONFIG_INDUSTRY_ETCETERA_TELEM_TX_HEARTBEAT     100
+
+pid_t gettid(void);
+int task_create(FAR const char *name, int priority, int stack_size,
+                int (*entry)(int argc, FAR char **argv), FAR char **argv);
+
+#endif /* TEST_INCLUDE_NUTTX_CONFIG_H */
@@ -0,0 +1,31 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/include/nuttx/crc32.h
+ * Host stand-in for the NuttX CRC-32 library
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef TEST_INCLUDE_NUTTX_CRC32_H
+#define TEST_INCLUDE_NUTTX_CRC32_H
+
+#include <nuttx/config.h>
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32(FAR const uint8_t *src, size_t len);
+
+#endif /* TEST_INCLUDE_NUTTX_CRC32_H */
@@ -0,0 +1,33 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/include/nuttx/semaphore.h
+ * Host stand-in for the NuttX semaphore interface
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef TEST_INCLUDE_NUTTX_SEMAPHORE_H
+#define TEST_INCLUDE_NUTTX_SEMAPHORE_H
+
+#include <semaphore.h>
+
+/* glibc has no static semaphore initializer, but keeps the count of an
+ * unshared semaphore in the low word of sem_t on 64-bit hosts.
+ */
+
+#define SEM_INITIALIZER(c) { .__align = (c) }
+
+#endif /* TEST_INCLUDE_NUTTX_SEMAPHORE_H */
@@ -0,0 +1,35 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/include/sched.h
+ * Host stand-in for the NuttX scheduler interface
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef TEST_INCLUDE_SCHED_H
+#define TEST_INCLUDE_SCHED_H
+
+#include_next <sched.h>
+
+/* Preemption cannot be disabled on the host. Code that relies on it for
+ * short critical sections must also be correct with these as no-ops, which
+ * is what the concurrency tests check.
+ */
+
+int sched_lock(void);
+int sched_unlock(void);
+
+#endif /* TEST_INCLUDE_SCHED_H */
@@ -0,0 +1,58 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/include/sys/boardctl.h
+ * Host stand-in for the board control interface
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef TEST_INCLUDE_SYS_BOARDCTL_H
+#define TEST_INCLUDE_SYS_BOARDCTL_H
+
+#include <stdint.h>
+
+/* The ETCetera board's commands. The tests supply boardctl() themselves
+ * and can see each command as it is issued.
+ */
+
+enum
+{
+  BOARDIOC_SAFING_SUBSCRIBE = 0x1000,
+  BOARDIOC_5V0LIN_SENSE_ARM,
+  BOARDIOC_5V0LIN_SENSE_RETRY_ARM,
+  BOARDIOC_5V0LIN_SENSE_RETRY_CHECK,
+  BOARDIOC_HW_PLAUS_CK_ARM,
+  BOARDIOC_HW_SAFING_ARM,
+  BOARDIOC_BUTTONS_SUBSCRIBE,
+  BOARDIOC_BRK_F_SUBSCRIBE,
+  BOARDIOC_BRK_R_SUBSCRIBE,
+  BOARDIOC_WS1_SUBSCRIBE,
+  BOARDIOC_WS2_SUBSCRIBE,
+  BOARDIOC_WS3_SUBSCRIBE,
+  BOARDIOC_WS4_SUBSCRIBE,
+  BOARDIOC_TPS1_SUBSCRIBE,
+  BOARDIOC_TPS2_SUBSCRIBE,
+  BOARDIOC_APPS1_SUBSCRIBE,
+  BOARDIOC_APPS2_SUBSCRIBE,
+  BOARDIOC_DRS_ANGLE,
+  BOARDIOC_DRS_START,
+  BOARDIOC_RELAY_ENABLE,
+  BOARDIOC_ETB_DUTY
+};
+
+int boardctl(unsigned int cmd, uintptr_t arg);
+
+#endif /* TEST_INCLUDE_SYS_BOARDCTL_H */
@@ -0,0 +1,551 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_can_broadcast.c
+ * Electronic Throttle Controller program - CAN receive dispatch tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <mqueue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "host.h"
+
+/* Routing is private to can_broadcast.c. Build it with a table big enough
+ * for the hundreds of routes the dispatch rate is measured with.
+ */
+
+#undef CONFIG_INDUSTRY_ETCETERA_CAN_RX_ROUTES
+#define CONFIG_INDUSTRY_ETCETERA_CAN_RX_ROUTES  1024
+
+#define main can_broadcast_main
+#include "../can_broadcast.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define NITEMS(a)             (sizeof(a) / sizeof((a)[0]))
+#define TEST_ROUTES           CAN_ROUTE_MAX_ROUTES
+#define TEST_FRAMES           4096  /* Distinct frames in the stream */
+#define TEST_PASSES           500
+#define TEST_WALKS            20000 /* Reads walked for the batch rate */
+#define TEST_RX_QUEUE_DEPTH   10    /* Linux default limit; NuttX uses 3 */
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* Every route registered, defaults first, for the reference lookup */
+
+static struct can_rx_route_s g_routes[TEST_ROUTES];
+static int g_nroutes;
+
+static struct can_hdr_s g_frames[TEST_FRAMES];
+
+/* One read() worth of packed frames, as the driver returns them */
+
+static uint8_t g_readbuf[sizeof(g_rxbuf)];
+static struct can_msg_s g_readframes[sizeof(g_rxbuf) / CAN_MSGLEN(0)];
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void test_random_id(FAR uint32_t *id, FAR bool *extid)
+{
+  *extid = (host_random() & 1) != 0;
+  *id = host_random() & (*extid ? CAN_MAX_EXTMSGID : CAN_MAX_STDMSGID);
+}
+
+/* What can_route_lookup() must return, found by a linear search */
+
+static int test_reference_lookup(FAR const struct can_hdr_s *hdr)
+{
+  int i;
+
+  for (i = 0; i < g_nroutes; ++i)
+  {
+    if (g_routes[i].id == hdr->ch_id && g_routes[i].extid == hdr->ch_extid)
+    {
+      return g_routes[i].mqueue_idx;
+    }
+  }
+
+  return -1;
+}
+
+static int test_register(uint32_t id, bool extid, int mqueue_idx)
+{
+  int ret = can_broadcast_register_rx(id, extid, mqueue_idx);
+
+  if (ret == OK && test_reference_lookup(&(struct can_hdr_s){
+                     .ch_id = id, .ch_extid = extid }) < 0)
+  {
+    g_routes[g_nroutes].id = id;
+    g_routes[g_nroutes].extid = extid;
+    g_routes[g_nroutes].mqueue_idx = mqueue_idx;
+    ++g_nroutes;
+  }
+
+  return ret;
+}
+
+/* Adds random routes until nroutes are registered */
+
+static void test_fill_routes(int nroutes)
+{
+  struct can_hdr_s hdr;
+  uint32_t id;
+  bool extid;
+  int ret;
+
+  while (g_nroutes < nroutes)
+  {
+    test_random_id(&id, &extid);
+    hdr.ch_id = id;
+    hdr.ch_extid = extid;
+    ret = test_register(id, extid, host_random() % CAN_NUM_RX_MQUEUES);
+    HOST_CHECK(ret == OK || (ret == -EEXIST
+                             && test_reference_lookup(&hdr) >= 0));
+  }
+}
+
+/* A frame stream in which half the frames are routed */
+
+static void test_fill_frames(void)
+{
+  uint32_t id;
+  bool extid;
+  int route;
+  int i;
+
+  for (i = 0; i < TEST_FRAMES; ++i)
+  {
+    if ((i & 1) == 0)
+    {
+      route = host_random() % g_nroutes;
+      id = g_routes[route].id;
+      extid = g_routes[route].extid;
+    }
+    else
+    {
+      test_random_id(&id, &extid);
+    }
+
+    memset(&g_frames[i], 0, sizeof(g_frames[i]));
+    g_frames[i].ch_id = id;
+    g_frames[i].ch_extid = extid;
+  }
+}
+
+static void test_lookups(void)
+{
+  int i;
+
+  for (i = 0; i < TEST_FRAMES; ++i)
+  {
+    if (!HOST_CHECK(can_route_lookup(&g_frames[i])
+                    == test_reference_lookup(&g_frames[i])))
+    {
+      fprintf(stderr, "  id 0x%" PRIx32 "%s with %d routes\n",
+              (uint32_t)g_frames[i].ch_id,
+              g_frames[i].ch_extid ? " (ext)" : "", g_nroutes);
+      return;
+    }
+  }
+}
+
+/* Frames per second routed by the hashed table, and by the linear search
+ * it replaced for comparison, with nroutes registered.
+ */
+
+static void test_rate(int nroutes)
+{
+  volatile int sink = 0;
+  uint64_t start;
+  uint64_t hashed;
+  uint64_t linear;
+  int pass;
+  int i;
+
+  test_fill_routes(nroutes);
+  test_fill_frames();
+  test_lookups();
+
+  start = host_time_ns();
+  for (pass = 0; pass < TEST_PASSES; ++pass)
+  {
+    for (i = 0; i < TEST_FRAMES; ++i)
+    {
+      sink += can_route_lookup(&g_frames[i]);
+    }
+  }
+
+  hashed = host_time_ns() - start;
+
+  start = host_time_ns();
+  for (pass = 0; pass < TEST_PASSES / 10; ++pass)
+  {
+    for (i = 0; i < TEST_FRAMES; ++i)
+    {
+      sink += test_reference_lookup(&g_frames[i]);
+    }
+  }
+
+  linear = (host_time_ns() - start) * 10;
+
+  printf("test_can_broadcast: %3d routes (longest probe %d): "
+         "%.1f M frames/s, linear search %.1f M frames/s\n",
+         g_nroutes, g_rx_route_maxprobe + 1,
+         1e3 * TEST_PASSES * TEST_FRAMES / hashed,
+         1e3 * TEST_PASSES * TEST_FRAMES / linear);
+}
+
+static void test_register_errors(void)
+{
+  uint32_t id;
+  bool extid;
+
+  HOST_CHECK(can_broadcast_register_rx(CAN_MAX_STDMSGID + 1, false, 0)
+             == -EINVAL);
+  HOST_CHECK(can_broadcast_register_rx(CAN_MAX_EXTMSGID + 1, true, 0)
+             == -EINVAL);
+  HOST_CHECK(can_broadcast_register_rx(0x123, false, -1) == -EINVAL);
+  HOST_CHECK(can_broadcast_register_rx(0x123, false,
+                                       CAN_CALIB_RX_DEST + 1) == -EINVAL);
+  HOST_CHECK(can_broadcast_register_rx(g_routes[0].id, g_routes[0].extid,
+                                       g_routes[0].mqueue_idx) == OK);
+  HOST_CHECK(can_broadcast_register_rx(g_routes[0].id, g_routes[0].extid,
+                                       (g_routes[0].mqueue_idx + 1)
+                                       % CAN_NUM_RX_MQUEUES) == -EEXIST);
+
+  test_fill_routes(TEST_ROUTES);
+  do
+  {
+    test_random_id(&id, &extid);
+  }
+  while (test_reference_lookup(&(struct can_hdr_s){
+           .ch_id = id, .ch_extid = extid }) >= 0);
+
+  HOST_CHECK(can_broadcast_register_rx(id, extid, 0) == -ENOSPC);
+}
+
+/* Fills g_readbuf with random frames until the next would not fit, as
+ * the driver fills a read. Returns the number of bytes used; the frames
+ * are also left in g_readframes.
+ */
+
+static size_t test_pack_read(FAR int *nframes)
+{
+  FAR struct can_msg_s *msg;
+  size_t nbytes = 0;
+  uint32_t id;
+  bool extid;
+  int dlc;
+  int i;
+
+  for (*nframes = 0; ; ++*nframes)
+  {
+    dlc = host_random() % (CAN_MAXDATALEN + 1);
+    if (nbytes + CAN_MSGLEN(dlc) > sizeof(g_readbuf))
+    {
+      return nbytes;
+    }
+
+    /* Half of the frames go to a routed ID, except the calibration one */
+
+    msg = &g_readframes[*nframes];
+    memset(msg, 0, sizeof(*msg));
+    do
+    {
+      if ((host_random() & 1) != 0)
+      {
+        i = host_random() % g_nroutes;
+        id = g_routes[i].id;
+        extid = g_routes[i].extid;
+      }
+      else
+      {
+        test_random_id(&id, &extid);
+      }
+    }
+    while (id == CAN_ID_CALIB_RX && extid);
+
+    msg->cm_hdr.ch_id = id;
+    msg->cm_hdr.ch_extid = extid;
+    msg->cm_hdr.ch_dlc = dlc;
+    for (i = 0; i < dlc; ++i)
+    {
+      msg->cm_data[i] = host_random();
+    }
+
+    memcpy(&g_readbuf[nbytes], msg, CAN_MSGLEN(dlc));
+    nbytes += CAN_MSGLEN(dlc);
+  }
+}
+
+static void test_open_rx_queues(void)
+{
+  struct mq_attr attr = {
+    .mq_maxmsg = TEST_RX_QUEUE_DEPTH,
+    .mq_msgsize = sizeof(struct can_msg_s)
+  };
+
+  char name[32];
+  int i;
+
+  for (i = 0; i < CAN_NUM_RX_MQUEUES; ++i)
+  {
+    snprintf(name, sizeof(name), "/test_can_broadcast.%d.%d", getpid(), i);
+    g_rx_mqueues[i] = mq_open(name, O_RDWR | O_NONBLOCK | O_CREAT, 0600,
+                              &attr);
+    if (g_rx_mqueues[i] == (mqd_t)-1)
+    {
+      printf("test_can_broadcast: no host message queues, frames routed "
+             "to them are counted as failures\n");
+      return;
+    }
+
+    mq_unlink(name);
+  }
+}
+
+/* Checks the frames a dispatch sent to each queue, in order, against the
+ * first nframes of g_readframes. A frame the queue had no room for must
+ * have been counted as a failure instead.
+ */
+
+static void test_check_rx_queues(int nframes, FAR uint32_t *failures)
+{
+  struct can_msg_s msg;
+  ssize_t len;
+  int route;
+  int i;
+
+  for (i = 0; i < nframes; ++i)
+  {
+    route = test_reference_lookup(&g_readframes[i].cm_hdr);
+    if (route < 0)
+    {
+      continue;
+    }
+
+    len = mq_receive(g_rx_mqueues[route], (FAR char *)&msg, sizeof(msg),
+                     NULL);
+    if (len < 0)
+    {
+      HOST_CHECK(g_can_stats.rx_mq_failures[route] > failures[route]);
+      continue;
+    }
+
+    HOST_CHECK(len == CAN_MSGLEN(g_readframes[i].cm_hdr.ch_dlc)
+               && memcmp(&msg, &g_readframes[i], len) == 0);
+  }
+
+  for (route = 0; route < CAN_NUM_RX_MQUEUES; ++route)
+  {
+    HOST_CHECK(mq_receive(g_rx_mqueues[route], (FAR char *)&msg,
+                          sizeof(msg), NULL) < 0);
+    failures[route] = g_can_stats.rx_mq_failures[route];
+  }
+}
+
+/* Walks full reads, then every truncation of one, and reads with an
+ * invalid DLC. The walker must forward exactly the whole frames before the
+ * first bad one, and never look past the bytes read.
+ */
+
+static void test_walker(void)
+{
+  uint32_t failures[CAN_NUM_RX_MQUEUES];
+  uint32_t frames;
+  uint32_t unrouted;
+  size_t nbytes;
+  size_t len;
+  size_t whole;
+  int nframes;
+  int expect;
+  int bad;
+  int i;
+
+  test_open_rx_queues();
+  memcpy(failures, g_can_stats.rx_mq_failures, sizeof(failures));
+
+  for (i = 0; i < 1000; ++i)
+  {
+    nbytes = test_pack_read(&nframes);
+    frames = g_can_stats.rx_frames;
+    unrouted = g_can_stats.rx_unrouted;
+    HOST_CHECK(can_broadcast_dispatch_rx(g_readbuf, nbytes) == nframes);
+    HOST_CHECK(g_can_stats.rx_frames - frames == nframes);
+
+    for (expect = 0, bad = 0; bad < nframes; ++bad)
+    {
+      expect += test_reference_lookup(&g_readframes[bad].cm_hdr) < 0;
+    }
+
+    HOST_CHECK(g_can_stats.rx_unrouted - unrouted == expect);
+    test_check_rx_queues(nframes, failures);
+  }
+
+  /* Every truncation, from nothing up to one byte short of the read.
+   * Allocated to its exact length so that a walk past it is caught by
+   * tools like valgrind and ASan.
+   */
+
+  nbytes = test_pack_read(&nframes);
+  for (len = 0; len < nbytes; ++len)
+  {
+    FAR uint8_t *copy = malloc(len > 0 ? len : 1);
+
+    memcpy(copy, g_readbuf, len);
+    for (expect = 0, whole = 0;
+         whole + CAN_MSGLEN(g_readframes[expect].cm_hdr.ch_dlc) <= len;
+         whole += CAN_MSGLEN(g_readframes[expect].cm_hdr.ch_dlc), ++expect)
+    {
+    }
+
+    HOST_CHECK(can_broadcast_dispatch_rx(copy, len) == expect);
+    test_check_rx_queues(expect, failures);
+    free(copy);
+  }
+
+  /* An invalid DLC ends the walk at that frame */
+
+  for (bad = 0; bad < nframes; ++bad)
+  {
+    nbytes = test_pack_read(&nframes);
+    if (bad >= nframes)
+    {
+      break;
+    }
+
+    for (i = 0, whole = 0; i < bad; ++i)
+    {
+      whole += CAN_MSGLEN(g_readframes[i].cm_hdr.ch_dlc);
+    }
+
+    ((FAR struct can_hdr_s *)&g_readbuf[whole])->ch_dlc =
+      CAN_MAXDATALEN + 1 + host_random() % (15 - CAN_MAXDATALEN);
+    HOST_CHECK(can_broadcast_dispatch_rx(g_readbuf, nbytes) == bad);
+    test_check_rx_queues(bad, failures);
+  }
+}
+
+/* Frames per read with the batch buffer, and the rate reads are walked
+ * and dispatched at, queue sends included. The queues are drained between
+ * reads, as the tasks reading them would.
+ */
+
+static void test_walker_rate(void)
+{
+  struct can_msg_s msg;
+  uint64_t elapsed = 0;
+  uint64_t start;
+  unsigned long frames = 0;
+  size_t nbytes;
+  int nframes;
+  int route;
+  int i;
+
+  for (i = 0; i < TEST_WALKS; ++i)
+  {
+    nbytes = test_pack_read(&nframes);
+
+    start = host_time_ns();
+    can_broadcast_dispatch_rx(g_readbuf, nbytes);
+    elapsed += host_time_ns() - start;
+    frames += nframes;
+
+    for (route = 0; route < CAN_NUM_RX_MQUEUES; ++route)
+    {
+      while (mq_receive(g_rx_mqueues[route], (FAR char *)&msg, sizeof(msg),
+                        NULL) >= 0)
+      {
+      }
+    }
+  }
+
+  printf("test_can_broadcast: %.1f frames per %zu-byte read, "
+         "%.2f M frames/s walked and dispatched\n",
+         (double)frames / TEST_WALKS, sizeof(g_rxbuf),
+         1e3 * frames / elapsed);
+}
+
+/* The lowest free descriptor, to show that nothing was left open */
+
+static int test_next_fd(void)
+{
+  int fd = open("/dev/null", O_RDONLY);
+
+  close(fd);
+  return fd;
+}
+
+/* A start that cannot open its devices must close what it did open and
+ * let the next start try again.
+ */
+
+static void test_start_errors(void)
+{
+  FAR char *no_rx[] = { "can_broadcast", "/nonexistent/can0", NULL };
+  FAR char *no_tx[] = { "can_broadcast", "/dev/null", "/nonexistent/can1",
+                        NULL };
+  int fd = test_next_fd();
+
+  HOST_CHECK(can_broadcast_main(2, no_rx) == -1);
+  HOST_CHECK(!can_broadcast_running() && test_next_fd() == fd);
+  HOST_CHECK(can_broadcast_main(3, no_tx) == -1);
+  HOST_CHECK(!can_broadcast_running() && test_next_fd() == fd);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  int i;
+
+  for (i = 0; i < NITEMS(g_default_rx_routes); ++i)
+  {
+    HOST_CHECK(test_register(g_default_rx_routes[i].id,
+                             g_default_rx_routes[i].extid,
+                             g_default_rx_routes[i].mqueue_idx) == OK);
+  }
+
+  test_rate(g_nroutes);
+  test_rate(32);
+  test_rate(128);
+  test_rate(TEST_ROUTES);
+  test_register_errors();
+  test_walker();
+  test_walker_rate();
+  test_start_errors();
+  return host_finish("test_can_broadcast");
+}
@@ -0,0 +1,271 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_can_filter.c
+ * Electronic Throttle Controller program - CAN filter planning tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <nuttx/can/can.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "can_filter.h"
+#include "host.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define NITEMS(a)             (sizeof(a) / sizeof((a)[0]))
+#define MAX_IDS               24
+#define RANDOM_SETS           200
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static bool test_accepts(FAR const struct can_filter_s *filters, int n,
+                         uint32_t id)
+{
+  int i;
+
+  for (i = 0; i < n; ++i)
+  {
+    if (((id ^ filters[i].id) & filters[i].mask) == 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Checks what every plan must satisfy: no more filters than allowed,
+ * every ID accepted, filters in canonical form, and no filter made
+ * redundant by another. For standard IDs the accepted count is also
+ * checked against an exhaustive count over the ID space.
+ */
+
+static void test_check_plan(FAR const uint32_t *ids, int nids,
+                            uint32_t idmask,
+                            FAR const struct can_filter_s *filters, int n,
+                            int maxfilters)
+{
+  uint32_t accepted;
+  uint32_t id;
+  int i;
+  int j;
+
+  HOST_CHECK(n >= 1 && n <= maxfilters);
+
+  for (i = 0; i < nids; ++i)
+  {
+    HOST_CHECK(test_accepts(filters, n, ids[i]));
+  }
+
+  for (i = 0; i < n; ++i)
+  {
+    HOST_CHECK((filters[i].id & ~filters[i].mask) == 0);
+    HOST_CHECK((filters[i].mask & ~idmask) == 0);
+
+    for (j = 0; j < n; ++j)
+    {
+      if (i != j)
+      {
+        HOST_CHECK(!((filters[j].mask & filters[i].mask) == filters[i].mask
+                     && ((filters[j].id ^ filters[i].id)
+                         & filters[i].mask) == 0));
+      }
+    }
+  }
+
+  if (idmask == CAN_MAX_STDMSGID)
+  {
+    accepted = 0;
+    for (id = 0; id <= CAN_MAX_STDMSGID; ++id)
+    {
+      accepted += test_accepts(filters, n, id);
+    }
+
+    HOST_CHECK(accepted <= can_filter_accepted(filters, n, idmask));
+  }
+}
+
+/* Any number of copies of an ID, including copies with bits above the ID
+ * width, need one exact filter.
+ */
+
+static void test_identical_ids(void)
+{
+  const uint32_t ids[] = { 0x123, 0x123, 0x923, 0x123 };
+  struct can_filter_s filters[NITEMS(ids)];
+  int n;
+
+  n = can_filter_merge(ids, NITEMS(ids), CAN_MAX_STDMSGID, filters, 4);
+  HOST_CHECK(n == 1);
+  HOST_CHECK(filters[0].id == 0x123);
+  HOST_CHECK(filters[0].mask == CAN_MAX_STDMSGID);
+  HOST_CHECK(can_filter_accepted(filters, n, CAN_MAX_STDMSGID) == 1);
+
+  n = can_filter_merge(ids, NITEMS(ids), CAN_MAX_STDMSGID, filters, 1);
+  HOST_CHECK(n == 1);
+  HOST_CHECK(filters[0].mask == CAN_MAX_STDMSGID);
+}
+
+/* With a filter to spare for every ID, each gets an exact match, in the
+ * order given. With no filter at all, the caller must accept everything.
+ */
+
+static void test_more_filters_than_ids(void)
+{
+  const uint32_t ids[] = { 0x7ff, 0x000, 0x1b0 };
+  struct can_filter_s filters[NITEMS(ids)];
+  int n;
+  int i;
+
+  n = can_filter_merge(ids, NITEMS(ids), CAN_MAX_STDMSGID, filters, 8);
+  HOST_CHECK(n == NITEMS(ids));
+  for (i = 0; i < n; ++i)
+  {
+    HOST_CHECK(filters[i].id == ids[i]);
+    HOST_CHECK(filters[i].mask == CAN_MAX_STDMSGID);
+  }
+
+  HOST_CHECK(can_filter_accepted(filters, n, CAN_MAX_STDMSGID) == 3);
+
+  HOST_CHECK(can_filter_merge(ids, NITEMS(ids), CAN_MAX_STDMSGID,
+                              filters, 0) == 0);
+  HOST_CHECK(can_filter_merge(ids, 0, CAN_MAX_STDMSGID, filters, 4) == 0);
+}
+
+/* Merging takes the cheapest pair first. 0x100 and 0x101 join for free;
+ * then 0x100/0x101 joins 0x200 at a cost of five extra IDs, where either
+ * join with 0x7ff would open up half the ID space. Last, everything left
+ * goes into one filter.
+ */
+
+static void test_merge_order(void)
+{
+  const uint32_t ids[] = { 0x100, 0x200, 0x7ff, 0x101 };
+  struct can_filter_s filters[NITEMS(ids)];
+  int n;
+
+  n = can_filter_merge(ids, NITEMS(ids), CAN_MAX_STDMSGID, filters, 3);
+  HOST_CHECK(n == 3);
+  HOST_CHECK(filters[0].id == 0x100 && filters[0].mask == 0x7fe);
+  HOST_CHECK(filters[1].id == 0x200 && filters[1].mask == 0x7ff);
+  HOST_CHECK(filters[2].id == 0x7ff && filters[2].mask == 0x7ff);
+  HOST_CHECK(can_filter_accepted(filters, n, CAN_MAX_STDMSGID) == 4);
+
+  n = can_filter_merge(ids, NITEMS(ids), CAN_MAX_STDMSGID, filters, 2);
+  HOST_CHECK(n == 2);
+  HOST_CHECK(filters[0].id == 0x000 && filters[0].mask == 0x4fe);
+  HOST_CHECK(filters[1].id == 0x7ff && filters[1].mask == 0x7ff);
+  HOST_CHECK(can_filter_accepted(filters, n, CAN_MAX_STDMSGID) == 9);
+  test_check_plan(ids, NITEMS(ids), CAN_MAX_STDMSGID, filters, n, 2);
+
+  n = can_filter_merge(ids, NITEMS(ids), CAN_MAX_STDMSGID, filters, 1);
+  HOST_CHECK(n == 1);
+  HOST_CHECK(filters[0].id == 0x000 && filters[0].mask == 0x000);
+}
+
+/* A join that covers another filter drops it, so the plan may use fewer
+ * filters than allowed.
+ */
+
+static void test_merge_covers(void)
+{
+  const uint32_t ids[] = { 0x300, 0x301, 0x302, 0x303, 0x010 };
+  struct can_filter_s filters[NITEMS(ids)];
+  int n;
+
+  n = can_filter_merge(ids, NITEMS(ids), CAN_MAX_STDMSGID, filters, 2);
+  HOST_CHECK(n == 2);
+  HOST_CHECK(filters[0].id == 0x300 && filters[0].mask == 0x7fc);
+  HOST_CHECK(filters[1].id == 0x010 && filters[1].mask == 0x7ff);
+  test_check_plan(ids, NITEMS(ids), CAN_MAX_STDMSGID, filters, n, 2);
+}
+
+/* Extended IDs merge the same way over 29 bits */
+
+static void test_extended(void)
+{
+  const uint32_t ids[] = { 0xbbbb3, 0xbbbb4, 0x1e0000a0, 0xbbbb3 };
+  struct can_filter_s filters[NITEMS(ids)];
+  int n;
+
+  n = can_filter_merge(ids, NITEMS(ids), CAN_MAX_EXTMSGID, filters, 2);
+  HOST_CHECK(n == 2);
+  HOST_CHECK(filters[0].id == 0xbbbb0
+             && filters[0].mask == (CAN_MAX_EXTMSGID & ~0x7));
+  HOST_CHECK(filters[1].id == 0x1e0000a0
+             && filters[1].mask == CAN_MAX_EXTMSGID);
+  test_check_plan(ids, NITEMS(ids), CAN_MAX_EXTMSGID, filters, n, 2);
+}
+
+/* Random ID sets, clustered like real routing tables, against every
+ * filter count.
+ */
+
+static void test_random_sets(void)
+{
+  uint32_t ids[MAX_IDS];
+  struct can_filter_s filters[MAX_IDS];
+  uint32_t base;
+  int nids;
+  int max;
+  int n;
+  int set;
+  int i;
+
+  for (set = 0; set < RANDOM_SETS; ++set)
+  {
+    nids = 1 + host_random() % MAX_IDS;
+    base = host_random() & CAN_MAX_STDMSGID;
+    for (i = 0; i < nids; ++i)
+    {
+      ids[i] = (host_random() % 4 == 0 ? host_random() : base + i * 3)
+               & CAN_MAX_STDMSGID;
+    }
+
+    for (max = 1; max <= nids + 1; ++max)
+    {
+      n = can_filter_merge(ids, nids, CAN_MAX_STDMSGID, filters, max);
+      test_check_plan(ids, nids, CAN_MAX_STDMSGID, filters, n, max);
+    }
+  }
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  test_identical_ids();
+  test_more_filters_than_ids();
+  test_merge_order();
+  test_merge_covers();
+  test_extended();
+  test_random_sets();
+  return host_finish("test_can_filter");
+}
@@ -0,0 +1,358 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_can_ring.c
+ * Electronic Throttle Controller program - CAN tx ring tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "can_ring.h"
+#include "host.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define TEST_FRAMES           500000
+#define TEST_MQ_DEPTH         3     /* As the tx mqueues were created */
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/* One producer and one consumer passing TEST_FRAMES numbered frames. Each
+ * frame carries its number in its ID and payload, so the consumer can tell
+ * a frame that was lost, repeated, reordered or torn. Like the tasks, the
+ * producer queues a burst of frames per tick and then gives up the CPU.
+ */
+
+struct test_run_s
+{
+  FAR const char *name;
+  FAR void *(*produce)(FAR void *arg);
+  FAR void *(*consume)(FAR void *arg);
+  FAR struct can_ring_s *ring;
+  mqd_t mq;
+  int burst;                    /* Frames queued per tick */
+  bool done;
+  uint32_t dropped;             /* Frames the producer could not queue */
+  uint32_t received;
+  uint32_t bad;                 /* Frames out of order or corrupted */
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static struct can_txframe_s g_slots_4[4];
+static struct can_txframe_s g_slots_64[64];
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void test_fill(FAR struct can_msg_s *msg, uint32_t n)
+{
+  msg->cm_hdr.ch_id = n & CAN_MAX_EXTMSGID;
+  msg->cm_hdr.ch_extid = 1;
+  msg->cm_hdr.ch_dlc = 8;
+  msg->cm_hdr.ch_rtr = 0;
+  msg->cm_hdr.ch_error = 0;
+  memcpy(&msg->cm_data[0], &n, 4);
+  n = ~n;
+  memcpy(&msg->cm_data[4], &n, 4);
+}
+
+/* Checks a received frame follows the last one. Returns its number. */
+
+static uint32_t test_check(FAR struct test_run_s *run,
+                           FAR const struct can_msg_s *msg, uint32_t last)
+{
+  uint32_t n;
+  uint32_t inv;
+
+  memcpy(&n, &msg->cm_data[0], 4);
+  memcpy(&inv, &msg->cm_data[4], 4);
+  if (inv != ~n || msg->cm_hdr.ch_id != (n & CAN_MAX_EXTMSGID)
+      || msg->cm_hdr.ch_dlc != 8 || (run->received > 0 && n <= last))
+  {
+    ++run->bad;
+  }
+
+  ++run->received;
+  return n;
+}
+
+static bool test_done(FAR struct test_run_s *run)
+{
+  return __atomic_load_n(&run->done, __ATOMIC_ACQUIRE);
+}
+
+static FAR void *test_ring_produce(FAR void *arg)
+{
+  FAR struct test_run_s *run = arg;
+  FAR struct can_msg_s *msg;
+  uint32_t n;
+
+  for (n = 0; n < TEST_FRAMES; ++n)
+  {
+    if (n % run->burst == 0)
+    {
+      sched_yield();
+    }
+
+    msg = can_ring_claim(run->ring);
+    if (msg == NULL)
+    {
+      ++run->dropped;
+      continue;
+    }
+
+    test_fill(msg, n);
+    can_ring_publish(run->ring, n);
+  }
+
+  __atomic_store_n(&run->done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static FAR void *test_ring_consume(FAR void *arg)
+{
+  FAR struct test_run_s *run = arg;
+  FAR struct can_txframe_s *frame;
+  uint32_t last = 0;
+  bool done;
+
+  do
+  {
+    done = test_done(run);
+    while ((frame = can_ring_peek(run->ring)) != NULL)
+    {
+      last = test_check(run, &frame->msg, last);
+      if (frame->enqueue_us != last)
+      {
+        ++run->bad;
+      }
+
+      can_ring_release(run->ring);
+    }
+
+    sched_yield();
+  }
+  while (!done);
+
+  return NULL;
+}
+
+/* The path the rings replaced: a copy into a short non-blocking queue,
+ * whose send failures were ignored.
+ */
+
+static FAR void *test_mq_produce(FAR void *arg)
+{
+  FAR struct test_run_s *run = arg;
+  struct can_msg_s msg;
+  uint32_t n;
+
+  for (n = 0; n < TEST_FRAMES; ++n)
+  {
+    if (n % run->burst == 0)
+    {
+      sched_yield();
+    }
+
+    test_fill(&msg, n);
+    if (mq_send(run->mq, (FAR const char *)&msg, sizeof(msg), 1) < 0)
+    {
+      ++run->dropped;
+    }
+  }
+
+  __atomic_store_n(&run->done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static FAR void *test_mq_consume(FAR void *arg)
+{
+  FAR struct test_run_s *run = arg;
+  struct can_msg_s msg;
+  uint32_t last = 0;
+  bool done;
+
+  do
+  {
+    done = test_done(run);
+    while (mq_receive(run->mq, (FAR char *)&msg, sizeof(msg), NULL) >= 0)
+    {
+      last = test_check(run, &msg, last);
+    }
+
+    sched_yield();
+  }
+  while (!done);
+
+  return NULL;
+}
+
+static void test_run(FAR struct test_run_s *run)
+{
+  pthread_t producer;
+  pthread_t consumer;
+  uint64_t start;
+  uint64_t elapsed;
+
+  start = host_time_ns();
+  HOST_CHECK(pthread_create(&consumer, NULL, run->consume, run) == 0);
+  HOST_CHECK(pthread_create(&producer, NULL, run->produce, run) == 0);
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+  elapsed = host_time_ns() - start;
+
+  HOST_CHECK(run->bad == 0);
+  HOST_CHECK(run->received + run->dropped == TEST_FRAMES);
+  if (run->ring != NULL)
+  {
+    HOST_CHECK(run->ring->dropped == run->dropped);
+    HOST_CHECK(can_ring_count(run->ring) == 0);
+  }
+
+  printf("test_can_ring: %-15s bursts of %2d: %5.2f M frames/s, "
+         "%6u dropped\n", run->name, run->burst,
+         1e3 * run->received / elapsed, run->dropped);
+}
+
+static void test_ring(FAR const char *name, FAR struct can_ring_s *ring,
+                      int burst)
+{
+  struct test_run_s run;
+
+  memset(&run, 0, sizeof(run));
+  ring->head = ring->tail = 0;
+  ring->dropped = 0;
+  run.name = name;
+  run.burst = burst;
+  run.produce = test_ring_produce;
+  run.consume = test_ring_consume;
+  run.ring = ring;
+  test_run(&run);
+}
+
+/* Skipped if the host has no POSIX message queues */
+
+static void test_mq(int burst)
+{
+  struct mq_attr attr = {
+    .mq_maxmsg = TEST_MQ_DEPTH,
+    .mq_msgsize = sizeof(struct can_msg_s)
+  };
+
+  struct test_run_s run;
+  char name[32];
+
+  memset(&run, 0, sizeof(run));
+  run.name = "mqueue, 3 deep";
+  run.burst = burst;
+  run.produce = test_mq_produce;
+  run.consume = test_mq_consume;
+
+  snprintf(name, sizeof(name), "/test_can_ring.%d", getpid());
+  run.mq = mq_open(name, O_RDWR | O_NONBLOCK | O_CREAT, 0600, &attr);
+  if (run.mq == (mqd_t)-1)
+  {
+    printf("test_can_ring: no host message queues, mqueue path skipped\n");
+    return;
+  }
+
+  mq_unlink(name);
+  test_run(&run);
+  mq_close(run.mq);
+}
+
+/* Wrapping of the 16-bit indices, and a full ring dropping rather than
+ * overwriting frames, with no other thread involved.
+ */
+
+static void test_wrap(void)
+{
+  struct can_ring_s ring = CAN_RING_INITIALIZER(g_slots_4);
+  FAR struct can_msg_s *msg;
+  FAR struct can_txframe_s *frame;
+  uint32_t n;
+  uint32_t last = 0;
+  struct test_run_s run;
+  int i;
+
+  memset(&run, 0, sizeof(run));
+  ring.head = ring.tail = UINT16_MAX - 5;
+
+  for (n = 0; n < 100; ++n)
+  {
+    for (i = 0; i < 5; ++i)
+    {
+      msg = can_ring_claim(&ring);
+      if (i < 4 && HOST_CHECK(msg != NULL))
+      {
+        test_fill(msg, n * 4 + i);
+        can_ring_publish(&ring, n * 4 + i);
+      }
+      else if (i == 4)
+      {
+        HOST_CHECK(msg == NULL);
+      }
+    }
+
+    HOST_CHECK(can_ring_count(&ring) == 4 && ring.highwater == 4);
+    while ((frame = can_ring_peek(&ring)) != NULL)
+    {
+      last = test_check(&run, &frame->msg, last);
+      can_ring_release(&ring);
+    }
+  }
+
+  HOST_CHECK(run.bad == 0 && run.received == 400 && ring.dropped == 100);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  struct can_ring_s ring4 = CAN_RING_INITIALIZER(g_slots_4);
+  struct can_ring_s ring64 = CAN_RING_INITIALIZER(g_slots_64);
+
+  test_wrap();
+  test_ring("ring, 4 deep", &ring4, 4);
+  test_ring("ring, 64 deep", &ring64, 4);
+  test_mq(4);
+  test_ring("ring, 4 deep", &ring4, 16);
+  test_ring("ring, 64 deep", &ring64, 16);
+  test_mq(16);
+  return host_finish("test_can_ring");
+}
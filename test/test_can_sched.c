@@ -0,0 +1,317 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_can_sched.c
+ * Electronic Throttle Controller program - CAN transmit schedule tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "can_broadcast.h"
+#include "can_sched.h"
+#include "host.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define NITEMS(a)             (sizeof(a) / sizeof((a)[0]))
+#define TEST_RING             CAN_TELEM_TX_RING
+#define TEST_TICK_MS          5     /* The safing loop's period */
+#define TEST_JITTER_MS        3     /* Most a tick wakes up late */
+#define TEST_STALL_EVERY      997   /* Ticks between long stalls */
+#define TEST_STALL_MS         37
+#define TEST_TICKS            200000
+#define TEST_DEADBAND         3
+#define TEST_HEARTBEAT_MS     100
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+struct test_stats_s
+{
+  uint32_t last_slot;           /* Slot index of the last frame sent */
+  uint32_t max_late_ms;         /* Outside stalls */
+  uint64_t total_late_ms;
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static int16_t g_value;
+
+static bool test_pack(FAR struct can_msg_s *msg, FAR void *arg);
+static bool test_pack_value(FAR struct can_msg_s *msg, FAR void *arg);
+
+static struct can_sched_entry_s g_entries[] = {
+  CAN_SCHED_ENTRY(0x100, false, 8, 10, 0, test_pack, NULL),
+  CAN_SCHED_ENTRY(0x101, false, 8, 10, 5, test_pack, NULL),
+  CAN_SCHED_ENTRY(0x102, false, 8, 20, 15, test_pack, NULL),
+  CAN_SCHED_ENTRY(0x103, true, 8, 200, 10, test_pack, NULL),
+  CAN_SCHED_ON_CHANGE_ENTRY(0x104, false, 2, 10, 5, test_pack_value, NULL,
+                            can_sched_changed_be16, TEST_DEADBAND,
+                            TEST_HEARTBEAT_MS)
+};
+
+static struct can_sched_s g_sched = {
+  .entries = g_entries,
+  .nentries = NITEMS(g_entries),
+  .ring = TEST_RING
+};
+
+static struct test_stats_s g_stats[NITEMS(g_entries)];
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static bool test_pack(FAR struct can_msg_s *msg, FAR void *arg)
+{
+  msg->cm_data[0] = msg->cm_hdr.ch_id & 0xff;
+  return true;
+}
+
+static bool test_pack_value(FAR struct can_msg_s *msg, FAR void *arg)
+{
+  msg->cm_data[0] = (uint16_t)g_value >> 8;
+  msg->cm_data[1] = g_value & 0xff;
+  return true;
+}
+
+static int test_entry(uint32_t id)
+{
+  int i;
+
+  for (i = 0; i < NITEMS(g_entries); ++i)
+  {
+    if (g_entries[i].id == id)
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Slots of an entry that have come up since the schedule was started at
+ * start_ms, up to and including now_ms
+ */
+
+static uint32_t test_slots(FAR const struct can_sched_entry_s *entry,
+                           uint32_t start_ms, uint32_t now_ms)
+{
+  uint32_t since = now_ms - start_ms;
+
+  if (since < entry->offset_ms)
+  {
+    return 0;
+  }
+
+  return (since - entry->offset_ms) / entry->period_ms + 1;
+}
+
+/* Takes the frames one run of the schedule queued. Each entry may send at
+ * most once per run, and each frame must belong to a slot after that of
+ * the entry's previous frame.
+ */
+
+static void test_drain(uint32_t start_ms, uint32_t now_ms,
+                       FAR const uint32_t *due_ms, bool stalled)
+{
+  FAR struct can_ring_s *ring = &g_can_tx_rings[TEST_RING];
+  FAR struct can_txframe_s *frame;
+  FAR struct test_stats_s *stats;
+  bool sent[NITEMS(g_entries)];
+  uint32_t late_ms;
+  uint32_t slot;
+  int i;
+
+  memset(sent, 0, sizeof(sent));
+  while ((frame = can_ring_peek(ring)) != NULL)
+  {
+    i = test_entry(frame->msg.cm_hdr.ch_id);
+    if (!HOST_CHECK(i >= 0 && !sent[i]))
+    {
+      can_ring_release(ring);
+      continue;
+    }
+
+    sent[i] = true;
+    stats = &g_stats[i];
+    slot = test_slots(&g_entries[i], start_ms, now_ms);
+    HOST_CHECK(slot > stats->last_slot);
+    stats->last_slot = slot;
+
+    late_ms = now_ms - due_ms[i];
+    if (!stalled)
+    {
+      HOST_CHECK(late_ms <= TEST_JITTER_MS);
+      if (late_ms > stats->max_late_ms)
+      {
+        stats->max_late_ms = late_ms;
+      }
+    }
+
+    stats->total_late_ms += late_ms;
+    can_ring_release(ring);
+  }
+}
+
+/* Runs the schedule from a 5 ms loop whose ticks wake up to 3 ms late,
+ * with an occasional long stall, across the 32-bit millisecond wrap. Every
+ * slot must end up either sent or counted as missed: the schedule neither
+ * drifts nor bursts.
+ */
+
+static void test_jitter(void)
+{
+  uint32_t due_ms[NITEMS(g_entries)];
+  uint32_t start_ms = UINT32_MAX - 10 * 1000;
+  uint32_t now_ms = start_ms;
+  uint32_t sent;
+  uint32_t slots;
+  bool stalled;
+  int tick;
+  int i;
+
+  memset(g_stats, 0, sizeof(g_stats));
+  can_sched_start(&g_sched, start_ms);
+
+  for (tick = 0; tick < TEST_TICKS; ++tick)
+  {
+    stalled = tick % TEST_STALL_EVERY == TEST_STALL_EVERY - 1;
+    now_ms = start_ms + tick * TEST_TICK_MS;
+    now_ms += stalled ? TEST_STALL_MS : host_random() % (TEST_JITTER_MS + 1);
+
+    /* The on-change value mostly wanders within the deadband */
+
+    if (host_random() % 50 == 0)
+    {
+      g_value += TEST_DEADBAND + 1;
+    }
+
+    for (i = 0; i < NITEMS(g_entries); ++i)
+    {
+      due_ms[i] = g_entries[i].due_ms;
+    }
+
+    can_sched_run(&g_sched, now_ms);
+    test_drain(start_ms, now_ms, due_ms, stalled);
+  }
+
+  for (i = 0; i < NITEMS(g_entries); ++i)
+  {
+    FAR struct can_sched_entry_s *entry = &g_entries[i];
+
+    slots = test_slots(entry, start_ms, now_ms);
+    sent = entry->sent + entry->suppressed;
+    HOST_CHECK(sent + entry->missed == slots);
+    printf("test_can_sched: 0x%03" PRIx32 " every %3u ms: %6" PRIu32
+           " slots, %6" PRIu32 " sent, %4" PRIu32 " suppressed, %3" PRIu32
+           " missed, late %.2f ms mean, %" PRIu32 " ms max unstalled\n",
+           entry->id, entry->period_ms, slots, entry->sent,
+           entry->suppressed, entry->missed,
+           (double)g_stats[i].total_late_ms / entry->sent,
+           g_stats[i].max_late_ms);
+  }
+}
+
+/* Runs the schedule and discards what it queued */
+
+static void test_run(uint32_t now_ms)
+{
+  can_sched_run(&g_sched, now_ms);
+  while (can_ring_peek(&g_can_tx_rings[TEST_RING]) != NULL)
+  {
+    can_ring_release(&g_can_tx_rings[TEST_RING]);
+  }
+}
+
+/* The on-change entry sends when the value moves past the deadband, and
+ * otherwise once per heartbeat.
+ */
+
+static void test_on_change(void)
+{
+  FAR struct can_sched_entry_s *entry = &g_entries[4];
+  uint32_t now_ms;
+  uint32_t sent;
+
+  can_sched_start(&g_sched, 0);
+  g_value = 0;
+
+  for (now_ms = 0; now_ms < 1000; now_ms += TEST_TICK_MS)
+  {
+    test_run(now_ms);
+  }
+
+  HOST_CHECK(entry->sent == 1000 / TEST_HEARTBEAT_MS);
+
+  /* The heartbeat at 1005 ms, then changes within and past the deadband */
+
+  test_run(1005);
+  sent = entry->sent;
+  g_value = TEST_DEADBAND;
+  test_run(1015);
+  test_run(1025);
+  HOST_CHECK(entry->sent == sent);
+
+  g_value = TEST_DEADBAND + 1;
+  test_run(1035);
+  HOST_CHECK(entry->sent == sent + 1);
+}
+
+/* For comparison: a loop that sleeps a fixed time between sends, as the
+ * safing loop did with usleep(50000), runs slow by however long each pass
+ * takes, and the error adds up.
+ */
+
+static void test_sleep_loop(void)
+{
+  uint32_t now_ms = 0;
+  uint32_t sent = 0;
+
+  while (now_ms < 60 * 1000)
+  {
+    now_ms += 50 + host_random() % (TEST_JITTER_MS + 1);
+    ++sent;
+  }
+
+  printf("test_can_sched: a 50 ms sleep loop sends %" PRIu32 " frames a "
+         "minute instead of 1200\n", sent);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  test_on_change();
+  test_jitter();
+  test_sleep_loop();
+  return host_finish("test_can_sched");
+}
@@ -0,0 +1,242 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_can_signals.c
+ * Electronic Throttle Controller program - CAN signal layout tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "can_messages.h"
+#include "host.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define RANDOM_FRAMES         100000
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* The hand-written packing the generated accessors replaced, as it was
+ * before CAN_SIGNAL. The DRS angle was read through a uint16_t cast of
+ * bytes 1-2, which on the little-endian target is the memcpy() below.
+ */
+
+static void old_pack_fault(FAR uint8_t *data, uint16_t fault_code,
+                           uint8_t keycycle, uint32_t time_ms)
+{
+  data[0] = (uint8_t)(fault_code >> 8);
+  data[1] = (uint8_t)(fault_code & 0xff);
+  data[2] = keycycle;
+  data[3] = (uint8_t)(time_ms >> 24);
+  data[4] = (uint8_t)(time_ms >> 16);
+  data[5] = (uint8_t)(time_ms >> 8);
+  data[6] = (uint8_t)(time_ms & 0xff);
+}
+
+static void old_pack_brake(FAR uint8_t *data, int16_t brk_f, int16_t brk_r)
+{
+  data[0] = brk_f >> 8;
+  data[1] = brk_f & 0xff;
+  data[2] = brk_r >> 8;
+  data[3] = brk_r & 0xff;
+}
+
+static void old_pack_ws(FAR uint8_t *data, FAR const int16_t *ws)
+{
+  data[0] = ws[0] >> 8;
+  data[1] = ws[0] & 0xff;
+  data[2] = ws[1] >> 8;
+  data[3] = ws[1] & 0xff;
+  data[4] = ws[2] >> 8;
+  data[5] = ws[2] & 0xff;
+  data[6] = ws[3] >> 8;
+  data[7] = ws[3] & 0xff;
+}
+
+static void old_put_be16(FAR uint8_t *data, uint32_t value)
+{
+  if (value > UINT16_MAX)
+  {
+    value = UINT16_MAX;
+  }
+
+  data[0] = value >> 8;
+  data[1] = value & 0xff;
+}
+
+static void old_pack_canstat(FAR uint8_t *data, FAR const uint32_t *v)
+{
+  old_put_be16(&data[0], v[0]);
+  old_put_be16(&data[2], v[1]);
+  old_put_be16(&data[4], v[2] / 100);
+  data[6] = v[3] > UINT8_MAX ? UINT8_MAX : v[3];
+  data[7] = v[4] > UINT8_MAX ? UINT8_MAX : v[4];
+}
+
+static uint16_t old_drs_angle(FAR const uint8_t *data)
+{
+  uint16_t angle;
+
+  memcpy(&angle, &data[1], sizeof(angle));
+  return angle;
+}
+
+static uint32_t test_saturate(uint32_t value, uint32_t max)
+{
+  return value > max ? max : value;
+}
+
+/* Random values, weighted towards the edges of each field */
+
+static uint32_t test_value(void)
+{
+  static const uint32_t edges[] = {
+    0, 1, 0x7f, 0x80, 0xff, 0x100, 0x7fff, 0x8000, 0xffff, 0x10000,
+    0x7fffffff, 0x80000000, 0xffffffff
+  };
+
+  uint32_t r = host_random();
+
+  if ((r & 3) == 0)
+  {
+    return edges[(r >> 2) % (sizeof(edges) / sizeof(edges[0]))];
+  }
+
+  return host_random() >> (r % 32);
+}
+
+/* Packs one frame each way into payloads with the same random contents,
+ * so that bytes a layout should leave alone are compared too, then checks
+ * that unpacking gives back the values packed.
+ */
+
+static bool test_frame(void)
+{
+  uint8_t before[8];
+  uint8_t old[8];
+  uint8_t new[8];
+  uint32_t v[5];
+  int16_t ws[4];
+  bool ok = true;
+  int i;
+
+  for (i = 0; i < 8; ++i)
+  {
+    before[i] = host_random();
+  }
+
+  for (i = 0; i < 5; ++i)
+  {
+    v[i] = test_value();
+  }
+
+  for (i = 0; i < 4; ++i)
+  {
+    ws[i] = (int16_t)v[i];
+  }
+
+  /* DTC and internal fault table entries */
+
+  memcpy(old, before, 8);
+  memcpy(new, before, 8);
+  old_pack_fault(old, v[0], v[1], v[2]);
+  fault_code_pack(new, (uint16_t)v[0]);
+  fault_keycycle_pack(new, (uint8_t)v[1]);
+  fault_time_ms_pack(new, v[2]);
+  ok &= HOST_CHECK(memcmp(old, new, 8) == 0);
+  ok &= HOST_CHECK(fault_code_unpack(new) == (uint16_t)v[0]);
+  ok &= HOST_CHECK(fault_keycycle_unpack(new) == (uint8_t)v[1]);
+  ok &= HOST_CHECK((uint32_t)fault_time_ms_unpack(new) == v[2]);
+
+  /* Brake pressures */
+
+  memcpy(old, before, 8);
+  memcpy(new, before, 8);
+  old_pack_brake(old, ws[0], ws[1]);
+  brake_front_pack(new, ws[0]);
+  brake_rear_pack(new, ws[1]);
+  ok &= HOST_CHECK(memcmp(old, new, 8) == 0);
+  ok &= HOST_CHECK(brake_front_unpack(new) == ws[0]);
+  ok &= HOST_CHECK(brake_rear_unpack(new) == ws[1]);
+
+  /* Wheel speeds */
+
+  memcpy(old, before, 8);
+  memcpy(new, before, 8);
+  old_pack_ws(old, ws);
+  ws_ws1_pack(new, ws[0]);
+  ws_ws2_pack(new, ws[1]);
+  ws_ws3_pack(new, ws[2]);
+  ws_ws4_pack(new, ws[3]);
+  ok &= HOST_CHECK(memcmp(old, new, 8) == 0);
+  ok &= HOST_CHECK(ws_ws1_unpack(new) == ws[0]
+                   && ws_ws2_unpack(new) == ws[1]
+                   && ws_ws3_unpack(new) == ws[2]
+                   && ws_ws4_unpack(new) == ws[3]);
+
+  /* Bus health summary, clamped by the caller as can_broadcast.c does */
+
+  memcpy(old, before, 8);
+  memcpy(new, before, 8);
+  old_pack_canstat(old, v);
+  canstat_ring_drops_pack(new, test_saturate(v[0], UINT16_MAX));
+  canstat_rx_drops_pack(new, test_saturate(v[1], UINT16_MAX));
+  canstat_max_latency_us_pack(new, test_saturate(v[2], UINT16_MAX * 100));
+  canstat_write_failures_pack(new, test_saturate(v[3], UINT8_MAX));
+  canstat_bus_errors_pack(new, test_saturate(v[4], UINT8_MAX));
+  ok &= HOST_CHECK(memcmp(old, new, 8) == 0);
+  ok &= HOST_CHECK(canstat_max_latency_us_unpack(new)
+                   == (int32_t)test_saturate(v[2], UINT16_MAX * 100)
+                      / 100 * 100);
+
+  /* DRS status and control */
+
+  memcpy(old, before, 8);
+  memcpy(new, before, 8);
+  old[0] = (uint8_t)v[0];
+  drs_status_pack(new, (uint8_t)v[0]);
+  ok &= HOST_CHECK(memcmp(old, new, 8) == 0);
+  ok &= HOST_CHECK(drs_control_cmd_unpack(before) == before[0]);
+  ok &= HOST_CHECK(drs_control_angle_unpack(before)
+                   == old_drs_angle(before));
+  return ok;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  int i;
+
+  for (i = 0; i < RANDOM_FRAMES && test_frame(); ++i)
+  {
+  }
+
+  return host_finish("test_can_signals");
+}
@@ -0,0 +1,471 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_canreplay.c
+ * Electronic Throttle Controller program - CAN log replay parser tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "host.h"
+
+/* The parsers are private to canreplay.c and the walker that replayed
+ * frames reach is private to can_broadcast.c, so both are built in here.
+ */
+
+#define main can_broadcast_main
+#include "../can_broadcast.c"
+#undef main
+
+#define main canreplay_main
+#include "../canreplay.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define NITEMS(a)             (sizeof(a) / sizeof((a)[0]))
+#define TEST_RX_QUEUE_DEPTH   10    /* Linux default limit; NuttX uses 3 */
+#define TEST_MAX_FRAMES       8
+#define TEST_PCAP_OVERSIZE    72    /* A CAN FD record */
+#define TEST_LINKTYPE_EN10MB  1
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+struct test_candump_s
+{
+  FAR const char *line;
+  bool ok;
+  uint32_t id;
+  bool extid;
+  bool rtr;
+  uint8_t dlc;
+  uint8_t data[CAN_MAXDATALEN];
+  uint64_t ts_us;
+};
+
+/* One record of the pcap files written below */
+
+struct test_pcap_rec_s
+{
+  uint32_t sec;
+  uint32_t usec;
+  uint32_t can_id;              /* SocketCAN ID, with its flags */
+  uint8_t dlc;
+  uint32_t incl_len;            /* 0 for the header and dlc bytes */
+  bool replayed;
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static const struct test_candump_s g_candump_lines[] =
+{
+  { "(1650000000.000100) can0 1A0#0102030405060708", true,
+    CAN_ID_ENGINE_RX, false, false, 8, { 1, 2, 3, 4, 5, 6, 7, 8 },
+    1650000000000100ull },
+  { " (12.5) vcan0 000AAAA2#BEEF", true,
+    CAN_ID_DRS_CONTROL_RX, true, false, 2, { 0xbe, 0xef }, 12000005ull },
+  { "(3.000000) can0 123#R4", true, 0x123, false, true, 4, { 0 },
+    3000000ull },
+  { "(3.000001) can0 7FF#", true, 0x7ff, false, false, 0, { 0 },
+    3000001ull },
+  { "(4.000000) can0 800#00", false },
+  { "(4.000000) can0 3FFFFFFF#00", false },
+  { "(4.000000) can0 123#010203040506070809", false },
+  { "(4.000000) can0 123#0G", false },
+  { "(4.000000) can0 12X#00", false },
+  { "(4.000000) can0 #00", false },
+  { "(4.000000) can0 123##100", false },
+  { "(4.000000) can0 123", false },
+  { "can0 123#00", false },
+  { "", false },
+};
+
+/* Covers every way a record is dropped, between frames that are kept */
+
+static const struct test_pcap_rec_s g_pcap_recs[] =
+{
+  { 100, 250, CAN_ID_ENGINE_RX, 8, 0, true },
+  { 100, 999999, SOCKETCAN_EFF_FLAG | CAN_ID_DRS_CONTROL_RX, 2, 0, true },
+  { 101, 0, TEST_PCAP_OVERSIZE, 8, TEST_PCAP_OVERSIZE, false },
+  { 101, 1, SOCKETCAN_ERR_FLAG | 0x4, 8, 0, false },
+  { 101, 2, 0x123, 8, SOCKETCAN_HDR_LEN + 4, false },
+  { 101, 3, 0x123, 3, SOCKETCAN_HDR_LEN - 1, false },
+  { 101, 4, SOCKETCAN_RTR_FLAG | 0x123, 0, 0, true },
+  { 4000000000u, 500000, CAN_ID_ENGINE_RX, 1, 0, true },
+};
+
+static char g_path[64];
+
+/* Frames read back from the last log, in order */
+
+static struct can_msg_s g_frames[TEST_MAX_FRAMES];
+static uint64_t g_frame_ts[TEST_MAX_FRAMES];
+static int g_nframes;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void test_candump_lines(void)
+{
+  FAR const struct test_candump_s *expect;
+  struct can_msg_s msg;
+  uint64_t ts_us;
+  bool ok;
+  int i;
+
+  for (i = 0; i < NITEMS(g_candump_lines); ++i)
+  {
+    expect = &g_candump_lines[i];
+    ts_us = 0;
+    ok = canreplay_parse_candump(expect->line, &msg, &ts_us);
+    if (!HOST_CHECK(ok == expect->ok))
+    {
+      fprintf(stderr, "  \"%s\"\n", expect->line);
+      continue;
+    }
+
+    if (!ok)
+    {
+      continue;
+    }
+
+    if (!HOST_CHECK(msg.cm_hdr.ch_id == expect->id
+                    && msg.cm_hdr.ch_extid == expect->extid
+                    && msg.cm_hdr.ch_rtr == expect->rtr
+                    && msg.cm_hdr.ch_dlc == expect->dlc
+                    && ts_us == expect->ts_us
+                    && memcmp(msg.cm_data, expect->data,
+                              expect->rtr ? 0 : expect->dlc) == 0))
+    {
+      fprintf(stderr, "  \"%s\"\n", expect->line);
+    }
+  }
+}
+
+/* Reads every frame of the log at g_path into g_frames */
+
+static int test_replay(FAR struct canreplay_s *replay)
+{
+  int ret = canreplay_open(replay, g_path);
+
+  if (ret < 0)
+  {
+    return ret;
+  }
+
+  g_nframes = 0;
+  while (g_nframes < TEST_MAX_FRAMES
+         && canreplay_next(replay, &g_frames[g_nframes],
+                           &g_frame_ts[g_nframes]))
+  {
+    ++g_nframes;
+  }
+
+  fclose(replay->log);
+  return OK;
+}
+
+/* A candump log is read line by line and lines that are not frames are
+ * counted and passed over.
+ */
+
+static void test_candump_file(void)
+{
+  struct canreplay_s replay;
+  FAR FILE *file;
+  int expect = 0;
+  int i;
+
+  file = fopen(g_path, "w");
+  if (!HOST_CHECK(file != NULL))
+  {
+    return;
+  }
+
+  for (i = 0; i < NITEMS(g_candump_lines); ++i)
+  {
+    fprintf(file, "%s\n", g_candump_lines[i].line);
+  }
+
+  fclose(file);
+
+  if (!HOST_CHECK(test_replay(&replay) == OK))
+  {
+    return;
+  }
+
+  HOST_CHECK(replay.format == CANREPLAY_CANDUMP);
+  for (i = 0; i < NITEMS(g_candump_lines); ++i)
+  {
+    if (g_candump_lines[i].ok)
+    {
+      HOST_CHECK(expect < g_nframes
+                 && g_frames[expect].cm_hdr.ch_id == g_candump_lines[i].id
+                 && g_frame_ts[expect] == g_candump_lines[i].ts_us);
+      ++expect;
+    }
+  }
+
+  HOST_CHECK(g_nframes == expect);
+  HOST_CHECK(replay.skipped == NITEMS(g_candump_lines) - expect);
+}
+
+static void test_pcap_word(FAR FILE *file, uint32_t value, bool swapped)
+{
+  value = canreplay_swap32(value, swapped);
+  fwrite(&value, sizeof(value), 1, file);
+}
+
+/* Writes g_pcap_recs to g_path with the given byte order, timestamp
+ * precision and link type.
+ */
+
+static void test_write_pcap(bool swapped, bool nsec, uint32_t linktype)
+{
+  FAR const struct test_pcap_rec_s *rec;
+  uint8_t data[TEST_PCAP_OVERSIZE];
+  uint32_t len;
+  FAR FILE *file;
+  int i;
+
+  file = fopen(g_path, "wb");
+  if (!HOST_CHECK(file != NULL))
+  {
+    return;
+  }
+
+  test_pcap_word(file, nsec ? PCAP_MAGIC_NSEC : PCAP_MAGIC_USEC, swapped);
+  test_pcap_word(file, 2 | (4 << 16), swapped);
+  test_pcap_word(file, 0, swapped);
+  test_pcap_word(file, 0, swapped);
+  test_pcap_word(file, sizeof(data), swapped);
+  test_pcap_word(file, linktype, swapped);
+
+  for (i = 0; i < NITEMS(g_pcap_recs); ++i)
+  {
+    rec = &g_pcap_recs[i];
+    len = rec->incl_len ? rec->incl_len : SOCKETCAN_HDR_LEN + rec->dlc;
+
+    /* The SocketCAN header is in network byte order whatever the file's */
+
+    memset(data, 0, sizeof(data));
+    data[0] = rec->can_id >> 24;
+    data[1] = rec->can_id >> 16;
+    data[2] = rec->can_id >> 8;
+    data[3] = rec->can_id;
+    data[4] = rec->dlc;
+    memset(&data[SOCKETCAN_HDR_LEN], i + 1, rec->dlc);
+
+    test_pcap_word(file, rec->sec, swapped);
+    test_pcap_word(file, nsec ? rec->usec * NSEC_PER_USEC : rec->usec,
+                   swapped);
+    test_pcap_word(file, len, swapped);
+    test_pcap_word(file, len, swapped);
+    fwrite(data, 1, len, file);
+  }
+
+  fclose(file);
+}
+
+static void test_pcap_file(bool swapped, bool nsec)
+{
+  FAR const struct test_pcap_rec_s *rec;
+  struct canreplay_s replay;
+  FAR struct can_msg_s *msg;
+  int expect = 0;
+  int i;
+
+  test_write_pcap(swapped, nsec, PCAP_LINKTYPE_SOCKETCAN);
+  if (!HOST_CHECK(test_replay(&replay) == OK))
+  {
+    return;
+  }
+
+  HOST_CHECK(replay.format == CANREPLAY_PCAP && replay.swapped == swapped
+             && replay.nsec == nsec);
+
+  for (i = 0; i < NITEMS(g_pcap_recs); ++i)
+  {
+    rec = &g_pcap_recs[i];
+    if (!rec->replayed)
+    {
+      continue;
+    }
+
+    msg = &g_frames[expect];
+    if (!HOST_CHECK(expect < g_nframes
+                    && msg->cm_hdr.ch_id
+                       == (rec->can_id & CAN_MAX_EXTMSGID)
+                    && msg->cm_hdr.ch_extid
+                       == ((rec->can_id & SOCKETCAN_EFF_FLAG) != 0)
+                    && msg->cm_hdr.ch_rtr
+                       == ((rec->can_id & SOCKETCAN_RTR_FLAG) != 0)
+                    && msg->cm_hdr.ch_dlc == rec->dlc
+                    && (rec->dlc == 0 || msg->cm_data[rec->dlc - 1] == i + 1)
+                    && g_frame_ts[expect]
+                       == (uint64_t)rec->sec * USEC_PER_SEC + rec->usec))
+    {
+      fprintf(stderr, "  record %d, %sswapped, %s\n", i,
+              swapped ? "" : "not ", nsec ? "nsec" : "usec");
+    }
+
+    ++expect;
+  }
+
+  HOST_CHECK(g_nframes == expect);
+  HOST_CHECK(replay.skipped == NITEMS(g_pcap_recs) - expect);
+
+  test_write_pcap(swapped, nsec, TEST_LINKTYPE_EN10MB);
+  HOST_CHECK(canreplay_open(&replay, g_path) == -EPROTONOSUPPORT);
+}
+
+static bool test_open_rx_queues(void)
+{
+  struct mq_attr attr = {
+    .mq_maxmsg = TEST_RX_QUEUE_DEPTH,
+    .mq_msgsize = sizeof(struct can_msg_s)
+  };
+
+  char name[32];
+  int i;
+
+  for (i = 0; i < CAN_NUM_RX_MQUEUES; ++i)
+  {
+    snprintf(name, sizeof(name), "/test_canreplay.%d.%d", getpid(), i);
+    g_rx_mqueues[i] = mq_open(name, O_RDWR | O_NONBLOCK | O_CREAT, 0600,
+                              &attr);
+    if (g_rx_mqueues[i] == (mqd_t)-1)
+    {
+      printf("test_canreplay: no host message queues, routing not "
+             "checked\n");
+      return false;
+    }
+
+    mq_unlink(name);
+  }
+
+  return true;
+}
+
+/* Packs the frames read from the last log as canreplay_run() writes them
+ * and walks them as the broadcast task would. Each routed frame must
+ * arrive whole on its queue, in log order.
+ */
+
+static void test_dispatch(bool queues)
+{
+  uint8_t buf[sizeof(struct can_msg_s) * TEST_MAX_FRAMES];
+  struct can_msg_s msg;
+  uint32_t unrouted = g_can_stats.rx_unrouted;
+  int expect_unrouted = 0;
+  size_t len = 0;
+  ssize_t got;
+  int route;
+  int i;
+
+  for (i = 0; i < g_nframes; ++i)
+  {
+    memcpy(&buf[len], &g_frames[i], CAN_MSGLEN(g_frames[i].cm_hdr.ch_dlc));
+    len += CAN_MSGLEN(g_frames[i].cm_hdr.ch_dlc);
+    if (can_route_lookup(&g_frames[i].cm_hdr) < 0)
+    {
+      ++expect_unrouted;
+    }
+  }
+
+  HOST_CHECK(can_broadcast_dispatch_rx(buf, len) == g_nframes);
+  HOST_CHECK(g_can_stats.rx_unrouted - unrouted == expect_unrouted);
+  HOST_CHECK(expect_unrouted < g_nframes);
+
+  if (!queues)
+  {
+    return;
+  }
+
+  for (i = 0; i < g_nframes; ++i)
+  {
+    route = can_route_lookup(&g_frames[i].cm_hdr);
+    if (route < 0)
+    {
+      continue;
+    }
+
+    got = mq_receive(g_rx_mqueues[route], (FAR char *)&msg, sizeof(msg),
+                     NULL);
+    HOST_CHECK(got == CAN_MSGLEN(g_frames[i].cm_hdr.ch_dlc)
+               && memcmp(&msg, &g_frames[i], got) == 0);
+  }
+
+  for (route = 0; route < CAN_NUM_RX_MQUEUES; ++route)
+  {
+    HOST_CHECK(mq_receive(g_rx_mqueues[route], (FAR char *)&msg,
+                          sizeof(msg), NULL) < 0);
+  }
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  bool queues;
+  int i;
+
+  for (i = 0; i < NITEMS(g_default_rx_routes); ++i)
+  {
+    if (g_default_rx_routes[i].mqueue_idx < CAN_NUM_RX_MQUEUES)
+    {
+      HOST_CHECK(can_broadcast_register_rx(g_default_rx_routes[i].id,
+                                           g_default_rx_routes[i].extid,
+                                           g_default_rx_routes[i].mqueue_idx)
+                 == OK);
+    }
+  }
+
+  queues = test_open_rx_queues();
+  snprintf(g_path, sizeof(g_path), "/tmp/test_canreplay.%d", getpid());
+
+  test_candump_lines();
+  test_candump_file();
+  test_dispatch(queues);
+
+  for (i = 0; i < 4; ++i)
+  {
+    test_pcap_file((i & 1) != 0, (i & 2) != 0);
+    test_dispatch(queues);
+  }
+
+  unlink(g_path);
+  return host_finish("test_canreplay");
+}
@@ -0,0 +1,584 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_dtc_store.c
+ * Electronic Throttle Controller program - DTC store concurrency tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "host.h"
+
+/* The store is private to safing.c */
+
+#define main safing_main
+#include "../safing.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define TEST_THREADS          6
+#define TEST_ROUNDS           400
+#define TEST_OCCURRENCES      4     /* Per thread and code in a round */
+#define TEST_CONFIRMED        8     /* Codes stored with safing_store_dtc() */
+#define TEST_PENDING          4     /* ... and with safing_report_dtc() */
+#define TEST_FULL_CODES       24    /* More than the table holds */
+#define TEST_LOG_SIZE         (SAFING_FAULTLOG_SECTORS \
+                               * SAFING_FAULTLOG_SECTOR_SIZE)
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+struct test_round_s
+{
+  int ncodes;                       /* Codes recorded by each thread */
+  int npending;                     /* The last npending are reported */
+  bool faults;                      /* Also store internal faults */
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* The fault log, kept in a file across simulated power cycles */
+
+static int g_log_fd;
+
+static pthread_barrier_t g_start;
+static pthread_barrier_t g_done;
+static FAR const struct test_round_s *g_round;
+static bool g_stop;
+
+/* Set by the signal handler in the thread it interrupted */
+
+static __thread volatile bool g_signalled;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static uint16_t test_code(int i)
+{
+  return DTC_P(1 + i);
+}
+
+static void test_reset(void)
+{
+  memset(g_dtc_entries, 0, sizeof(g_dtc_entries));
+  memset(g_dtc_present, 0, sizeof(g_dtc_present));
+  memset(g_dtc_slot_of, 0, sizeof(g_dtc_slot_of));
+  g_dtc_table.valid = 0;
+  g_dtc_table.logged = 0;
+  g_dtc_table.lost = 0;
+
+  memset(g_fault_entries, 0, sizeof(g_fault_entries));
+  memset(g_fault_present, 0, sizeof(g_fault_present));
+  memset(g_fault_slot_of, 0, sizeof(g_fault_slot_of));
+  g_fault_table.valid = 0;
+  g_fault_table.logged = 0;
+  g_fault_table.lost = 0;
+}
+
+/* Records a code the workers record too, perhaps while the interrupted
+ * worker holds its entry.
+ */
+
+static void test_sigusr1(int signo)
+{
+  safing_store_dtc(test_code(0));
+  g_signalled = true;
+}
+
+/* Each thread records every code of the round TEST_OCCURRENCES times, in
+ * its own order, so that threads collide on both new and stored codes.
+ */
+
+static FAR void *test_worker(FAR void *arg)
+{
+  int id = (int)(intptr_t)arg;
+  int n;
+  int i;
+  int k;
+
+  while (true)
+  {
+    pthread_barrier_wait(&g_start);
+    if (g_stop)
+    {
+      return NULL;
+    }
+
+    n = g_round->ncodes;
+    for (k = 0; k < TEST_OCCURRENCES; ++k)
+    {
+      for (i = 0; i < n; ++i)
+      {
+        int c = (i + k + id) % n;
+
+        c = (id & 1) != 0 ? n - 1 - c : c;
+
+        if (c >= n - g_round->npending)
+        {
+          safing_report_dtc(test_code(c));
+        }
+        else
+        {
+          safing_store_dtc(test_code(c));
+        }
+      }
+
+      if (g_round->faults)
+      {
+        safing_store_internal_fault(FAULT_CAN_OPEN_FAILED + id % 3);
+      }
+    }
+
+    /* Each worker is signalled once per round, maybe after it is done */
+
+    while (!g_signalled)
+    {
+      sched_yield();
+    }
+
+    g_signalled = false;
+    pthread_barrier_wait(&g_done);
+  }
+}
+
+/* Checks one table after a round: every valid slot holds a different code,
+ * the present bitmap and slot_of agree with the slots, and no entry is left
+ * mid-write. Unless occurrences is zero, every one of them must also have
+ * been either counted or reported lost; that does not hold once entries
+ * are replaced. Returns the number of codes stored.
+ */
+
+static int test_check_table(FAR struct safing_store_s *store,
+                            uint32_t occurrences)
+{
+  uint32_t present[SAFING_DTC_INDICES / 32];
+  uint32_t counted = 0;
+  uint32_t valid = store->valid;
+  int nindices = store->log_type == FAULTLOG_TYPE_DTC
+                 ? SAFING_DTC_INDICES : SAFING_FAULT_INDICES;
+  int slot;
+  int index;
+  int i;
+
+  memset(present, 0, sizeof(present));
+
+  for (slot = 0; slot < store->nentries; ++slot)
+  {
+    FAR struct fault_entry_s *entry = &store->entries[slot];
+
+    HOST_CHECK((entry->seq & 1) == 0);
+    if ((valid & (1u << slot)) == 0)
+    {
+      HOST_CHECK(entry->status == SAFING_ENTRY_EMPTY);
+      continue;
+    }
+
+    index = safing_store_index(store, entry->fault_code);
+    HOST_CHECK(index >= 0 && index < nindices);
+    HOST_CHECK((present[index / 32] & (1u << (index % 32))) == 0);
+    present[index / 32] |= 1u << (index % 32);
+    HOST_CHECK(store->slot_of[index] == slot);
+    HOST_CHECK(SAFING_ENTRY_COUNT(entry->status) < SAFING_ENTRY_MAX_COUNT);
+    counted += SAFING_ENTRY_COUNT(entry->status);
+  }
+
+  for (i = 0; i < nindices / 32; ++i)
+  {
+    HOST_CHECK(store->present[i] == present[i]);
+  }
+
+  if (occurrences > 0)
+  {
+    HOST_CHECK(counted + store->lost == occurrences);
+  }
+  return __builtin_popcount(valid);
+}
+
+static void test_run_round(FAR const struct test_round_s *round,
+                           FAR pthread_t *threads)
+{
+  int i;
+
+  test_reset();
+  g_round = round;
+  pthread_barrier_wait(&g_start);
+
+  /* Interrupt the workers while they store */
+
+  for (i = 0; i < TEST_THREADS; ++i)
+  {
+    pthread_kill(threads[i], SIGUSR1);
+  }
+
+  pthread_barrier_wait(&g_done);
+}
+
+/* Fewer codes than slots: every code is stored exactly once, in the state
+ * it was recorded with, and nothing that fitted is lost.
+ */
+
+static void test_no_lost_or_duplicate(FAR pthread_t *threads)
+{
+  static const struct test_round_s round = {
+    .ncodes = TEST_CONFIRMED + TEST_PENDING,
+    .npending = TEST_PENDING,
+    .faults = true
+  };
+
+  struct fault_entry_s copy;
+  uint32_t occurrences;
+  uint32_t lost = 0;
+  int stored;
+  int r;
+  int i;
+
+  for (r = 0; r < TEST_ROUNDS; ++r)
+  {
+    test_run_round(&round, threads);
+
+    occurrences = TEST_THREADS
+                  * (TEST_OCCURRENCES * (round.ncodes + 1) + 1);
+    stored = test_check_table(&g_dtc_table, occurrences);
+    HOST_CHECK(stored == round.ncodes + 1);
+
+    for (i = 0; i < round.ncodes; ++i)
+    {
+      if (!HOST_CHECK(safing_read_entry(&g_dtc_table,
+                                        safing_dtc_index(test_code(i)),
+                                        test_code(i), &copy)))
+      {
+        continue;
+      }
+
+      HOST_CHECK(SAFING_ENTRY_STATE(copy.status)
+                 == (i >= round.ncodes - round.npending
+                     ? SAFING_ENTRY_PENDING : SAFING_ENTRY_CONFIRMED));
+    }
+
+    HOST_CHECK(safing_read_entry(&g_dtc_table,
+                                 safing_dtc_index(DTC_INTERNAL_FAULT),
+                                 DTC_INTERNAL_FAULT, &copy));
+
+    HOST_CHECK(test_check_table(&g_fault_table,
+                                TEST_THREADS * TEST_OCCURRENCES) == 3);
+    lost += g_dtc_table.lost + g_fault_table.lost;
+  }
+
+  printf("test_dtc_store: %d rounds of %d threads, %u occurrences lost to "
+         "racing writes\n", TEST_ROUNDS, TEST_THREADS, lost);
+}
+
+/* More codes than slots: the table fills up without duplicates, and every
+ * occurrence that found no slot is counted as lost.
+ */
+
+static void test_table_full(FAR pthread_t *threads)
+{
+  static const struct test_round_s round = {
+    .ncodes = TEST_FULL_CODES,
+    .npending = TEST_FULL_CODES / 2,
+    .faults = false
+  };
+
+  int r;
+
+  for (r = 0; r < TEST_ROUNDS / 4; ++r)
+  {
+    test_run_round(&round, threads);
+
+    HOST_CHECK(test_check_table(&g_dtc_table, 0) == SAFING_NUM_DTC_ENTRIES);
+    HOST_CHECK(g_dtc_table.lost > 0);
+  }
+}
+
+/* Confirmed codes replace pending ones once the table is full, and never
+ * the other way round.
+ */
+
+static void test_replacement(void)
+{
+  struct fault_entry_s copy;
+  int i;
+
+  test_reset();
+  for (i = 0; i < SAFING_NUM_DTC_ENTRIES; ++i)
+  {
+    safing_report_dtc(test_code(i));
+  }
+
+  safing_store_dtc(test_code(SAFING_NUM_DTC_ENTRIES));
+  safing_report_dtc(test_code(SAFING_NUM_DTC_ENTRIES + 1));
+
+  HOST_CHECK(test_check_table(&g_dtc_table, 0) == SAFING_NUM_DTC_ENTRIES);
+  HOST_CHECK(g_dtc_table.lost == 1);
+  HOST_CHECK(safing_read_entry(&g_dtc_table,
+               safing_dtc_index(test_code(SAFING_NUM_DTC_ENTRIES)),
+               test_code(SAFING_NUM_DTC_ENTRIES), &copy)
+             && SAFING_ENTRY_STATE(copy.status) == SAFING_ENTRY_CONFIRMED);
+}
+
+/* The state of a stored DTC, or SAFING_ENTRY_EMPTY if it is not stored */
+
+static int test_state(uint16_t code)
+{
+  struct fault_entry_s copy;
+
+  return safing_read_entry(&g_dtc_table, safing_dtc_index(code), code,
+                           &copy) ? SAFING_ENTRY_STATE(copy.status)
+                                  : SAFING_ENTRY_EMPTY;
+}
+
+/* Writes out the changed entries, as the fault log thread does when woken,
+ * then powers off and back on: the tables are lost and must come back from
+ * the log exactly as they were. Then starts the next keycycle and ages
+ * them, as safing_faultlog_start() does.
+ */
+
+static void test_power_cycle(void)
+{
+  struct fault_entry_s saved[SAFING_NUM_DTC_ENTRIES];
+  struct fault_entry_s copy;
+  uint32_t valid;
+  int nsaved = 0;
+  int i;
+
+  HOST_CHECK(safing_faultlog_flush(&g_dtc_table) == OK
+             && safing_faultlog_flush(&g_fault_table) == OK);
+
+  for (valid = g_dtc_table.valid; valid != 0; valid &= valid - 1)
+  {
+    saved[nsaved++] = g_dtc_entries[__builtin_ctz(valid)];
+  }
+
+  test_reset();
+  g_safing_keycycle = 0;
+  HOST_CHECK(faultlog_open(&g_faultlog, &g_faultlog_fd_ops,
+                           (FAR void *)(intptr_t)g_log_fd,
+                           SAFING_FAULTLOG_SECTORS,
+                           SAFING_FAULTLOG_SECTOR_SIZE,
+                           safing_faultlog_replay, safing_faultlog_snapshot,
+                           NULL) == OK);
+
+  HOST_CHECK(__builtin_popcount(g_dtc_table.valid) == nsaved);
+  for (i = 0; i < nsaved; ++i)
+  {
+    if (!HOST_CHECK(safing_read_entry(&g_dtc_table,
+                                      safing_dtc_index(saved[i].fault_code),
+                                      saved[i].fault_code, &copy)
+                    && copy.status == saved[i].status
+                    && copy.first_keycycle == saved[i].first_keycycle
+                    && copy.first_ms == saved[i].first_ms
+                    && copy.last_ms == saved[i].last_ms))
+    {
+      fprintf(stderr, "  DTC 0x%04x in keycycle %u\n",
+              saved[i].fault_code, g_safing_keycycle);
+    }
+  }
+
+  HOST_CHECK(faultlog_start_keycycle(&g_faultlog, 0) == OK);
+  g_safing_keycycle = g_faultlog.keycycle;
+  safing_store_age(&g_dtc_table);
+  safing_store_age(&g_fault_table);
+}
+
+/* The state an entry that last occurred in keycycle last must be in now,
+ * given the state it was left in then.
+ */
+
+static int test_expected_state(uint16_t last, int state)
+{
+  uint16_t clean = safing_entry_clean_cycles(SAFING_ENTRY_STATUS(0, 0,
+                                                                 last));
+
+  if (state == SAFING_ENTRY_CONFIRMED && clean >= SAFING_DTC_HEAL_CYCLES)
+  {
+    state = SAFING_ENTRY_HEALED;
+  }
+
+  return clean >= SAFING_DTC_AGING_CYCLES ? SAFING_ENTRY_EMPTY : state;
+}
+
+/* Steps codes through their lifecycle one keycycle at a time, powering off
+ * between keycycles: a pending code is confirmed by occurring again in a
+ * later keycycle, but not in the same one; confirmed codes heal after
+ * SAFING_DTC_HEAL_CYCLES clean keycycles, and healed and pending ones are
+ * removed after SAFING_DTC_AGING_CYCLES.
+ */
+
+static void test_keycycles(void)
+{
+  uint16_t again = test_code(0);        /* Reported in two keycycles */
+  uint16_t stored = test_code(1);       /* Stored confirmed */
+  uint16_t glitch = test_code(2);       /* Reported once */
+  uint16_t first;
+  int cycle;
+
+  test_power_cycle();
+  first = g_safing_keycycle;
+
+  safing_report_dtc(again);
+  safing_report_dtc(again);
+  safing_store_dtc(stored);
+  safing_report_dtc(glitch);
+  HOST_CHECK(test_state(again) == SAFING_ENTRY_PENDING);
+  HOST_CHECK(test_state(stored) == SAFING_ENTRY_CONFIRMED);
+  HOST_CHECK(test_state(glitch) == SAFING_ENTRY_PENDING);
+
+  test_power_cycle();
+  HOST_CHECK(test_state(again) == SAFING_ENTRY_PENDING);
+  safing_report_dtc(again);
+  HOST_CHECK(test_state(again) == SAFING_ENTRY_CONFIRMED);
+
+  for (cycle = 0; cycle <= SAFING_DTC_AGING_CYCLES + 1; ++cycle)
+  {
+    test_power_cycle();
+    if (!HOST_CHECK(test_state(again)
+                    == test_expected_state(first + 1,
+                                           SAFING_ENTRY_CONFIRMED)
+                    && test_state(stored)
+                       == test_expected_state(first,
+                                              SAFING_ENTRY_CONFIRMED)
+                    && test_state(glitch)
+                       == test_expected_state(first,
+                                              SAFING_ENTRY_PENDING)))
+    {
+      fprintf(stderr, "  keycycle %u after the first\n",
+              (uint16_t)(g_safing_keycycle - first));
+    }
+  }
+
+  HOST_CHECK(g_dtc_table.valid == 0);
+}
+
+/* Once the table is full, a new entry replaces the healed one, then the
+ * pending one with the fewest occurrences, and one that outranks nothing
+ * is lost. The log must replay to the same table.
+ */
+
+static void test_keycycle_replacement(void)
+{
+  uint16_t healed = test_code(0);
+  uint16_t once = test_code(1);
+  uint16_t pending = test_code(SAFING_NUM_DTC_ENTRIES);
+  uint16_t confirmed = test_code(SAFING_NUM_DTC_ENTRIES + 1);
+  uint16_t lost = test_code(SAFING_NUM_DTC_ENTRIES + 2);
+  int cycle;
+  int i;
+
+  safing_store_dtc(healed);
+  for (cycle = 0; cycle <= SAFING_DTC_HEAL_CYCLES; ++cycle)
+  {
+    test_power_cycle();
+  }
+
+  HOST_CHECK(test_state(healed) == SAFING_ENTRY_HEALED);
+
+  for (i = 1; i < SAFING_NUM_DTC_ENTRIES; ++i)
+  {
+    safing_report_dtc(test_code(i));
+    if (test_code(i) != once)
+    {
+      safing_report_dtc(test_code(i));
+    }
+  }
+
+  safing_report_dtc(pending);
+  safing_report_dtc(pending);
+  HOST_CHECK(test_state(healed) == SAFING_ENTRY_EMPTY);
+  HOST_CHECK(test_state(pending) == SAFING_ENTRY_PENDING);
+
+  safing_store_dtc(confirmed);
+  HOST_CHECK(test_state(once) == SAFING_ENTRY_EMPTY);
+  HOST_CHECK(test_state(confirmed) == SAFING_ENTRY_CONFIRMED);
+
+  safing_report_dtc(lost);
+  HOST_CHECK(test_state(lost) == SAFING_ENTRY_EMPTY);
+  HOST_CHECK(g_dtc_table.lost == 1);
+  HOST_CHECK(test_check_table(&g_dtc_table, 0) == SAFING_NUM_DTC_ENTRIES);
+
+  test_power_cycle();
+  HOST_CHECK(test_state(healed) == SAFING_ENTRY_EMPTY
+             && test_state(once) == SAFING_ENTRY_EMPTY);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  static uint8_t erased[TEST_LOG_SIZE];
+  struct sigaction action;
+  pthread_t threads[TEST_THREADS];
+  FAR FILE *file;
+  int i;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = test_sigusr1;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+
+  pthread_barrier_init(&g_start, NULL, TEST_THREADS + 1);
+  pthread_barrier_init(&g_done, NULL, TEST_THREADS + 1);
+  for (i = 0; i < TEST_THREADS; ++i)
+  {
+    pthread_create(&threads[i], NULL, test_worker, (FAR void *)(intptr_t)i);
+  }
+
+  test_no_lost_or_duplicate(threads);
+  test_table_full(threads);
+
+  g_stop = true;
+  pthread_barrier_wait(&g_start);
+  for (i = 0; i < TEST_THREADS; ++i)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  test_replacement();
+
+  file = tmpfile();
+  if (HOST_CHECK(file != NULL))
+  {
+    memset(erased, 0xff, sizeof(erased));
+    g_log_fd = fileno(file);
+    HOST_CHECK(pwrite(g_log_fd, erased, sizeof(erased), 0)
+               == sizeof(erased));
+    test_reset();
+    test_keycycles();
+    test_keycycle_replacement();
+    fclose(file);
+  }
+
+  return host_finish("test_dtc_store");
+}
@@ -0,0 +1,284 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_etb_pedal.c
+ * Electronic Throttle Controller program - ETB pedal map tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+
+/* The pedal map lookup is private to etb.c */
+
+#define main etb_main
+#include "../etb.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define NITEMS(a)             (sizeof(a) / sizeof((a)[0]))
+
+#define TEST_MAPS             4
+#define TEST_APPS_STEP        31    /* Coprime with every grid spacing */
+#define TEST_RPM_STEP         257
+#define TEST_TIMED_LOOKUPS    1000000
+#define TEST_INPUTS           4096
+#define TEST_HIST_CYCLES      4096
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Sets up a map: the calibrated default, random openings on random grids,
+ * all shut, or wide open everywhere.
+ */
+
+static void test_fill(FAR struct calib_pedal_s *pedal, int map)
+{
+  int i;
+  int j;
+
+  if (map == 0)
+  {
+    return;
+  }
+
+  pedal->apps_shift = host_random() % (CALIB_PEDAL_MAX_SHIFT + 1);
+  pedal->rpm_shift = host_random() % (CALIB_PEDAL_MAX_SHIFT + 1);
+  pedal->apps_base = (int16_t)(host_random() % 20000) - 10000;
+  pedal->rpm_base = host_random() % 8000;
+
+  for (j = 0; j < CALIB_PEDAL_RPM_POINTS; ++j)
+  {
+    for (i = 0; i < CALIB_PEDAL_APPS_POINTS; ++i)
+    {
+      pedal->map[j][i] = map == 1 ? host_random() % (CALIB_PEDAL_FULL + 1)
+                         : map == 2 ? 0 : CALIB_PEDAL_FULL;
+    }
+  }
+}
+
+/* Where x falls along an axis, in points, held at either end */
+
+static double test_axis(double x, double base, int shift, int npoints)
+{
+  double pos = (x - base) / (1 << shift);
+
+  return fmax(0, fmin(pos, npoints - 1));
+}
+
+/* Bilinear interpolation of the map in floating point */
+
+static double test_reference(FAR const struct calib_pedal_s *pedal,
+                             int16_t apps, uint16_t rpm,
+                             int16_t lhp, int16_t ums)
+{
+  double x = test_axis(apps, pedal->apps_base, pedal->apps_shift,
+                       CALIB_PEDAL_APPS_POINTS);
+  double y = test_axis(rpm, pedal->rpm_base, pedal->rpm_shift,
+                       CALIB_PEDAL_RPM_POINTS);
+  int i = x < CALIB_PEDAL_APPS_POINTS - 1 ? (int)x
+                                          : CALIB_PEDAL_APPS_POINTS - 2;
+  int j = y < CALIB_PEDAL_RPM_POINTS - 1 ? (int)y
+                                         : CALIB_PEDAL_RPM_POINTS - 2;
+  double fx = x - i;
+  double fy = y - j;
+  double a = pedal->map[j][i] * (1 - fx) + pedal->map[j][i + 1] * fx;
+  double b = pedal->map[j + 1][i] * (1 - fx)
+             + pedal->map[j + 1][i + 1] * fx;
+  double opening = a * (1 - fy) + b * fy;
+
+  return lhp + (ums - lhp) * opening / CALIB_PEDAL_FULL;
+}
+
+/* The lookup against the reference over the whole of both axes, for a few
+ * spans of travel. Fixed point truncates, so it may fall short of the
+ * reference by up to a count but never pass it.
+ */
+
+static void test_lookup(FAR const struct calib_data_s *calib)
+{
+  static const int16_t stops[][2] = {
+    {3500, 11300}, {0, INT16_MAX}, {INT16_MIN, INT16_MAX}, {8000, 8000}
+  };
+
+  struct calib_pedal_s pedal;
+  double worst = 0;
+  double err;
+  unsigned long points = 0;
+  int16_t want;
+  int32_t apps;
+  int32_t rpm;
+  int map;
+  int s;
+
+  for (map = 0; map < TEST_MAPS; ++map)
+  {
+    pedal = calib->pedal;
+    test_fill(&pedal, map);
+    for (s = 0; s < NITEMS(stops); ++s)
+    {
+      for (apps = INT16_MIN; apps <= INT16_MAX; apps += TEST_APPS_STEP)
+      {
+        for (rpm = 0; rpm <= UINT16_MAX; rpm += TEST_RPM_STEP)
+        {
+          want = etb_pedal_want(&pedal, apps, rpm, stops[s][0],
+                                stops[s][1]);
+          err = test_reference(&pedal, apps, rpm, stops[s][0],
+                               stops[s][1]) - want;
+          worst = err > worst ? err : worst;
+          ++points;
+          if (!HOST_CHECK(err > -1e-9 && err < 1))
+          {
+            printf("map %d stops %d apps %ld rpm %ld: %d, %f off\n", map,
+                   s, (long)apps, (long)rpm, want, err);
+            return;
+          }
+        }
+      }
+    }
+  }
+
+  printf("test_etb_pedal: %lu points at most %.4f counts short of "
+         "floating point\n", points, worst);
+}
+
+/* The target starts from limp home and moves towards what the map wants
+ * at no more than the calibrated rates, without overshooting.
+ */
+
+static void test_rate(FAR const struct calib_data_s *calib)
+{
+  FAR const struct calib_pedal_s *pedal = &calib->pedal;
+  struct etb_pedal_s ped;
+  int16_t target;
+  int16_t last;
+  int16_t want;
+  int tick;
+
+  memset(&ped, 0, sizeof(ped));
+  last = 3500;
+  for (tick = 0; tick < 2000; ++tick)
+  {
+    want = tick < 1000 ? 11300 : tick < 1500 ? 3500 : 3500 + (tick & 63);
+    target = etb_pedal_step(&ped, pedal, want, 3500);
+    if (!HOST_CHECK(target - last <= (int32_t)pedal->rise
+                    && last - target <= (int32_t)pedal->fall
+                    && (target == want
+                        || target - last == (int32_t)pedal->rise
+                        || last - target == (int32_t)pedal->fall)))
+    {
+      printf("tick %d: from %d to %d wanting %d\n", tick, last, target,
+             want);
+      return;
+    }
+
+    last = target;
+  }
+
+  /* A reset starts again from limp home */
+
+  ped.primed = false;
+  HOST_CHECK(etb_pedal_step(&ped, pedal, 11300, 3500)
+             == 3500 + pedal->rise);
+}
+
+/* Cycles for the lookup and rate limit of one tick: on average over a
+ * batch, and the 99.9th percentile of single ticks timed one at a time,
+ * which includes reading the counter. The rest are the host interrupting.
+ */
+
+static void test_timing(FAR const struct calib_data_s *calib)
+{
+  FAR const struct calib_pedal_s *pedal = &calib->pedal;
+  static uint32_t hist[TEST_HIST_CYCLES + 1];
+  static int16_t apps[TEST_INPUTS];
+  static uint16_t rpm[TEST_INPUTS];
+  struct etb_pedal_s ped;
+  volatile int16_t target;
+  uint64_t start;
+  uint64_t cycles;
+  uint32_t seen = 0;
+  int i;
+
+  for (i = 0; i < TEST_INPUTS; ++i)
+  {
+    apps[i] = host_random() & 0x7fff;
+    rpm[i] = host_random() % 16000;
+  }
+
+  memset(&ped, 0, sizeof(ped));
+  start = host_cycles();
+  for (i = 0; i < TEST_TIMED_LOOKUPS; ++i)
+  {
+    target = etb_pedal_step(&ped, pedal,
+                            etb_pedal_want(pedal, apps[i % TEST_INPUTS],
+                                           rpm[i % TEST_INPUTS],
+                                           3500, 11300),
+                            3500);
+  }
+
+  cycles = host_cycles() - start;
+
+  for (i = 0; i < TEST_TIMED_LOOKUPS; ++i)
+  {
+    start = host_cycles();
+    target = etb_pedal_step(&ped, pedal,
+                            etb_pedal_want(pedal, apps[i % TEST_INPUTS],
+                                           rpm[i % TEST_INPUTS],
+                                           3500, 11300),
+                            3500);
+    start = host_cycles() - start;
+    ++hist[start < TEST_HIST_CYCLES ? start : TEST_HIST_CYCLES];
+  }
+
+  (void)target;
+  for (i = 0; seen < TEST_TIMED_LOOKUPS - TEST_TIMED_LOOKUPS / 1000; ++i)
+  {
+    seen += hist[i];
+  }
+
+  printf("test_etb_pedal: a tick's lookup takes %.1f cycles, %d or fewer "
+         "99.9%% of the time\n", (double)cycles / TEST_TIMED_LOOKUPS,
+         i - 1);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  FAR const struct calib_data_s *calib = calib_acquire();
+
+  test_lookup(calib);
+  test_rate(calib);
+  test_timing(calib);
+  calib_release(calib);
+
+  return host_finish("test_etb_pedal");
+}
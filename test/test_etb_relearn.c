@@ -0,0 +1,299 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_etb_relearn.c
+ * Electronic Throttle Controller program - ETB spring relearn tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+
+/* The relearn is private to etb.c */
+
+#define main etb_main
+#include "../etb.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Every attempt gives up within this many ticks */
+
+#define TEST_MAX_TICKS        (ETB_RELEARN_ATTEMPTS * 60000)
+
+/* How close the learned values must be. Noise and the settling window
+ * blur the end stops; the duty step and lag blur each slip duty.
+ */
+
+#define TEST_STOP_TOL         (ETB_RELEARN_STILL + TEST_NOISE)
+#define TEST_DUTY_TOL         3.0
+#define TEST_NOISE            3
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/* Stand-in for the throttle body: a preloaded, slightly progressive return
+ * spring between limp home and the upper stop, Coulomb friction, a lagging
+ * blade and a noisy sensor.
+ */
+
+struct test_plant_s
+{
+  double lhp;                   /* Limp home, where the blade rests */
+  double ums;                   /* Upper mechanical stop */
+  double preload;               /* Duty to hold the blade off limp home */
+  double rate;                  /* Spring duty per count */
+  double rise;                  /* Progression, duty per count squared */
+  double friction;              /* Coulomb friction, in duty */
+  double lag;                   /* Fraction of the way moved each tick */
+  bool stuck;                   /* Blade does not move at all */
+  int chatter;                  /* Square wave on the reading, in counts */
+  uint32_t ticks;
+  double x;
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void test_plant_init(FAR struct test_plant_s *plant)
+{
+  plant->lhp = 3500;
+  plant->ums = 11300;
+  plant->preload = 100;
+  plant->rate = 0.04;
+  plant->rise = 0.000002;
+  plant->friction = 15;
+  plant->lag = 0.2;
+  plant->stuck = false;
+  plant->chatter = 0;
+  plant->ticks = 0;
+  plant->x = plant->lhp;
+}
+
+/* Duty that balances the spring at a position */
+
+static double test_spring(FAR const struct test_plant_s *plant, double x)
+{
+  double d = x - plant->lhp;
+
+  return plant->preload + plant->rate * d + plant->rise * d * d;
+}
+
+/* Position at which the spring balances a duty, within the stops */
+
+static double test_balance(FAR const struct test_plant_s *plant,
+                           double duty)
+{
+  double c = plant->preload - duty;
+  double d;
+
+  if (c >= 0)
+  {
+    return plant->lhp;
+  }
+
+  d = (-plant->rate + sqrt(plant->rate * plant->rate
+                           - 4 * plant->rise * c)) / (2 * plant->rise);
+  return fmin(plant->lhp + d, plant->ums);
+}
+
+/* One tick: the blade only moves once the duty is more than friction away
+ * from holding it where it is, and then towards where the spring and
+ * friction balance. Returns the sensor reading.
+ */
+
+static int16_t test_plant_step(FAR struct test_plant_s *plant,
+                               uint16_t duty)
+{
+  double hold = test_spring(plant, plant->x);
+  double target = plant->x;
+  int noise = (int)(host_random() % (2 * TEST_NOISE + 1)) - TEST_NOISE;
+
+  if (!plant->stuck && duty > hold + plant->friction)
+  {
+    target = test_balance(plant, duty - plant->friction);
+  }
+  else if (!plant->stuck && duty < hold - plant->friction
+           && plant->x > plant->lhp)
+  {
+    target = test_balance(plant, duty + plant->friction);
+  }
+
+  /* Chatter flips every settling window, so the reading never matches
+   * the one a window before.
+   */
+
+  if ((plant->ticks++ / ETB_RELEARN_WINDOW) & 1)
+  {
+    noise += plant->chatter;
+  }
+
+  plant->x += (target - plant->x) * plant->lag;
+  return (int16_t)lrint(plant->x) + noise;
+}
+
+/* Runs the relearn against the plant until it finishes or gives up.
+ * Returns the ticks taken.
+ */
+
+static uint32_t test_run(FAR struct etb_relearn_s *rl,
+                         FAR const struct calib_data_s *calib,
+                         FAR struct test_plant_s *plant)
+{
+  uint16_t duty = 0;
+  int16_t tps;
+
+  etb_relearn_reset(rl);
+  while (rl->phase != ETB_RELEARN_DONE && rl->phase != ETB_RELEARN_FAILED
+         && rl->ticks < TEST_MAX_TICKS)
+  {
+    tps = test_plant_step(plant, duty);
+    duty = etb_relearn_step(rl, calib, tps);
+    if (!HOST_CHECK(duty <= calib->etb.duty_max))
+    {
+      break;
+    }
+  }
+
+  return rl->ticks;
+}
+
+/* A healthy throttle: the end stops, the spring at every point between
+ * them and the friction all come out close to the plant's.
+ */
+
+static void test_learn(FAR const struct calib_data_s *calib)
+{
+  FAR const struct calib_spring_s *spring = &calib->spring;
+  struct test_plant_s plant;
+  struct etb_relearn_s rl;
+  double worst = 0;
+  double err;
+  uint32_t ticks;
+  int32_t point;
+  int i;
+
+  test_plant_init(&plant);
+  ticks = test_run(&rl, calib, &plant);
+  HOST_CHECK(rl.phase == ETB_RELEARN_DONE && rl.attempts == 0);
+  HOST_CHECK(fabs(rl.learned_lhp - plant.lhp) <= TEST_STOP_TOL);
+  HOST_CHECK(fabs(rl.learned_ums - plant.ums) <= TEST_STOP_TOL);
+  HOST_CHECK(fabs(rl.friction - plant.friction) <= TEST_DUTY_TOL);
+
+  for (i = 0; i < CALIB_SPRING_POINTS; ++i)
+  {
+    point = etb_spring_point(spring, i);
+    if (point <= plant.lhp + TEST_STOP_TOL
+        || point >= plant.ums - TEST_STOP_TOL)
+    {
+      /* Points off the travel keep their calibrated duty */
+
+      HOST_CHECK(rl.spring.duty[i] == spring->duty[i]);
+      continue;
+    }
+
+    HOST_CHECK(i >= rl.first && i <= rl.last);
+    err = fabs(rl.spring.duty[i] - test_spring(&plant, point));
+    worst = err > worst ? err : worst;
+  }
+
+  HOST_CHECK(worst <= TEST_DUTY_TOL);
+  HOST_CHECK(rl.spring.tps_base == spring->tps_base
+             && rl.spring.tps_shift == spring->tps_shift);
+  printf("test_etb_relearn: relearned in %lu ms, spring within %.1f duty, "
+         "stops at %d and %d, friction %u\n",
+         (unsigned long)(ticks * ETB_CTL_PERIOD_US / USEC_PER_MSEC), worst,
+         rl.learned_lhp, rl.learned_ums, rl.friction);
+}
+
+/* Faulty throttles fail every attempt and then give up */
+
+static void test_faults(FAR const struct calib_data_s *calib)
+{
+  struct test_plant_s plant;
+  struct etb_relearn_s rl;
+  uint32_t ticks;
+
+  /* Stuck at limp home: no travel */
+
+  test_plant_init(&plant);
+  plant.stuck = true;
+  ticks = test_run(&rl, calib, &plant);
+  HOST_CHECK(rl.phase == ETB_RELEARN_FAILED);
+  HOST_CHECK(rl.attempts == ETB_RELEARN_ATTEMPTS);
+  HOST_CHECK(etb_relearn_step(&rl, calib, 0) == 0);
+  printf("test_etb_relearn: a stuck throttle gives up in %lu ms\n",
+         (unsigned long)(ticks * ETB_CTL_PERIOD_US / USEC_PER_MSEC));
+
+  /* Jammed part way open */
+
+  test_plant_init(&plant);
+  plant.ums = plant.lhp + ETB_RELEARN_MIN_TRAVEL / 2;
+  test_run(&rl, calib, &plant);
+  HOST_CHECK(rl.phase == ETB_RELEARN_FAILED);
+
+  /* Too stiff to open with the duty allowed */
+
+  test_plant_init(&plant);
+  plant.preload = calib->etb.duty_max;
+  test_run(&rl, calib, &plant);
+  HOST_CHECK(rl.phase == ETB_RELEARN_FAILED);
+
+  /* A sensor that chatters never reads settled, so each attempt times
+   * out.
+   */
+
+  test_plant_init(&plant);
+  plant.chatter = 4 * ETB_RELEARN_STILL;
+  ticks = test_run(&rl, calib, &plant);
+  HOST_CHECK(rl.phase == ETB_RELEARN_FAILED);
+  HOST_CHECK(ticks > ETB_RELEARN_ATTEMPTS * ETB_RELEARN_TIMEOUT);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  FAR const struct calib_data_s *calib = calib_acquire();
+  struct calib_data_s wide = *calib;
+
+  test_learn(calib);
+  test_faults(calib);
+
+  /* Upper points past the sensor's range, which calib_data_valid()
+   * rejects, must not wrap round into the travel.
+   */
+
+  wide.spring.tps_shift = 10;
+  test_learn(&wide);
+  calib_release(calib);
+
+  return host_finish("test_etb_relearn");
+}
@@ -0,0 +1,335 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_etb_spring.c
+ * Electronic Throttle Controller program - ETB spring feedforward tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+
+/* The feedforward lookup and position loop are private to etb.c */
+
+#define main etb_main
+#include "../etb.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* The XCP subset calibration is written through (ASAM MCD-1 XCP) */
+
+#define TEST_XCP_PID_RES      0xff
+#define TEST_XCP_CMD_CONNECT  0xff
+#define TEST_XCP_CMD_SET_MTA  0xf6
+#define TEST_XCP_CMD_DOWNLOAD 0xf0
+
+#define TEST_TABLES           4
+#define TEST_TIMED_LOOKUPS    10000000
+#define TEST_TICKS            1000
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Fills a spring table: a rising curve, random points, a step from 0 to
+ * full duty, or full duty throughout.
+ */
+
+static void test_fill(FAR struct calib_spring_s *spring, int table)
+{
+  int i;
+
+  for (i = 0; i < CALIB_SPRING_POINTS; ++i)
+  {
+    switch (table)
+    {
+      case 0:
+        spring->duty[i] = 150 + i * i * 8;
+        break;
+
+      case 1:
+        spring->duty[i] = host_random() & 0xffff;
+        break;
+
+      case 2:
+        spring->duty[i] = i < CALIB_SPRING_POINTS / 2 ? 0 : UINT16_MAX;
+        break;
+
+      default:
+        spring->duty[i] = UINT16_MAX;
+        break;
+    }
+  }
+}
+
+/* Linear interpolation of the table in floating point */
+
+static double test_reference(FAR const struct calib_spring_s *spring,
+                             int16_t tps)
+{
+  double step = 1 << spring->tps_shift;
+  double pos = (tps - spring->tps_base) / step;
+  int idx;
+
+  if (pos <= 0)
+  {
+    return spring->duty[0];
+  }
+
+  idx = (int)pos;
+  if (idx >= CALIB_SPRING_POINTS - 1)
+  {
+    return spring->duty[CALIB_SPRING_POINTS - 1];
+  }
+
+  return spring->duty[idx]
+         + (spring->duty[idx + 1] - (double)spring->duty[idx])
+           * (pos - idx);
+}
+
+/* The lookup against the reference at every throttle position, for every
+ * grid spacing calibration allows.
+ */
+
+static void test_lookup(void)
+{
+  struct calib_spring_s spring;
+  double worst = 0;
+  double err;
+  int64_t duty;
+  int table;
+  int32_t tps;
+
+  for (table = 0; table < TEST_TABLES; ++table)
+  {
+    test_fill(&spring, table);
+    for (spring.tps_shift = 0; spring.tps_shift <= CALIB_SPRING_MAX_SHIFT;
+         ++spring.tps_shift)
+    {
+      spring.tps_base = spring.tps_shift < 8 ? 3500 : -20000;
+      for (tps = INT16_MIN; tps <= INT16_MAX; ++tps)
+      {
+        duty = get_feedforward_duty(&spring, tps);
+        err = duty / 65536.0 - test_reference(&spring, tps);
+        err = err < 0 ? -err : err;
+        worst = err > worst ? err : worst;
+        if (!HOST_CHECK(duty >= 0 && duty <= (int64_t)UINT16_MAX << 16
+                        && err < 1.0 / 65536))
+        {
+          printf("table %d shift %u tps %ld: %lld\n", table,
+                 spring.tps_shift, (long)tps, (long long)duty);
+          return;
+        }
+      }
+    }
+  }
+
+  printf("test_etb_spring: lookup within %g duty of floating point\n",
+         worst);
+}
+
+/* At full duty the loop must hold full duty, not wrap: Q16 duty and the
+ * integrator go past INT32_MAX, and the last duty past INT16_MAX.
+ */
+
+static void test_full_duty(void)
+{
+  FAR const struct calib_data_s *defaults = calib_acquire();
+  struct calib_data_s calib = *defaults;
+  struct etb_ctl_s ctl;
+  uint16_t duty = 0;
+  int tick;
+
+  calib_release(defaults);
+  calib.etb.duty_max = UINT16_MAX;
+  calib.etb.slew = 1000;
+
+  /* Full feedforward: slews up from 0 and stays at the top */
+
+  test_fill(&calib.spring, 3);
+  memset(&ctl, 0, sizeof(ctl));
+  for (tick = 1; tick <= TEST_TICKS; ++tick)
+  {
+    duty = etb_control(&ctl, &calib.spring, &calib, 20000, 20000);
+    if (!HOST_CHECK(duty == (tick * 1000 < UINT16_MAX ? tick * 1000
+                                                      : UINT16_MAX)))
+    {
+      printf("tick %d: duty %u\n", tick, duty);
+      break;
+    }
+  }
+
+  /* Overshooting, it slews back down from full */
+
+  duty = etb_control(&ctl, &calib.spring, &calib, 0, 30000);
+  HOST_CHECK(duty == UINT16_MAX - calib.etb.slew);
+
+  /* No feedforward and integral action only, short of the target: the
+   * integrator winds up to its limit and holds full duty.
+   */
+
+  memset(calib.spring.duty, 0, sizeof(calib.spring.duty));
+  calib.etb.kp = 0;
+  calib.etb.kd = 0;
+  calib.etb.ki = 65536;
+  calib.etb.slew = 2000;
+  memset(&ctl, 0, sizeof(ctl));
+  for (tick = 1; tick <= TEST_TICKS; ++tick)
+  {
+    duty = etb_control(&ctl, &calib.spring, &calib, 20000, 19000);
+  }
+
+  HOST_CHECK(ctl.integral == (int64_t)UINT16_MAX << 16);
+  HOST_CHECK(duty == UINT16_MAX);
+}
+
+/* Freeze frames record duty halved: full duty must stay positive and half
+ * duty must not read as a channel with no source.
+ */
+
+static void test_freeze_duty(void)
+{
+  int16_t values[FREEZE_NUM_CHANNELS];
+
+  freeze_set_source(FREEZE_CHAN_ETB_DUTY, &g_etb_duty);
+
+  etb_set_duty(UINT16_MAX);
+  freeze_sample(values);
+  HOST_CHECK(values[FREEZE_CHAN_ETB_DUTY] == INT16_MAX);
+
+  etb_set_duty(0x8000);
+  freeze_sample(values);
+  HOST_CHECK(values[FREEZE_CHAN_ETB_DUTY] == 0x4000);
+
+  etb_set_duty(0);
+  freeze_sample(values);
+  HOST_CHECK(values[FREEZE_CHAN_ETB_DUTY] == 0);
+}
+
+/* Writes one 16-bit calibration value through XCP. Returns true if the
+ * download was accepted.
+ */
+
+static bool test_download(size_t offset, uint16_t value)
+{
+  uint8_t cmd[8];
+  uint8_t resp[8];
+
+  memset(cmd, 0, sizeof(cmd));
+  cmd[0] = TEST_XCP_CMD_SET_MTA;
+  cmd[4] = offset & 0xff;
+  cmd[5] = (offset >> 8) & 0xff;
+  HOST_CHECK(calib_xcp_command(cmd, 8, resp) == 1
+             && resp[0] == TEST_XCP_PID_RES);
+
+  cmd[0] = TEST_XCP_CMD_DOWNLOAD;
+  cmd[1] = 2;
+  cmd[2] = value & 0xff;
+  cmd[3] = value >> 8;
+  return calib_xcp_command(cmd, 4, resp) == 1
+         && resp[0] == TEST_XCP_PID_RES;
+}
+
+/* No spring point may ask for more than the loop may command, and the
+ * last point may not lie past the sensor's range.
+ */
+
+static void test_validation(void)
+{
+  FAR const struct calib_data_s *calib = calib_acquire();
+  uint16_t duty_max = calib->etb.duty_max;
+  size_t point = offsetof(struct calib_data_s, spring.duty[5]);
+  size_t max = offsetof(struct calib_data_s, etb.duty_max);
+  size_t base = offsetof(struct calib_data_s, spring.tps_base);
+  size_t shift = offsetof(struct calib_data_s, spring.tps_shift);
+  int16_t tps_base = calib->spring.tps_base;
+  uint16_t tps_shift = calib->spring.tps_shift;
+  int16_t top = INT16_MAX - ((CALIB_SPRING_POINTS - 1) << tps_shift);
+  uint8_t cmd[8];
+  uint8_t resp[8];
+
+  calib_release(calib);
+  memset(cmd, 0, sizeof(cmd));
+  cmd[0] = TEST_XCP_CMD_CONNECT;
+  HOST_CHECK(calib_xcp_command(cmd, 2, resp) > 0);
+
+  HOST_CHECK(!test_download(point, duty_max + 1));
+  HOST_CHECK(test_download(point, duty_max));
+  HOST_CHECK(!test_download(max, duty_max - 1));
+  HOST_CHECK(test_download(max, UINT16_MAX));
+  HOST_CHECK(test_download(point, UINT16_MAX));
+
+  HOST_CHECK(test_download(base, top));
+  HOST_CHECK(!test_download(base, top + 1));
+  HOST_CHECK(!test_download(shift, tps_shift + 1));
+  HOST_CHECK(test_download(base, tps_base));
+
+  calib = calib_acquire();
+  HOST_CHECK(calib->spring.duty[5] == UINT16_MAX);
+  HOST_CHECK(calib->spring.tps_base == tps_base
+             && calib->spring.tps_shift == tps_shift);
+  calib_release(calib);
+}
+
+static void test_timing(void)
+{
+  FAR const struct calib_data_s *calib = calib_acquire();
+  struct calib_spring_s spring = calib->spring;
+  volatile int16_t tps = 0;
+  int64_t sum = 0;
+  uint64_t cycles;
+  int i;
+
+  calib_release(calib);
+  test_fill(&spring, 1);
+  cycles = host_cycles();
+  for (i = 0; i < TEST_TIMED_LOOKUPS; ++i)
+  {
+    tps = i & 0x7fff;
+    sum += get_feedforward_duty(&spring, tps);
+  }
+
+  cycles = host_cycles() - cycles;
+  HOST_CHECK(sum > 0);
+  printf("test_etb_spring: a lookup takes %.1f cycles\n",
+         (double)cycles / TEST_TIMED_LOOKUPS);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  test_lookup();
+  test_full_duty();
+  test_freeze_duty();
+  test_validation();
+  test_timing();
+
+  return host_finish("test_etb_spring");
+}
@@ -0,0 +1,358 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_faultlog.c
+ * Electronic Throttle Controller program - fault log power-cut tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "faultlog.h"
+#include "host.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Small sectors, so that the sequence below rotates through the log area
+ * several times. A snapshot is a marker and one record per code.
+ */
+
+#define TEST_SECTORS          3
+#define TEST_SECTOR_SIZE      (FAULTLOG_HEADER_SIZE + \
+                               8 * FAULTLOG_RECORD_SIZE)
+#define TEST_CODES            4
+#define TEST_KEYCYCLES        3
+#define TEST_APPENDS          7     /* Per keycycle */
+#define TEST_OPS              (TEST_KEYCYCLES * (1 + TEST_APPENDS))
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/* What the log describes: the latest keycycle, and the latest count
+ * recorded for each code.
+ */
+
+struct test_state_s
+{
+  uint16_t keycycle;
+  uint16_t count[TEST_CODES];
+  uint8_t present;
+};
+
+/* Storage that loses power once a number of bytes have been written. The
+ * write in progress then stops part way, and every later one fails.
+ */
+
+struct test_flash_s
+{
+  int fd;
+  long budget;
+  long written;
+  bool cut;
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* State before the first operation and after each one */
+
+static struct test_state_s g_expected[TEST_OPS + 1];
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static int test_flash_read(FAR void *priv, off_t offset, FAR void *buf,
+                           size_t len)
+{
+  FAR struct test_flash_s *flash = priv;
+
+  return g_faultlog_fd_ops.read((FAR void *)(intptr_t)flash->fd, offset,
+                                buf, len);
+}
+
+static int test_flash_write(FAR void *priv, off_t offset,
+                            FAR const void *buf, size_t len)
+{
+  FAR struct test_flash_s *flash = priv;
+  FAR void *fd = (FAR void *)(intptr_t)flash->fd;
+
+  if (flash->cut)
+  {
+    return -EIO;
+  }
+
+  if ((long)len > flash->budget)
+  {
+    if (flash->budget > 0)
+    {
+      g_faultlog_fd_ops.write(fd, offset, buf, flash->budget);
+      flash->written += flash->budget;
+    }
+
+    flash->budget = 0;
+    flash->cut = true;
+    return -EIO;
+  }
+
+  flash->budget -= len;
+  flash->written += len;
+  return g_faultlog_fd_ops.write(fd, offset, buf, len);
+}
+
+static int test_flash_erase(FAR void *priv, off_t offset, size_t len)
+{
+  uint8_t erased[TEST_SECTOR_SIZE];
+
+  memset(erased, 0xff, sizeof(erased));
+  return test_flash_write(priv, offset, erased, len);
+}
+
+static const struct faultlog_ops_s g_test_flash_ops = {
+  .read = test_flash_read,
+  .write = test_flash_write,
+  .erase = test_flash_erase
+};
+
+static void test_replay(FAR const struct faultlog_record_s *rec,
+                        FAR void *arg)
+{
+  FAR struct test_state_s *state = arg;
+
+  if (rec->type == FAULTLOG_TYPE_BOOT)
+  {
+    if ((int16_t)(rec->keycycle - state->keycycle) > 0)
+    {
+      state->keycycle = rec->keycycle;
+    }
+  }
+  else if (HOST_CHECK(rec->type == FAULTLOG_TYPE_DTC
+                      && rec->code < TEST_CODES))
+  {
+    state->count[rec->code] = rec->count;
+    state->present |= 1 << rec->code;
+  }
+}
+
+/* Rewrites every code recorded so far into the new head sector */
+
+static int test_snapshot(FAR struct faultlog_s *log, FAR void *arg)
+{
+  FAR const struct test_state_s *state = arg;
+  struct faultlog_record_s rec;
+  int code;
+  int ret;
+
+  for (code = 0; code < TEST_CODES; ++code)
+  {
+    if ((state->present & (1 << code)) != 0)
+    {
+      memset(&rec, 0, sizeof(rec));
+      rec.type = FAULTLOG_TYPE_DTC;
+      rec.code = code;
+      rec.count = state->count[code];
+      ret = faultlog_append(log, &rec);
+      if (ret < 0)
+      {
+        return ret;
+      }
+    }
+  }
+
+  return OK;
+}
+
+static bool test_state_equal(FAR const struct test_state_s *a,
+                             FAR const struct test_state_s *b)
+{
+  return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+/* Operation n of the sequence: a keycycle start, or a new count for one of
+ * the codes. The state passed in is updated only if it succeeds.
+ */
+
+static int test_op(FAR struct faultlog_s *log, int n,
+                   FAR struct test_state_s *state)
+{
+  struct faultlog_record_s rec;
+  int i = n % (1 + TEST_APPENDS);
+  int ret;
+
+  if (i == 0)
+  {
+    ret = faultlog_start_keycycle(log, n);
+    if (ret == OK)
+    {
+      state->keycycle = log->keycycle;
+    }
+
+    return ret;
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = FAULTLOG_TYPE_DTC;
+  rec.code = (n * 3) % TEST_CODES;
+  rec.count = n;
+  rec.keycycle = state->keycycle;
+  ret = faultlog_append(log, &rec);
+  if (ret == OK)
+  {
+    state->count[rec.code] = rec.count;
+    state->present |= 1 << rec.code;
+  }
+
+  return ret;
+}
+
+static void test_erase_file(int fd)
+{
+  uint8_t erased[TEST_SECTORS * TEST_SECTOR_SIZE];
+
+  memset(erased, 0xff, sizeof(erased));
+  HOST_CHECK(pwrite(fd, erased, sizeof(erased), 0) == sizeof(erased));
+}
+
+/* Runs the sequence from an erased log until power is cut after budget
+ * bytes. Returns the number of operations that completed.
+ */
+
+static int test_run(int fd, long budget, FAR long *written)
+{
+  struct test_flash_s flash = { .fd = fd, .budget = budget };
+  struct test_state_s state;
+  struct faultlog_s log;
+  int n;
+
+  memset(&state, 0, sizeof(state));
+  test_erase_file(fd);
+  HOST_CHECK(faultlog_open(&log, &g_test_flash_ops, &flash, TEST_SECTORS,
+                           TEST_SECTOR_SIZE, NULL, test_snapshot,
+                           &state) == OK);
+
+  for (n = 0; n < TEST_OPS; ++n)
+  {
+    if (test_op(&log, n, &state) < 0)
+    {
+      break;
+    }
+
+    g_expected[n + 1] = state;
+  }
+
+  *written = flash.written;
+  return n;
+}
+
+/* Opens the log after a power cut and replays it */
+
+static void test_reopen(int fd, FAR struct faultlog_s *log,
+                        FAR struct test_state_s *state,
+                        FAR struct test_flash_s *flash)
+{
+  memset(state, 0, sizeof(*state));
+  memset(flash, 0, sizeof(*flash));
+  flash->fd = fd;
+  flash->budget = LONG_MAX;
+  HOST_CHECK(faultlog_open(log, &g_test_flash_ops, flash, TEST_SECTORS,
+                           TEST_SECTOR_SIZE, test_replay, test_snapshot,
+                           state) == OK);
+  HOST_CHECK(log->keycycle == state->keycycle);
+}
+
+/* Cuts power after every byte written by the sequence in turn. The log
+ * must then replay to the state before the operation that was cut short,
+ * or after it if the write that completes it had got through. Appending
+ * after the cut must work and be replayed too.
+ */
+
+static void test_power_cut(int fd)
+{
+  struct test_state_s state;
+  struct test_flash_s flash;
+  struct faultlog_s log;
+  long total;
+  long written;
+  long cut;
+  int done;
+
+  memset(g_expected, 0, sizeof(g_expected));
+  HOST_CHECK(test_run(fd, LONG_MAX, &total) == TEST_OPS);
+
+  test_reopen(fd, &log, &state, &flash);
+  HOST_CHECK(test_state_equal(&state, &g_expected[TEST_OPS]));
+
+  for (cut = 0; cut < total; ++cut)
+  {
+    done = test_run(fd, cut, &written);
+    if (!HOST_CHECK(done < TEST_OPS && written == cut))
+    {
+      continue;
+    }
+
+    test_reopen(fd, &log, &state, &flash);
+    if (!HOST_CHECK(test_state_equal(&state, &g_expected[done])
+                    || test_state_equal(&state, &g_expected[done + 1])))
+    {
+      fprintf(stderr, "  power cut after %ld of %ld bytes, in operation "
+              "%d\n", cut, total, done);
+      continue;
+    }
+
+    /* Carry on from what was found */
+
+    if (HOST_CHECK(test_op(&log, done, &state) == OK))
+    {
+      struct test_state_s carried = state;
+
+      test_reopen(fd, &log, &state, &flash);
+      HOST_CHECK(test_state_equal(&state, &carried));
+    }
+  }
+
+  printf("test_faultlog: power cut at each of %ld bytes written\n", total);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  FAR FILE *file = tmpfile();
+
+  if (!HOST_CHECK(file != NULL))
+  {
+    return host_finish("test_faultlog");
+  }
+
+  test_power_cut(fileno(file));
+  fclose(file);
+  return host_finish("test_faultlog");
+}
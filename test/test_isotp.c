@@ -0,0 +1,420 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_isotp.c
+ * Electronic Throttle Controller program - ISO-TP and UDS loopback tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "host.h"
+
+/* The UDS server is private to safing.c */
+
+#define main safing_main
+#include "../safing.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* The tester sends on the DRS ring and the server on the safing ring, so
+ * each side's frames can be told apart and handed to the other.
+ */
+
+#define TEST_TESTER_RING      CAN_DRS_TX_RING
+#define TEST_SERVER_RING      CAN_SAFING_TX_RING
+#define TEST_MAX_TICKS        200
+#define TEST_DTCS             SAFING_NUM_DTC_ENTRIES
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static uint32_t g_now_ms;
+
+static struct isotp_s g_tester;
+static struct isotp_s g_server;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Takes the next frame a ring holds into msg. Returns false if empty. */
+
+static bool test_take(int ring, FAR struct can_msg_s *msg)
+{
+  FAR struct can_txframe_s *frame = can_ring_peek(&g_can_tx_rings[ring]);
+
+  if (frame == NULL)
+  {
+    return false;
+  }
+
+  *msg = frame->msg;
+  can_ring_release(&g_can_tx_rings[ring]);
+  return true;
+}
+
+static void test_flush(void)
+{
+  struct can_msg_s msg;
+
+  while (test_take(TEST_TESTER_RING, &msg) || test_take(TEST_SERVER_RING,
+                                                        &msg))
+  {
+  }
+}
+
+/* One tick of a bus between two links: each side's frames are received by
+ * the other, then both send what they can. Returns the length of a
+ * message completed at to, if any.
+ */
+
+static int test_tick(FAR struct isotp_s *from, int from_ring,
+                     FAR struct isotp_s *to, int to_ring)
+{
+  struct can_msg_s msg;
+  int ret;
+  int len = 0;
+
+  while (test_take(from_ring, &msg))
+  {
+    HOST_CHECK(msg.cm_hdr.ch_dlc == CAN_MAXDATALEN);
+    ret = isotp_receive(to, &msg, g_now_ms);
+    HOST_CHECK(ret >= 0);
+    if (ret > 0)
+    {
+      len = ret;
+    }
+  }
+
+  while (test_take(to_ring, &msg))
+  {
+    HOST_CHECK(isotp_receive(from, &msg, g_now_ms) == 0);
+  }
+
+  isotp_poll(from, g_now_ms);
+  isotp_poll(to, g_now_ms);
+  g_now_ms += SAFING_TICK_MS;
+  return len;
+}
+
+/* Sends a message of every length from one link to the other and checks
+ * it arrives whole, in ticks of the safing loop.
+ */
+
+static void test_loopback(FAR struct isotp_s *from, int from_ring,
+                          FAR struct isotp_s *to, int to_ring)
+{
+  int maxticks = 0;
+  int ticks;
+  int len;
+  int got;
+  int i;
+
+  for (len = 1; len <= ISOTP_MAX_PAYLOAD; ++len)
+  {
+    for (i = 0; i < len; ++i)
+    {
+      from->txbuf[i] = host_random();
+    }
+
+    HOST_CHECK(isotp_send(from, len, g_now_ms) == OK);
+    for (ticks = 1, got = 0; got == 0 && ticks < TEST_MAX_TICKS; ++ticks)
+    {
+      got = test_tick(from, from_ring, to, to_ring);
+    }
+
+    if (!HOST_CHECK(got == len && memcmp(to->rxbuf, from->txbuf, len) == 0
+                    && from->tx_state == ISOTP_TX_IDLE))
+    {
+      fprintf(stderr, "  %d-byte message\n", len);
+      return;
+    }
+
+    if (ticks > maxticks)
+    {
+      maxticks = ticks;
+    }
+  }
+
+  HOST_CHECK(from->errors == 0 && to->errors == 0);
+  printf("test_isotp: messages of 1-%d bytes, at most %d ticks each\n",
+         ISOTP_MAX_PAYLOAD, maxticks);
+}
+
+/* A peer that asks for blocks of two frames at least 10 ms apart. The
+ * sender must pause for flow control after every block and space its
+ * frames, with sequence numbers wrapping through 0.
+ */
+
+static void test_flow_control(void)
+{
+  struct can_msg_s fc;
+  struct can_msg_s msg;
+  uint8_t rxbuf[ISOTP_MAX_PAYLOAD];
+  uint32_t start_ms = g_now_ms;
+  uint32_t last_ms = 0;
+  uint16_t len = 200;
+  uint16_t off;
+  uint8_t sn = 1;
+  int inblock = 0;
+  int i;
+
+  for (i = 0; i < len; ++i)
+  {
+    g_server.txbuf[i] = host_random();
+  }
+
+  memset(&fc, 0, sizeof(fc));
+  fc.cm_hdr.ch_dlc = CAN_MAXDATALEN;
+  fc.cm_data[0] = 0x30;
+  fc.cm_data[1] = 2;
+  fc.cm_data[2] = 10;
+
+  HOST_CHECK(isotp_send(&g_server, len, g_now_ms) == OK);
+  HOST_CHECK(test_take(TEST_SERVER_RING, &msg) && msg.cm_data[0] == 0x10
+             && msg.cm_data[1] == len);
+  memcpy(rxbuf, &msg.cm_data[2], 6);
+  off = 6;
+
+  isotp_receive(&g_server, &fc, g_now_ms);
+  while (off < len && g_now_ms - start_ms < 10000)
+  {
+    isotp_poll(&g_server, g_now_ms);
+    while (test_take(TEST_SERVER_RING, &msg))
+    {
+      HOST_CHECK(msg.cm_data[0] == (0x20 | sn));
+      HOST_CHECK(inblock == 0 || g_now_ms - last_ms >= 10);
+      HOST_CHECK(++inblock <= 2);
+      memcpy(&rxbuf[off], &msg.cm_data[1], len - off < 7 ? len - off : 7);
+      off += len - off < 7 ? len - off : 7;
+      sn = (sn + 1) & 0x0f;
+      last_ms = g_now_ms;
+    }
+
+    /* Answer a finished block a little later */
+
+    if (inblock == 2 && g_now_ms - last_ms >= 20)
+    {
+      HOST_CHECK(g_server.tx_state == ISOTP_TX_WAIT_FC);
+      inblock = 0;
+      isotp_receive(&g_server, &fc, g_now_ms);
+    }
+
+    ++g_now_ms;
+  }
+
+  HOST_CHECK(off == len && memcmp(rxbuf, g_server.txbuf, len) == 0);
+  HOST_CHECK(g_server.tx_state == ISOTP_TX_IDLE);
+}
+
+static void test_errors(void)
+{
+  struct can_msg_s msg;
+  uint32_t errors;
+
+  /* No flow control: the sender gives up after N_Bs */
+
+  errors = g_server.errors;
+  HOST_CHECK(isotp_send(&g_server, 20, g_now_ms) == OK);
+  test_flush();
+  isotp_poll(&g_server, g_now_ms + ISOTP_TIMEOUT_MS);
+  HOST_CHECK(g_server.tx_state == ISOTP_TX_WAIT_FC);
+  HOST_CHECK(isotp_send(&g_server, 5, g_now_ms) == -EBUSY);
+  isotp_poll(&g_server, g_now_ms + ISOTP_TIMEOUT_MS + 1);
+  HOST_CHECK(g_server.tx_state == ISOTP_TX_IDLE);
+  HOST_CHECK(g_server.errors == errors + 1);
+
+  /* A consecutive frame out of sequence or after N_Cr abandons the
+   * reception.
+   */
+
+  memset(&msg, 0, sizeof(msg));
+  msg.cm_hdr.ch_dlc = CAN_MAXDATALEN;
+  msg.cm_data[0] = 0x10;
+  msg.cm_data[1] = 20;
+  HOST_CHECK(isotp_receive(&g_server, &msg, g_now_ms) == 0);
+  msg.cm_data[0] = 0x22;
+  HOST_CHECK(isotp_receive(&g_server, &msg, g_now_ms) == -EPROTO);
+
+  msg.cm_data[0] = 0x10;
+  HOST_CHECK(isotp_receive(&g_server, &msg, g_now_ms) == 0);
+  msg.cm_data[0] = 0x21;
+  HOST_CHECK(isotp_receive(&g_server, &msg,
+                           g_now_ms + ISOTP_TIMEOUT_MS + 1) == -EPROTO);
+
+  /* Too long for the buffer: the peer is told to stop */
+
+  test_flush();
+  msg.cm_data[0] = 0x10 | ((ISOTP_MAX_PAYLOAD + 1) >> 8);
+  msg.cm_data[1] = (ISOTP_MAX_PAYLOAD + 1) & 0xff;
+  HOST_CHECK(isotp_receive(&g_server, &msg, g_now_ms) == -EMSGSIZE);
+  HOST_CHECK(test_take(TEST_SERVER_RING, &msg) && msg.cm_data[0] == 0x32);
+
+  /* Malformed single frames */
+
+  msg.cm_data[0] = 0x00;
+  HOST_CHECK(isotp_receive(&g_server, &msg, g_now_ms) == -EINVAL);
+  msg.cm_data[0] = 0x08;
+  HOST_CHECK(isotp_receive(&g_server, &msg, g_now_ms) == -EINVAL);
+  msg.cm_hdr.ch_dlc = 3;
+  msg.cm_data[0] = 0x05;
+  HOST_CHECK(isotp_receive(&g_server, &msg, g_now_ms) == -EINVAL);
+
+  test_flush();
+}
+
+/* Sends a UDS request from the tester to the safing task's server, as the
+ * tester's frames would arrive through its rx queue, and waits for the
+ * response. Returns its length, with the ticks it took in *ticks.
+ */
+
+static int test_uds(FAR const uint8_t *req, int len, FAR int *ticks)
+{
+  struct can_msg_s msg;
+  int got = 0;
+  int ret;
+
+  memcpy(g_tester.txbuf, req, len);
+  HOST_CHECK(isotp_send(&g_tester, len, g_now_ms) == OK);
+
+  for (*ticks = 1; got == 0 && *ticks < TEST_MAX_TICKS; ++*ticks)
+  {
+    while (test_take(TEST_TESTER_RING, &msg))
+    {
+      HOST_CHECK(mq_send(g_diag_rxmq, (FAR const char *)&msg,
+                         CAN_MSGLEN(msg.cm_hdr.ch_dlc), 1) == 0);
+    }
+
+    safing_diag_poll(g_now_ms);
+
+    while (test_take(TEST_SERVER_RING, &msg))
+    {
+      ret = isotp_receive(&g_tester, &msg, g_now_ms);
+      HOST_CHECK(ret >= 0);
+      if (ret > 0)
+      {
+        got = ret;
+      }
+    }
+
+    isotp_poll(&g_tester, g_now_ms);
+    g_now_ms += SAFING_TICK_MS;
+  }
+
+  return got;
+}
+
+static void test_uds_server(void)
+{
+  static const uint8_t count_req[] = { 0x19, 0x01, 0xff };
+  static const uint8_t list_req[] = { 0x19, 0x02, 0xff };
+  static const uint8_t table_req[] = { 0x22, 0xf1, 0xa0 };
+  static const uint8_t bad_req[] = { 0x10, 0x01 };
+
+  struct mq_attr attr = {
+    .mq_maxmsg = 10,
+    .mq_msgsize = sizeof(struct can_msg_s)
+  };
+
+  FAR const uint8_t *resp = g_tester.rxbuf;
+  uint32_t seen = 0;
+  char name[32];
+  uint16_t code;
+  int ticks;
+  int len;
+  int i;
+
+  snprintf(name, sizeof(name), "/test_isotp.%d", getpid());
+  g_diag_rxmq = mq_open(name, O_RDWR | O_NONBLOCK | O_CREAT, 0600, &attr);
+  if (g_diag_rxmq == (mqd_t)-1)
+  {
+    printf("test_isotp: no host message queues, UDS server skipped\n");
+    return;
+  }
+
+  mq_unlink(name);
+  isotp_init(&g_diag_link, CAN_ID_DIAG_RESP_TX, true, TEST_SERVER_RING);
+
+  for (i = 0; i < TEST_DTCS; ++i)
+  {
+    safing_store_dtc(DTC_P(1 + i));
+  }
+
+  len = test_uds(count_req, sizeof(count_req), &ticks);
+  HOST_CHECK(len == 6 && resp[0] == 0x59 && resp[1] == 0x01
+             && resp[4] == 0 && resp[5] == TEST_DTCS);
+
+  len = test_uds(list_req, sizeof(list_req), &ticks);
+  HOST_CHECK(len == 3 + 4 * TEST_DTCS && resp[0] == 0x59);
+
+  len = test_uds(table_req, sizeof(table_req), &ticks);
+  if (HOST_CHECK(len == 4 + SAFING_ENTRY_RECORD_LEN * TEST_DTCS
+                 && resp[0] == 0x62 && resp[1] == 0xf1 && resp[2] == 0xa0
+                 && resp[3] == TEST_DTCS))
+  {
+    for (i = 0; i < TEST_DTCS; ++i)
+    {
+      code = fault_code_unpack(&resp[4 + i * SAFING_ENTRY_RECORD_LEN]);
+      if (HOST_CHECK(code >= DTC_P(1) && code <= DTC_P(TEST_DTCS)))
+      {
+        seen |= 1u << (code - DTC_P(1));
+      }
+    }
+
+    HOST_CHECK(seen == (uint32_t)((1ull << TEST_DTCS) - 1));
+  }
+
+  printf("test_isotp: %d-byte DTC table read in %d ticks of %d ms\n", len,
+         ticks - 1, SAFING_TICK_MS);
+
+  len = test_uds(bad_req, sizeof(bad_req), &ticks);
+  HOST_CHECK(len == 3 && resp[0] == 0x7f && resp[1] == 0x10
+             && resp[2] == UDS_NRC_SERVICE_NOT_SUPPORTED);
+
+  HOST_CHECK(g_tester.errors == 0 && g_diag_link.errors == 0);
+  mq_close(g_diag_rxmq);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  isotp_init(&g_tester, CAN_ID_DIAG_REQ_RX, true, TEST_TESTER_RING);
+  isotp_init(&g_server, CAN_ID_DIAG_RESP_TX, true, TEST_SERVER_RING);
+
+  test_loopback(&g_tester, TEST_TESTER_RING, &g_server, TEST_SERVER_RING);
+  test_loopback(&g_server, TEST_SERVER_RING, &g_tester, TEST_TESTER_RING);
+  test_flow_control();
+  test_errors();
+  test_uds_server();
+  return host_finish("test_isotp");
+}
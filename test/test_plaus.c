@@ -0,0 +1,284 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_plaus.c
+ * Electronic Throttle Controller program - plausibility fault injection tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+
+/* The plausibility checker is private to safing.c */
+
+#define main safing_main
+#include "../safing.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define TEST_MID              16000 /* A plausible reading */
+#define TEST_SOAK_TICKS       1000
+#define TEST_TIMED_TICKS      1000000
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* Readings of the checked channels, indexed by CALIB_PLAUS_* */
+
+static volatile int16_t g_readings[CALIB_PLAUS_CHANNELS];
+static struct calib_plaus_s g_plaus;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void test_reset(void)
+{
+  int i;
+
+  memset(g_dtc_entries, 0, sizeof(g_dtc_entries));
+  memset(g_dtc_present, 0, sizeof(g_dtc_present));
+  memset(g_dtc_slot_of, 0, sizeof(g_dtc_slot_of));
+  g_dtc_table.valid = 0;
+  g_dtc_table.logged = 0;
+  g_dtc_table.lost = 0;
+
+  memset(g_plaus_count, 0, sizeof(g_plaus_count));
+  g_plaus_confirmed = 0;
+
+  for (i = 0; i < CALIB_PLAUS_CHANNELS; ++i)
+  {
+    g_readings[i] = TEST_MID;
+    freeze_set_source(g_plaus_chan[i], &g_readings[i]);
+  }
+}
+
+static bool test_stored(uint16_t dtc)
+{
+  struct fault_entry_s entry;
+
+  return safing_read_entry(&g_dtc_table, safing_dtc_index(dtc), dtc,
+                           &entry);
+}
+
+/* Runs ticks until the checker reports a confirmed fault. Returns the
+ * number of ticks that took, or 0 if it did not within limit ticks.
+ */
+
+static int test_ticks_to_confirm(int limit)
+{
+  int tick;
+
+  for (tick = 1; tick <= limit; ++tick)
+  {
+    if (safing_check_sensor_ranges() < 0)
+    {
+      return tick;
+    }
+  }
+
+  return 0;
+}
+
+/* Each channel held below and then above its range confirms exactly when
+ * its debounce runs out, stores only its own DTC, and clears once the
+ * reading is back in range.
+ */
+
+static void test_range(void)
+{
+  int16_t bad;
+  int ticks;
+  int i;
+  int side;
+
+  for (i = 0; i < CALIB_PLAUS_CHANNELS; ++i)
+  {
+    for (side = 0; side < 2; ++side)
+    {
+      test_reset();
+      bad = side == 0 ? g_plaus.min[i] - 1 : g_plaus.max[i] + 1;
+      g_readings[i] = bad;
+
+      /* The other channel of a correlated pair follows, so that only the
+       * range check fails.
+       */
+
+      if (i < CALIB_PLAUS_BRKF)
+      {
+        g_readings[i ^ 1] = bad;
+      }
+
+      ticks = test_ticks_to_confirm(CALIB_PLAUS_MAX_DEBOUNCE);
+      HOST_CHECK(ticks == g_plaus.range_debounce);
+      HOST_CHECK(test_stored(g_plaus_dtcs[2 * i + side]));
+      HOST_CHECK(__builtin_popcount(g_dtc_table.valid)
+                 == (i < CALIB_PLAUS_BRKF ? 2 : 1));
+
+      g_readings[i] = TEST_MID;
+      if (i < CALIB_PLAUS_BRKF)
+      {
+        g_readings[i ^ 1] = TEST_MID;
+      }
+
+      HOST_CHECK(safing_check_sensor_ranges() == OK);
+    }
+  }
+
+  /* The limits themselves are in range */
+
+  test_reset();
+  for (i = 0; i < CALIB_PLAUS_CHANNELS; ++i)
+  {
+    g_readings[i] = i & 1 ? g_plaus.max[i] : g_plaus.min[i];
+  }
+
+  g_readings[CALIB_PLAUS_APPS2] = g_readings[CALIB_PLAUS_APPS1];
+  g_readings[CALIB_PLAUS_TPS2] = g_readings[CALIB_PLAUS_TPS1];
+  HOST_CHECK(test_ticks_to_confirm(TEST_SOAK_TICKS) == 0);
+}
+
+/* APPS1/APPS2 and TPS1/TPS2 apart by more than their tolerance confirm on
+ * the correlation debounce; apart by exactly the tolerance, never.
+ */
+
+static void test_correlation(void)
+{
+  static const struct
+  {
+    int chan;
+    uint16_t dtc;
+  } pairs[] = {
+    { CALIB_PLAUS_APPS1, DTC_APPS_OOC },
+    { CALIB_PLAUS_TPS1, DTC_TPS_OOC }
+  };
+
+  int16_t tol;
+  int i;
+
+  for (i = 0; i < 2; ++i)
+  {
+    tol = pairs[i].chan == CALIB_PLAUS_APPS1 ? g_plaus.apps_tol
+                                             : g_plaus.tps_tol;
+
+    test_reset();
+    g_readings[pairs[i].chan + 1] = TEST_MID + tol;
+    HOST_CHECK(test_ticks_to_confirm(TEST_SOAK_TICKS) == 0);
+
+    test_reset();
+    g_readings[pairs[i].chan + 1] = TEST_MID - tol - 1;
+    HOST_CHECK(test_ticks_to_confirm(CALIB_PLAUS_MAX_DEBOUNCE)
+               == g_plaus.ooc_debounce);
+    HOST_CHECK(test_stored(pairs[i].dtc)
+               && __builtin_popcount(g_dtc_table.valid) == 1);
+  }
+}
+
+/* A fault present on alternate ticks, or for one tick less than the
+ * debounce at a time, never confirms.
+ */
+
+static void test_intermittent(void)
+{
+  int tick;
+
+  test_reset();
+  for (tick = 0; tick < TEST_SOAK_TICKS; ++tick)
+  {
+    g_readings[CALIB_PLAUS_BRKF] = tick & 1 ? g_plaus.max[CALIB_PLAUS_BRKF]
+                                              + 1
+                                            : TEST_MID;
+    g_readings[CALIB_PLAUS_TPS2] = tick & 1 ? TEST_MID
+                                            : TEST_MID + g_plaus.tps_tol + 1;
+    HOST_CHECK(safing_check_sensor_ranges() == OK);
+  }
+
+  test_reset();
+  for (tick = 0; tick < TEST_SOAK_TICKS; ++tick)
+  {
+    g_readings[CALIB_PLAUS_BRKR] =
+      tick % g_plaus.range_debounce == 0 ? TEST_MID
+                                         : g_plaus.min[CALIB_PLAUS_BRKR] - 1;
+    HOST_CHECK(safing_check_sensor_ranges() == OK);
+  }
+
+  HOST_CHECK(g_dtc_table.valid == 0);
+}
+
+/* A channel with no source yet is not checked, even against its partner */
+
+static void test_unsubscribed(void)
+{
+  test_reset();
+  freeze_set_source(FREEZE_CHAN_APPS2, NULL);
+  freeze_set_source(FREEZE_CHAN_BRKF, NULL);
+  g_readings[CALIB_PLAUS_APPS1] = TEST_MID + g_plaus.apps_tol + 100;
+  HOST_CHECK(test_ticks_to_confirm(TEST_SOAK_TICKS) == 0);
+}
+
+static void test_tick_time(void)
+{
+  uint64_t start;
+  uint64_t cycles;
+  int tick;
+
+  test_reset();
+  start = host_time_ns();
+  cycles = host_cycles();
+  for (tick = 0; tick < TEST_TIMED_TICKS; ++tick)
+  {
+    g_readings[CALIB_PLAUS_BRKF] = TEST_MID + (tick & 0xff);
+    safing_check_sensor_ranges();
+  }
+
+  cycles = host_cycles() - cycles;
+  printf("test_plaus: one tick of the checks takes %.0f ns, %.0f cycles\n",
+         (double)(host_time_ns() - start) / TEST_TIMED_TICKS,
+         (double)cycles / TEST_TIMED_TICKS);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  FAR const struct calib_data_s *calib = calib_acquire();
+
+  g_plaus = calib->plaus;
+  calib_release(calib);
+
+  test_range();
+  test_correlation();
+  test_intermittent();
+  test_unsubscribed();
+  test_tick_time();
+
+  printf("test_plaus: range faults confirm in %u ticks, correlation "
+         "faults in %u\n", g_plaus.range_debounce, g_plaus.ooc_debounce);
+  return host_finish("test_plaus");
+}
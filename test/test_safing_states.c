@@ -0,0 +1,400 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_safing_states.c
+ * Electronic Throttle Controller program - safing state machine tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+
+/* The state machine and arming are private to safing.c */
+
+#define main safing_main
+#include "../safing.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define TEST_MID              16000 /* A plausible reading */
+#define TEST_MAX_TICKS        1000
+#define TEST_TIMED_STEPS      1000000
+
+/* Ticks of each arming phase: start, 50 ms settle, range checks past any
+ * debounce, then 200 ms of open-line detection.
+ */
+
+#define TEST_SETTLE_TICKS     (50 / SAFING_TICK_MS)
+#define TEST_CHECKED_TICKS    (1 + TEST_SETTLE_TICKS + \
+                               CALIB_PLAUS_MAX_DEBOUNCE)
+#define TEST_ARM_TICKS        (TEST_CHECKED_TICKS + 200 / SAFING_TICK_MS)
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static volatile int16_t g_readings[CALIB_PLAUS_CHANNELS];
+static int16_t g_brake;
+static struct calib_data_s g_calib;
+
+/* Tick on which each board command was last seen, and the command to fail */
+
+static int g_tick;
+static int g_cmd_tick[BOARDIOC_APPS2_SUBSCRIBE + 1];
+static unsigned int g_fail_cmd;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static int test_boardctl(unsigned int cmd, uintptr_t arg)
+{
+  if (cmd < sizeof(g_cmd_tick) / sizeof(g_cmd_tick[0]))
+  {
+    g_cmd_tick[cmd] = g_tick;
+  }
+
+  return cmd == g_fail_cmd ? -EIO : OK;
+}
+
+/* Puts safing straight into a state, as the one task that writes it */
+
+static void test_set(uint8_t state, uint8_t reason)
+{
+  g_safing_status.state = state;
+  g_safing_status.reason = reason;
+  g_safing_status.fault_flags = 0;
+  g_safing_subscr.faultflags = 0;
+  g_safing_arm_phase = SAFING_ARM_START;
+}
+
+static void test_reset(void)
+{
+  int i;
+
+  memset(g_dtc_entries, 0, sizeof(g_dtc_entries));
+  memset(g_dtc_present, 0, sizeof(g_dtc_present));
+  memset(g_dtc_slot_of, 0, sizeof(g_dtc_slot_of));
+  g_dtc_table.valid = 0;
+  g_dtc_table.logged = 0;
+  g_dtc_table.lost = 0;
+
+  memset(g_plaus_count, 0, sizeof(g_plaus_count));
+  g_plaus_confirmed = 0;
+
+  for (i = 0; i < CALIB_PLAUS_CHANNELS; ++i)
+  {
+    g_readings[i] = TEST_MID;
+    freeze_set_source(g_plaus_chan[i], &g_readings[i]);
+  }
+
+  memset(g_cmd_tick, 0, sizeof(g_cmd_tick));
+  g_fail_cmd = 0;
+  g_tick = 0;
+}
+
+static bool test_stored(uint16_t dtc)
+{
+  struct fault_entry_s entry;
+
+  return safing_read_entry(&g_dtc_table, safing_dtc_index(dtc), dtc,
+                           &entry);
+}
+
+/* Runs safing ticks until the state or reason changes from what it was.
+ * Returns the number of ticks taken, or 0 if nothing changed.
+ */
+
+static int test_run_until_change(void)
+{
+  struct safing_status_s before;
+  struct safing_status_s after;
+
+  safing_get_status(&before);
+  for (g_tick = 1; g_tick <= TEST_MAX_TICKS; ++g_tick)
+  {
+    safing_run_state();
+    safing_get_status(&after);
+    if (after.state != before.state || after.reason != before.reason)
+    {
+      return g_tick;
+    }
+  }
+
+  return 0;
+}
+
+static bool test_status_is(uint8_t state, uint8_t reason)
+{
+  struct safing_status_s status;
+
+  safing_get_status(&status);
+  return status.state == state && status.reason == reason;
+}
+
+/* Spot checks of the table: the proveouts go in order and only once
+ * complete, faults are reachable from everywhere but a hard fault, and a
+ * refused step changes nothing.
+ */
+
+static void test_table(void)
+{
+  uint8_t from;
+  uint8_t to;
+
+  for (from = 0; from < SAFING_NUM_STATES; ++from)
+  {
+    for (to = 0; to < SAFING_NUM_STATES; ++to)
+    {
+      test_set(from, 0);
+      if (from == SAFING_STATE_HARD_FAULT)
+      {
+        HOST_CHECK(safing_try_step(to) == -EPERM);
+      }
+      else if (to == SAFING_STATE_HARD_FAULT)
+      {
+        HOST_CHECK(safing_try_step(to) == OK
+                   && test_status_is(to, 0));
+      }
+      else if (to == SAFING_STATE_SOFT_FAULT
+               && from != SAFING_STATE_SOFT_FAULT)
+      {
+        HOST_CHECK(safing_try_step(to) == OK);
+      }
+    }
+
+    test_set(from, 0);
+    HOST_CHECK(safing_try_step(SAFING_NUM_STATES) == -EINVAL);
+  }
+
+  test_set(SAFING_STATE_ONBOARD_PROVEOUT,
+           SAFING_ONBOARD_PROVEOUT_INPROGRESS);
+  HOST_CHECK(safing_try_step(SAFING_STATE_BSPD_PROVEOUT) == -EPERM);
+  HOST_CHECK(test_status_is(SAFING_STATE_ONBOARD_PROVEOUT,
+                            SAFING_ONBOARD_PROVEOUT_INPROGRESS));
+  HOST_CHECK(safing_set_reason(SAFING_STATE_ONBOARD_PROVEOUT,
+                               SAFING_ONBOARD_PROVEOUT_SUCCESSFUL) == OK);
+  HOST_CHECK(safing_try_step(SAFING_STATE_BSPD_PROVEOUT) == OK);
+  HOST_CHECK(safing_set_reason(SAFING_STATE_ONBOARD_PROVEOUT,
+                               SAFING_ONBOARD_PROVEOUT_SUCCESSFUL)
+             == -EPERM);
+  HOST_CHECK(safing_try_step(SAFING_STATE_ACTIVE) == -EPERM);
+
+  test_set(SAFING_STATE_PRE_PROVEOUT, 0);
+  HOST_CHECK(safing_try_step(SAFING_STATE_ACTIVE) == -EPERM);
+
+  /* A failed arm proves out again rather than going on to relearn */
+
+  test_set(SAFING_STATE_PAUSED, SAFING_PAUSED_ARM_FAILED);
+  HOST_CHECK(safing_try_step(SAFING_STATE_ETB_RELEARN) == -EPERM);
+  HOST_CHECK(safing_try_step(SAFING_STATE_ONBOARD_PROVEOUT) == OK);
+
+  test_set(SAFING_STATE_PAUSED, SAFING_PAUSED_THROTTLE_STUCK);
+  HOST_CHECK(safing_try_step(SAFING_STATE_ONBOARD_PROVEOUT) == -EPERM);
+  HOST_CHECK(safing_try_step_reason(SAFING_STATE_ETB_RELEARN,
+                                    SAFING_ETB_RELEARN_AWAIT_CMS_CLOSE)
+             == OK);
+  HOST_CHECK(test_status_is(SAFING_STATE_ETB_RELEARN,
+                            SAFING_ETB_RELEARN_AWAIT_CMS_CLOSE));
+
+  test_set(SAFING_STATE_SOFT_FAULT, 0);
+  HOST_CHECK(safing_try_step(SAFING_STATE_PRE_PROVEOUT) == OK);
+}
+
+/* Arming does one phase per tick and never sleeps, so onboard proveout
+ * completes in exactly TEST_ARM_TICKS ticks, with each board command on
+ * the tick its phase ends.
+ */
+
+static void test_arm(void)
+{
+  int ticks;
+
+  test_reset();
+  test_set(SAFING_STATE_ONBOARD_PROVEOUT,
+           SAFING_ONBOARD_PROVEOUT_INPROGRESS);
+  ticks = test_run_until_change();
+  HOST_CHECK(ticks == TEST_ARM_TICKS);
+  HOST_CHECK(test_status_is(SAFING_STATE_ONBOARD_PROVEOUT,
+                            SAFING_ONBOARD_PROVEOUT_SUCCESSFUL));
+  HOST_CHECK(g_cmd_tick[BOARDIOC_SAFING_SUBSCRIBE] == 1);
+  HOST_CHECK(g_cmd_tick[BOARDIOC_5V0LIN_SENSE_ARM] == 1);
+  HOST_CHECK(g_cmd_tick[BOARDIOC_HW_PLAUS_CK_ARM] == TEST_CHECKED_TICKS);
+  HOST_CHECK(g_cmd_tick[BOARDIOC_HW_SAFING_ARM] == TEST_ARM_TICKS);
+  HOST_CHECK(g_dtc_table.valid == 0);
+  printf("test_safing_states: arming takes %d ticks of %d ms\n", ticks,
+         SAFING_TICK_MS);
+
+  /* Each failure pauses on the tick it happens */
+
+  test_reset();
+  g_fail_cmd = BOARDIOC_5V0LIN_SENSE_ARM;
+  test_set(SAFING_STATE_ONBOARD_PROVEOUT,
+           SAFING_ONBOARD_PROVEOUT_INPROGRESS);
+  HOST_CHECK(test_run_until_change() == 1);
+  HOST_CHECK(test_status_is(SAFING_STATE_PAUSED, SAFING_PAUSED_ARM_FAILED));
+  HOST_CHECK(test_stored(DTC_5V0LIN_SENSE_STG)
+             && test_stored(DTC_INITIAL_ARM_FAILED));
+
+  test_reset();
+  g_fail_cmd = BOARDIOC_HW_SAFING_ARM;
+  test_set(SAFING_STATE_ONBOARD_PROVEOUT,
+           SAFING_ONBOARD_PROVEOUT_INPROGRESS);
+  HOST_CHECK(test_run_until_change() == TEST_ARM_TICKS);
+  HOST_CHECK(test_status_is(SAFING_STATE_PAUSED, SAFING_PAUSED_ARM_FAILED));
+
+  test_reset();
+  g_readings[CALIB_PLAUS_BRKR] = 0;
+  test_set(SAFING_STATE_ONBOARD_PROVEOUT,
+           SAFING_ONBOARD_PROVEOUT_INPROGRESS);
+  HOST_CHECK(test_run_until_change()
+             == 1 + TEST_SETTLE_TICKS + g_calib.plaus.range_debounce);
+  HOST_CHECK(test_status_is(SAFING_STATE_PAUSED, SAFING_PAUSED_ARM_FAILED));
+  HOST_CHECK(test_stored(DTC_BRKR_LOW)
+             && test_stored(DTC_INITIAL_ARM_FAILED));
+
+  /* Arming left part way starts over on proving out again */
+
+  test_reset();
+  test_set(SAFING_STATE_ONBOARD_PROVEOUT,
+           SAFING_ONBOARD_PROVEOUT_INPROGRESS);
+  for (g_tick = 1; g_tick <= TEST_ARM_TICKS / 2; ++g_tick)
+  {
+    safing_run_state();
+  }
+
+  HOST_CHECK(safing_try_step_reason(SAFING_STATE_PAUSED,
+                                    SAFING_PAUSED_ARM_FAILED) == OK);
+  safing_run_state();
+  HOST_CHECK(safing_try_step(SAFING_STATE_ONBOARD_PROVEOUT) == OK);
+  memset(g_cmd_tick, 0, sizeof(g_cmd_tick));
+  HOST_CHECK(test_run_until_change() == TEST_ARM_TICKS);
+  HOST_CHECK(g_cmd_tick[BOARDIOC_5V0LIN_SENSE_ARM] == 1);
+}
+
+/* The rest of the startup sequence, then faults once armed */
+
+static void test_startup(void)
+{
+  int16_t brake_open = g_calib.drs.brake_open;
+
+  test_reset();
+  test_set(SAFING_STATE_ONBOARD_PROVEOUT,
+           SAFING_ONBOARD_PROVEOUT_SUCCESSFUL);
+  HOST_CHECK(safing_try_step(SAFING_STATE_BSPD_PROVEOUT) == OK);
+  HOST_CHECK(test_run_until_change() == 1);
+  HOST_CHECK(test_status_is(SAFING_STATE_BSPD_PROVEOUT,
+                            SAFING_BSPD_PROVEOUT_SUCCESSFUL));
+  HOST_CHECK(safing_try_step(SAFING_STATE_ETB_RELEARN) == OK);
+
+  /* Relearned with the brake held: active once it is released */
+
+  g_brake = brake_open;
+  HOST_CHECK(safing_set_reason(SAFING_STATE_ETB_RELEARN,
+                               SAFING_ETB_RELEARN_AWAIT_BRAKE_RELEASE)
+             == OK);
+  safing_run_state();
+  HOST_CHECK(test_status_is(SAFING_STATE_ETB_RELEARN,
+                            SAFING_ETB_RELEARN_AWAIT_BRAKE_RELEASE));
+  g_brake = brake_open - 1;
+  HOST_CHECK(test_run_until_change() == 1);
+  HOST_CHECK(test_status_is(SAFING_STATE_ACTIVE, SAFING_ACTIVE_OK));
+
+  /* A confirmed plausibility failure is a soft fault */
+
+  g_readings[CALIB_PLAUS_TPS1] = INT16_MAX;
+  g_readings[CALIB_PLAUS_TPS2] = INT16_MAX;
+  HOST_CHECK(test_run_until_change() == g_calib.plaus.range_debounce);
+  HOST_CHECK(test_status_is(SAFING_STATE_SOFT_FAULT, 0));
+
+  /* The circuit opening by itself is a hard fault on the next tick, and
+   * the flags are published with it.
+   */
+
+  test_reset();
+  test_set(SAFING_STATE_ACTIVE, SAFING_ACTIVE_OK);
+  HOST_CHECK(test_run_until_change() == 0);
+  g_safing_subscr.faultflags = SAFINGSIG_SAFING1_DISARMING;
+  HOST_CHECK(test_run_until_change() == 1);
+  HOST_CHECK(test_status_is(SAFING_STATE_HARD_FAULT, 0));
+  HOST_CHECK(g_safing_status.fault_flags == SAFINGSIG_SAFING1_DISARMING);
+}
+
+static void test_latency(void)
+{
+  struct safing_status_s status;
+  uint64_t start;
+  uint64_t step_ns;
+  uint64_t read_ns;
+  int i;
+
+  test_set(SAFING_STATE_PAUSED, SAFING_PAUSED_SOFTWARE_REQUEST);
+  start = host_time_ns();
+  for (i = 0; i < TEST_TIMED_STEPS; ++i)
+  {
+    safing_try_step(SAFING_STATE_ETB_RELEARN);
+    safing_try_step(SAFING_STATE_PAUSED);
+  }
+
+  step_ns = host_time_ns() - start;
+  HOST_CHECK(test_status_is(SAFING_STATE_PAUSED,
+                            SAFING_PAUSED_SOFTWARE_REQUEST));
+
+  start = host_time_ns();
+  for (i = 0; i < TEST_TIMED_STEPS; ++i)
+  {
+    safing_get_status(&status);
+    __asm__ volatile("" : : "r"(&status) : "memory");
+  }
+
+  read_ns = host_time_ns() - start;
+  printf("test_safing_states: a step takes %.0f ns, "
+         "safing_get_status() %.1f ns\n",
+         (double)step_ns / (2 * TEST_TIMED_STEPS),
+         (double)read_ns / TEST_TIMED_STEPS);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  FAR const struct calib_data_s *calib = calib_acquire();
+
+  g_calib = *calib;
+  calib_release(calib);
+
+  g_host_boardctl = test_boardctl;
+  g_brk_f_value = &g_brake;
+
+  test_table();
+  test_arm();
+  test_startup();
+  test_latency();
+
+  return host_finish("test_safing_states");
+}
@@ -0,0 +1,252 @@
+/****************************************************************************
+ * apps/industry/ETCetera/test/test_seqlock.c
+ * Electronic Throttle Controller program - seqlock torn read tests
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+#include "seqlock.h"
+
+/* The TPS sample and its lock are private to etb.c */
+
+#define main etb_main
+#include "../etb.c"
+#undef main
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define TEST_READERS          3
+#define TEST_READS            20000 /* At least, by each reader */
+#define TEST_RUN_NS           500000000ull
+#define TEST_WORDS            256   /* Long enough to be preempted in */
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/* Every word of a consistent copy holds the same write count */
+
+struct test_data_s
+{
+  uint32_t words[TEST_WORDS];
+};
+
+struct test_reader_s
+{
+  pthread_t thread;
+  FAR void *(*read)(FAR void *arg);
+  unsigned long reads;
+  unsigned long torn;
+  unsigned long backwards;
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static struct test_data_s g_data;
+static struct seqlock_s g_data_lock = SEQLOCK_INITIALIZER;
+static int16_t g_test_tps1;
+static int16_t g_test_tps2;
+static bool g_done;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static bool test_done(void)
+{
+  return __atomic_load_n(&g_done, __ATOMIC_ACQUIRE);
+}
+
+static void test_write_data(uint32_t count)
+{
+  int i;
+
+  seqlock_write_begin(&g_data_lock);
+  for (i = 0; i < TEST_WORDS; ++i)
+  {
+    g_data.words[i] = count;
+  }
+
+  seqlock_write_end(&g_data_lock);
+}
+
+static FAR void *test_read_data(FAR void *arg)
+{
+  FAR struct test_reader_s *reader = arg;
+  struct test_data_s copy;
+  uint32_t last = 0;
+  uint32_t seq;
+  int i;
+
+  while (!test_done())
+  {
+    do
+    {
+      seq = seqlock_read_begin(&g_data_lock);
+      copy = g_data;
+    }
+    while (seqlock_read_retry(&g_data_lock, seq));
+
+    __atomic_store_n(&reader->reads, reader->reads + 1, __ATOMIC_RELAXED);
+    for (i = 1; i < TEST_WORDS; ++i)
+    {
+      if (copy.words[i] != copy.words[0])
+      {
+        ++reader->torn;
+        break;
+      }
+    }
+
+    if (copy.words[0] < last)
+    {
+      ++reader->backwards;
+    }
+
+    last = copy.words[0];
+  }
+
+  return NULL;
+}
+
+/* The ETB task's sample, written the way its control tick writes it. Both
+ * channels and the frozen mask are derived from the tick time, so a copy
+ * mixing two ticks shows.
+ */
+
+static void test_write_tps(uint32_t count)
+{
+  struct etb_tps_s tps;
+
+  g_test_tps1 = (int16_t)count;
+  g_test_tps2 = (int16_t)~count;
+  __atomic_store_n(&g_frozen_channels, count & (TPS1_FROZEN | TPS2_FROZEN),
+                   __ATOMIC_RELAXED);
+  etb_sample_tps(&tps, count);
+}
+
+static FAR void *test_read_tps(FAR void *arg)
+{
+  FAR struct test_reader_s *reader = arg;
+  struct etb_tps_s tps;
+  uint32_t last = 0;
+  uint8_t valid;
+
+  while (!test_done())
+  {
+    etb_get_tps(&tps);
+
+    __atomic_store_n(&reader->reads, reader->reads + 1, __ATOMIC_RELAXED);
+    valid = ((tps.time_ms & TPS1_FROZEN) == 0 ? ETB_TPS1_VALID : 0)
+            | ((tps.time_ms & TPS2_FROZEN) == 0 ? ETB_TPS2_VALID : 0);
+    if (tps.tps1 != (int16_t)tps.time_ms
+        || tps.tps2 != (int16_t)~tps.time_ms
+        || tps.frozen != (tps.time_ms & (TPS1_FROZEN | TPS2_FROZEN))
+        || tps.valid != valid)
+    {
+      ++reader->torn;
+    }
+
+    if (tps.time_ms < last)
+    {
+      ++reader->backwards;
+    }
+
+    last = tps.time_ms;
+  }
+
+  return NULL;
+}
+
+/* Runs readers against one writer. On the host the scheduler lock is a
+ * no-op, so readers are preempted in the middle of copies and run in the
+ * middle of writes, and only the retry keeps their copies whole.
+ */
+
+static void test_readers(FAR const char *name,
+                         FAR void *(*read)(FAR void *arg),
+                         void (*write)(uint32_t count))
+{
+  struct test_reader_s readers[TEST_READERS];
+  unsigned long reads = 0;
+  uint64_t start;
+  uint32_t count = 0;
+  int i;
+
+  memset(readers, 0, sizeof(readers));
+  __atomic_store_n(&g_done, false, __ATOMIC_RELEASE);
+
+  for (i = 0; i < TEST_READERS; ++i)
+  {
+    HOST_CHECK(pthread_create(&readers[i].thread, NULL, read,
+                              &readers[i]) == 0);
+  }
+
+  /* Write until every reader has had its share of the CPU */
+
+  start = host_time_ns();
+  for (i = 0; i < TEST_READERS; ++count)
+  {
+    write(count + 1);
+    if (__atomic_load_n(&readers[i].reads, __ATOMIC_RELAXED) >= TEST_READS
+        && host_time_ns() - start >= TEST_RUN_NS)
+    {
+      ++i;
+    }
+  }
+
+  __atomic_store_n(&g_done, true, __ATOMIC_RELEASE);
+
+  for (i = 0; i < TEST_READERS; ++i)
+  {
+    pthread_join(readers[i].thread, NULL);
+    HOST_CHECK(readers[i].torn == 0);
+    HOST_CHECK(readers[i].backwards == 0);
+    reads += readers[i].reads;
+  }
+
+  printf("test_seqlock: %s: %lu writes and %lu reads in %llu ms\n", name,
+         (unsigned long)count, reads,
+         (unsigned long long)((host_time_ns() - start) / 1000000));
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, FAR char *argv[])
+{
+  g_tps1 = &g_test_tps1;
+  g_tps2 = &g_test_tps2;
+
+  test_readers("seqlock_s", test_read_data, test_write_data);
+  test_readers("etb_get_tps", test_read_tps, test_write_tps);
+  return host_finish("test_seqlock");
+}